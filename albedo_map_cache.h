@@ -0,0 +1,248 @@
+#ifndef FACESHAPEFROMSHADING_ALBEDO_MAP_CACHE_H
+#define FACESHAPEFROMSHADING_ALBEDO_MAP_CACHE_H
+
+#include "common.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// Binary cache of the albedo index map and the barycentric pixel map.
+//
+// The file is a fixed header followed by tex_size x tex_size records in row
+// major order, each holding the face index (-1 for empty texels) and the full
+// precision barycentric coordinates. The layout is flat so the file can be
+// mapped and read in place. A cache is only valid for the mesh topology,
+// texture size and subdivision depth it was built with, all of which are part
+// of the file name and are checked again against the header on load.
+
+struct AlbedoMapCacheKey {
+  AlbedoMapCacheKey() : topology_hash(0), tex_size(0), subdivision_depth(0) {}
+  AlbedoMapCacheKey(uint64_t topology_hash, int tex_size, int subdivision_depth)
+    : topology_hash(topology_hash), tex_size(tex_size), subdivision_depth(subdivision_depth) {}
+
+  uint64_t topology_hash;
+  int tex_size;
+  int subdivision_depth;
+};
+
+struct AlbedoMapCacheHeader {
+  static constexpr uint32_t kVersion = 1;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t tex_size;
+  uint32_t subdivision_depth;
+  uint32_t record_size;
+  uint64_t topology_hash;
+};
+
+struct AlbedoMapCacheRecord {
+  int32_t fidx;
+  float bcoords[3];
+};
+
+static_assert(sizeof(AlbedoMapCacheHeader) == 32, "unexpected albedo map cache header size");
+static_assert(sizeof(AlbedoMapCacheRecord) == 16, "unexpected albedo map cache record size");
+
+namespace albedo_map_cache_detail {
+const char kMagic[8] = {'S', 'F', 'S', 'A', 'M', 'A', 'P', '\0'};
+
+inline void HashBytes(uint64_t& h, const void* data, size_t size) {
+  // FNV-1a
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for(size_t i=0;i<size;++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+}
+
+template <typename T>
+inline void HashValue(uint64_t& h, T value) {
+  HashBytes(h, &value, sizeof(T));
+}
+}  // namespace albedo_map_cache_detail
+
+// Hash of everything the index and pixel maps depend on: the triangles and
+// their texture coordinates. Vertex positions are deliberately left out.
+inline uint64_t ComputeTopologyHash(const BasicMesh& mesh) {
+  using namespace albedo_map_cache_detail;
+  uint64_t h = 14695981039346656037ULL;
+  HashValue<int32_t>(h, mesh.NumVertices());
+  HashValue<int32_t>(h, mesh.NumFaces());
+  for(int i=0;i<mesh.NumFaces();++i) {
+    auto f = mesh.face(i);
+    auto ft = mesh.face_texture(i);
+    for(int k=0;k<3;++k) {
+      HashValue<int32_t>(h, f[k]);
+      HashValue<int32_t>(h, ft[k]);
+      auto t = mesh.texture_coords(ft[k]);
+      HashValue<double>(h, t[0]);
+      HashValue<double>(h, t[1]);
+    }
+  }
+  return h;
+}
+
+inline string AlbedoMapCacheFilename(const string& cache_dir, const AlbedoMapCacheKey& key) {
+  char hash_str[17];
+  snprintf(hash_str, sizeof(hash_str), "%016llx", static_cast<unsigned long long>(key.topology_hash));
+  return cache_dir + "/albedo_map_" + hash_str
+       + "_" + to_string(key.tex_size)
+       + "_" + to_string(key.subdivision_depth) + ".bin";
+}
+
+// Read-only mapping of a cache file.
+class MappedAlbedoMapCache {
+public:
+  MappedAlbedoMapCache() : data(nullptr), size(0) {}
+  MappedAlbedoMapCache(const MappedAlbedoMapCache&) = delete;
+  MappedAlbedoMapCache& operator=(const MappedAlbedoMapCache&) = delete;
+  ~MappedAlbedoMapCache() { Close(); }
+
+  // Map the file and validate it against the key. Returns false if the file
+  // does not exist or belongs to a different mesh / texture configuration.
+  bool Open(const string& filename, const AlbedoMapCacheKey& key) {
+    Close();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(AlbedoMapCacheHeader))) {
+      close(fd);
+      return false;
+    }
+
+    void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(ptr == MAP_FAILED) return false;
+
+    data = static_cast<const char*>(ptr);
+    size = st.st_size;
+
+    const size_t num_records = static_cast<size_t>(key.tex_size) * key.tex_size;
+    const AlbedoMapCacheHeader& h = header();
+    if(memcmp(h.magic, albedo_map_cache_detail::kMagic, sizeof(h.magic)) != 0
+       || h.version != AlbedoMapCacheHeader::kVersion
+       || h.record_size != sizeof(AlbedoMapCacheRecord)
+       || h.tex_size != static_cast<uint32_t>(key.tex_size)
+       || h.subdivision_depth != static_cast<uint32_t>(key.subdivision_depth)
+       || h.topology_hash != key.topology_hash
+       || size != sizeof(AlbedoMapCacheHeader) + num_records * sizeof(AlbedoMapCacheRecord)) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+    if(data) munmap(const_cast<char*>(data), size);
+    data = nullptr;
+    size = 0;
+  }
+
+  bool IsOpen() const { return data != nullptr; }
+  int tex_size() const { return header().tex_size; }
+
+  const AlbedoMapCacheHeader& header() const {
+    return *reinterpret_cast<const AlbedoMapCacheHeader*>(data);
+  }
+
+  // Records of texel row i
+  const AlbedoMapCacheRecord* row(int i) const {
+    return reinterpret_cast<const AlbedoMapCacheRecord*>(data + sizeof(AlbedoMapCacheHeader))
+           + static_cast<size_t>(i) * tex_size();
+  }
+
+private:
+  const char* data;
+  size_t size;
+};
+
+inline bool LoadAlbedoMapCache(const string& filename,
+                               const AlbedoMapCacheKey& key,
+                               vector<vector<PixelInfo>>& albedo_pixel_map) {
+  MappedAlbedoMapCache cache;
+  if(!cache.Open(filename, key)) return false;
+
+  const int tex_size = key.tex_size;
+  albedo_pixel_map.assign(tex_size, vector<PixelInfo>(tex_size));
+  for(int i=0;i<tex_size;++i) {
+    const AlbedoMapCacheRecord* row = cache.row(i);
+    for(int j=0;j<tex_size;++j) {
+      albedo_pixel_map[i][j] = PixelInfo(row[j].fidx,
+                                         glm::vec3(row[j].bcoords[0],
+                                                   row[j].bcoords[1],
+                                                   row[j].bcoords[2]));
+    }
+  }
+  return true;
+}
+
+// Write the cache to a temporary file first and rename it in place, so a
+// reader never maps a partially written cache.
+inline bool SaveAlbedoMapCache(const string& filename,
+                               const AlbedoMapCacheKey& key,
+                               const vector<vector<PixelInfo>>& albedo_pixel_map) {
+  AlbedoMapCacheHeader header;
+  memcpy(header.magic, albedo_map_cache_detail::kMagic, sizeof(header.magic));
+  header.version = AlbedoMapCacheHeader::kVersion;
+  header.tex_size = key.tex_size;
+  header.subdivision_depth = key.subdivision_depth;
+  header.record_size = sizeof(AlbedoMapCacheRecord);
+  header.topology_hash = key.topology_hash;
+
+  const string tmp_filename = filename + ".tmp" + to_string(getpid());
+  {
+    ofstream fout(tmp_filename, ios::binary);
+    if(!fout) return false;
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    vector<AlbedoMapCacheRecord> row(key.tex_size);
+    for(int i=0;i<key.tex_size;++i) {
+      for(int j=0;j<key.tex_size;++j) {
+        const PixelInfo& pix = albedo_pixel_map[i][j];
+        row[j].fidx = pix.fidx;
+        // the coordinates of texels outside the mesh are left uninitialized
+        const bool covered = pix.fidx >= 0;
+        row[j].bcoords[0] = covered? pix.bcoords.x : 0.0f;
+        row[j].bcoords[1] = covered? pix.bcoords.y : 0.0f;
+        row[j].bcoords[2] = covered? pix.bcoords.z : 0.0f;
+      }
+      fout.write(reinterpret_cast<const char*>(row.data()), sizeof(AlbedoMapCacheRecord) * row.size());
+    }
+    if(!fout) {
+      fout.close();
+      unlink(tmp_filename.c_str());
+      return false;
+    }
+  }
+  return rename(tmp_filename.c_str(), filename.c_str()) == 0;
+}
+
+// Rebuild the color coded index map from the face indices of a pixel map.
+inline QImage IndexMapFromPixelMap(const vector<vector<PixelInfo>>& albedo_pixel_map) {
+  const int tex_size = albedo_pixel_map.size();
+  QImage albedo_index_map(tex_size, tex_size, QImage::Format_ARGB32);
+  albedo_index_map.fill(qRgb(0, 0, 0));
+  for(int i=0;i<tex_size;++i) {
+    for(int j=0;j<tex_size;++j) {
+      int fidx = albedo_pixel_map[i][j].fidx;
+      if(fidx < 0) continue;
+      unsigned char r, g, b;
+      encode_index(fidx, r, g, b);
+      albedo_index_map.setPixel(j, i, qRgb(r, g, b));
+    }
+  }
+  return albedo_index_map;
+}
+
+#endif  // FACESHAPEFROMSHADING_ALBEDO_MAP_CACHE_H
@@ -0,0 +1,331 @@
+#include <QApplication>
+#include <QDir>
+
+#include <GL/freeglut_std.h>
+
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include "synthetic_data.h"
+
+// Synthetic shape from shading data with known ground truth.
+//
+// The template mesh, or a combination of the FACS blendshapes, is rendered
+// under a given second order spherical harmonics lighting and albedo from a
+// few view angles, at each of the requested resolutions. A fine sinusoidal
+// relief is added to the rendered geometry so that it differs from the
+// coarse mesh the pipeline starts from. The output directory looks like
+//
+//   <output_dir>/benchmark.json        resource options, lighting, albedo
+//   <output_dir>/<size>/settings.txt   image list, as read by LoadImageBundles
+//   <output_dir>/<size>/<i>.png        rendered image
+//   <output_dir>/<size>/<i>.pts        projected landmarks
+//   <output_dir>/<size>/<i>.png.res    camera and pose of the coarse mesh
+//   <output_dir>/<size>/<i>.png.gt     ground truth depth, normals, lighting and albedo
+//
+// and is consumed by sfs_benchmark.
+
+namespace {
+
+po::variables_map ParseCommandlineOptions(int argc, char** argv) {
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help", "Print help messages")
+    ("output_dir", po::value<string>()->required(), "Output directory.")
+    ("sizes", po::value<string>()->default_value("128 256 512"), "Image sizes to render, in pixels.")
+    ("yaw", po::value<string>()->default_value("-0.3 0 0.3"), "Yaw angle of each view, in radians.")
+    ("fovy", po::value<double>()->default_value(0.25), "Vertical field of view, in radians.")
+    ("lighting", po::value<string>()->default_value("0.6 0.05 0.1 0.4 0 0 0 0 0.05"), "Spherical harmonics lighting coefficients.")
+    ("albedo", po::value<string>()->default_value("0.75 0.6 0.5"), "Constant RGB albedo in [0, 1].")
+    ("albedo_texture", po::value<string>(), "Albedo texture of the template. Used instead of the constant albedo if given.")
+    ("detail_amplitude", po::value<double>()->default_value(0.005), "Amplitude of the added relief, relative to the mesh size.")
+    ("detail_frequency", po::value<double>()->default_value(12.0), "Number of relief periods across the mesh.")
+    ("blendshapes_path", po::value<string>(), "Input blendshapes path. Render a blendshape combination instead of the template if given.")
+    ("blendshape_weights", po::value<string>()->default_value(""), "Blendshape weights as index:weight pairs, e.g. \"1:0.5 12:0.3\".")
+    ("subdivision_depth", po::value<int>()->default_value(0), "The depth of subdivision of the template.");
+  po::variables_map vm;
+
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if(vm.count("help")) {
+      cout << desc << endl;
+      exit(1);
+    }
+    return vm;
+  } catch(po::error& e) {
+    cerr << "Error: " << e.what() << endl;
+    cerr << desc << endl;
+    exit(1);
+  }
+}
+
+vector<double> ParseNumbers(const string& s) {
+  vector<double> values;
+  istringstream iss(s);
+  double v;
+  while(iss >> v) values.push_back(v);
+  return values;
+}
+
+VectorXd ParseBlendshapeWeights(const string& s) {
+  const int num_blendshapes = 46;
+  VectorXd weights = VectorXd::Zero(num_blendshapes+1);
+  istringstream iss(s);
+  string item;
+  while(iss >> item) {
+    auto pos = item.find(':');
+    if(pos == string::npos) throw runtime_error("Invalid blendshape weight " + item);
+    int idx = stoi(item.substr(0, pos));
+    if(idx < 1 || idx > num_blendshapes) throw runtime_error("Invalid blendshape index " + item);
+    weights(idx) = stod(item.substr(pos+1));
+  }
+  return weights;
+}
+
+// Displace the vertices along their normals by a product of sines over the
+// frontal plane.
+BasicMesh AddRelief(const BasicMesh& mesh, double amplitude, double frequency) {
+  BasicMesh detailed = mesh;
+  const MatrixX3d& verts = mesh.vertices();
+  Vector3d vmin = verts.colwise().minCoeff();
+  Vector3d vmax = verts.colwise().maxCoeff();
+  Vector3d extent = vmax - vmin;
+  const double scale = amplitude * extent.norm();
+
+  MatrixX3d verts_new = verts;
+  for(int j=0;j<verts.rows();++j) {
+    double u = (verts(j, 0) - vmin[0]) / max(extent[0], 1e-16);
+    double v = (verts(j, 1) - vmin[1]) / max(extent[1], 1e-16);
+    double h = sin(2.0 * M_PI * frequency * u) * sin(2.0 * M_PI * frequency * v);
+    verts_new.row(j) += mesh.vertex_normal(j).transpose() * (scale * h);
+  }
+  detailed.vertices() = verts_new;
+  detailed.ComputeNormals();
+  return detailed;
+}
+
+// Place the mesh in front of the camera so that it fills most of the image.
+ReconstructionResult MakeParameters(const BasicMesh& mesh, int size, double fovy, double yaw,
+                                    const VectorXd& blendshape_weights) {
+  const MatrixX3d& verts = mesh.vertices();
+  Vector3d vmin = verts.colwise().minCoeff();
+  Vector3d vmax = verts.colwise().maxCoeff();
+  Vector3d center = 0.5 * (vmin + vmax);
+  const double extent = (vmax - vmin).maxCoeff();
+
+  ReconstructionResult params;
+  params.params_cam.fovy = fovy;
+  params.params_cam.image_size = glm::dvec2(size, size);
+  params.params_cam.focal_length = 0.5 * size / tan(0.5 * fovy);
+
+  // @NOTE The focal length is also the near plane of the renderer, keep the
+  // whole face behind it.
+  const double fill_ratio = 0.8;
+  double distance = 0.5 * extent / (fill_ratio * tan(0.5 * fovy));
+  if(distance - extent < params.params_cam.focal_length) {
+    cerr << "Warning: the mesh is too small to fill a " << size << "x" << size
+         << " image, it is moved behind the near plane." << endl;
+    distance = params.params_cam.focal_length + extent;
+  }
+  params.params_cam.far = distance + 2.0 * extent;
+
+  params.params_model.R = Vector3d(yaw, 0, 0);
+  glm::dmat4 Rmat = glm::eulerAngleYXZ(yaw, 0.0, 0.0);
+  glm::dvec4 c = Rmat * glm::dvec4(center[0], center[1], center[2], 1.0);
+  params.params_model.T = Vector3d(-c.x, -c.y, -c.z - distance);
+  params.params_model.Wexp_FACS = blendshape_weights;
+  return params;
+}
+
+void WriteReconstructionResult(const string& filename, const ReconstructionResult& params) {
+  ofstream fout(filename);
+  fout << params.params_cam << endl;
+  fout << params.params_model << endl;
+}
+
+void WritePoints(const string& filename, const BasicMesh& mesh, const vector<int>& landmarks,
+                 const ReconstructionResult& params) {
+  glm::dmat4 Rmat = glm::eulerAngleYXZ(params.params_model.R[0],
+                                       params.params_model.R[1],
+                                       params.params_model.R[2]);
+  glm::dmat4 Tmat = glm::translate(glm::dmat4(1.0),
+                                   glm::dvec3(params.params_model.T[0],
+                                              params.params_model.T[1],
+                                              params.params_model.T[2]));
+  glm::dmat4 Mview = Tmat * Rmat;
+  const double height = params.params_cam.image_size.y;
+
+  ofstream fout(filename);
+  fout << landmarks.size() << endl;
+  for(auto vidx : landmarks) {
+    auto v = mesh.vertex(vidx);
+    glm::dvec3 p = ProjectPoint(glm::dvec3(v[0], v[1], v[2]), Mview, params.params_cam);
+    fout << p.x << ' ' << height - 1 - p.y << endl;
+  }
+}
+
+// Albedo of each pixel, either constant or sampled from the texture
+cv::Mat RenderAlbedo(const BasicMesh& mesh, const vector<int>& faces,
+                     const ReconstructionResult& params, int size,
+                     const QImage& albedo_texture, const Vector3d& albedo) {
+  cv::Mat albedo_map(size, size, CV_64FC3, cv::Scalar(albedo[0], albedo[1], albedo[2]));
+  if(albedo_texture.isNull()) return albedo_map;
+
+  OffscreenMeshVisualizer visualizer(size, size);
+  visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
+  visualizer.SetRenderMode(OffscreenMeshVisualizer::TexturedMesh);
+  visualizer.BindMesh(mesh);
+  visualizer.BindTexture(albedo_texture);
+  visualizer.SetCameraParameters(params.params_cam);
+  visualizer.SetMeshRotationTranslation(params.params_model.R, params.params_model.T);
+  visualizer.SetFacesToRender(faces);
+  QImage albedo_image = visualizer.Render(true);
+
+  for(int y=0;y<size;++y) {
+    for(int x=0;x<size;++x) {
+      // the texture comes back in BGR order
+      QRgb pix = albedo_image.pixel(x, y);
+      albedo_map.at<cv::Vec3d>(y, x) = cv::Vec3d(qBlue(pix) / 255.0, qGreen(pix) / 255.0, qRed(pix) / 255.0);
+    }
+  }
+  return albedo_map;
+}
+
+QImage ShadeImage(const SurfaceMaps& surface, const cv::Mat& albedo, const VectorXd& lighting_coeffs) {
+  QImage image(surface.zmap.cols, surface.zmap.rows, QImage::Format_ARGB32);
+  image.fill(qRgb(0, 0, 0));
+  for(int y=0;y<surface.zmap.rows;++y) {
+    for(int x=0;x<surface.zmap.cols;++x) {
+      if(surface.zmap.at<float>(y, x) < -1e5) continue;
+      cv::Vec3d n = surface.normal_map.at<cv::Vec3d>(y, x);
+      double LdotY = lighting_coeffs.transpose() * sphericalharmonics(n[0], n[1], n[2]);
+      cv::Vec3d pix = albedo.at<cv::Vec3d>(y, x) * (LdotY * 255.0);
+      image.setPixel(x, y, qRgb(clamp<double>(pix[0], 0, 255),
+                                clamp<double>(pix[1], 0, 255),
+                                clamp<double>(pix[2], 0, 255)));
+    }
+  }
+  return image;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  po::variables_map vm = ParseCommandlineOptions(argc, argv);
+
+  QApplication a(argc, argv);
+  glutInit(&argc, argv);
+
+  const string home_directory = QDir::homePath().toStdString();
+  cout << "Home dir: " << home_directory << endl;
+
+  vector<double> sizes = ParseNumbers(vm["sizes"].as<string>());
+  vector<double> yaws = ParseNumbers(vm["yaw"].as<string>());
+  vector<double> lighting = ParseNumbers(vm["lighting"].as<string>());
+  vector<double> albedo_values = ParseNumbers(vm["albedo"].as<string>());
+  if(lighting.size() != 9) {
+    cerr << "Error: 9 lighting coefficients are expected." << endl;
+    return 1;
+  }
+  if(albedo_values.size() != 3) {
+    cerr << "Error: 3 albedo values are expected." << endl;
+    return 1;
+  }
+  VectorXd lighting_coeffs = Map<VectorXd>(lighting.data(), lighting.size());
+  Vector3d albedo(albedo_values[0], albedo_values[1], albedo_values[2]);
+
+  QImage albedo_texture;
+  if(vm.count("albedo_texture")) {
+    albedo_texture = QImage(vm["albedo_texture"].as<string>().c_str());
+    if(albedo_texture.isNull()) {
+      cerr << "Error: failed to load " << vm["albedo_texture"].as<string>() << endl;
+      return 1;
+    }
+  }
+
+  // The pipeline must see the same coarse geometry, so the resources are set
+  // up the way the benchmark will load them
+  SFSResourceOptions resource_options;
+  if(vm.count("blendshapes_path")) {
+    resource_options.use_blendshapes = true;
+    resource_options.blendshapes_path = vm["blendshapes_path"].as<string>();
+  } else {
+    resource_options.use_template_geometry = true;
+  }
+  resource_options.subdivision_depth = vm["subdivision_depth"].as<int>();
+  VectorXd blendshape_weights = ParseBlendshapeWeights(vm["blendshape_weights"].as<string>());
+
+  SFSResources resources(SFSResourcePaths::FromHomeDirectory(home_directory), resource_options);
+  const vector<int>& landmarks = resources.assets.Landmarks();
+
+  ReconstructionResult shape_params;
+  shape_params.params_model.Wexp_FACS = blendshape_weights;
+  resources.ApplyParams(shape_params);
+  const BasicMesh& coarse_mesh = resources.mesh();
+  BasicMesh detailed_mesh = AddRelief(coarse_mesh,
+                                      vm["detail_amplitude"].as<double>(),
+                                      vm["detail_frequency"].as<double>());
+
+  const fs::path output_dir(vm["output_dir"].as<string>());
+  fs::create_directories(output_dir);
+
+  json description;
+  description["resource_options"]["use_blendshapes"] = resource_options.use_blendshapes;
+  description["resource_options"]["blendshapes_path"] = resource_options.blendshapes_path;
+  description["resource_options"]["subdivision_depth"] = resource_options.subdivision_depth;
+  description["resource_options"]["use_template_geometry"] = resource_options.use_template_geometry;
+  description["lighting"] = lighting;
+  description["albedo"] = albedo_values;
+  description["detail_amplitude"] = vm["detail_amplitude"].as<double>();
+  description["detail_frequency"] = vm["detail_frequency"].as<double>();
+  description["resolutions"] = json::array();
+
+  for(double size_value : sizes) {
+    const int size = static_cast<int>(size_value);
+    const fs::path size_dir = output_dir / fs::path(to_string(size));
+    fs::create_directories(size_dir);
+    PhGUtils::message("Rendering " + to_string(size) + "x" + to_string(size) + " images ...");
+
+    ofstream settings_file((size_dir / fs::path("settings.txt")).string());
+    for(int i=0;i<yaws.size();++i) {
+      const string image_filename = to_string(i) + ".png";
+      const string pts_filename = to_string(i) + ".pts";
+
+      ReconstructionResult params = MakeParameters(coarse_mesh, size, vm["fovy"].as<double>(),
+                                                   yaws[i], blendshape_weights);
+
+      SyntheticGroundTruth gt;
+      gt.surface = RenderSurfaceMaps(detailed_mesh, resources.valid_faces_indices(), params, size, size);
+      gt.lighting_coeffs = lighting_coeffs;
+      gt.albedo = RenderAlbedo(detailed_mesh, resources.valid_faces_indices(), params, size,
+                               albedo_texture, albedo);
+
+      QImage image = ShadeImage(gt.surface, gt.albedo, lighting_coeffs);
+      image.save((size_dir / fs::path(image_filename)).string().c_str());
+
+      WritePoints((size_dir / fs::path(pts_filename)).string(), coarse_mesh, landmarks, params);
+      WriteReconstructionResult((size_dir / fs::path(image_filename + ".res")).string(), params);
+      if(!SaveGroundTruth((size_dir / fs::path(image_filename + ".gt")).string(), gt)) {
+        cerr << "Failed to write ground truth for " << image_filename << endl;
+        return 1;
+      }
+
+      settings_file << image_filename << ' ' << pts_filename << endl;
+    }
+    settings_file.close();
+
+    json resolution;
+    resolution["size"] = size;
+    resolution["settings_file"] = (fs::path(to_string(size)) / fs::path("settings.txt")).string();
+    description["resolutions"].push_back(resolution);
+    PhGUtils::message("done.");
+  }
+
+  ofstream fout((output_dir / fs::path("benchmark.json")).string());
+  fout << setw(2) << description << endl;
+  fout.close();
+
+  PhGUtils::message("Synthetic data written to " + output_dir.string());
+  return 0;
+}
@@ -0,0 +1,227 @@
+#include <QApplication>
+#include <QDir>
+
+#include <GL/freeglut_std.h>
+
+#include <chrono>
+#include <mutex>
+
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include "synthetic_data.h"
+#include "../sfs_trace.h"
+
+// End-to-end benchmark of the shape from shading pipeline on the data written
+// by generate_synthetic_faces. Every resolution is run through the complete
+// pipeline with tracing enabled. The wall time of each stage is taken from
+// the recorded spans, summed over all images, along with the memory they
+// used (heap figures need a build with SFS_MEMORY_PROFILING), and the final
+// depth and normal
+// maps are compared against the ground truth. The error of the initial
+// reference maps is reported alongside as the baseline to improve on.
+
+namespace {
+
+// Stages reported in the summary table, in execution order
+const char* kReportedStages[] = {
+  "mean_texture", "prepare", "prepare_solver", "lighting", "albedo", "depth", "export"
+};
+
+po::variables_map ParseCommandlineOptions(int argc, char** argv) {
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help", "Print help messages")
+    ("data_dir", po::value<string>()->required(), "Directory written by generate_synthetic_faces.")
+    ("max_iters", po::value<int>(), "Override the number of iterations of the main loop.")
+    ("report", po::value<string>(), "Report file. Defaults to <data_dir>/benchmark_report.json.");
+  AddSettingsOptions(desc);
+  po::variables_map vm;
+
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if(vm.count("help")) {
+      cout << desc << endl;
+      exit(1);
+    }
+    return vm;
+  } catch(po::error& e) {
+    cerr << "Error: " << e.what() << endl;
+    cerr << desc << endl;
+    exit(1);
+  }
+}
+
+json ErrorToJson(const SurfaceError& error) {
+  json j;
+  j["num_pixels"] = error.num_pixels;
+  j["depth_rmse"] = error.depth_rmse;
+  j["depth_mean_abs"] = error.depth_mean_abs;
+  j["normal_mean_angle"] = error.normal_mean_angle;
+  j["normal_median_angle"] = error.normal_median_angle;
+  return j;
+}
+
+struct ImageResult {
+  string filename;
+  SurfaceError initial, final;
+};
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  po::variables_map vm = ParseCommandlineOptions(argc, argv);
+
+  QApplication a(argc, argv);
+  glutInit(&argc, argv);
+
+  const string home_directory = QDir::homePath().toStdString();
+  cout << "Home dir: " << home_directory << endl;
+
+  const fs::path data_dir(vm["data_dir"].as<string>());
+  const json description = json::parse(ifstream((data_dir / fs::path("benchmark.json")).string()));
+
+  SFSSettings global_settings = SFSSettings::FromJson(LoadSettingsJson(vm, home_directory));
+  global_settings.preparation_only = false;
+  global_settings.trace.enabled = true;
+  global_settings.trace.memory = true;
+  if(vm.count("max_iters")) global_settings.max_iters = vm["max_iters"].as<int>();
+
+  const json& resource_settings = description["resource_options"];
+  SFSResourceOptions resource_options;
+  resource_options.use_blendshapes = resource_settings["use_blendshapes"];
+  resource_options.blendshapes_path = resource_settings["blendshapes_path"];
+  resource_options.subdivision_depth = resource_settings["subdivision_depth"];
+  resource_options.use_template_geometry = resource_settings["use_template_geometry"];
+
+  SFSResources resources(SFSResourcePaths::FromHomeDirectory(home_directory), resource_options);
+
+  json report;
+  report["settings"] = global_settings.ToJson();
+  report["resolutions"] = json::array();
+
+  for(auto& resolution : description["resolutions"]) {
+    const int size = resolution["size"];
+    const fs::path settings_file = data_dir / fs::path(resolution["settings_file"].get<string>());
+    const fs::path results_path = settings_file.parent_path() / fs::path("SFS_benchmark");
+
+    vector<ImageBundle> image_bundles = LoadImageBundles(settings_file.string());
+
+    map<string, SyntheticGroundTruth> ground_truths;
+    for(auto& bundle : image_bundles) {
+      const string gt_filename = (settings_file.parent_path() / fs::path(bundle.filename + ".gt")).string();
+      if(!LoadGroundTruth(gt_filename, ground_truths[bundle.filename])) {
+        cerr << "Error: failed to load ground truth " << gt_filename << endl;
+        return 1;
+      }
+    }
+
+    std::mutex results_mutex;
+    vector<ImageResult> image_results;
+
+    SFSPipeline pipeline(resources, global_settings);
+    pipeline.SetResultCallback([&](const ImageBundle& bundle, const SFSImageState& state) {
+      const SyntheticGroundTruth& gt = ground_truths.at(bundle.filename);
+      ImageResult result;
+      result.filename = bundle.filename;
+      result.initial = CompareSurfaces(gt.surface, state.depth_map_ref, state.normal_map_ref.ToMat());
+      result.final = CompareSurfaces(gt.surface, state.zmap, state.normal_map.ToMat());
+      std::lock_guard<std::mutex> lock(results_mutex);
+      image_results.push_back(result);
+    });
+
+    PhGUtils::message("Running " + to_string(size) + "x" + to_string(size) + " ...");
+    auto start_time = std::chrono::steady_clock::now();
+    pipeline.Run(image_bundles, results_path);
+    const double wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    json entry;
+    entry["size"] = size;
+    entry["num_images"] = image_bundles.size();
+    entry["wall_time"] = wall_time;
+    for(auto& item : Tracer::Instance().SpanTotals()) {
+      entry["stages"][item.first]["time"] = item.second.duration * 1e-6;
+      entry["stages"][item.first]["count"] = item.second.count;
+      entry["stages"][item.first]["peak_rss_mb"] = item.second.peak_rss_mb;
+      if(HeapProfilingEnabled()) {
+        entry["stages"][item.first]["allocated_mb"] = item.second.allocated_mb;
+        entry["stages"][item.first]["peak_heap_mb"] = item.second.peak_heap_mb;
+      }
+    }
+    entry["peak_rss_mb"] = ToMegabytes(PeakRSS());
+
+    std::sort(image_results.begin(), image_results.end(),
+              [](const ImageResult& r1, const ImageResult& r2) { return r1.filename < r2.filename; });
+    double initial_depth = 0, final_depth = 0, initial_normal = 0, final_normal = 0;
+    entry["images"] = json::array();
+    for(auto& result : image_results) {
+      json image_entry;
+      image_entry["filename"] = result.filename;
+      image_entry["initial"] = ErrorToJson(result.initial);
+      image_entry["final"] = ErrorToJson(result.final);
+      entry["images"].push_back(image_entry);
+
+      initial_depth += result.initial.depth_rmse;
+      final_depth += result.final.depth_rmse;
+      initial_normal += result.initial.normal_mean_angle;
+      final_normal += result.final.normal_mean_angle;
+    }
+    const double num_results = max<size_t>(image_results.size(), 1);
+    entry["mean_error"]["initial"]["depth_rmse"] = initial_depth / num_results;
+    entry["mean_error"]["initial"]["normal_mean_angle"] = initial_normal / num_results;
+    entry["mean_error"]["final"]["depth_rmse"] = final_depth / num_results;
+    entry["mean_error"]["final"]["normal_mean_angle"] = final_normal / num_results;
+    report["resolutions"].push_back(entry);
+    PhGUtils::message("done.");
+  }
+
+  // ====================================================================
+  // summary
+  // ====================================================================
+  cout << endl << "[Shape from shading] Benchmark summary (seconds, summed over images)" << endl;
+  cout << setw(8) << "size" << setw(10) << "wall";
+  for(auto stage : kReportedStages) cout << setw(16) << stage;
+  cout << setw(14) << "depth_rmse" << setw(14) << "normal_deg" << endl;
+  for(auto& entry : report["resolutions"]) {
+    cout << setw(8) << entry["size"].get<int>()
+         << setw(10) << fixed << setprecision(2) << entry["wall_time"].get<double>();
+    for(auto stage : kReportedStages) {
+      double t = entry["stages"].count(stage)? entry["stages"][stage]["time"].get<double>() : 0.0;
+      cout << setw(16) << t;
+    }
+    cout << setw(14) << setprecision(5) << entry["mean_error"]["final"]["depth_rmse"].get<double>()
+         << setw(14) << setprecision(3) << entry["mean_error"]["final"]["normal_mean_angle"].get<double>()
+         << endl;
+  }
+  if(HeapProfilingEnabled()) {
+    cout << endl << "[Shape from shading] Benchmark memory (MB, largest heap peak of a single image)" << endl;
+    cout << setw(8) << "size" << setw(10) << "peak_rss";
+    for(auto stage : kReportedStages) cout << setw(16) << stage;
+    cout << endl;
+    for(auto& entry : report["resolutions"]) {
+      cout << setw(8) << entry["size"].get<int>()
+           << setw(10) << fixed << setprecision(1) << entry["peak_rss_mb"].get<double>();
+      for(auto stage : kReportedStages) {
+        double m = entry["stages"].count(stage)? entry["stages"][stage]["peak_heap_mb"].get<double>() : 0.0;
+        cout << setw(16) << m;
+      }
+      cout << endl;
+    }
+  }
+  cout.unsetf(ios::fixed);
+
+  resources.assets.ReportLoadTimes();
+  for(auto& t : resources.assets.LoadTimes()) {
+    report["resource_load_times"][t.first] = t.second;
+  }
+
+  const string report_filename = vm.count("report")?
+    vm["report"].as<string>() : (data_dir / fs::path("benchmark_report.json")).string();
+  ofstream fout(report_filename);
+  fout << setw(2) << report << endl;
+  fout.close();
+  PhGUtils::message("Report written to " + report_filename);
+
+  return 0;
+}
@@ -0,0 +1,132 @@
+#include "synthetic_data.h"
+
+#include <numeric>
+
+namespace {
+
+const uint64_t kGroundTruthFingerprint = HashString("synthetic_ground_truth_v1");
+
+}  // namespace
+
+SurfaceMaps RenderSurfaceMaps(const BasicMesh& mesh,
+                              const vector<int>& faces,
+                              const ReconstructionResult& params,
+                              int width, int height) {
+  OffscreenMeshVisualizer visualizer(width, height);
+  visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
+  visualizer.SetRenderMode(OffscreenMeshVisualizer::Normal);
+  visualizer.BindMesh(mesh);
+  visualizer.SetCameraParameters(params.params_cam);
+  visualizer.SetMeshRotationTranslation(params.params_model.R, params.params_model.T);
+  visualizer.SetFacesToRender(faces);
+
+  pair<QImage, vector<float>> img_and_depth = visualizer.RenderWithDepth();
+  const QImage& img = img_and_depth.first;
+  const vector<float>& depth = img_and_depth.second;
+
+  // same projection as SFSPrepareStage, near is the focal length
+  const double aspect_ratio = params.params_cam.image_size.x / params.params_cam.image_size.y;
+  const double far = params.params_cam.far;
+  const double near = params.params_cam.focal_length;
+  const double top = near * tan(0.5 * params.params_cam.fovy);
+  const double right = top * aspect_ratio;
+  glm::dmat4 Mproj = glm::dmat4(near/right, 0, 0, 0,
+                                0, near/top, 0, 0,
+                                0, 0, -(far+near)/(far-near), -1,
+                                0, 0, -2.0 * far * near / (far - near), 0.0);
+  glm::ivec4 viewport(0, 0, width, height);
+
+  glm::dmat4 Rmat = glm::eulerAngleYXZ(params.params_model.R[0],
+                                       params.params_model.R[1],
+                                       params.params_model.R[2]);
+  glm::dmat4 Tmat = glm::translate(glm::dmat4(1.0),
+                                   glm::dvec3(params.params_model.T[0],
+                                              params.params_model.T[1],
+                                              params.params_model.T[2]));
+  glm::dmat4 Mview = Tmat * Rmat;
+
+  SurfaceMaps maps;
+  maps.zmap = cv::Mat(height, width, CV_32F);
+  maps.normal_map = cv::Mat(height, width, CV_64FC3);
+  for(int y=0;y<height;++y) {
+    for(int x=0;x<width;++x) {
+      auto pix = img.pixel(x, y);
+      double nx = qRed(pix) / 255.0 * 2.0 - 1.0;
+      double ny = qGreen(pix) / 255.0 * 2.0 - 1.0;
+      double nz = max(0.0, qBlue(pix) / 255.0 * 2.0 - 1.0);
+
+      double theta, phi;
+      tie(theta, phi) = normal2sphericalcoords<double>(nx, ny, nz);
+      tie(nx, ny, nz) = sphericalcoords2normal<double>(theta, phi);
+      maps.normal_map.at<cv::Vec3d>(y, x) = cv::Vec3d(nx, ny, nz);
+
+      double dvalue = depth[(height-1-y)*width+x];
+      if(dvalue < 1) {
+        glm::dvec3 XYZ = glm::unProject(glm::dvec3(x, height-1-y, dvalue), Mview, Mproj, viewport);
+        glm::dvec4 Rxyz = Rmat * glm::dvec4(XYZ.x, XYZ.y, XYZ.z, 1);
+        maps.zmap.at<float>(y, x) = Rxyz.z;
+      } else {
+        maps.zmap.at<float>(y, x) = -1e6;
+      }
+    }
+  }
+  return maps;
+}
+
+bool SaveGroundTruth(const string& filename, const SyntheticGroundTruth& gt) {
+  CheckpointWriter writer(kGroundTruthFingerprint);
+  writer.Write("zmap", gt.surface.zmap);
+  writer.Write("normal_map", gt.surface.normal_map);
+  writer.Write("lighting_coeffs", gt.lighting_coeffs);
+  writer.Write("albedo", gt.albedo);
+  return writer.Save(filename);
+}
+
+bool LoadGroundTruth(const string& filename, SyntheticGroundTruth& gt) {
+  CheckpointReader reader;
+  if(!reader.Load(filename, kGroundTruthFingerprint)) return false;
+  bool ok = true;
+  ok &= reader.Read("zmap", gt.surface.zmap);
+  ok &= reader.Read("normal_map", gt.surface.normal_map);
+  ok &= reader.Read("lighting_coeffs", gt.lighting_coeffs);
+  ok &= reader.Read("albedo", gt.albedo);
+  return ok;
+}
+
+SurfaceError CompareSurfaces(const SurfaceMaps& truth,
+                             const cv::Mat& zmap,
+                             const cv::Mat& normal_map) {
+  cv::Mat z;
+  zmap.convertTo(z, CV_64F);
+
+  double sum_sq = 0, sum_abs = 0;
+  vector<double> angles;
+  for(int y=0;y<truth.zmap.rows;++y) {
+    for(int x=0;x<truth.zmap.cols;++x) {
+      const double z_true = truth.zmap.at<float>(y, x);
+      const double z_est = z.at<double>(y, x);
+      if(z_true < -1e5 || z_est < -1e5) continue;
+
+      const double dz = z_est - z_true;
+      sum_sq += dz * dz;
+      sum_abs += fabs(dz);
+
+      cv::Vec3d n_true = truth.normal_map.at<cv::Vec3d>(y, x);
+      cv::Vec3d n_est = normal_map.at<cv::Vec3d>(y, x);
+      Vector3d a(n_true[0], n_true[1], n_true[2]), b(n_est[0], n_est[1], n_est[2]);
+      const double norms = a.norm() * b.norm();
+      const double cos_angle = norms > 0? clamp<double>(a.dot(b) / norms, -1.0, 1.0) : 1.0;
+      angles.push_back(acos(cos_angle) * 180.0 / M_PI);
+    }
+  }
+
+  SurfaceError error{static_cast<int>(angles.size()), 0, 0, 0, 0};
+  if(angles.empty()) return error;
+
+  error.depth_rmse = sqrt(sum_sq / angles.size());
+  error.depth_mean_abs = sum_abs / angles.size();
+  error.normal_mean_angle = std::accumulate(angles.begin(), angles.end(), 0.0) / angles.size();
+  std::nth_element(angles.begin(), angles.begin() + angles.size() / 2, angles.end());
+  error.normal_median_angle = angles[angles.size() / 2];
+  return error;
+}
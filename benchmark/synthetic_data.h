@@ -0,0 +1,46 @@
+#ifndef FACESHAPEFROMSHADING_SYNTHETIC_DATA_H
+#define FACESHAPEFROMSHADING_SYNTHETIC_DATA_H
+
+#include "../sfs_pipeline.h"
+
+// Depth and normal maps of a rendered mesh, in the same frame as the maps of
+// SFSImageState: zmap holds the z value of the rotated mesh (-1e6 outside the
+// face) and normal_map the decoded normals.
+struct SurfaceMaps {
+  cv::Mat zmap;         // CV_32F
+  cv::Mat normal_map;   // CV_64FC3
+};
+
+// Render the faces of a mesh seen through the camera and pose of params the
+// same way SFSPrepareStage builds its reference maps.
+SurfaceMaps RenderSurfaceMaps(const BasicMesh& mesh,
+                              const vector<int>& faces,
+                              const ReconstructionResult& params,
+                              int width, int height);
+
+// Ground truth of a synthetic image, stored next to it as <image>.gt.
+struct SyntheticGroundTruth {
+  SurfaceMaps surface;
+  VectorXd lighting_coeffs;
+  cv::Mat albedo;       // CV_64FC3, [0, 1] range
+};
+
+bool SaveGroundTruth(const string& filename, const SyntheticGroundTruth& gt);
+bool LoadGroundTruth(const string& filename, SyntheticGroundTruth& gt);
+
+struct SurfaceError {
+  int num_pixels;
+  double depth_rmse;
+  double depth_mean_abs;
+  double normal_mean_angle;     // degrees
+  double normal_median_angle;   // degrees
+};
+
+// Compare an estimated depth map (CV_32F or CV_64F, values below -1e5 are
+// invalid) and normal map against the ground truth, over the pixels valid in
+// both.
+SurfaceError CompareSurfaces(const SurfaceMaps& truth,
+                             const cv::Mat& zmap,
+                             const cv::Mat& normal_map);
+
+#endif  // FACESHAPEFROMSHADING_SYNTHETIC_DATA_H
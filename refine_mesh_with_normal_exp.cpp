@@ -37,6 +37,9 @@ using json = nlohmann::json;
 
 #include "cost_functions.h"
 #include "defs.h"
+#include "sfs_log.h"
+#include "sfs_resources.h"
+#include "sfs_settings.h"
 #include "utils.h"
 
 struct NormalConstraint {
@@ -58,6 +61,7 @@ po::variables_map ParseCommandlineOptions(int argc, char** argv) {
     ("output_dir", po::value<string>()->required(), "Directory for output data.")
     ("subdivision", "Whether the input blendshapes are subdivided or not.")
     ("subdivision_depth", po::value<int>(), "The depth of subdivision.");
+  AddSettingsOptions(desc);
   po::variables_map vm;
 
   try {
@@ -87,52 +91,15 @@ int main(int argc, char** argv) {
 
   // load the settings file
   PhGUtils::message("Loading global settings ...");
-  json global_settings = json::parse(ifstream(home_directory + "/Codes/FaceShapeFromShading/settings.txt"));
+  const SFSSettings global_settings = SFSSettings::FromJson(LoadSettingsJson(vm, home_directory));
+  ApplyLogSettings(global_settings.log);
   PhGUtils::message("done.");
-  cout << setw(2) << global_settings << endl;
-
-  const string model_filename(home_directory + "/Data/Multilinear/blendshape_core.tensor");
-  const string id_prior_filename(home_directory + "/Data/Multilinear/blendshape_u_0_aug.tensor");
-  const string exp_prior_filename(home_directory + "/Data/Multilinear/blendshape_u_1_aug.tensor");
-  const string template_mesh_filename(home_directory + "/Data/Multilinear/template.obj");
-  const string contour_points_filename(home_directory + "/Data/Multilinear/contourpoints.txt");
-  const string landmarks_filename(home_directory + "/Data/Multilinear/landmarks_73.txt");
-  const string albedo_index_map_filename(home_directory + "/Data/Multilinear/albedo_index.png");
-  const string albedo_pixel_map_filename(home_directory + "/Data/Multilinear/albedo_pixel.png");
-  const string mean_albedo_filename(home_directory + "/Data/Texture/mean_texture.png");
-  const string core_face_region_filename(home_directory + "/Data/Multilinear/albedos/core_face.png");
-
-  const string valid_faces_indices_filename(home_directory + "/Data/Multilinear/face_region_indices.txt");
-  const string face_boundary_indices_filename(home_directory + "/Data/Multilinear/face_boundary_indices.txt");
-  const string hair_region_filename(home_directory + "/Data/Multilinear/hair_region_indices.txt");
-
-  BasicMesh mesh(template_mesh_filename);
-  auto landmarks = LoadIndices(landmarks_filename);
-  auto contour_indices = LoadContourIndices(contour_points_filename);
-
-  auto valid_faces_indices_quad = LoadIndices(valid_faces_indices_filename);
-  // @HACK each quad face is triangulated, so the indices change from i to [2*i, 2*i+1]
-  vector<int> valid_faces_indices;
-  for(auto fidx : valid_faces_indices_quad) {
-    valid_faces_indices.push_back(fidx*2);
-    valid_faces_indices.push_back(fidx*2+1);
-  }
+  cout << setw(2) << global_settings.ToJson() << endl;
 
-  auto faces_boundary_indices_quad = LoadIndices(face_boundary_indices_filename);
-  // @HACK each quad face is triangulated, so the indices change from i to [2*i, 2*i+1]
-  unordered_set<int> face_boundary_indices;
-  for(auto fidx : faces_boundary_indices_quad) {
-    face_boundary_indices.insert(fidx*2);
-    face_boundary_indices.insert(fidx*2+1);
-  }
-
-  auto hair_region_indices_quad = LoadIndices(hair_region_filename);
-  // @HACK each quad face is triangulated, so the indices change from i to [2*i, 2*i+1]
-  unordered_set<int> hair_region_indices;
-  for(auto fidx : hair_region_indices_quad) {
-    hair_region_indices.insert(fidx*2);
-    hair_region_indices.insert(fidx*2+1);
-  }
+  // the assets are loaded on first use
+  SFSAssetRegistry assets(SFSResourcePaths::FromHomeDirectory(home_directory));
+  BasicMesh mesh = assets.TemplateMesh();
+  vector<int> valid_faces_indices = assets.ValidFacesIndices();
 
   if(vm.count("subdivision")) {
     // HACK: subdivie the template mesh so it has the same topology as the input
@@ -176,8 +143,6 @@ int main(int argc, char** argv) {
     blendshapes[i].ComputeNormals();
   }
 
-  MultilinearModel model(model_filename);
-
   // Start the main process
   {
     cout << "[" << image_filename << ", " << pts_filename << "]" << endl;
@@ -320,7 +285,7 @@ int main(int argc, char** argv) {
     auto triangles_indices_pair = FindTrianglesIndices(mesh_img);
     set<int> triangles = triangles_indices_pair.first;
     vector<int> triangle_indices_map = triangles_indices_pair.second;
-    cerr << "Num triangles visible: " << triangles.size() << endl;
+    SFS_LOG(Debug, Refine) << "Num triangles visible: " << triangles.size();
 
     // for each visible pixel, compute its bary-centric coordinates
     cv::Mat mask_image = cv::imread(mask_filename.string(), CV_LOAD_IMAGE_GRAYSCALE);
@@ -335,7 +300,7 @@ int main(int argc, char** argv) {
         const int fidx = triangle_indices_map[pidx];
 
         if(pix > 0 && fidx >= 0) {
-          cout << pix << " " << fidx << endl;
+          SFS_LOG(Trace, Refine) << pix << " " << fidx;
           auto f = mesh.face(fidx);
           auto v0 = mesh.vertex(f[0]), v1 = mesh.vertex(f[1]), v2 = mesh.vertex(f[2]);
 
@@ -348,7 +313,7 @@ int main(int argc, char** argv) {
                                                   PhGUtils::Point3d(v2[0], v2[1], v2[2]),
                                                   bcoords);
 
-          cout << bcoords.x << ", " << bcoords.y << ", " << bcoords.z << endl;
+          SFS_LOG(Trace, Refine) << bcoords.x << ", " << bcoords.y << ", " << bcoords.z;
           bcoords.x = clamp<float>(bcoords.x, 0, 1);
           bcoords.y = clamp<float>(bcoords.y, 0, 1);
           bcoords.z = clamp<float>(bcoords.z, 0, 1);
@@ -387,5 +352,6 @@ int main(int argc, char** argv) {
     }
   }
 
+  assets.ReportLoadTimes();
   return 0;
 }
@@ -0,0 +1,173 @@
+#include "sfs_cache.h"
+
+#include <fstream>
+
+#include "sfs_log.h"
+#include "sfs_pipeline.h"
+
+#ifndef SFS_CODE_VERSION
+#define SFS_CODE_VERSION "unknown"
+#endif
+
+namespace {
+
+// Bump when the content of the entries changes without a new commit
+const int kCacheLayoutVersion = 2;
+
+template <typename Derived>
+uint64_t HashMatrix(const Eigen::MatrixBase<Derived>& m, uint64_t seed) {
+  for(int j=0;j<m.size();++j) {
+    const double value = m(j);
+    seed = HashBytes(&value, sizeof(value), seed);
+  }
+  return seed;
+}
+
+uint64_t HashDouble(double value, uint64_t seed) {
+  return HashBytes(&value, sizeof(value), seed);
+}
+
+}  // namespace
+
+string SFSCodeVersion() {
+  return string(SFS_CODE_VERSION) + "/" + to_string(kCacheLayoutVersion);
+}
+
+uint64_t HashImageBundle(const ImageBundle& bundle) {
+  const QImage& image = bundle.image;
+  uint64_t h = HashString(to_string(image.width()) + "x" + to_string(image.height())
+                          + "/" + to_string(static_cast<int>(image.format())));
+  // the scanlines are padded to 4 bytes, only hash the pixels
+  const int line_bytes = (image.width() * image.depth() + 7) / 8;
+  for(int y=0;y<image.height();++y) {
+    h = HashBytes(image.constScanLine(y), line_bytes, h);
+  }
+
+  const CameraParameters& cam = bundle.params.params_cam;
+  h = HashDouble(cam.fovy, h);
+  h = HashDouble(cam.far, h);
+  h = HashDouble(cam.focal_length, h);
+  h = HashDouble(cam.image_size.x, h);
+  h = HashDouble(cam.image_size.y, h);
+
+  const ModelParameters& model = bundle.params.params_model;
+  h = HashMatrix(model.Wid, h);
+  h = HashMatrix(model.Wexp, h);
+  h = HashMatrix(model.Wexp_FACS, h);
+  h = HashMatrix(model.R, h);
+  h = HashMatrix(model.T, h);
+  return h;
+}
+
+uint64_t HashFile(const string& filename) {
+  ifstream fin(filename, ios::binary);
+  if(!fin) return 0;
+  uint64_t h = HashString("");
+  char buffer[65536];
+  while(fin.read(buffer, sizeof(buffer)) || fin.gcount() > 0) {
+    h = HashBytes(buffer, fin.gcount(), h);
+  }
+  return h;
+}
+
+SFSResultCache::SFSResultCache(const fs::path& cache_path)
+  : cache_path(cache_path), num_hits(0), num_misses(0) {
+  fs::create_directories(cache_path);
+}
+
+string SFSResultCache::EntryFilename(const string& kind, uint64_t key) const {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(key));
+  const fs::path dir = cache_path / fs::path(kind) / fs::path(string(hex, 2));
+  return (dir / fs::path(string(hex) + ".ckpt")).string();
+}
+
+bool SFSResultCache::Has(const string& kind, uint64_t key) const {
+  CheckpointReader reader;
+  return reader.Load(EntryFilename(kind, key), key);
+}
+
+bool SFSResultCache::Load(const string& kind, uint64_t key, CheckpointReader& reader) const {
+  const bool found = reader.Load(EntryFilename(kind, key), key);
+  ++(found? num_hits : num_misses);
+  return found;
+}
+
+void SFSResultCache::Save(const string& kind, uint64_t key, const CheckpointWriter& writer) const {
+  const string filename = EntryFilename(kind, key);
+  boost::system::error_code ec;
+  fs::create_directories(fs::path(filename).parent_path(), ec);
+  if(ec || !writer.Save(filename)) {
+    SFS_LOG(Error, Cache) << "Failed to write cache entry " << filename;
+  }
+}
+
+bool SFSResultCache::LoadMeanTexture(uint64_t key, QImage& mean_texture) const {
+  CheckpointReader reader;
+  if(!Load("mean_texture", key, reader)) return false;
+
+  cv::Mat pixels;
+  if(!reader.Read("mean_texture", pixels)) return false;
+
+  if(pixels.empty()) {
+    mean_texture = QImage();
+  } else {
+    if(pixels.type() != CV_8UC4) return false;
+    mean_texture = QImage(pixels.data, pixels.cols, pixels.rows, static_cast<int>(pixels.step[0]),
+                          QImage::Format_ARGB32).copy();
+  }
+  return true;
+}
+
+void SFSResultCache::SaveMeanTexture(uint64_t key, const QImage& mean_texture) const {
+  CheckpointWriter writer(key);
+  if(mean_texture.isNull()) {
+    writer.Write("mean_texture", cv::Mat());
+  } else {
+    QImage image = mean_texture.convertToFormat(QImage::Format_ARGB32);
+    writer.Write("mean_texture", cv::Mat(image.height(), image.width(), CV_8UC4,
+                                         const_cast<uchar*>(image.constBits()), image.bytesPerLine()));
+  }
+  Save("mean_texture", key, writer);
+}
+
+bool SFSResultCache::LoadFaceIndices(uint64_t key, vector<int>& face_indices_map) const {
+  CheckpointReader reader;
+  return Load("face_indices", key, reader) && reader.Read("face_indices_map", face_indices_map);
+}
+
+void SFSResultCache::SaveFaceIndices(uint64_t key, const vector<int>& face_indices_map) const {
+  CheckpointWriter writer(key);
+  writer.Write("face_indices_map", face_indices_map);
+  Save("face_indices", key, writer);
+}
+
+bool SFSResultCache::HasPrepared(uint64_t key) const {
+  return Has("prepare", key);
+}
+
+bool SFSResultCache::LoadPrepared(uint64_t key, SFSImageState& state) const {
+  CheckpointReader reader;
+  return Load("prepare", key, reader) && ReadPreparedFields(reader, state);
+}
+
+void SFSResultCache::SavePrepared(uint64_t key, const SFSImageState& state) const {
+  CheckpointWriter writer(key);
+  WritePreparedFields(writer, state);
+  Save("prepare", key, writer);
+}
+
+bool SFSResultCache::HasStage(uint64_t key) const {
+  return Has("stage", key);
+}
+
+bool SFSResultCache::LoadStage(uint64_t key, SFSCheckpointStore::Stage stage, SFSImageState& state) const {
+  CheckpointReader reader;
+  return Load("stage", key, reader) && ReadStageFields(reader, stage, state);
+}
+
+void SFSResultCache::SaveStage(uint64_t key, SFSCheckpointStore::Stage stage, const SFSImageState& state) const {
+  CheckpointWriter writer(key);
+  WriteStageFields(writer, stage, state);
+  Save("stage", key, writer);
+}
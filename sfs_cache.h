@@ -0,0 +1,72 @@
+#ifndef FACESHAPEFROMSHADING_SFS_CACHE_H
+#define FACESHAPEFROMSHADING_SFS_CACHE_H
+
+#include "common.h"
+
+#include <atomic>
+
+#include "sfs_checkpoint.h"
+
+// Version of the code in the cache keys: the git commit the program was built
+// from (see CMakeLists.txt). Uncommitted changes are not part of it, clear the
+// cache after changing a solver locally.
+string SFSCodeVersion();
+
+// Content hashes of the stage inputs. An image is hashed by its pixels and
+// the reconstruction parameters, not by its filename, so a renamed or copied
+// image maps to the same cache entries. The landmarks are not used by the
+// stages and are left out.
+uint64_t HashImageBundle(const ImageBundle& bundle);
+// 0 if the file cannot be read
+uint64_t HashFile(const string& filename);
+
+// Stage results stored by the hash of everything they were computed from,
+// shared by all the jobs and subjects using the same cache directory:
+//
+//   <cache_path>/mean_texture/<xx>/<key>.ckpt   mean texture of a subject
+//   <cache_path>/face_indices/<xx>/<key>.ckpt   face index map of an image
+//   <cache_path>/prepare/<xx>/<key>.ckpt        prepared maps of an image
+//   <cache_path>/stage/<xx>/<key>.ckpt          result of one solver stage
+//
+// where xx are the first two hex digits of the key. The entries use the
+// checkpoint format (sfs_checkpoint.h) with the key as fingerprint. An entry
+// is never updated: a change in the inputs gives another key. The directory
+// can be removed at any time to reclaim the space.
+class SFSResultCache {
+public:
+  explicit SFSResultCache(const fs::path& cache_path);
+
+  const fs::path& path() const { return cache_path; }
+
+  // Mean texture of a set of images
+  bool LoadMeanTexture(uint64_t key, QImage& mean_texture) const;
+  void SaveMeanTexture(uint64_t key, const QImage& mean_texture) const;
+
+  // Face index map of an image, found while building the mean texture. Stored
+  // per image so that they can be read back one at a time.
+  bool LoadFaceIndices(uint64_t key, vector<int>& face_indices_map) const;
+  void SaveFaceIndices(uint64_t key, const vector<int>& face_indices_map) const;
+
+  bool HasPrepared(uint64_t key) const;
+  bool LoadPrepared(uint64_t key, SFSImageState& state) const;
+  void SavePrepared(uint64_t key, const SFSImageState& state) const;
+
+  bool HasStage(uint64_t key) const;
+  bool LoadStage(uint64_t key, SFSCheckpointStore::Stage stage, SFSImageState& state) const;
+  void SaveStage(uint64_t key, SFSCheckpointStore::Stage stage, const SFSImageState& state) const;
+
+  // Entries loaded and looked up in vain since construction
+  int hits() const { return num_hits; }
+  int misses() const { return num_misses; }
+
+private:
+  string EntryFilename(const string& kind, uint64_t key) const;
+  bool Has(const string& kind, uint64_t key) const;
+  bool Load(const string& kind, uint64_t key, CheckpointReader& reader) const;
+  void Save(const string& kind, uint64_t key, const CheckpointWriter& writer) const;
+
+  fs::path cache_path;
+  mutable std::atomic<int> num_hits, num_misses;
+};
+
+#endif  // FACESHAPEFROMSHADING_SFS_CACHE_H
@@ -0,0 +1,353 @@
+#include "sfs_checkpoint.h"
+
+#include <cstring>
+#include <fstream>
+
+#include <unistd.h>
+
+#include "sfs_log.h"
+#include "sfs_pipeline.h"
+
+namespace {
+
+const char kCheckpointMagic[8] = {'S', 'F', 'S', 'C', 'K', 'P', 'T', '\0'};
+const uint32_t kCheckpointVersion = 2;
+
+enum FieldKind : uint32_t {
+  kMat = 1,
+  kVectorXd = 2,
+  kIntVector = 3,
+  kBoolVector = 4,
+  kPixelVector = 5
+};
+
+template <typename T>
+void WritePod(ostream& os, const T& value) {
+  os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+bool ReadPod(istream& is, T& value) {
+  is.read(reinterpret_cast<char*>(&value), sizeof(T));
+  return static_cast<bool>(is);
+}
+
+template <typename Writer>
+void WritePreparedFieldsTo(Writer& writer, const SFSImageState& state) {
+  writer.Write("lighting_coeffs", state.lighting_coeffs);
+  writer.Write("normal_map_ref", state.normal_map_ref);
+  writer.Write("depth_map_ref", state.depth_map_ref);
+  writer.Write("xy_map", state.xy_map);
+  writer.Write("zmap", state.zmap);
+  writer.Write("albedo_ref", state.albedo_ref);
+  writer.Write("valid_pixels_map", state.valid_pixels_map);
+  writer.Write("face_indices_map", state.face_indices_map);
+}
+
+template <typename Reader>
+bool ReadPreparedFieldsFrom(const Reader& reader, SFSImageState& state) {
+  bool ok = true;
+  ok &= reader.Read("lighting_coeffs", state.lighting_coeffs);
+  ok &= reader.Read("normal_map_ref", state.normal_map_ref);
+  ok &= reader.Read("depth_map_ref", state.depth_map_ref);
+  ok &= reader.Read("xy_map", state.xy_map);
+  ok &= reader.Read("zmap", state.zmap);
+  ok &= reader.Read("albedo_ref", state.albedo_ref);
+  ok &= reader.Read("valid_pixels_map", state.valid_pixels_map);
+  ok &= reader.Read("face_indices_map", state.face_indices_map);
+  if(!ok) return false;
+
+  // same as after the prepare stage, the working maps start as the references
+  state.normal_map = state.normal_map_ref;
+  state.albedo = state.albedo_ref;
+  return true;
+}
+
+}  // namespace
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed) {
+  // FNV-1a
+  uint64_t h = seed;
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for(size_t j=0;j<size;++j) {
+    h ^= bytes[j];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t HashString(const string& s, uint64_t seed) {
+  return HashBytes(s.data(), s.size(), seed);
+}
+
+uint64_t HashCombine(uint64_t seed, uint64_t value) {
+  return HashBytes(&value, sizeof(value), seed);
+}
+
+void WritePreparedFields(CheckpointWriter& writer, const SFSImageState& state) {
+  WritePreparedFieldsTo(writer, state);
+}
+
+bool ReadPreparedFields(const CheckpointReader& reader, SFSImageState& state) {
+  return ReadPreparedFieldsFrom(reader, state);
+}
+
+void WritePreparedFields(SharedMapsWriter& writer, const SFSImageState& state) {
+  WritePreparedFieldsTo(writer, state);
+}
+
+bool ReadPreparedFields(const SharedMapsReader& reader, SFSImageState& state) {
+  return ReadPreparedFieldsFrom(reader, state);
+}
+
+void WriteStageFields(CheckpointWriter& writer, SFSCheckpointStore::Stage stage, const SFSImageState& state) {
+  switch(stage) {
+    case SFSCheckpointStore::Lighting:
+      writer.Write("lighting_coeffs", state.lighting_coeffs);
+      break;
+    case SFSCheckpointStore::Albedo:
+      writer.Write("albedo", state.albedo);
+      break;
+    case SFSCheckpointStore::Depth:
+      writer.Write("zmap", state.zmap);
+      writer.Write("normal_map", state.normal_map);
+      writer.Write("valid_depth_pixels", state.valid_depth_pixels);
+      writer.Write("is_boundary", state.is_boundary);
+      writer.Write("depth_cost_reduction", VectorXd::Constant(1, state.depth_cost_reduction));
+      break;
+  }
+}
+
+bool ReadStageFields(const CheckpointReader& reader, SFSCheckpointStore::Stage stage, SFSImageState& state) {
+  switch(stage) {
+    case SFSCheckpointStore::Lighting:
+      return reader.Read("lighting_coeffs", state.lighting_coeffs);
+    case SFSCheckpointStore::Albedo:
+      return reader.Read("albedo", state.albedo);
+    case SFSCheckpointStore::Depth: {
+      bool ok = true;
+      ok &= reader.Read("zmap", state.zmap);
+      ok &= reader.Read("normal_map", state.normal_map);
+      ok &= reader.Read("valid_depth_pixels", state.valid_depth_pixels);
+      ok &= reader.Read("is_boundary", state.is_boundary);
+      VectorXd cost_reduction;
+      ok &= reader.Read("depth_cost_reduction", cost_reduction) && cost_reduction.size() == 1;
+      if(ok) state.depth_cost_reduction = cost_reduction[0];
+      return ok;
+    }
+  }
+  return false;
+}
+
+void CheckpointWriter::AddField(const string& name, uint32_t kind, const void* data, size_t size) {
+  fields.push_back(make_pair(name, make_pair(kind, string(static_cast<const char*>(data), size))));
+}
+
+void CheckpointWriter::Write(const string& name, const cv::Mat& m) {
+  cv::Mat mc = m.isContinuous()? m : m.clone();
+  const int32_t dims[] = {mc.type(), mc.rows, mc.cols};
+  string payload(reinterpret_cast<const char*>(dims), sizeof(dims));
+  payload.append(reinterpret_cast<const char*>(mc.data), mc.total() * mc.elemSize());
+  AddField(name, kMat, payload.data(), payload.size());
+}
+
+void CheckpointWriter::Write(const string& name, const VectorXd& v) {
+  AddField(name, kVectorXd, v.data(), sizeof(double) * v.size());
+}
+
+void CheckpointWriter::Write(const string& name, const vector<int>& v) {
+  AddField(name, kIntVector, v.data(), sizeof(int) * v.size());
+}
+
+void CheckpointWriter::Write(const string& name, const vector<bool>& v) {
+  vector<unsigned char> bytes(v.begin(), v.end());
+  AddField(name, kBoolVector, bytes.data(), bytes.size());
+}
+
+void CheckpointWriter::Write(const string& name, const vector<glm::ivec2>& v) {
+  vector<int32_t> coords;
+  coords.reserve(v.size() * 2);
+  for(auto& p : v) {
+    coords.push_back(p.x);
+    coords.push_back(p.y);
+  }
+  AddField(name, kPixelVector, coords.data(), sizeof(int32_t) * coords.size());
+}
+
+bool CheckpointWriter::Save(const string& filename) const {
+  const string tmp_filename = filename + ".tmp" + to_string(getpid());
+  {
+    ofstream fout(tmp_filename, ios::binary);
+    if(!fout) return false;
+    fout.write(kCheckpointMagic, sizeof(kCheckpointMagic));
+    WritePod(fout, kCheckpointVersion);
+    WritePod(fout, fingerprint);
+    WritePod(fout, static_cast<uint32_t>(fields.size()));
+    for(auto& field : fields) {
+      WritePod(fout, static_cast<uint32_t>(field.first.size()));
+      fout.write(field.first.data(), field.first.size());
+      WritePod(fout, field.second.first);
+      WritePod(fout, static_cast<uint64_t>(field.second.second.size()));
+      fout.write(field.second.second.data(), field.second.second.size());
+    }
+    if(!fout) {
+      fout.close();
+      unlink(tmp_filename.c_str());
+      return false;
+    }
+  }
+  return rename(tmp_filename.c_str(), filename.c_str()) == 0;
+}
+
+bool CheckpointReader::Load(const string& filename, uint64_t fingerprint) {
+  fields.clear();
+
+  ifstream fin(filename, ios::binary);
+  if(!fin) return false;
+
+  char magic[8];
+  uint32_t version, num_fields;
+  uint64_t file_fingerprint;
+  fin.read(magic, sizeof(magic));
+  if(!fin || memcmp(magic, kCheckpointMagic, sizeof(magic)) != 0) return false;
+  if(!ReadPod(fin, version) || version != kCheckpointVersion) return false;
+  if(!ReadPod(fin, file_fingerprint) || file_fingerprint != fingerprint) return false;
+  if(!ReadPod(fin, num_fields)) return false;
+
+  for(uint32_t k=0;k<num_fields;++k) {
+    uint32_t name_size, kind;
+    uint64_t size;
+    if(!ReadPod(fin, name_size)) return false;
+    string name(name_size, '\0');
+    fin.read(&name[0], name_size);
+    if(!ReadPod(fin, kind) || !ReadPod(fin, size)) return false;
+    string payload(size, '\0');
+    fin.read(&payload[0], size);
+    if(!fin) {
+      fields.clear();
+      return false;
+    }
+    fields[name] = make_pair(kind, std::move(payload));
+  }
+  return true;
+}
+
+const string* CheckpointReader::Find(const string& name, uint32_t kind) const {
+  auto it = fields.find(name);
+  if(it == fields.end() || it->second.first != kind) return nullptr;
+  return &(it->second.second);
+}
+
+bool CheckpointReader::Read(const string& name, cv::Mat& m) const {
+  const string* payload = Find(name, kMat);
+  if(!payload || payload->size() < sizeof(int32_t) * 3) return false;
+  int32_t dims[3];
+  memcpy(dims, payload->data(), sizeof(dims));
+  cv::Mat loaded(dims[1], dims[2], dims[0]);
+  if(payload->size() != sizeof(dims) + loaded.total() * loaded.elemSize()) return false;
+  memcpy(loaded.data, payload->data() + sizeof(dims), loaded.total() * loaded.elemSize());
+
+  // Restore in place when possible: the working maps may share their data
+  // with the reference maps.
+  if(!m.empty() && m.rows == loaded.rows && m.cols == loaded.cols && m.type() == loaded.type()) {
+    loaded.copyTo(m);
+  } else {
+    m = loaded;
+  }
+  return true;
+}
+
+bool CheckpointReader::Read(const string& name, VectorXd& v) const {
+  const string* payload = Find(name, kVectorXd);
+  if(!payload || payload->size() % sizeof(double) != 0) return false;
+  v.resize(payload->size() / sizeof(double));
+  memcpy(v.data(), payload->data(), payload->size());
+  return true;
+}
+
+bool CheckpointReader::Read(const string& name, vector<int>& v) const {
+  const string* payload = Find(name, kIntVector);
+  if(!payload || payload->size() % sizeof(int) != 0) return false;
+  v.resize(payload->size() / sizeof(int));
+  memcpy(v.data(), payload->data(), payload->size());
+  return true;
+}
+
+bool CheckpointReader::Read(const string& name, vector<bool>& v) const {
+  const string* payload = Find(name, kBoolVector);
+  if(!payload) return false;
+  v.assign(payload->begin(), payload->end());
+  return true;
+}
+
+bool CheckpointReader::Read(const string& name, vector<glm::ivec2>& v) const {
+  const string* payload = Find(name, kPixelVector);
+  if(!payload || payload->size() % (sizeof(int32_t) * 2) != 0) return false;
+  vector<int32_t> coords(payload->size() / sizeof(int32_t));
+  memcpy(coords.data(), payload->data(), payload->size());
+  v.resize(coords.size() / 2);
+  for(size_t j=0;j<v.size();++j) {
+    v[j] = glm::ivec2(coords[j*2], coords[j*2+1]);
+  }
+  return true;
+}
+
+SFSCheckpointStore::SFSCheckpointStore(const fs::path& checkpoint_path,
+                                       uint64_t prepare_fingerprint,
+                                       uint64_t solve_fingerprint)
+  : checkpoint_path(checkpoint_path),
+    prepare_fingerprint(prepare_fingerprint),
+    solve_fingerprint(solve_fingerprint) {
+  fs::create_directories(checkpoint_path);
+}
+
+string SFSCheckpointStore::PreparedFilename(int i) const {
+  return (checkpoint_path / fs::path("prepare_" + to_string(i) + ".ckpt")).string();
+}
+
+string SFSCheckpointStore::StageFilename(int i, int iters, Stage stage) const {
+  const char* stage_names[] = {"lighting", "albedo", "depth"};
+  return (checkpoint_path / fs::path("iter_" + to_string(i) + "_" + to_string(iters)
+                                     + "_" + stage_names[stage] + ".ckpt")).string();
+}
+
+bool SFSCheckpointStore::HasPrepared(int i, const string& image_filename) const {
+  CheckpointReader reader;
+  return reader.Load(PreparedFilename(i), HashString(image_filename, prepare_fingerprint));
+}
+
+bool SFSCheckpointStore::LoadPrepared(int i, const string& image_filename, SFSImageState& state) const {
+  CheckpointReader reader;
+  if(!reader.Load(PreparedFilename(i), HashString(image_filename, prepare_fingerprint))) return false;
+  return ReadPreparedFields(reader, state);
+}
+
+void SFSCheckpointStore::SavePrepared(int i, const string& image_filename, const SFSImageState& state) const {
+  CheckpointWriter writer(HashString(image_filename, prepare_fingerprint));
+  WritePreparedFields(writer, state);
+  if(!writer.Save(PreparedFilename(i))) {
+    SFS_LOG(Error, Cache) << "Failed to write checkpoint " << PreparedFilename(i);
+  }
+}
+
+bool SFSCheckpointStore::HasStage(int i, const string& image_filename, int iters, Stage stage) const {
+  CheckpointReader reader;
+  return reader.Load(StageFilename(i, iters, stage), HashString(image_filename, solve_fingerprint));
+}
+
+bool SFSCheckpointStore::LoadStage(int i, const string& image_filename, int iters, Stage stage,
+                                   SFSImageState& state) const {
+  CheckpointReader reader;
+  if(!reader.Load(StageFilename(i, iters, stage), HashString(image_filename, solve_fingerprint))) return false;
+  return ReadStageFields(reader, stage, state);
+}
+
+void SFSCheckpointStore::SaveStage(int i, const string& image_filename, int iters, Stage stage,
+                                   const SFSImageState& state) const {
+  CheckpointWriter writer(HashString(image_filename, solve_fingerprint));
+  WriteStageFields(writer, stage, state);
+  const string filename = StageFilename(i, iters, stage);
+  if(!writer.Save(filename)) {
+    SFS_LOG(Error, Cache) << "Failed to write checkpoint " << filename;
+  }
+}
@@ -0,0 +1,128 @@
+#ifndef FACESHAPEFROMSHADING_SFS_CHECKPOINT_H
+#define FACESHAPEFROMSHADING_SFS_CHECKPOINT_H
+
+#include "common.h"
+
+#include <cstdint>
+
+#include <opencv2/opencv.hpp>
+
+#include "sfs_maps.h"
+#include "sfs_shm.h"
+#include "utils.h"
+
+struct SFSImageState;
+
+// A checkpoint file is a small header followed by named, typed fields:
+//
+//   magic "SFSCKPT\0" | uint32 version | uint64 fingerprint | uint32 num_fields
+//   per field: uint32 name length | name | uint32 kind | uint64 size | payload
+//
+// The fingerprint identifies the inputs and settings the data was computed
+// with. A checkpoint whose fingerprint does not match is treated as missing.
+class CheckpointWriter {
+public:
+  explicit CheckpointWriter(uint64_t fingerprint) : fingerprint(fingerprint) {}
+
+  void Write(const string& name, const cv::Mat& m);
+  void Write(const string& name, const VectorXd& v);
+  void Write(const string& name, const vector<int>& v);
+  void Write(const string& name, const vector<bool>& v);
+  void Write(const string& name, const vector<glm::ivec2>& v);
+
+  // One field per plane: name.0, name.1, ...
+  template <int Channels>
+  void Write(const string& name, const PlanarMap<Channels>& m) {
+    for(int k=0;k<Channels;++k) Write(name + "." + to_string(k), m.plane(k));
+  }
+
+  // Written to a temporary file and renamed in place, so an interrupted run
+  // never leaves a truncated checkpoint behind.
+  bool Save(const string& filename) const;
+
+private:
+  void AddField(const string& name, uint32_t kind, const void* data, size_t size);
+
+  uint64_t fingerprint;
+  vector<pair<string, pair<uint32_t, string>>> fields;
+};
+
+class CheckpointReader {
+public:
+  // Returns false if the file is missing, truncated or has another fingerprint.
+  bool Load(const string& filename, uint64_t fingerprint);
+
+  bool Read(const string& name, cv::Mat& m) const;
+  bool Read(const string& name, VectorXd& v) const;
+  bool Read(const string& name, vector<int>& v) const;
+  bool Read(const string& name, vector<bool>& v) const;
+  bool Read(const string& name, vector<glm::ivec2>& v) const;
+
+  // Fails if the planes were stored with another MapScalar
+  template <int Channels>
+  bool Read(const string& name, PlanarMap<Channels>& m) const {
+    vector<cv::Mat> planes(Channels);
+    for(int k=0;k<Channels;++k) {
+      planes[k] = m.plane(k);
+      if(!Read(name + "." + to_string(k), planes[k])) return false;
+    }
+    return m.SetPlanes(planes);
+  }
+
+private:
+  const string* Find(const string& name, uint32_t kind) const;
+
+  map<string, pair<uint32_t, string>> fields;
+};
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ULL);
+uint64_t HashString(const string& s, uint64_t seed = 14695981039346656037ULL);
+uint64_t HashCombine(uint64_t seed, uint64_t value);
+
+// Checkpoints of one job, stored under <results_path>/checkpoints:
+//
+//   prepare_<i>.ckpt            reference maps, initial albedo, face indices
+//   iter_<i>_<k>_lighting.ckpt  lighting coefficients after iteration k
+//   iter_<i>_<k>_albedo.ckpt    albedo after iteration k
+//   iter_<i>_<k>_depth.ckpt     depth, normals and valid pixels after iteration k
+//
+// Every stage only stores what it changes, so resuming replays the
+// checkpoints in execution order up to the first missing one.
+class SFSCheckpointStore {
+public:
+  enum Stage { Lighting, Albedo, Depth };
+
+  // prepare_fingerprint covers everything the preparation depends on,
+  // solve_fingerprint additionally covers the solver settings. Both are
+  // combined with the image filename, so a checkpoint of another image at the
+  // same index is not restored.
+  SFSCheckpointStore(const fs::path& checkpoint_path,
+                     uint64_t prepare_fingerprint,
+                     uint64_t solve_fingerprint);
+
+  bool HasPrepared(int i, const string& image_filename) const;
+  bool LoadPrepared(int i, const string& image_filename, SFSImageState& state) const;
+  void SavePrepared(int i, const string& image_filename, const SFSImageState& state) const;
+
+  bool HasStage(int i, const string& image_filename, int iters, Stage stage) const;
+  bool LoadStage(int i, const string& image_filename, int iters, Stage stage, SFSImageState& state) const;
+  void SaveStage(int i, const string& image_filename, int iters, Stage stage, const SFSImageState& state) const;
+
+private:
+  string PreparedFilename(int i) const;
+  string StageFilename(int i, int iters, Stage stage) const;
+
+  fs::path checkpoint_path;
+  uint64_t prepare_fingerprint, solve_fingerprint;
+};
+
+// Fields stored for each group, shared with the result cache (sfs_cache.h).
+// The prepared fields are also what is handed over in shared memory.
+void WritePreparedFields(CheckpointWriter& writer, const SFSImageState& state);
+bool ReadPreparedFields(const CheckpointReader& reader, SFSImageState& state);
+void WritePreparedFields(SharedMapsWriter& writer, const SFSImageState& state);
+bool ReadPreparedFields(const SharedMapsReader& reader, SFSImageState& state);
+void WriteStageFields(CheckpointWriter& writer, SFSCheckpointStore::Stage stage, const SFSImageState& state);
+bool ReadStageFields(const CheckpointReader& reader, SFSCheckpointStore::Stage stage, SFSImageState& state);
+
+#endif  // FACESHAPEFROMSHADING_SFS_CHECKPOINT_H
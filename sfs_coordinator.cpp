@@ -0,0 +1,402 @@
+#include <csignal>
+#include <chrono>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include <MultilinearReconstruction/ioutilities.h>
+
+#include "sfs_settings.h"
+#include "sfs_spool.h"
+
+// Runs a batch of subjects on a pool of sfs_worker processes.
+//
+// The manifest lists the subjects and where the merged results go:
+//
+//   {
+//     "results_path": "/path/to/results",
+//     "images_per_shard": 8,                         (optional, 0: one shard per subject)
+//     "max_attempts": 3,                             (optional)
+//     "settings_overrides": ["/path/to/override.json"],  (optional)
+//     "settings": {"mean_texture_options": {"generate_mean_texture": false}},  (optional)
+//     "subjects": [
+//       {"name": "subject_a",
+//        "settings_file": "/path/to/subject_a/settings.txt",
+//        "recon_path": "/path/to/reconstructions",   (optional)
+//        "settings": {"depth": {"w_reg": 0.1}}}      (optional)
+//     ]
+//   }
+//
+// Each subject is split into shards of images_per_shard images, and each
+// shard is submitted as one job to the spool (see sfs_spool.h). The
+// coordinator launches num_workers local workers on the spool, takes back
+// the jobs of workers that died or stopped renewing their lease, and retries
+// failed shards up to max_attempts times. Workers on other machines can join
+// by running sfs_worker on the same spool directory, with --external_workers
+// the coordinator only submits the shards and waits for them.
+//
+// Shard k of a subject writes to <results_path>/<subject>/shards/<shard>. The
+// image indices in the output filenames are those of the whole subject, so
+// once all shards are finished their files are moved up to
+// <results_path>/<subject>. Files written by several shards of a subject,
+// like the mean texture, stay in the shard directories. A shard only sees its
+// own images, so a subject is only split if its settings read the mean
+// texture from a file, i.e. set mean_texture_options.generate_mean_texture to
+// false, through the manifest settings or the override files.
+//
+// Running the coordinator again with the same manifest skips the shards that
+// are already done, and resumes the others from their checkpoints.
+
+namespace {
+
+volatile sig_atomic_t stop_requested = 0;
+
+void HandleStopSignal(int) {
+  stop_requested = 1;
+}
+
+po::variables_map ParseCommandlineOptions(int argc, char** argv) {
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help", "Print help messages")
+    ("manifest", po::value<string>()->required(), "Batch manifest file.")
+    ("spool_dir", po::value<string>(), "Spool directory. Defaults to <results_path>/spool.")
+    ("num_workers", po::value<int>()->default_value(2), "Number of local worker processes.")
+    ("external_workers", "Do not launch workers, wait for workers started elsewhere.")
+    ("worker", po::value<string>(), "Worker executable. Defaults to sfs_worker next to this program.")
+    ("worker_arg", po::value<vector<string>>()->composing(), "Argument passed to the workers, e.g. --worker_arg=--subdivision_depth=1. Can be repeated.")
+    ("lease_seconds", po::value<int>()->default_value(60), "A shard is taken back if its lease is not renewed for this long.")
+    ("poll_interval", po::value<int>()->default_value(1000), "Progress polling interval in milliseconds.");
+  po::positional_options_description positional;
+  positional.add("manifest", 1);
+  po::variables_map vm;
+
+  try {
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+    po::notify(vm);
+    if(vm.count("help")) {
+      cout << desc << endl;
+      exit(1);
+    }
+    return vm;
+  } catch(po::error& e) {
+    cerr << "Error: " << e.what() << endl;
+    cerr << desc << endl;
+    exit(1);
+  }
+}
+
+struct Shard {
+  string name;
+  string subject;
+  fs::path results_path;
+  vector<string> images;
+  json job;
+};
+
+string SafeName(const string& name) {
+  string safe = name;
+  for(auto& c : safe) {
+    if(!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_') c = '_';
+  }
+  return safe;
+}
+
+vector<Shard> MakeShards(const json& manifest, const fs::path& results_path) {
+  const int images_per_shard = manifest.value("images_per_shard", 0);
+  const int max_attempts = manifest.value("max_attempts", 3);
+  const json common_settings = manifest.value("settings", json::object());
+
+  // The settings the shards add on top of the global settings of the workers
+  json override_settings = json::object();
+  if(manifest.count("settings_overrides")) {
+    for(auto& override_file : manifest["settings_overrides"]) {
+      MergeSettings(override_settings, json::parse(ifstream(override_file.get<string>())));
+    }
+  }
+
+  vector<Shard> shards;
+  set<string> subject_names;
+  for(auto& subject : manifest.at("subjects")) {
+    const string settings_file = subject.at("settings_file");
+    const string subject_name = SafeName(subject.value("name", fs::path(settings_file).parent_path().filename().string()));
+    if(!subject_names.insert(subject_name).second) {
+      throw runtime_error("Duplicate subject name " + subject_name);
+    }
+
+    json settings = common_settings;
+    MergeSettings(settings, subject.value("settings", json::object()));
+
+    vector<string> images;
+    for(auto& p : ParseSettingsFile(settings_file)) images.push_back(p.first);
+    const int shard_size = images_per_shard > 0? images_per_shard : max<int>(images.size(), 1);
+
+    // A generated mean texture would depend on how the images are split
+    if(images.size() > shard_size) {
+      json shard_settings = override_settings;
+      MergeSettings(shard_settings, settings);
+      const json mean_texture_options = shard_settings.value("mean_texture_options", json::object());
+      if(mean_texture_options.value("generate_mean_texture", true)) {
+        throw runtime_error("Subject " + subject_name + " is split into shards but generates its mean texture, "
+                            "set mean_texture_options.generate_mean_texture to false or images_per_shard to 0");
+      }
+    }
+
+    for(int first=0, k=0;first<images.size();first+=shard_size, ++k) {
+      Shard shard;
+      std::ostringstream name;
+      name << subject_name << "-" << setw(3) << setfill('0') << k;
+      shard.name = name.str();
+      shard.subject = subject_name;
+      shard.results_path = results_path / fs::path(subject_name) / fs::path("shards") / fs::path(shard.name);
+      shard.images.assign(images.begin() + first,
+                          images.begin() + min<int>(first + shard_size, images.size()));
+
+      json& job = shard.job;
+      job["settings_file"] = settings_file;
+      if(subject.count("recon_path")) job["recon_path"] = subject["recon_path"];
+      job["results_path"] = shard.results_path.string();
+      job["images"] = shard.images;
+      job["first_index"] = first;
+      job["resume"] = true;
+      job["max_attempts"] = max_attempts;
+      if(manifest.count("settings_overrides")) job["settings_overrides"] = manifest["settings_overrides"];
+      if(!settings.empty()) job["settings"] = settings;
+      job["shard"] = {{"subject", subject_name}, {"index", k}};
+      shards.push_back(shard);
+    }
+  }
+  return shards;
+}
+
+enum class ShardState { Pending, Running, Done, Failed };
+
+ShardState GetShardState(const SFSSpool& spool, const string& name) {
+  const fs::path filename(name + ".json");
+  if(fs::exists(spool.dir() / fs::path("done") / filename)) return ShardState::Done;
+  if(fs::exists(spool.dir() / fs::path("failed") / filename)) return ShardState::Failed;
+  if(fs::exists(spool.dir() / fs::path("running") / filename)) return ShardState::Running;
+  return ShardState::Pending;
+}
+
+pid_t LaunchWorker(const string& worker, const vector<string>& args, const fs::path& log_filename) {
+  const pid_t pid = fork();
+  if(pid != 0) return pid;
+
+  // child: log to a file, then become the worker
+  const int fd = open(log_filename.string().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd >= 0) {
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+  }
+  vector<char*> argv;
+  argv.push_back(const_cast<char*>(worker.c_str()));
+  for(auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
+  execv(worker.c_str(), argv.data());
+  perror(("Failed to start " + worker).c_str());
+  _exit(127);
+}
+
+// Move the files of the finished shards of a subject up to its results
+// directory, except the ones written by several shards.
+json MergeShards(const fs::path& subject_path, const vector<const Shard*>& shards) {
+  map<string, int> writers;
+  for(auto shard : shards) {
+    if(!fs::is_directory(shard->results_path)) continue;
+    for(fs::directory_iterator it(shard->results_path), end; it != end; ++it) {
+      if(fs::is_regular_file(it->status())) ++writers[it->path().filename().string()];
+    }
+  }
+
+  json merged = json::object();
+  for(auto shard : shards) {
+    if(!fs::is_directory(shard->results_path)) continue;
+    int num_moved = 0, num_kept = 0;
+    for(fs::directory_iterator it(shard->results_path), end; it != end; ++it) {
+      if(!fs::is_regular_file(it->status())) continue;
+      const string filename = it->path().filename().string();
+      if(writers[filename] > 1) {
+        ++num_kept;
+        continue;
+      }
+      boost::system::error_code ec;
+      fs::rename(it->path(), subject_path / fs::path(filename), ec);
+      if(ec) {
+        SFS_LOG(Error, Spool) << "Failed to move " << it->path() << ": " << ec.message();
+        ++num_kept;
+      } else {
+        ++num_moved;
+      }
+    }
+    merged[shard->name] = {{"moved", num_moved}, {"kept", num_kept}};
+  }
+  return merged;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  po::variables_map vm = ParseCommandlineOptions(argc, argv);
+
+  std::signal(SIGINT, HandleStopSignal);
+  std::signal(SIGTERM, HandleStopSignal);
+
+  const json manifest = json::parse(ifstream(vm["manifest"].as<string>()));
+  const fs::path results_path(manifest.at("results_path").get<string>());
+  const fs::path spool_dir = vm.count("spool_dir")?
+    fs::path(vm["spool_dir"].as<string>()) : results_path / fs::path("spool");
+  const std::chrono::seconds lease_duration(max(vm["lease_seconds"].as<int>(), 1));
+  const auto poll_interval = std::chrono::milliseconds(vm["poll_interval"].as<int>());
+
+  // ====================================================================
+  // submit the shards that are not done yet
+  // ====================================================================
+  SFSSpool spool(spool_dir);
+  vector<Shard> shards = MakeShards(manifest, results_path);
+  int num_submitted = 0;
+  for(auto& shard : shards) {
+    fs::create_directories(shard.results_path);
+    const ShardState state = GetShardState(spool, shard.name);
+    if(state == ShardState::Done) continue;
+    if(state == ShardState::Failed) {
+      // a new run gives failed shards a new set of attempts
+      fs::remove(spool_dir / fs::path("failed") / fs::path(shard.name + ".json"));
+    } else if(state == ShardState::Running
+              || fs::exists(spool_dir / fs::path(shard.name + ".json"))) {
+      continue;
+    }
+    spool.Submit(shard.name, shard.job);
+    ++num_submitted;
+  }
+  SFS_LOG(Info, Spool) << shards.size() << " shards, " << num_submitted << " submitted to " << spool_dir.string();
+
+  // ====================================================================
+  // run the workers until every shard is done or out of attempts
+  // ====================================================================
+  const bool launch_workers = !vm.count("external_workers");
+  const int num_workers = max(vm["num_workers"].as<int>(), 1);
+  const string worker = vm.count("worker")?
+    vm["worker"].as<string>() : (fs::path(argv[0]).parent_path() / fs::path("sfs_worker")).string();
+  vector<string> worker_args = {
+    "--spool_dir", spool_dir.string(),
+    "--lease_seconds", to_string(lease_duration.count()),
+    "--once"
+  };
+  if(vm.count("worker_arg")) {
+    for(auto& arg : vm["worker_arg"].as<vector<string>>()) worker_args.push_back(arg);
+  }
+  const fs::path log_path = spool_dir / fs::path("logs");
+  fs::create_directories(log_path);
+
+  set<pid_t> workers;
+  int num_launched = 0;
+  string last_progress;
+  bool workers_broken = false;
+  while(!stop_requested) {
+    for(auto& name : spool.RequeueAbandoned(lease_duration)) {
+      SFS_LOG(Info, Spool) << "Took back shard " << name;
+    }
+
+    // reap the workers that exited
+    int status;
+    pid_t pid;
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      workers.erase(pid);
+      if(WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        workers_broken = true;
+      } else if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        SFS_LOG(Warning, Spool) << "Worker " << pid << " exited abnormally, its shard will be taken back.";
+      }
+    }
+    if(workers_broken) {
+      SFS_LOG(Error, Spool) << "failed to start " << worker;
+      break;
+    }
+
+    int num_done = 0, num_failed = 0, num_running = 0, num_pending = 0;
+    for(auto& shard : shards) {
+      switch(GetShardState(spool, shard.name)) {
+        case ShardState::Done: ++num_done; break;
+        case ShardState::Failed: ++num_failed; break;
+        case ShardState::Running: ++num_running; break;
+        case ShardState::Pending: ++num_pending; break;
+      }
+    }
+
+    const string progress = to_string(num_done) + "/" + to_string(shards.size()) + " done, "
+      + to_string(num_running) + " running, " + to_string(num_pending) + " pending, "
+      + to_string(num_failed) + " failed";
+    if(progress != last_progress) {
+      SFS_LOG(Info, Spool) << "[coordinator] " << progress;
+      last_progress = progress;
+    }
+    if(num_done + num_failed == shards.size()) break;
+
+    // the workers exit when the queue is empty, start new ones for retries
+    while(launch_workers && static_cast<int>(workers.size()) < min(num_workers, num_pending + num_running)) {
+      const fs::path log_filename = log_path / fs::path("worker_" + to_string(num_launched++) + ".log");
+      const pid_t worker_pid = LaunchWorker(worker, worker_args, log_filename);
+      if(worker_pid < 0) {
+        perror("fork");
+        break;
+      }
+      workers.insert(worker_pid);
+    }
+
+    std::this_thread::sleep_for(poll_interval);
+  }
+
+  if(stop_requested || workers_broken) {
+    for(auto worker_pid : workers) kill(worker_pid, SIGTERM);
+    for(auto worker_pid : workers) waitpid(worker_pid, nullptr, 0);
+    SFS_LOG(Info, Spool) << "Coordinator stopped, run it again to continue.";
+    return 1;
+  }
+  for(auto worker_pid : workers) waitpid(worker_pid, nullptr, 0);
+
+  // ====================================================================
+  // merge the outputs of each subject
+  // ====================================================================
+  json report;
+  report["manifest"] = vm["manifest"].as<string>();
+  report["spool_dir"] = spool_dir.string();
+  map<string, vector<const Shard*>> subject_shards;
+  bool all_done = true;
+  for(auto& shard : shards) {
+    json entry;
+    entry["subject"] = shard.subject;
+    entry["images"] = shard.images;
+    const bool done = GetShardState(spool, shard.name) == ShardState::Done;
+    const fs::path job_file = spool_dir / fs::path(done? "done" : "failed") / fs::path(shard.name + ".json");
+    json job;
+    ifstream fin(job_file.string());
+    if(fin) job = json::parse(fin);
+    entry["status"] = done? "done" : "failed";
+    entry["attempts"] = job.value("attempts", 0) + (done? 1 : 0);
+    if(job.count("error")) entry["error"] = job["error"];
+    report["shards"][shard.name] = entry;
+
+    if(done) subject_shards[shard.subject].push_back(&shard);
+    all_done &= done;
+  }
+
+  for(auto& p : subject_shards) {
+    const fs::path subject_path = results_path / fs::path(p.first);
+    report["merged"][p.first] = MergeShards(subject_path, p.second);
+  }
+
+  const fs::path report_filename = results_path / fs::path("coordinator_report.json");
+  ofstream fout(report_filename.string());
+  fout << setw(2) << report << endl;
+  fout.close();
+  SFS_LOG(Info, Spool) << "Report written to " << report_filename.string();
+
+  return all_done? 0 : 1;
+}
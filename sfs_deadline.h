@@ -0,0 +1,38 @@
+#ifndef FACESHAPEFROMSHADING_SFS_DEADLINE_H
+#define FACESHAPEFROMSHADING_SFS_DEADLINE_H
+
+#include "common.h"
+
+#include <chrono>
+#include <limits>
+
+// Wall clock budget of one image in the anytime mode, counted from the start
+// of its solve. The solver checks it before each stage and stops early
+// instead of overrunning, the image then keeps the result of the last stage
+// that completed.
+class SFSDeadline {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // seconds <= 0 means no deadline
+  explicit SFSDeadline(double seconds)
+    : start(Clock::now()), budget(seconds > 0? seconds : std::numeric_limits<double>::infinity()) {}
+
+  double Elapsed() const {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  double Remaining() const { return budget - Elapsed(); }
+
+  bool Expired() const { return Remaining() <= 0; }
+
+  // Whether a step that took estimated_seconds the last time it ran can
+  // still finish in time
+  bool Allows(double estimated_seconds) const { return Remaining() > estimated_seconds; }
+
+private:
+  Clock::time_point start;
+  double budget;
+};
+
+#endif  // FACESHAPEFROMSHADING_SFS_DEADLINE_H
@@ -0,0 +1,198 @@
+#include "sfs_log.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+
+namespace {
+
+const char* kLevelNames[] = {"error", "warning", "info", "debug", "trace"};
+// In the order of SFSLogModule
+const char* kModuleNames[] = {"pipeline", "resources", "mean_texture", "prepare", "lighting",
+                              "albedo", "depth", "export", "refine", "output", "cache", "spool"};
+
+struct LogEntry {
+  SFSLogLevel level;
+  SFSLogModule module;
+  string message;
+};
+
+// Bounded multi-producer queue after Dmitry Vyukov's design. Each cell
+// carries a sequence number telling the producers and the consumer whose
+// turn it is, so a push is a single compare and swap on the write position.
+// There is a single consumer, the writer thread.
+class LogQueue {
+public:
+  explicit LogQueue(size_t capacity)
+    : cells(capacity), mask(capacity - 1), enqueue_pos(0), dequeue_pos(0) {
+    for(size_t i=0;i<capacity;++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  // False if the queue is full
+  bool Push(LogEntry&& entry) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    for(;;) {
+      cell = &cells[pos & mask];
+      const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if(diff == 0) {
+        if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if(diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->entry = std::move(entry);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side only
+  bool Pop(LogEntry& entry) {
+    Cell& cell = cells[dequeue_pos & mask];
+    if(cell.sequence.load(std::memory_order_acquire) != dequeue_pos + 1) return false;
+    entry = std::move(cell.entry);
+    cell.sequence.store(dequeue_pos + mask + 1, std::memory_order_release);
+    ++dequeue_pos;
+    return true;
+  }
+
+  // Messages pushed so far
+  size_t Pushed() const { return enqueue_pos.load(std::memory_order_acquire); }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    LogEntry entry;
+  };
+
+  vector<Cell> cells;
+  const size_t mask;
+  std::atomic<size_t> enqueue_pos;
+  size_t dequeue_pos;
+};
+
+class LogWriter {
+public:
+  LogWriter() : queue(8192), written(0), dropped(0) {
+    std::thread([this]() { Run(); }).detach();
+  }
+
+  void Write(LogEntry&& entry) {
+    if(!queue.Push(std::move(entry))) dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void Flush() {
+    const size_t target = queue.Pushed();
+    while(written.load(std::memory_order_acquire) < target) {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+  }
+
+  uint64_t Dropped() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+  void Run() {
+    LogEntry entry;
+    uint64_t reported_drops = 0;
+    for(;;) {
+      bool wrote = false;
+      while(queue.Pop(entry)) {
+        Print(entry);
+        written.fetch_add(1, std::memory_order_release);
+        wrote = true;
+      }
+
+      const uint64_t drops = Dropped();
+      if(drops != reported_drops) {
+        cerr << "Warning: " << drops - reported_drops << " log messages dropped" << '\n';
+        reported_drops = drops;
+      }
+
+      // flush once the queue runs dry rather than on every line
+      if(wrote) {
+        cout.flush();
+        cerr.flush();
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  }
+
+  static void Print(const LogEntry& entry) {
+    switch(entry.level) {
+      case SFSLogLevel::Error: cerr << "Error: " << entry.message << '\n'; break;
+      case SFSLogLevel::Warning: cerr << "Warning: " << entry.message << '\n'; break;
+      case SFSLogLevel::Info: cout << entry.message << '\n'; break;
+      default: cout << "[" << LogModuleName(entry.module) << "] " << entry.message << '\n'; break;
+    }
+  }
+
+  LogQueue queue;
+  std::atomic<size_t> written;
+  std::atomic<uint64_t> dropped;
+};
+
+// Never destroyed, so that logging from static destructors stays safe. What
+// is queued at exit is written out by an exit handler.
+LogWriter& Writer() {
+  static LogWriter* writer = []() {
+    LogWriter* w = new LogWriter();
+    std::atexit([]() { SFSLog::Flush(); });
+    return w;
+  }();
+  return *writer;
+}
+
+}  // namespace
+
+// Everything up to info by default
+static_assert(static_cast<int>(SFSLogModule::Count) == 12, "one initializer per module");
+std::atomic<int> SFSLog::verbosity[static_cast<int>(SFSLogModule::Count)] = {
+  {2}, {2}, {2}, {2}, {2}, {2}, {2}, {2}, {2}, {2}, {2}, {2}
+};
+
+SFSLogLevel ParseLogLevel(const string& name) {
+  for(int i=0;i<5;++i) {
+    if(name == kLevelNames[i]) return static_cast<SFSLogLevel>(i);
+  }
+  throw invalid_argument("Unknown log level " + name + ", expected error, warning, info, debug or trace.");
+}
+
+SFSLogModule ParseLogModule(const string& name) {
+  for(int i=0;i<static_cast<int>(SFSLogModule::Count);++i) {
+    if(name == kModuleNames[i]) return static_cast<SFSLogModule>(i);
+  }
+  throw invalid_argument("Unknown log module " + name);
+}
+
+const char* LogLevelName(SFSLogLevel level) {
+  return kLevelNames[static_cast<int>(level)];
+}
+
+const char* LogModuleName(SFSLogModule module) {
+  return kModuleNames[static_cast<int>(module)];
+}
+
+void SFSLog::SetVerbosity(SFSLogLevel level) {
+  for(auto& v : verbosity) v.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+void SFSLog::SetVerbosity(SFSLogModule module, SFSLogLevel level) {
+  verbosity[static_cast<int>(module)].store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+void SFSLog::Write(SFSLogLevel level, SFSLogModule module, string message) {
+  Writer().Write(LogEntry{level, module, std::move(message)});
+  if(level == SFSLogLevel::Error) Flush();
+}
+
+void SFSLog::Flush() {
+  Writer().Flush();
+}
+
+uint64_t SFSLog::Dropped() {
+  return Writer().Dropped();
+}
@@ -0,0 +1,93 @@
+#ifndef FACESHAPEFROMSHADING_SFS_LOG_H
+#define FACESHAPEFROMSHADING_SFS_LOG_H
+
+#include "common.h"
+
+#include <atomic>
+#include <sstream>
+
+// Leveled logging with a verbosity per module. A message is formatted on the
+// calling thread and handed to a background thread through a bounded
+// lock-free queue, so the solvers never wait for the terminal, a lock or a
+// flush. If the queue is full the message is dropped and counted instead.
+// Messages above the verbosity of their module are not formatted at all:
+//
+//   SFS_LOG(Debug, Depth) << "mean dz = " << mean_dz_val;
+//
+// Info messages are printed as they are, the other levels with a prefix.
+// Errors and warnings go to stderr, the rest to stdout. An error waits until
+// it is written.
+
+enum class SFSLogLevel { Error = 0, Warning, Info, Debug, Trace };
+
+enum class SFSLogModule {
+  Pipeline,     // job flow and the image source
+  Resources,    // models, meshes and albedo maps
+  MeanTexture,
+  Prepare,
+  Lighting,
+  Albedo,
+  Depth,
+  Export,
+  Refine,       // refine_mesh_with_normal
+  Output,       // the image writer
+  Cache,        // checkpoints and the result cache
+  Spool,        // batch jobs and their leases
+  Count
+};
+
+// Throw invalid_argument for an unknown name
+SFSLogLevel ParseLogLevel(const string& name);
+SFSLogModule ParseLogModule(const string& name);
+const char* LogLevelName(SFSLogLevel level);
+const char* LogModuleName(SFSLogModule module);
+
+class SFSLog {
+public:
+  static bool Enabled(SFSLogLevel level, SFSLogModule module) {
+    return static_cast<int>(level)
+      <= verbosity[static_cast<int>(module)].load(std::memory_order_relaxed);
+  }
+
+  // Most verbose level printed, for every module or for one
+  static void SetVerbosity(SFSLogLevel level);
+  static void SetVerbosity(SFSLogModule module, SFSLogLevel level);
+
+  static void Write(SFSLogLevel level, SFSLogModule module, string message);
+
+  // Wait until everything logged so far is written
+  static void Flush();
+
+  // Messages dropped because the queue was full
+  static uint64_t Dropped();
+
+private:
+  static std::atomic<int> verbosity[static_cast<int>(SFSLogModule::Count)];
+};
+
+// One message, written when the line goes out of scope
+class SFSLogLine {
+public:
+  SFSLogLine(SFSLogLevel level, SFSLogModule module) : level(level), module(module) {}
+  ~SFSLogLine() { SFSLog::Write(level, module, stream.str()); }
+
+  SFSLogLine(const SFSLogLine&) = delete;
+  SFSLogLine& operator=(const SFSLogLine&) = delete;
+
+  template <typename T>
+  SFSLogLine& operator<<(const T& value) {
+    stream << value;
+    return *this;
+  }
+
+private:
+  SFSLogLevel level;
+  SFSLogModule module;
+  ostringstream stream;
+};
+
+#define SFS_LOG(level, module)                                                  \
+  if(!SFSLog::Enabled(SFSLogLevel::level, SFSLogModule::module)) {}            \
+  else SFSLogLine(SFSLogLevel::level, SFSLogModule::module)
+
+#endif  // FACESHAPEFROMSHADING_SFS_LOG_H
@@ -0,0 +1,92 @@
+#ifndef FACESHAPEFROMSHADING_SFS_MAPS_H
+#define FACESHAPEFROMSHADING_SFS_MAPS_H
+
+#include "common.h"
+
+#include <opencv2/opencv.hpp>
+
+// Scalar type of the per-image normal, albedo and depth maps. The maps are
+// rendered from 8 bit images and a 24 bit depth buffer and the solvers copy
+// what they use into double vectors, so single precision storage loses
+// nothing the solvers can see. Configure with -DSFS_DOUBLE_PRECISION_MAPS=ON
+// to keep them in double instead.
+#ifdef SFS_DOUBLE_PRECISION_MAPS
+using MapScalar = double;
+#else
+using MapScalar = float;
+#endif
+
+const int kMapDepth = cv::DataType<MapScalar>::type;
+
+// A per-pixel map with one plane per channel. Loops that only need one
+// channel touch a single plane, and a plane can be handed to OpenCV as is.
+// Pixels are read and written as cv::Vec<double, Channels>.
+//
+// Like cv::Mat, copies share the planes. Use clone() for a deep copy.
+template <int Channels>
+class PlanarMap {
+public:
+  using Pixel = cv::Vec<double, Channels>;
+
+  PlanarMap() : rows(0), cols(0) {}
+  PlanarMap(int rows, int cols) : rows(rows), cols(cols) {
+    for(int k=0;k<Channels;++k) planes[k] = cv::Mat(rows, cols, kMapDepth);
+  }
+
+  bool empty() const { return rows == 0 || cols == 0; }
+
+  Pixel operator()(int r, int c) const {
+    Pixel p;
+    for(int k=0;k<Channels;++k) p[k] = planes[k].template at<MapScalar>(r, c);
+    return p;
+  }
+
+  void Set(int r, int c, const Pixel& p) {
+    for(int k=0;k<Channels;++k) planes[k].template at<MapScalar>(r, c) = static_cast<MapScalar>(p[k]);
+  }
+
+  cv::Mat& plane(int k) { return planes[k]; }
+  const cv::Mat& plane(int k) const { return planes[k]; }
+
+  PlanarMap clone() const {
+    PlanarMap m;
+    m.rows = rows; m.cols = cols;
+    for(int k=0;k<Channels;++k) m.planes[k] = planes[k].clone();
+    return m;
+  }
+
+  // Interleaved CV_64FC<Channels> copy, for OpenCV filters and image output
+  cv::Mat ToMat() const {
+    vector<cv::Mat> channels(Channels);
+    for(int k=0;k<Channels;++k) planes[k].convertTo(channels[k], CV_64F);
+    cv::Mat m;
+    cv::merge(channels, m);
+    return m;
+  }
+
+  // Takes over the given planes. Returns false unless there are Channels
+  // planes of the same size, stored as MapScalar.
+  bool SetPlanes(const vector<cv::Mat>& new_planes) {
+    if(new_planes.size() != Channels) return false;
+    for(auto& p : new_planes) {
+      if(p.type() != kMapDepth || p.size() != new_planes[0].size()) return false;
+    }
+    rows = new_planes[0].rows; cols = new_planes[0].cols;
+    for(int k=0;k<Channels;++k) planes[k] = new_planes[k];
+    return true;
+  }
+
+  size_t bytes() const { return static_cast<size_t>(rows) * cols * Channels * sizeof(MapScalar); }
+
+  int rows, cols;
+
+private:
+  cv::Mat planes[Channels];
+};
+
+// Normals and albedos (RGB) of each pixel
+using Map3 = PlanarMap<3>;
+// Camera space x and y of each pixel
+using Map2 = PlanarMap<2>;
+
+#endif  // FACESHAPEFROMSHADING_SFS_MAPS_H
@@ -0,0 +1,149 @@
+#include "sfs_memory.h"
+
+#include <atomic>
+#include <cerrno>
+#include <fstream>
+
+#ifdef SFS_MEMORY_PROFILING
+#include <malloc.h>
+#endif
+
+namespace {
+
+// Plain data only, so that touching them from malloc never allocates
+thread_local ThreadHeapUsage thread_heap = {0, 0, 0};
+std::atomic<int64_t> process_heap(0), process_heap_peak(0);
+
+// Value of a "Key:   1234 kB" line of /proc/self/status
+size_t ReadStatusField(const string& key) {
+  ifstream fin("/proc/self/status");
+  string line;
+  while(getline(fin, line)) {
+    if(line.compare(0, key.size(), key) == 0 && line.size() > key.size() && line[key.size()] == ':') {
+      return static_cast<size_t>(stoull(line.substr(key.size() + 1))) * 1024;
+    }
+  }
+  return 0;
+}
+
+#ifdef SFS_MEMORY_PROFILING
+void CountAllocation(void* ptr) {
+  if(!ptr) return;
+  const int64_t size = malloc_usable_size(ptr);
+  thread_heap.allocated += size;
+  thread_heap.live += size;
+  if(thread_heap.live > thread_heap.peak) thread_heap.peak = thread_heap.live;
+
+  const int64_t total = process_heap.fetch_add(size, std::memory_order_relaxed) + size;
+  int64_t peak = process_heap_peak.load(std::memory_order_relaxed);
+  while(total > peak && !process_heap_peak.compare_exchange_weak(peak, total, std::memory_order_relaxed)) {}
+}
+
+void CountFree(void* ptr) {
+  if(!ptr) return;
+  const int64_t size = malloc_usable_size(ptr);
+  thread_heap.live -= size;
+  process_heap.fetch_sub(size, std::memory_order_relaxed);
+}
+#endif
+
+}  // namespace
+
+#ifdef SFS_MEMORY_PROFILING
+// The allocator of glibc under its internal names. Defining the public
+// functions in the executable makes every library allocate through them.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t num, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void* __libc_valloc(size_t size);
+void* __libc_pvalloc(size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+  void* ptr = __libc_malloc(size);
+  CountAllocation(ptr);
+  return ptr;
+}
+
+void* calloc(size_t num, size_t size) {
+  void* ptr = __libc_calloc(num, size);
+  CountAllocation(ptr);
+  return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+  CountFree(ptr);
+  void* new_ptr = __libc_realloc(ptr, size);
+  // a failed realloc leaves the block as it was
+  CountAllocation(new_ptr? new_ptr : (size? ptr : nullptr));
+  return new_ptr;
+}
+
+void* memalign(size_t alignment, size_t size) {
+  void* ptr = __libc_memalign(alignment, size);
+  CountAllocation(ptr);
+  return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+  if(alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+  void* result = memalign(alignment, size);
+  if(!result && size) return ENOMEM;
+  *ptr = result;
+  return 0;
+}
+
+void* valloc(size_t size) {
+  void* ptr = __libc_valloc(size);
+  CountAllocation(ptr);
+  return ptr;
+}
+
+void* pvalloc(size_t size) {
+  void* ptr = __libc_pvalloc(size);
+  CountAllocation(ptr);
+  return ptr;
+}
+
+void free(void* ptr) {
+  CountFree(ptr);
+  __libc_free(ptr);
+}
+}
+#endif
+
+size_t CurrentRSS() { return ReadStatusField("VmRSS"); }
+
+size_t PeakRSS() { return ReadStatusField("VmHWM"); }
+
+bool HeapProfilingEnabled() {
+#ifdef SFS_MEMORY_PROFILING
+  return true;
+#else
+  return false;
+#endif
+}
+
+ThreadHeapUsage CurrentThreadHeapUsage() { return thread_heap; }
+
+int64_t ProcessHeapBytes() { return process_heap.load(std::memory_order_relaxed); }
+
+int64_t PeakProcessHeapBytes() { return process_heap_peak.load(std::memory_order_relaxed); }
+
+HeapScope::HeapScope() : start(thread_heap), outer_peak(thread_heap.peak) {
+  thread_heap.peak = thread_heap.live;
+}
+
+HeapScope::~HeapScope() {
+  thread_heap.peak = max(outer_peak, thread_heap.peak);
+}
+
+int64_t HeapScope::Allocated() const { return thread_heap.allocated - start.allocated; }
+
+int64_t HeapScope::Peak() const { return thread_heap.peak - start.live; }
@@ -0,0 +1,60 @@
+#ifndef FACESHAPEFROMSHADING_SFS_MEMORY_H
+#define FACESHAPEFROMSHADING_SFS_MEMORY_H
+
+#include "common.h"
+
+// Memory accounting. The resident set size of the process is always
+// available. Heap accounting needs a build with SFS_MEMORY_PROFILING, which
+// replaces malloc and friends with versions that count the bytes each thread
+// allocates and frees. Everything allocates through them: operator new,
+// Eigen, OpenCV, CHOLMOD and ceres.
+//
+// The heap counts are per thread, so images solved concurrently do not mix.
+// Memory allocated by the OpenMP threads of an inner solver is counted on
+// those threads, not on the thread that runs the stage.
+
+// Resident set size of the process and its high water mark, in bytes, 0
+// where /proc is not available
+size_t CurrentRSS();
+size_t PeakRSS();
+
+// Whether the heap counters below are maintained
+bool HeapProfilingEnabled();
+
+// Heap usage of the calling thread. live is allocated minus freed on this
+// thread, which goes negative for memory handed over by another thread.
+struct ThreadHeapUsage {
+  int64_t allocated;
+  int64_t live;
+  int64_t peak;
+};
+ThreadHeapUsage CurrentThreadHeapUsage();
+
+// Bytes allocated and not freed by the whole process, and the high water mark
+int64_t ProcessHeapBytes();
+int64_t PeakProcessHeapBytes();
+
+// Heap usage of the calling thread over the lifetime of the scope. Scopes
+// nest: the peak of an inner scope is reported relative to its own start and
+// still counts towards the peak of the outer one.
+class HeapScope {
+public:
+  HeapScope();
+  ~HeapScope();
+
+  HeapScope(const HeapScope&) = delete;
+  HeapScope& operator=(const HeapScope&) = delete;
+
+  // Bytes allocated since the scope started
+  int64_t Allocated() const;
+  // Largest amount of memory held above the level at the start
+  int64_t Peak() const;
+
+private:
+  ThreadHeapUsage start;
+  int64_t outer_peak;
+};
+
+inline double ToMegabytes(double bytes) { return bytes / (1024.0 * 1024.0); }
+
+#endif  // FACESHAPEFROMSHADING_SFS_MEMORY_H
@@ -0,0 +1,226 @@
+#include "sfs_metrics.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "sfs_log.h"
+
+namespace {
+
+string FormatValue(double value) {
+  ostringstream oss;
+  oss << setprecision(12) << value;
+  return oss.str();
+}
+
+// name{labels} with the extra label appended
+string SeriesName(const string& name, const string& labels, const string& extra = "") {
+  string all = labels;
+  if(!extra.empty()) all += (all.empty()? "" : ",") + extra;
+  return all.empty()? name : name + "{" + all + "}";
+}
+
+}  // namespace
+
+const vector<double>& MetricBuckets() {
+  static const vector<double> buckets{0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+                                      30, 60, 120, 300, 600};
+  return buckets;
+}
+
+SFSMetrics::SFSMetrics() : start_time(std::chrono::steady_clock::now()) {}
+
+SFSMetrics& SFSMetrics::Instance() {
+  static SFSMetrics metrics;
+  return metrics;
+}
+
+SFSMetrics::Family& SFSMetrics::GetFamily(const string& name, Type type) {
+  auto it = families.find(name);
+  if(it == families.end()) {
+    it = families.insert(make_pair(name, Family())).first;
+    it->second.type = type;
+  } else if(it->second.type != type) {
+    throw runtime_error("Metric " + name + " is used with two different types");
+  }
+  return it->second;
+}
+
+void SFSMetrics::Increment(const string& name, double value, const string& labels) {
+  std::lock_guard<std::mutex> lock(mtx);
+  GetFamily(name, Type::Counter).series[labels].value += value;
+}
+
+void SFSMetrics::Set(const string& name, double value, const string& labels) {
+  std::lock_guard<std::mutex> lock(mtx);
+  GetFamily(name, Type::Gauge).series[labels].value = value;
+}
+
+void SFSMetrics::Observe(const string& name, double value, const string& labels) {
+  const vector<double>& bounds = MetricBuckets();
+  const size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+
+  std::lock_guard<std::mutex> lock(mtx);
+  Series& series = GetFamily(name, Type::Histogram).series[labels];
+  if(series.buckets.empty()) series.buckets.assign(bounds.size() + 1, 0);
+  ++series.buckets[bucket];
+  ++series.count;
+  series.sum += value;
+}
+
+double SFSMetrics::Uptime() const {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+void SFSMetrics::Clear() {
+  std::lock_guard<std::mutex> lock(mtx);
+  families.clear();
+}
+
+map<string, SFSMetrics::Family> SFSMetrics::Snapshot() const {
+  map<string, Family> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    snapshot = families;
+  }
+
+  // Rates of the pipeline counters, so that a collector without a query
+  // language can read them as they are
+  auto total = [&snapshot](const string& name) {
+    double sum = 0;
+    auto it = snapshot.find(name);
+    if(it == snapshot.end()) return sum;
+    for(auto& s : it->second.series) {
+      sum += it->second.type == Type::Histogram? s.second.sum : s.second.value;
+    }
+    return sum;
+  };
+  auto add_gauge = [&snapshot](const string& name, double value) {
+    Family& family = snapshot[name];
+    family.type = Type::Gauge;
+    family.series[""].value = value;
+  };
+
+  const double uptime = Uptime();
+  add_gauge("sfs_uptime_seconds", uptime);
+  add_gauge("sfs_images_per_hour", uptime > 0? total("sfs_images_total") / uptime * 3600 : 0);
+  const double solve_seconds = total("sfs_solve_seconds");
+  add_gauge("sfs_pixels_per_second", solve_seconds > 0? total("sfs_pixels_total") / solve_seconds : 0);
+  const double evaluation_seconds = total("sfs_ceres_residual_evaluation_seconds_total");
+  add_gauge("sfs_ceres_residual_evaluations_per_second",
+            evaluation_seconds > 0? total("sfs_ceres_residual_evaluations_total") / evaluation_seconds : 0);
+  return snapshot;
+}
+
+string SFSMetrics::ToPrometheus() const {
+  const vector<double>& bounds = MetricBuckets();
+  ostringstream oss;
+  for(auto& f : Snapshot()) {
+    const string& name = f.first;
+    const Family& family = f.second;
+    switch(family.type) {
+      case Type::Counter: oss << "# TYPE " << name << " counter\n"; break;
+      case Type::Gauge: oss << "# TYPE " << name << " gauge\n"; break;
+      case Type::Histogram: oss << "# TYPE " << name << " histogram\n"; break;
+    }
+    for(auto& s : family.series) {
+      const string& labels = s.first;
+      const Series& series = s.second;
+      if(family.type != Type::Histogram) {
+        oss << SeriesName(name, labels) << " " << FormatValue(series.value) << "\n";
+        continue;
+      }
+      // the buckets of the exposition format are cumulative
+      uint64_t cumulative = 0;
+      for(size_t b=0;b<bounds.size();++b) {
+        cumulative += series.buckets[b];
+        oss << SeriesName(name + "_bucket", labels, "le=\"" + FormatValue(bounds[b]) + "\"")
+            << " " << cumulative << "\n";
+      }
+      oss << SeriesName(name + "_bucket", labels, "le=\"+Inf\"") << " " << series.count << "\n";
+      oss << SeriesName(name + "_sum", labels) << " " << FormatValue(series.sum) << "\n";
+      oss << SeriesName(name + "_count", labels) << " " << series.count << "\n";
+    }
+  }
+  return oss.str();
+}
+
+json SFSMetrics::ToJson() const {
+  const vector<double>& bounds = MetricBuckets();
+  json j;
+  j["metrics"] = json::object();
+  for(auto& f : Snapshot()) {
+    const Family& family = f.second;
+    json& item = j["metrics"][f.first];
+    item["type"] = family.type == Type::Counter? "counter"
+                   : family.type == Type::Gauge? "gauge" : "histogram";
+    item["series"] = json::array();
+    for(auto& s : family.series) {
+      json series;
+      series["labels"] = s.first;
+      if(family.type != Type::Histogram) {
+        series["value"] = s.second.value;
+      } else {
+        series["count"] = s.second.count;
+        series["sum"] = s.second.sum;
+        uint64_t cumulative = 0;
+        for(size_t b=0;b<bounds.size();++b) {
+          cumulative += s.second.buckets[b];
+          series["buckets"].push_back({{"le", bounds[b]}, {"count", cumulative}});
+        }
+      }
+      item["series"].push_back(series);
+    }
+  }
+  return j;
+}
+
+MetricsFileWriter::MetricsFileWriter(const string& filename, const string& format, double interval_seconds)
+  : filename(filename), format(format), interval_seconds(interval_seconds), stopping(false) {
+  const size_t pid_pos = this->filename.find("{pid}");
+  if(pid_pos != string::npos) this->filename.replace(pid_pos, 5, to_string(getpid()));
+
+  if(interval_seconds <= 0) return;
+  writer = std::thread([this]() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while(!stopping) {
+      stop_requested.wait_for(lock, std::chrono::duration<double>(this->interval_seconds));
+      if(stopping) break;
+      lock.unlock();
+      Write();
+      lock.lock();
+    }
+  });
+}
+
+MetricsFileWriter::~MetricsFileWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  stop_requested.notify_all();
+  if(writer.joinable()) writer.join();
+  Write();
+}
+
+bool MetricsFileWriter::Write() const {
+  const SFSMetrics& metrics = SFSMetrics::Instance();
+  const string content = format == "json"? metrics.ToJson().dump(2) + "\n" : metrics.ToPrometheus();
+
+  const string tmp_filename = filename + ".tmp." + to_string(getpid());
+  {
+    ofstream fout(tmp_filename);
+    fout << content;
+    if(!fout) {
+      SFS_LOG(Error, Pipeline) << "Failed to write metrics " << tmp_filename;
+      return false;
+    }
+  }
+  if(rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    SFS_LOG(Error, Pipeline) << "Failed to write metrics " << filename;
+    return false;
+  }
+  return true;
+}
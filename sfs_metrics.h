@@ -0,0 +1,132 @@
+#ifndef FACESHAPEFROMSHADING_SFS_METRICS_H
+#define FACESHAPEFROMSHADING_SFS_METRICS_H
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "nlohmann/json.hpp"
+using json = nlohmann::json;
+
+// Process wide performance counters, aggregated over all the jobs a process
+// runs. Unlike the trace, they are always collected and stay small: a value
+// per counter and gauge, and fixed buckets per histogram. MetricsFileWriter
+// writes them out periodically for a local collector to scrape.
+//
+// The pipeline records
+//   sfs_stage_seconds{stage}                    histogram of the stage times
+//   sfs_solve_seconds                           histogram of the image solves
+//   sfs_cholmod_factorize_seconds               histogram
+//   sfs_ceres_solve_seconds                     histogram
+//   sfs_ceres_iterations_total                  counter
+//   sfs_ceres_residual_evaluations_total        counter, residuals evaluated
+//   sfs_ceres_residual_evaluation_seconds_total counter, residual and jacobian time
+//   sfs_images_total, sfs_pixels_total          counters, face pixels solved
+//   sfs_jobs_total                              counter
+// and the snapshots add the gauges sfs_uptime_seconds, sfs_images_per_hour,
+// sfs_pixels_per_second (per solver) and
+// sfs_ceres_residual_evaluations_per_second.
+//
+// Metrics are identified by name and a label string in the Prometheus
+// syntax, e.g. Observe("sfs_stage_seconds", t, "stage=\"depth\"").
+class SFSMetrics {
+public:
+  static SFSMetrics& Instance();
+
+  // Counters only go up
+  void Increment(const string& name, double value = 1, const string& labels = "");
+  void Set(const string& name, double value, const string& labels = "");
+  void Observe(const string& name, double value, const string& labels = "");
+
+  // Seconds since the process started collecting
+  double Uptime() const;
+
+  // Prometheus text exposition format
+  string ToPrometheus() const;
+  json ToJson() const;
+
+  // Drop everything collected so far
+  void Clear();
+
+private:
+  SFSMetrics();
+
+  enum class Type { Counter, Gauge, Histogram };
+
+  struct Series {
+    double value = 0;           // counter or gauge
+    vector<uint64_t> buckets;   // histogram, not cumulative
+    uint64_t count = 0;
+    double sum = 0;
+  };
+
+  struct Family {
+    Type type = Type::Counter;
+    map<string, Series> series;  // by labels
+  };
+
+  Family& GetFamily(const string& name, Type type);
+
+  // Copy of the metrics with the derived rates added
+  map<string, Family> Snapshot() const;
+
+  std::chrono::steady_clock::time_point start_time;
+  mutable std::mutex mtx;
+  map<string, Family> families;
+};
+
+// Upper bounds of the histogram buckets, in seconds
+const vector<double>& MetricBuckets();
+
+// Observes the lifetime of the enclosing scope in a histogram, in seconds
+class ScopedLatency {
+public:
+  ScopedLatency(const string& name, const string& labels = "")
+    : name(name), labels(labels), start(std::chrono::steady_clock::now()) {}
+  ~ScopedLatency() {
+    SFSMetrics::Instance().Observe(
+      name, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), labels);
+  }
+
+  ScopedLatency(const ScopedLatency&) = delete;
+  ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+private:
+  string name, labels;
+  std::chrono::steady_clock::time_point start;
+};
+
+// Label string of a single label
+inline string MetricLabel(const string& key, const string& value) {
+  return key + "=\"" + value + "\"";
+}
+
+// Writes the metrics to a file every interval_seconds on a background thread,
+// and once more when destroyed. The file is replaced atomically, so a reader
+// never sees a partial snapshot. The format is "prometheus" or "json". A
+// "{pid}" in the filename is replaced by the process id, for processes that
+// share their settings.
+class MetricsFileWriter {
+public:
+  MetricsFileWriter(const string& filename, const string& format, double interval_seconds);
+  ~MetricsFileWriter();
+
+  MetricsFileWriter(const MetricsFileWriter&) = delete;
+  MetricsFileWriter& operator=(const MetricsFileWriter&) = delete;
+
+  bool Write() const;
+
+private:
+  string filename, format;
+  double interval_seconds;
+
+  std::mutex mtx;
+  std::condition_variable stop_requested;
+  bool stopping;
+  std::thread writer;
+};
+
+#endif  // FACESHAPEFROMSHADING_SFS_METRICS_H
@@ -0,0 +1,140 @@
+#include "sfs_output.h"
+
+#include <stdexcept>
+
+#include "sfs_log.h"
+#include "sfs_trace.h"
+
+namespace {
+
+bool IsPNG(const string& filename) {
+  return filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".png") == 0;
+}
+
+// Encode and write one queued file, traced on the thread that does it so the
+// export shows up next to the solves it overlaps
+bool RunWrite(const string& filename, const std::function<bool()>& task) {
+  TraceSpan span("write_image");
+  span.SetArg("file", filename);
+  return task();
+}
+
+}  // namespace
+
+SFSOutputLevel ParseOutputLevel(const string& name) {
+  if(name == "none") return SFSOutputLevel::None;
+  if(name == "final") return SFSOutputLevel::Final;
+  if(name == "per-iteration") return SFSOutputLevel::PerIteration;
+  if(name == "debug") return SFSOutputLevel::Debug;
+  throw invalid_argument("Unknown output level " + name
+                         + ", expected none, final, per-iteration or debug.");
+}
+
+string OutputLevelName(SFSOutputLevel level) {
+  switch(level) {
+    case SFSOutputLevel::None: return "none";
+    case SFSOutputLevel::Final: return "final";
+    case SFSOutputLevel::PerIteration: return "per-iteration";
+    case SFSOutputLevel::Debug: return "debug";
+  }
+  return "debug";
+}
+
+AsyncImageWriter::AsyncImageWriter(int num_threads, int png_compression, int max_pending)
+  : png_compression(min(max(png_compression, 0), 9)),
+    max_pending(max(max_pending, 1)),
+    num_active(0), num_failures(0), stopping(false) {
+  for(int i=0;i<num_threads;++i) {
+    workers.emplace_back(&AsyncImageWriter::WorkerLoop, this);
+  }
+}
+
+AsyncImageWriter::~AsyncImageWriter() {
+  Flush();
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  task_available.notify_all();
+  for(auto& worker : workers) worker.join();
+}
+
+void AsyncImageWriter::Write(const string& filename, const QImage& image) {
+  const int compression = png_compression;
+  Enqueue([filename, image, compression]() { return Save(filename, image, compression); }, filename);
+}
+
+void AsyncImageWriter::Write(const string& filename, const cv::Mat& image) {
+  const int compression = png_compression;
+  Enqueue([filename, image, compression]() { return Save(filename, image, compression); }, filename);
+}
+
+void AsyncImageWriter::Enqueue(std::function<bool()> task, const string& filename) {
+  if(workers.empty()) {
+    if(!RunWrite(filename, task)) {
+      std::lock_guard<std::mutex> lock(mtx);
+      ++num_failures;
+      SFS_LOG(Error, Output) << "Failed to write " << filename;
+    }
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    queue_changed.wait(lock, [this]{ return tasks.size() < max_pending; });
+    tasks.push_back(make_pair(filename, std::move(task)));
+  }
+  task_available.notify_one();
+}
+
+void AsyncImageWriter::Flush() {
+  std::unique_lock<std::mutex> lock(mtx);
+  queue_changed.wait(lock, [this]{ return tasks.empty() && num_active == 0; });
+}
+
+int AsyncImageWriter::NumFailures() const {
+  std::lock_guard<std::mutex> lock(mtx);
+  return num_failures;
+}
+
+void AsyncImageWriter::WorkerLoop() {
+  while(true) {
+    pair<string, std::function<bool()>> task;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      task_available.wait(lock, [this]{ return stopping || !tasks.empty(); });
+      if(tasks.empty()) return;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+      ++num_active;
+    }
+    queue_changed.notify_all();
+
+    const bool ok = RunWrite(task.first, task.second);
+
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      --num_active;
+      if(!ok) {
+        ++num_failures;
+        SFS_LOG(Error, Output) << "Failed to write " << task.first;
+      }
+    }
+    queue_changed.notify_all();
+  }
+}
+
+bool AsyncImageWriter::Save(const string& filename, const QImage& image, int png_compression) {
+  // Qt maps the quality of a PNG to the zlib level as (100 - quality) * 9 / 91
+  const int quality = IsPNG(filename)? (9 - png_compression) * 91 / 9 : -1;
+  return image.save(filename.c_str(), nullptr, quality);
+}
+
+bool AsyncImageWriter::Save(const string& filename, const cv::Mat& image, int png_compression) {
+  vector<int> params;
+  if(IsPNG(filename)) {
+    params.push_back(cv::IMWRITE_PNG_COMPRESSION);
+    params.push_back(png_compression);
+  }
+  return cv::imwrite(filename, image, params);
+}
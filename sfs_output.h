@@ -0,0 +1,77 @@
+#ifndef FACESHAPEFROMSHADING_SFS_OUTPUT_H
+#define FACESHAPEFROMSHADING_SFS_OUTPUT_H
+
+#include "common.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <QImage>
+#include <opencv2/opencv.hpp>
+
+// How much the pipeline writes to the results directory. Each level includes
+// the ones below it, and diagnostics above the selected level are not
+// computed at all.
+//
+//   none           nothing but checkpoints
+//   final          prepared maps, mean texture and the recovered point clouds
+//   per-iteration  lighting, albedo and normal images of every iteration
+//   debug          LoG images, mesh index renders, A.txt and other dumps
+enum class SFSOutputLevel {
+  None = 0,
+  Final = 1,
+  PerIteration = 2,
+  Debug = 3
+};
+
+// Throws invalid_argument for an unknown level name.
+SFSOutputLevel ParseOutputLevel(const string& name);
+string OutputLevelName(SFSOutputLevel level);
+
+// Saves images on a small pool of background threads so the solvers do not
+// wait for PNG encoding and disk writes. The number of queued images is
+// bounded: Write blocks while the queue is full. Images are shared with the
+// queue, so they must not be modified after being handed over.
+class AsyncImageWriter {
+public:
+  // With num_threads = 0 images are written synchronously by the caller.
+  // png_compression is the zlib level, from 0 (fastest) to 9 (smallest).
+  AsyncImageWriter(int num_threads, int png_compression, int max_pending = 64);
+
+  // Waits for the queued images to be written.
+  ~AsyncImageWriter();
+
+  AsyncImageWriter(const AsyncImageWriter&) = delete;
+  AsyncImageWriter& operator=(const AsyncImageWriter&) = delete;
+
+  void Write(const string& filename, const QImage& image);
+  void Write(const string& filename, const cv::Mat& image);
+
+  // Block until everything queued so far is on disk.
+  void Flush();
+
+  // Number of images that could not be written
+  int NumFailures() const;
+
+  static bool Save(const string& filename, const QImage& image, int png_compression);
+  static bool Save(const string& filename, const cv::Mat& image, int png_compression);
+
+private:
+  void Enqueue(std::function<bool()> task, const string& filename);
+  void WorkerLoop();
+
+  const int png_compression;
+  const size_t max_pending;
+
+  mutable std::mutex mtx;
+  std::condition_variable task_available, queue_changed;
+  std::deque<pair<string, std::function<bool()>>> tasks;
+  int num_active;
+  int num_failures;
+  bool stopping;
+  vector<std::thread> workers;
+};
+
+#endif  // FACESHAPEFROMSHADING_SFS_OUTPUT_H
@@ -0,0 +1,2283 @@
+#include "sfs_pipeline.h"
+
+#include <mutex>
+#include <sstream>
+
+#include "ceres/ceres.h"
+
+#include "albedo_map_cache.h"
+#include "cost_functions.h"
+#include "sfs_log.h"
+#include "sfs_metrics.h"
+#include "sfs_pyramid.h"
+#include "sfs_roi.h"
+#include "sfs_threads.h"
+#include "sfs_trace.h"
+#include "work_stealing_scheduler.h"
+
+namespace {
+
+// Guards the debug dumps written to the working directory, which are shared
+// by all images solved concurrently.
+std::mutex debug_output_mutex;
+
+// Writes the recorded trace when a job ends, whichever way it ends.
+struct ScopedTraceWriter {
+  explicit ScopedTraceWriter(const string& filename) : filename(filename) {}
+  ~ScopedTraceWriter() {
+    if(filename.empty()) return;
+    if(Tracer::Instance().WriteChromeTrace(filename)) {
+      SFS_LOG(Info, Pipeline) << "Trace written to " << filename;
+    } else {
+      SFS_LOG(Error, Pipeline) << "Failed to write trace " << filename;
+    }
+  }
+  string filename;
+};
+
+// Face index maps from the mean texture pass, waiting for their images to be
+// prepared. In streaming mode they wait in files under spill_path, which is
+// removed with the store, instead of in memory.
+class FaceIndexMaps {
+public:
+  FaceIndexMaps(int num_images, const fs::path& spill_path)
+    : maps(spill_path.empty()? num_images : 0), spill_path(spill_path) {
+    if(!spill_path.empty()) fs::create_directories(spill_path);
+  }
+
+  ~FaceIndexMaps() {
+    boost::system::error_code ec;
+    if(!spill_path.empty()) fs::remove_all(spill_path, ec);
+  }
+
+  void Put(int i, vector<int> face_indices_map) {
+    if(spill_path.empty()) {
+      maps[i] = std::move(face_indices_map);
+      return;
+    }
+    CheckpointWriter writer(0);
+    writer.Write("face_indices_map", face_indices_map);
+    if(!writer.Save(Filename(i))) throw runtime_error("Failed to write " + Filename(i));
+  }
+
+  // The map is handed over and not kept here
+  vector<int> Take(int i) {
+    vector<int> face_indices_map;
+    if(spill_path.empty()) {
+      face_indices_map.swap(maps[i]);
+      return face_indices_map;
+    }
+    CheckpointReader reader;
+    if(!reader.Load(Filename(i), 0) || !reader.Read("face_indices_map", face_indices_map)) {
+      throw runtime_error("Failed to read " + Filename(i));
+    }
+    boost::system::error_code ec;
+    fs::remove(Filename(i), ec);
+    return face_indices_map;
+  }
+
+private:
+  string Filename(int i) const {
+    return (spill_path / fs::path("face_indices_" + to_string(i) + ".ckpt")).string();
+  }
+
+  vector<vector<int>> maps;
+  fs::path spill_path;
+};
+
+// One row per iteration of an image: the energy of each term, "-" for the
+// stages that were restored or skipped
+string EnergyTable(int image, const vector<pair<int, SFSEnergy>>& rows) {
+  const char* columns[] = {"light.data", "light.reg", "albedo.data", "albedo.LoG",
+                           "depth.data", "depth.int", "depth.reg"};
+  ostringstream oss;
+  oss << "[Shape from shading] Energy of image " << image << endl;
+  oss << setw(5) << "iter";
+  for(auto column : columns) oss << setw(13) << column;
+  oss << scientific << setprecision(4);
+  for(auto& row : rows) {
+    const SFSEnergy& e = row.second;
+    const double values[] = {e.lighting_data, e.lighting_reg, e.albedo_data, e.albedo_LoG,
+                             e.depth_data, e.depth_integrability, e.depth_reg};
+    oss << '\n' << setw(5) << row.first;
+    for(double value : values) {
+      if(std::isnan(value)) oss << setw(13) << "-";
+      else oss << setw(13) << value;
+    }
+  }
+  return oss.str();
+}
+
+// Albedo of the face pixels, to measure how much an iteration changed it
+vector<cv::Vec3d> SampleFaceAlbedo(const SFSImageState& state) {
+  const int num_cols = state.albedo.cols;
+  vector<cv::Vec3d> samples;
+  samples.reserve(state.valid_pixels_map.size());
+  for(int pidx : state.valid_pixels_map) {
+    samples.push_back(state.albedo(pidx / num_cols, pidx % num_cols));
+  }
+  return samples;
+}
+
+// sum |after - before| / sum |before|, infinite if before is zero
+double RelativeChange(const vector<cv::Vec3d>& before, const vector<cv::Vec3d>& after) {
+  double change = 0, total = 0;
+  for(size_t j=0;j<before.size() && j<after.size();++j) {
+    for(int k=0;k<3;++k) {
+      change += fabs(after[j][k] - before[j][k]);
+      total += fabs(before[j][k]);
+    }
+  }
+  return total > 0? change / total : std::numeric_limits<double>::infinity();
+}
+
+double RelativeChange(const VectorXd& before, const VectorXd& after) {
+  if(before.size() != after.size() || before.norm() == 0) return std::numeric_limits<double>::infinity();
+  return (after - before).norm() / before.norm();
+}
+
+// Cache key of the result of a stage of the full resolution iterations
+uint64_t StageCacheKey(const SFSImageState& state, const SFSContext& context,
+                       int iters, SFSCheckpointStore::Stage stage) {
+  return HashCombine(HashCombine(state.cache_key, context.solve_key), iters * 3 + stage);
+}
+
+void WriteDepthMesh(const string& filename,
+                    const vector<glm::dvec3>& points,
+                    const vector<glm::ivec2>& pixel_indices,
+                    const vector<int>& depth_node_map,
+                    int num_rows, int num_cols) {
+  ofstream fout(filename);
+  for(int j=0;j<points.size();++j) {
+    auto& p = points[j];
+    fout << "v " << p.x << ' ' << p.y << ' ' << p.z << '\n';
+  }
+  for(int j=0;j<points.size();++j) {
+    int r = pixel_indices[j].x, c = pixel_indices[j].y;
+    int idx = r * num_cols + c;
+    int lidx = idx - 1;
+    int ridx = idx + 1;
+    int uidx = idx - num_cols;
+    int didx = idx + num_cols;
+    if(ridx < num_cols * num_rows && didx < num_cols * num_rows) {
+      if(depth_node_map[ridx] > 0 && depth_node_map[didx] > 0) {
+        fout << "f " << depth_node_map[idx] << " " << depth_node_map[didx] << " " << depth_node_map[ridx] << '\n';
+      }
+    }
+    if(lidx >= 0 && uidx >= 0) {
+      if(depth_node_map[lidx] > 0 && depth_node_map[uidx] > 0) {
+        fout << "f " << depth_node_map[idx] << " " << depth_node_map[uidx] << " " << depth_node_map[lidx] << '\n';
+      }
+    }
+  }
+  fout.close();
+}
+
+}  // namespace
+
+SFSResources::SFSResources(const SFSResourcePaths& paths, const SFSResourceOptions& options)
+  : paths(paths), options(options), assets(paths) {}
+
+const BasicMesh& SFSResources::subdivided_template() {
+  return assets.Get(subdivided_template_mesh, "subdivided_template_mesh", [this]() {
+    BasicMesh mesh = assets.TemplateMesh();
+    // HACK: subdivie the template mesh so it has the same topology as the input
+    // blendshapes
+    for(int i=0;i<options.subdivision_depth;++i) {
+      mesh.BuildHalfEdgeMesh();
+      SFS_LOG(Debug, Resources) << "Subdivision #" << i;
+      mesh.Subdivide();
+      SFS_LOG(Debug, Resources) << "#faces = " << mesh.NumFaces();
+    }
+    return mesh;
+  });
+}
+
+BasicMesh& SFSResources::mesh() {
+  return assets.Get(working_mesh, "mesh", [this]() {
+    BasicMesh mesh = subdivided_template();
+    if(options.use_template_geometry) {
+      mesh.ComputeNormals();
+    }
+    return mesh;
+  });
+}
+
+const vector<int>& SFSResources::valid_faces_indices() {
+  return assets.Get(subdivided_valid_faces_indices, "subdivided_valid_faces_indices", [this]() {
+    vector<int> valid_faces_indices = assets.ValidFacesIndices();
+    // HACK: each valid face i becomes [4i, 4i+1, 4i+2, 4i+3] after the each
+    // subdivision. See BasicMesh::Subdivide for details
+    for(int i=0;i<options.subdivision_depth;++i) {
+      vector<int> valid_faces_indices_new;
+      for(auto fidx : valid_faces_indices) {
+        int fidx_base = fidx*4;
+        valid_faces_indices_new.push_back(fidx_base);
+        valid_faces_indices_new.push_back(fidx_base+1);
+        valid_faces_indices_new.push_back(fidx_base+2);
+        valid_faces_indices_new.push_back(fidx_base+3);
+      }
+      valid_faces_indices = valid_faces_indices_new;
+    }
+    return valid_faces_indices;
+  });
+}
+
+const vector<BasicMesh>& SFSResources::blendshapes() {
+  return assets.Get(blendshape_meshes, "blendshapes", [this]() {
+    // Load all the input blendshapes
+    const int num_blendshapes = 46;
+    vector<BasicMesh> blendshapes(num_blendshapes+1);
+    for(int i=0;i<=num_blendshapes;++i) {
+      blendshapes[i].LoadOBJMesh( options.blendshapes_path + "/" + "B_" + to_string(i) + ".obj" );
+      blendshapes[i].ComputeNormals();
+    }
+    return blendshapes;
+  });
+}
+
+const SFSResources::AlbedoMaps& SFSResources::albedo_maps() {
+  return assets.Get(loaded_albedo_maps, "albedo_maps", [this]() {
+    // the maps only depend on the topology and texture coordinates, so they
+    // are built from the undeformed mesh
+    const BasicMesh& mesh = subdivided_template();
+    AlbedoMaps maps;
+
+    AlbedoMapCacheKey cache_key;
+    string cache_filename;
+    if(options.use_map_cache) {
+      string cache_dir = options.map_cache_dir;
+      if(cache_dir.empty()) {
+        cache_dir = fs::path(paths.albedo_pixel_map_filename).parent_path().string();
+      }
+      cache_key = AlbedoMapCacheKey(ComputeTopologyHash(mesh), options.tex_size, options.subdivision_depth);
+      cache_filename = AlbedoMapCacheFilename(cache_dir, cache_key);
+    }
+
+    if(options.use_map_cache && LoadAlbedoMapCache(cache_filename, cache_key, maps.pixel_map)) {
+      SFS_LOG(Info, Resources) << "albedo index map and pixel map loaded from " << cache_filename;
+      maps.index_map = IndexMapFromPixelMap(maps.pixel_map);
+    } else {
+      // Generate index map for albedo
+      maps.index_map = GetIndexMap(paths.albedo_index_map_filename,
+                                   mesh,
+                                   options.generate_index_map,
+                                   options.tex_size);
+
+      // Compute the barycentric coordinates for each pixel
+      QImage pixel_map_image;
+      tie(pixel_map_image, maps.pixel_map) = GetPixelCoordinatesMap(paths.albedo_pixel_map_filename,
+                                                                    maps.index_map,
+                                                                    mesh,
+                                                                    options.generate_pixel_map,
+                                                                    options.tex_size);
+
+      if(options.use_map_cache) {
+        if(SaveAlbedoMapCache(cache_filename, cache_key, maps.pixel_map)) {
+          SFS_LOG(Info, Resources) << "albedo map cache written to " << cache_filename;
+        } else {
+          SFS_LOG(Warning, Resources) << "Failed to write albedo map cache " << cache_filename;
+        }
+      }
+    }
+    return maps;
+  });
+}
+
+void SFSResources::ApplyParams(const ReconstructionResult& params) {
+  if(options.use_template_geometry) return;
+
+  if(options.use_blendshapes) {
+    ::ApplyWeights(mesh(), blendshapes(), params.params_model.Wexp_FACS);
+  } else {
+    MultilinearModel& model = assets.Model();
+    model.ApplyWeights(params.params_model.Wid, params.params_model.Wexp);
+    mesh().UpdateVertices(model.GetTM());
+    mesh().ComputeNormals();
+  }
+}
+
+json SFSEnergy::ToJson() const {
+  // NaN is written as null
+  json j;
+  j["lighting_data"] = lighting_data;
+  j["lighting_reg"] = lighting_reg;
+  j["albedo_data"] = albedo_data;
+  j["albedo_LoG"] = albedo_LoG;
+  j["depth_data"] = depth_data;
+  j["depth_integrability"] = depth_integrability;
+  j["depth_reg"] = depth_reg;
+  return j;
+}
+
+vector<ImageBundle> LoadImageBundles(const string& settings_filename, const string& recon_path,
+                                     const vector<string>& images) {
+  // Load the image bundles: image, points and its reconstruction result
+  const SFSImageSource source = SFSImageSource::Stream(settings_filename, recon_path, images);
+  vector<ImageBundle> image_bundles;
+  for(int i=0;i<source.size();++i) image_bundles.push_back(source.Load(i));
+  SFS_LOG(Info, Pipeline) << "Image bundles loaded.";
+  return image_bundles;
+}
+
+SFSImageSource::SFSImageSource(vector<ImageBundle> image_bundles)
+  : image_bundles(std::move(image_bundles)) {
+  for(auto& bundle : this->image_bundles) filenames.push_back(bundle.filename);
+}
+
+SFSImageSource SFSImageSource::Stream(const string& settings_filename, const string& recon_path,
+                                      const vector<string>& images) {
+  fs::path settings_filepath(settings_filename);
+
+  // Load the settings file
+  SFS_LOG(Info, Pipeline) << "Reading settings file " << settings_filename;
+  vector<pair<string, string>> image_points_filenames = ParseSettingsFile(settings_filename);
+  SFS_LOG(Info, Pipeline) << image_points_filenames.size() << " input images.";
+  if(!images.empty()) {
+    const set<string> selected(images.begin(), images.end());
+    image_points_filenames.erase(
+      std::remove_if(image_points_filenames.begin(), image_points_filenames.end(),
+                     [&selected](const pair<string, string>& p) { return !selected.count(p.first); }),
+      image_points_filenames.end());
+    if(image_points_filenames.size() != selected.size()) {
+      throw runtime_error("Not all of the selected images are listed in " + settings_filename);
+    }
+    SFS_LOG(Info, Pipeline) << image_points_filenames.size() << " of them selected.";
+  }
+
+  fs::path res_path = recon_path.empty()? settings_filepath.parent_path() : fs::path(recon_path);
+
+  SFSImageSource source;
+  for(auto& p : image_points_filenames) {
+    ImageFiles f;
+    f.image = settings_filepath.parent_path() / fs::path(p.first);
+    f.points = settings_filepath.parent_path() / fs::path(p.second);
+    f.reconstruction = res_path / fs::path(p.first + ".res");
+    source.filenames.push_back(p.first);
+    source.files.push_back(f);
+  }
+  return source;
+}
+
+ImageBundle SFSImageSource::Load(int i) const {
+  if(!streamed()) return image_bundles[i];
+
+  const ImageFiles& f = files[i];
+  SFS_LOG(Info, Pipeline) << "[" << f.image << ", " << f.points << "]";
+  auto image_points_pair = LoadImageAndPoints(f.image.string(), f.points.string(), false);
+  auto recon_results = LoadReconstructionResult(f.reconstruction.string());
+  return ImageBundle(filenames[i], image_points_pair.first, image_points_pair.second, recon_results);
+}
+
+void SFSPrepareStage::Run(const ImageBundle& bundle, SFSImageState& state) {
+  auto& resources = context.resources;
+  const fs::path& results_path = context.results_path;
+  const int image_index = state.image_index;
+
+  TraceSpan span("prepare");
+  span.SetArg("image", state.index);
+  ScopedLatency latency("sfs_stage_seconds", MetricLabel("stage", "prepare"));
+
+  state.lighting_coeffs = VectorXd::Zero(9);
+  state.lighting_coeffs[0] = 1.0;
+
+  // get the geometry of the mesh, update normal
+  resources.ApplyParams(bundle.params);
+
+  // generate reference normal map and depth map
+  {
+    // for each image bundle, render the mesh to FBO with culling to get the visible triangles
+    OffscreenMeshVisualizer visualizer(bundle.image.width(), bundle.image.height());
+    visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
+    visualizer.SetRenderMode(OffscreenMeshVisualizer::Normal);
+    visualizer.BindMesh(resources.mesh());
+    visualizer.SetCameraParameters(bundle.params.params_cam);
+    visualizer.SetMeshRotationTranslation(bundle.params.params_model.R, bundle.params.params_model.T);
+    visualizer.SetFacesToRender(resources.valid_faces_indices());
+
+    TraceSpan render_span("render_normal_depth");
+    pair<QImage, vector<float>> img_and_depth = visualizer.RenderWithDepth();
+    render_span.End();
+    QImage img = img_and_depth.first;
+    const vector<float>& depth = img_and_depth.second;
+
+    // get camera parameters for computing actual z values
+    const double aspect_ratio =
+      bundle.params.params_cam.image_size.x / bundle.params.params_cam.image_size.y;
+
+    const double far = bundle.params.params_cam.far;
+    // near is the focal length
+    const double near = bundle.params.params_cam.focal_length;
+    const double top = near * tan(0.5 * bundle.params.params_cam.fovy);
+    const double right = top * aspect_ratio;
+    glm::dmat4 Mproj = glm::dmat4(near/right, 0, 0, 0,
+                                  0, near/top, 0, 0,
+                                  0, 0, -(far+near)/(far-near), -1,
+                                  0, 0, -2.0 * far * near / (far - near), 0.0);
+
+    glm::ivec4 viewport(0, 0, bundle.image.width(), bundle.image.height());
+
+    glm::dmat4 Rmat = glm::eulerAngleYXZ(bundle.params.params_model.R[0],
+                                         bundle.params.params_model.R[1],
+                                         bundle.params.params_model.R[2]);
+
+    glm::dmat4 Tmat = glm::translate(glm::dmat4(1.0),
+                                     glm::dvec3(bundle.params.params_model.T[0],
+                                                bundle.params.params_model.T[1],
+                                                bundle.params.params_model.T[2]));
+    glm::dmat4 Mview = Tmat * Rmat;
+
+    // copy to normal maps and depth maps
+    state.normal_map_ref = Map3(img.height(), img.width());
+    state.depth_map_ref = cv::Mat(img.height(), img.width(), kMapDepth);
+    state.xy_map = Map2(img.height(), img.width());
+    state.zmap = cv::Mat(img.height(), img.width(), CV_32F);
+    state.valid_pixels_map.clear();
+
+    // the depth image, point clouds and depth mesh are only collected to be
+    // written out
+    const bool write_maps = context.ShouldWrite(SFSOutputLevel::Final);
+    QImage depth_img;
+    if(write_maps) depth_img = img;
+    TraceSpan readback_span("unproject_depth");
+    vector<glm::dvec3> point_cloud;
+    vector<glm::dvec4> point_cloud_with_id;
+    vector<double> output_depth_map;
+    if(write_maps) output_depth_map.reserve(img.height()*img.width()*3);
+    //#pragma omp parallel for
+    for(int y=0;y<img.height();++y) {
+      for(int x=0;x<img.width();++x) {
+        auto pix = img.pixel(x, y);
+        // 0~255 range
+        double nx = qRed(pix) / 255.0 * 2.0 - 1.0;
+        double ny = qGreen(pix) / 255.0 * 2.0 - 1.0;
+        double nz = max(0.0, qBlue(pix) / 255.0 * 2.0 - 1.0);
+
+        double theta, phi;
+        tie(theta, phi) = normal2sphericalcoords<double>(nx, ny, nz);
+        tie(nx, ny, nz) = sphericalcoords2normal<double>(theta, phi);
+
+        state.normal_map_ref.Set(y, x, cv::Vec3d(nx, ny, nz));
+
+        // get the screen z-value
+        double dvalue = depth[(img.height()-1-y)*img.width()+x];
+        if(dvalue < 1) {
+          // unproject this point to obtain the actual z value
+          glm::dvec3 XYZ = glm::unProject(glm::dvec3(x, img.height()-1-y, dvalue), Mview, Mproj, viewport);
+          glm::dvec4 Rxyz = Rmat * glm::dvec4(XYZ.x, XYZ.y, XYZ.z, 1);
+          state.depth_map_ref.at<MapScalar>(y, x) = Rxyz.z;
+          state.xy_map.Set(y, x, cv::Vec2d(Rxyz.x, Rxyz.y));
+          state.zmap.at<float>(y, x) = Rxyz.z;
+          state.valid_pixels_map.push_back(y * img.width() + x);
+          if(write_maps) {
+            point_cloud.push_back(glm::dvec3(Rxyz.x, Rxyz.y, Rxyz.z));
+            point_cloud_with_id.push_back(glm::dvec4(Rxyz.x, Rxyz.y, Rxyz.z, y*img.width()+x));
+            output_depth_map.push_back(Rxyz.x); output_depth_map.push_back(Rxyz.y); output_depth_map.push_back(Rxyz.z);
+            depth_img.setPixel(x, y, qRgb(dvalue*255, 0, (1-dvalue)*255));
+          }
+        } else {
+          state.depth_map_ref.at<MapScalar>(y, x) = -1e6;
+          state.xy_map.Set(y, x, cv::Vec2d(0, 0));
+          state.zmap.at<float>(y, x) = -1e6;
+          if(write_maps) {
+            output_depth_map.push_back(0); output_depth_map.push_back(0); output_depth_map.push_back(-1e6);
+            depth_img.setPixel(x, y, qRgb(255, 255, 255));
+          }
+        }
+      }
+    }
+
+    readback_span.End();
+
+    if(write_maps) {
+      TraceSpan write_span("write_prepared_maps");
+      context.WriteImage("normal" + std::to_string(image_index) + ".png", img);
+      context.WriteImage("depth" + std::to_string(image_index) + ".png", depth_img);
+
+      // Write out the entire depth map
+      {
+        ofstream fout( (results_path / fs::path("depth_map" + std::to_string(image_index) + ".bin")).string(), ios::binary );
+        int depth_map_size[] = {img.height(), img.width()};
+        fout.write(reinterpret_cast<char*>(depth_map_size), sizeof(int)*2);
+        fout.write(reinterpret_cast<char*>(output_depth_map.data()), sizeof(double)*img.height()*img.width()*3);
+        fout.close();
+      }
+
+      // Write out the depth map as a per-pixel mesh
+      {
+        ofstream fout((results_path / fs::path("depth_mesh" + std::to_string(image_index) + ".obj")).string());
+
+        vector<int> depth_node_map(img.width()*img.height(), 0);
+        for(int j=0;j<point_cloud_with_id.size();++j) {
+          auto& p = point_cloud_with_id[j];
+          fout << "v " << p.x << ' ' << p.y << ' ' << p.z << '\n';
+          depth_node_map[static_cast<int>(p.w)] = j + 1;
+        }
+
+        for(int j=0;j<point_cloud_with_id.size();++j) {
+          int idx = point_cloud_with_id[j].w;
+          int lidx = idx - 1;
+          int ridx = idx + 1;
+          int uidx = idx - img.width();
+          int didx = idx + img.width();
+          if(ridx < img.width()*img.height() && didx < img.width()*img.height()) {
+            if(depth_node_map[ridx] > 0 && depth_node_map[didx] > 0) {
+              fout << "f " << depth_node_map[idx] << " " << depth_node_map[didx] << " " << depth_node_map[ridx] << '\n';
+            }
+          }
+          if(lidx >= 0 && uidx >= 0) {
+            if(depth_node_map[lidx] > 0 && depth_node_map[uidx] > 0) {
+              fout << "f " << depth_node_map[idx] << " " << depth_node_map[uidx] << " " << depth_node_map[lidx] << '\n';
+            }
+          }
+        }
+        fout.close();
+      }
+
+      // Write out the initial point cloud
+      {
+        ofstream fout( (results_path / fs::path("point_cloud" + std::to_string(image_index) + ".txt")).string() );
+        for(auto p : point_cloud) {
+          fout << p.x << ' ' << p.y << ' ' << p.z << endl;
+        }
+        fout.close();
+      }
+    }
+  }
+  // use the reference normal map as initial value, the two share the planes
+  state.normal_map = state.normal_map_ref;
+
+  // initialize albedos by rendering the mesh with texture
+  {
+    // for each image bundle, render the mesh to FBO with culling to get the visible triangles
+    OffscreenMeshVisualizer visualizer(bundle.image.width(), bundle.image.height());
+    visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
+    visualizer.SetRenderMode(OffscreenMeshVisualizer::TexturedMesh);
+    visualizer.BindMesh(resources.mesh());
+    visualizer.BindTexture(context.mean_texture_image);
+    visualizer.SetCameraParameters(bundle.params.params_cam);
+    visualizer.SetMeshRotationTranslation(bundle.params.params_model.R, bundle.params.params_model.T);
+    visualizer.SetFacesToRender(resources.valid_faces_indices());
+
+    TraceSpan render_span("render_albedo");
+    QImage albedo_image = visualizer.Render(true);
+    render_span.End();
+
+    state.albedo_ref = Map3(bundle.image.height(), bundle.image.width());
+    //#pragma omp parallel for
+    for(int y=0;y<albedo_image.height();++y) {
+      for(int x=0;x<albedo_image.width();++x) {
+
+        QRgb pix = albedo_image.pixel(x, y);
+        unsigned char r = static_cast<unsigned char>(qRed(pix));
+        unsigned char g = static_cast<unsigned char>(qGreen(pix));
+        unsigned char b = static_cast<unsigned char>(qBlue(pix));
+
+        // convert from BGR to RGB
+        albedo_image.setPixel(x, y, qRgb(b, g, r));
+      }
+    }
+
+    if(context.ShouldWrite(SFSOutputLevel::Final)) {
+      context.WriteImage("albedo" + std::to_string(image_index) + ".png", albedo_image);
+    }
+
+    // color transfer from bundle.image to albedo_image, so the initial albedo
+    // is a better match
+    {
+      TraceSpan transfer_span("transfer_color");
+      albedo_image = TransferColor(albedo_image, bundle.image, state.valid_pixels_map, state.valid_pixels_map);
+    }
+
+    if(context.ShouldWrite(SFSOutputLevel::Final)) {
+      context.WriteImage("albedo_transferred_" + std::to_string(image_index) + ".png", albedo_image);
+    }
+
+    //#pragma omp parallel for
+    for(int y=0;y<albedo_image.height();++y) {
+      for(int x=0;x<albedo_image.width();++x) {
+        QRgb pix = albedo_image.pixel(x, y);
+        unsigned char r = static_cast<unsigned char>(qRed(pix));
+        unsigned char g = static_cast<unsigned char>(qGreen(pix));
+        unsigned char b = static_cast<unsigned char>(qBlue(pix));
+        // convert to [0, 1] range
+        state.albedo_ref.Set(y, x, cv::Vec3d(r / 255.0, g / 255.0, b / 255.0));
+      }
+    }
+  }
+
+  // use the reference albedo as initial albedo
+  state.albedo = state.albedo_ref;
+}
+
+void SFSPrepareStage::PrepareSolver(const ImageBundle& bundle, SFSImageState& state) {
+  const int i = state.index;
+
+  TraceSpan span("prepare_solver");
+  span.SetArg("image", i);
+
+  // ====================================================================
+  // construct LoG matrix for this image
+  // ====================================================================
+  const int num_rows = bundle.image.height(), num_cols = bundle.image.width();
+  using Tripletd = SFSImageState::Tripletd;
+
+  const int kLoG = 2;
+  const double sigmaLoG = 1.0;
+  MatrixXd LoG = ComputeLoGKernel(kLoG, sigmaLoG);
+
+  state.LoG_coeffs.clear();
+  state.LoG_coeffs_perpixel.assign(num_rows*num_cols, vector<pair<int, double>>());
+  {
+    TraceSpan LoG_span("build_LoG");
+    // collect the coefficients for each pixel
+    for (int r = 0; r < num_rows; ++r) {
+      for (int c = 0; c < num_cols; ++c) {
+        int pidx = r * num_cols + c;
+        for (int kr = -kLoG; kr <= kLoG; ++kr) {
+          int ri = r + kr;
+          if (ri < 0 || ri >= num_rows) continue;
+          for (int kc = -kLoG; kc <= kLoG; ++kc) {
+            int ci = c + kc;
+            if (ci < 0 || ci >= num_cols) continue;
+
+            int qidx = ri * num_cols + ci;
+
+            // add this element to the matrix
+            state.LoG_coeffs.push_back(Tripletd(pidx, qidx, LoG(kr+kLoG, kc+kLoG)));
+
+            state.LoG_coeffs_perpixel[pidx].push_back(make_pair(qidx, LoG(kr+kLoG, kc+kLoG)));
+          }
+        }
+
+      }
+    }
+  }
+
+  // ====================================================================
+  // compute LoG filtered reference albedo and normal map
+  // ====================================================================
+  cv::Mat LoG_kernel(kLoG*2+1, kLoG*2+1, CV_64F);
+  for(int kr=0;kr<kLoG*2+1;++kr) {
+    for(int kc=0;kc<kLoG*2+1;++kc) {
+      LoG_kernel.at<double>(kr, kc) = LoG(kr, kc);
+    }
+  }
+
+  const bool write_debug_images = context.ShouldWrite(SFSOutputLevel::Debug);
+
+  // filtered in double, the results feed the solvers directly
+  cv::Mat albedo_ref_LoG;
+  cv::filter2D(state.albedo_ref.ToMat(), albedo_ref_LoG, -1, LoG_kernel, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
+  if(write_debug_images) {
+    context.WriteImage("albedo_LoG" + std::to_string(i) + ".png", cv::Mat((albedo_ref_LoG + 0.5) * 255.0));
+  }
+
+  // store it in num_pixels-by-3 matrix
+  state.albedo_ref_LoG_i = MatrixXd(num_rows*num_cols, 3);
+  for(int r=0, pidx=0;r<num_rows;++r) {
+    for(int c=0;c<num_cols;++c,++pidx) {
+      cv::Vec3d pix = albedo_ref_LoG.at<cv::Vec3d>(r, c);
+      state.albedo_ref_LoG_i(pidx, 0) = pix[0];
+      state.albedo_ref_LoG_i(pidx, 1) = pix[1];
+      state.albedo_ref_LoG_i(pidx, 2) = pix[2];
+    }
+  }
+
+  // the LoG filtered normal map is only inspected
+  if(write_debug_images) {
+    cv::Mat normal_map_ref_LoG;
+    cv::filter2D(state.normal_map_ref.ToMat(), normal_map_ref_LoG, -1, LoG_kernel, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
+    context.WriteImage("normal_LoG" + std::to_string(i) + ".png", cv::Mat((normal_map_ref_LoG + 1.0) * 0.5 * 255.0));
+  }
+
+  cv::Mat depth_map_ref, depth_map_ref_LoG;
+  state.depth_map_ref.convertTo(depth_map_ref, CV_64F);
+  cv::filter2D(depth_map_ref, depth_map_ref_LoG, -1, LoG_kernel, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
+  state.depth_map_ref_LoG_i = VectorXd(num_rows*num_cols);
+  for(int r=0, pidx=0;r<num_rows;++r) {
+    for(int c=0;c<num_cols;++c,++pidx) {
+      state.depth_map_ref_LoG_i(pidx) = depth_map_ref_LoG.at<double>(r, c);
+    }
+  }
+
+  if(write_debug_images) {
+    cv::Mat dzmapdx, dzmapdy;
+    cv::Sobel(state.zmap, dzmapdx, -1, 1, 0);
+    cv::Sobel(state.zmap, dzmapdy, -1, 0, 1);
+    cv::Mat dz_gradient(num_rows, num_cols, CV_32F);
+    for(int r=0;r<num_rows;++r) {
+      for(int c=0;c<num_cols;++c) {
+        float dzdx = dzmapdx.at<float>(r, c);
+        float dzdy = dzmapdy.at<float>(r, c);
+
+        dz_gradient.at<float>(r, c) = sqrt(dzdx * dzdx + dzdy * dzdy);
+      }
+    }
+    cv::threshold(dz_gradient, dz_gradient, 0.1, 255, cv::THRESH_BINARY);
+    cv::dilate(dz_gradient, dz_gradient, cv::Mat());
+    context.WriteImage("zmap_gradient" + std::to_string(i) + ".png", dz_gradient);
+  }
+
+  state.is_boundary.assign(num_rows * num_cols, false);
+  state.valid_depth_pixels.clear();
+}
+
+double SFSLightingStage::SecondOrderWeight(int iters, int max_iters) {
+  if(max_iters <= 1) return 1.0;
+  return min((iters - 1) / static_cast<double>(max_iters - 1), 1.0);
+}
+
+void SFSLightingStage::Run(const ImageBundle& bundle, SFSImageState& state, int iters) {
+  const SFSSettings& global_settings = context.settings;
+  auto& resources = context.resources;
+  const int i = state.index;
+  const int num_rows = bundle.image.height(), num_cols = bundle.image.width();
+  const int max_iters = global_settings.max_iters;
+
+  const double second_order_scale = 0.0;
+  double second_order_weights = SecondOrderWeight(iters, max_iters) * second_order_scale;
+
+  // ====================================================================
+  // collect valid pixels
+  // ====================================================================
+  TraceSpan select_span("select_lighting_pixels");
+  vector<glm::ivec2> pixel_indices_i;
+  const int SATURATED_THRESHOLD = global_settings.lighting.saturated_pixels_threshold;
+  const int DARK_PIXEL_THRESHOLD = global_settings.lighting.dark_pixels_threshold;
+  const unordered_set<int>& hair_region_indices = resources.hair_region_indices();
+  const unordered_set<int>& face_boundary_indices = resources.face_boundary_indices();
+
+  for (int y = 0; y < state.normal_map.rows; ++y) {
+    for (int x = 0; x < state.normal_map.cols; ++x) {
+      float zval = state.zmap.at<float>(y, x);
+      int pidx = y * num_cols + x;
+      bool is_good_pixel = true;
+      is_good_pixel &= (zval > -1e5);
+      is_good_pixel &= (hair_region_indices.count(state.face_indices_map[pidx]) == 0);
+      is_good_pixel &= (face_boundary_indices.count(state.face_indices_map[pidx]) == 0);
+
+      auto pix = bundle.image.pixel(x, y);
+      if(qRed(pix) + qGreen(pix) + qBlue(pix) > SATURATED_THRESHOLD * 3) {
+        is_good_pixel = false;
+      }
+      if(qRed(pix) + qGreen(pix) + qBlue(pix) < DARK_PIXEL_THRESHOLD * 3) {
+        is_good_pixel = false;
+      }
+
+      if(is_good_pixel) pixel_indices_i.push_back(glm::ivec2(y, x));
+    }
+  }
+
+  // Without constraints the solve only sees the regularization and would
+  // pull the lighting towards zero, keep the previous estimate instead
+  auto keep_lighting = [&]() {
+    SFS_LOG(Warning, Lighting) << "No pixels to estimate the lighting of image " << i
+                               << " from in iteration " << iters << ", keeping the previous lighting";
+  };
+  if(pixel_indices_i.empty()) {
+    keep_lighting();
+    return;
+  }
+
+  // ====================================================================
+  // filter pixels
+  // ====================================================================
+  vector<double> albedo_distances_i(num_cols*num_rows);
+  vector<double> albedo_distances_i_vec;
+  for(int j = 0; j < pixel_indices_i.size(); ++j) {
+    int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+    cv::Vec3d pix_ref = state.albedo_ref(r, c);
+    cv::Vec3d pix = state.albedo(r, c);
+    cv::Vec3d pix_diff = pix_ref - pix;
+    double d_j = pix_diff[0] * pix_diff[0] + pix_diff[1] * pix_diff[1] + pix_diff[2] * pix_diff[2];
+    albedo_distances_i[r*num_cols+c] = d_j;
+    albedo_distances_i_vec.push_back(d_j);
+  }
+
+  std::sort(pixel_indices_i.begin(), pixel_indices_i.end(), [&](glm::ivec2 p1, glm::ivec2 p2) {
+    return albedo_distances_i[p1.x*num_cols+p1.y] < albedo_distances_i[p2.x*num_cols+p2.y];
+  });
+
+  vector<double> albedo_distances_i_sorted = albedo_distances_i_vec;
+  std::sort(albedo_distances_i_sorted.begin(), albedo_distances_i_sorted.end());
+
+  const int nbins = global_settings.lighting.albedo_distance_bins;
+  vector<int> counter(nbins, 0);
+  double max_albedo_distance = albedo_distances_i_sorted.back(), min_albedo_distance = albedo_distances_i_sorted.front();
+  double diff_albedo_distance = max(max_albedo_distance - min_albedo_distance, 1e-16);
+  SFS_LOG(Debug, Lighting) << min_albedo_distance << ", " << max_albedo_distance << ", " << diff_albedo_distance;
+  for(auto d_j : albedo_distances_i_sorted) {
+    int binidx = min(static_cast<int>((d_j - min_albedo_distance) / diff_albedo_distance * nbins), nbins-1);
+    ++counter[binidx];
+  }
+  for(int j=1;j<nbins;++j) {
+    counter[j] += counter[j-1];
+  }
+  const double lighting_pixels_ratio_lower = global_settings.lighting.lighting_pixels_ratio_lower;
+  const double lighting_pixels_ratio_upper = global_settings.lighting.lighting_pixels_ratio_upper;
+  double lighting_pixels_ratio = iters / (double)max_iters * lighting_pixels_ratio_upper + (1.0 - iters / (double) max_iters) * lighting_pixels_ratio_lower;
+  auto cutoff = std::lower_bound(counter.begin(), counter.end(), static_cast<int>(lighting_pixels_ratio*albedo_distances_i_sorted.size()));
+  const int cutoff_count = cutoff == counter.end()? counter.back() : *cutoff;
+  SFS_LOG(Debug, Lighting) << "num constraints [before]: " << pixel_indices_i.size();
+  pixel_indices_i.erase(pixel_indices_i.begin()+cutoff_count, pixel_indices_i.end());
+  SFS_LOG(Debug, Lighting) << "num constraints [after]: " << pixel_indices_i.size();
+  select_span.End();
+  if(pixel_indices_i.empty()) {
+    keep_lighting();
+    return;
+  }
+
+  if(context.ShouldWrite(SFSOutputLevel::PerIteration)) {
+    QImage lighting_pixel_image(num_cols, num_rows, QImage::Format_ARGB32);
+    lighting_pixel_image.fill(0);
+    for(int j=0;j<pixel_indices_i.size();++j) {
+      int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+      lighting_pixel_image.setPixel(c, r, qRgb(255, 255, 255));
+    }
+    context.WriteImage("lighting_pixels" + std::to_string(i) + "_" + std::to_string(iters) + ".png", lighting_pixel_image);
+  }
+
+  // ====================================================================
+  // assemble matrices
+  // ====================================================================
+  const int num_constraints = pixel_indices_i.size();
+  const int num_dof = global_settings.lighting.num_dof;
+  TraceCounter("lighting.num_constraints", num_constraints);
+  TraceSpan assemble_span("assemble_lighting");
+
+  MatrixXd Y(num_constraints, num_dof);
+  MatrixXd A(num_constraints * 3, num_dof);
+  VectorXd b(num_constraints * 3);
+
+  for(int j=0;j<num_constraints;++j) {
+    int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+
+    cv::Vec3d pix = state.normal_map(r, c);
+    double nx, ny, nz;
+    nx = pix[0], ny = pix[1], nz = pix[2];
+
+    cv::Vec3d pix_albedo = state.albedo(r, c);
+    double ar = pix_albedo[0], ag = pix_albedo[1], ab = pix_albedo[2];
+
+    auto pix_i = bundle.image.pixel(c, r);
+    double Ir = qRed(pix_i) / 255.0;
+    double Ig = qGreen(pix_i) / 255.0;
+    double Ib = qBlue(pix_i) / 255.0;
+
+    Y.row(j) = sphericalharmonics(nx, ny, nz).transpose();
+
+    A.row(j*3) = Y.row(j) * ar; b(j*3) = Ir;
+    A.row(j*3+1) = Y.row(j) * ag; b(j*3+1) = Ig;
+    A.row(j*3+2) = Y.row(j) * ab; b(j*3+2) = Ib;
+  }
+
+  // Lighting regularization
+  const double w_reg = global_settings.lighting.w_reg * num_constraints;
+  MatrixXd Afinal(num_constraints*3+9, 9);
+  Afinal.topRows(num_constraints*3) = A;
+  Afinal.bottomRows(9) = MatrixXd::Identity(9, 9) * w_reg;
+  VectorXd bfinal(num_constraints*3+9);
+  bfinal.topRows(num_constraints*3) = b;
+  bfinal.bottomRows(9) = VectorXd::Zero(9);
+
+  // Apply weights to
+  Afinal.rightCols(5) *= second_order_weights;
+  assemble_span.End();
+
+  // ====================================================================
+  // solve linear least squares
+  // ====================================================================
+  TraceSpan solve_span("qr_solve");
+  VectorXd l_i = Afinal.colPivHouseholderQr().solve(bfinal);
+  solve_span.End();
+
+  // energy at the solution, before the relaxation
+  const VectorXd lighting_residuals = Afinal * l_i - bfinal;
+  state.energy.lighting_data = lighting_residuals.head(num_constraints*3).squaredNorm();
+  state.energy.lighting_reg = lighting_residuals.tail(9).squaredNorm();
+
+  const double relax_factor = global_settings.lighting.relaxation;
+  state.lighting_coeffs = (1.0 - relax_factor) * state.lighting_coeffs + relax_factor * l_i;
+  SFS_LOG(Debug, Lighting) << l_i.transpose();
+
+  // ====================================================================
+  // [Optional] output result of estimated lighting
+  // ====================================================================
+  if(!context.ShouldWrite(SFSOutputLevel::PerIteration)) return;
+
+  TraceSpan write_span("write_lighting_images");
+  QImage image_with_lighting(num_cols, num_rows, QImage::Format_ARGB32);
+  image_with_lighting.fill(0);
+  for (int y = 0; y < state.normal_map.rows; ++y) {
+    for (int x = 0; x < state.normal_map.cols; ++x) {
+      float zval = state.zmap.at<float>(y, x);
+      if (zval < -1e5) continue;
+      else {
+        cv::Vec3d pix = state.normal_map(y, x);
+        double nx = pix[0], ny = pix[1], nz = pix[2];
+
+        VectorXd Y_ij = sphericalharmonics(nx, ny, nz);
+
+        double LdotY = l_i.transpose() * Y_ij;
+        cv::Vec3d rho(0.5, 0.5, 0.5);
+        rho *= 255.0 * LdotY;
+
+        image_with_lighting.setPixel(x, y, qRgb(clamp<double>(rho[0], 0, 255),
+                                                clamp<double>(rho[1], 0, 255),
+                                                clamp<double>(rho[2], 0, 255)));
+      }
+    }
+  }
+  context.WriteImage("lighting_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", image_with_lighting);
+
+  QImage lighting_coeffs_image(256, 256, QImage::Format_ARGB32);
+  lighting_coeffs_image.fill(0);
+  for(int r=0;r<256;++r) {
+    double y = (127 - r)/127.0;
+    for(int c=0;c<256;++c) {
+      double x = (c - 127)/127.0;
+      if(x*x + y*y <= 1.0) {
+        // x = sin(theta)*sin(phi)
+        // y = sin(theta)*cos(phi)
+        // z = cos(theta)
+
+        double z = sqrt(1 - x*x - y*y);
+        VectorXd Y = sphericalharmonics(x, y, z);
+        double LdotY = l_i.transpose() * Y;
+
+        lighting_coeffs_image.setPixel(c, r, jet_color_QRgb(clamp<double>(LdotY / 1.5, 0.0, 1.0)));
+      }
+    }
+  }
+  context.WriteImage("lighting_coeffs" + std::to_string(i) + "_" + std::to_string(iters) + ".png", lighting_coeffs_image);
+}
+
+// @NOTE Construct the problem for whole image, then solve for valid pixels only
+void SFSAlbedoStage::Run(const ImageBundle& bundle, SFSImageState& state, int iters) {
+  const SFSSettings& global_settings = context.settings;
+  const int i = state.index;
+  const int num_rows = bundle.image.height(), num_cols = bundle.image.width();
+  using Tripletd = SFSImageState::Tripletd;
+
+  const double lambda2 = global_settings.albedo.lambda / pow(2, (iters - 1));
+
+  // ====================================================================
+  // collect valid pixels
+  // ====================================================================
+  vector<glm::ivec2> pixel_indices_i;
+
+  for (int y = 0; y < num_rows; ++y) {
+    for (int x = 0; x < num_cols; ++x) {
+      float zval = state.zmap.at<float>(y, x);
+      if (zval < -1e5) continue;
+      else {
+        pixel_indices_i.push_back(glm::ivec2(y, x));
+      }
+    }
+  }
+
+  // ====================================================================
+  // collect constraints from valid pixels
+  // ====================================================================
+  const int num_constraints = pixel_indices_i.size();
+  SFS_LOG(Debug, Albedo) << num_constraints;
+  TraceCounter("albedo.num_constraints", num_constraints);
+  TraceSpan assemble_span("assemble_albedo");
+
+  MatrixXd pixels_i(num_constraints, 3);
+
+  for (int j = 0; j < num_constraints; ++j) {
+    int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+
+    auto pix_i = bundle.image.pixel(c, r);
+    pixels_i(j, 0) = qRed(pix_i) / 255.0;
+    pixels_i(j, 1) = qGreen(pix_i) / 255.0;
+    pixels_i(j, 2) = qBlue(pix_i) / 255.0;
+  }
+
+  const bool write_debug_output = context.ShouldWrite(SFSOutputLevel::Debug);
+  if(write_debug_output) {
+    QImage albedo_texture_image(num_cols, num_rows, QImage::Format_ARGB32);
+    QImage albedo_normal_image(num_cols, num_rows, QImage::Format_ARGB32);
+    for (int j = 0; j < num_constraints; ++j) {
+      int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+
+      cv::Vec3d pix = state.normal_map(r, c);
+      albedo_normal_image.setPixel(c, r, qRgb((pix[0]+1.0)*0.5*255,
+                                              (pix[1]+1.0)*0.5*255,
+                                              (pix[2]+1.0)*0.5*255));
+      albedo_texture_image.setPixel(c, r, bundle.image.pixel(c, r));
+    }
+
+    std::lock_guard<std::mutex> lock(debug_output_mutex);
+    albedo_normal_image.save("albedo_normal_image.png");
+    albedo_texture_image.save("albedo_texture_image.png");
+  }
+
+  // ====================================================================
+  // assemble matrices
+  // ====================================================================
+  const int num_dof = 9;  // use first order approximation
+  MatrixXd Y(num_constraints, num_dof);
+
+  for(int j=0;j<num_constraints;++j) {
+    int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+
+    cv::Vec3d pix = state.normal_map(r, c);
+    double nx, ny, nz;
+    nx = pix[0], ny = pix[1], nz = pix[2];
+
+    Y.row(j) = sphericalharmonics(nx, ny, nz).transpose();
+  }
+
+  VectorXd LdotY = Y * state.lighting_coeffs;
+
+  vector<bool> is_valid_pixel(num_rows*num_cols, false);
+  vector<int> pixel_index_map(num_rows*num_cols, -1);
+  for(int j=0;j<num_constraints;++j) {
+    int pidx = pixel_indices_i[j].x * num_cols + pixel_indices_i[j].y;
+    is_valid_pixel[pidx] = true;
+    pixel_index_map[pidx] = j;
+  }
+
+  SFS_LOG(Debug, Albedo) << "Assembling matrices ...";
+  vector<Tripletd> A_coeffs;
+  A_coeffs.reserve(num_constraints + num_constraints * 25);
+  for(int j=0;j<num_constraints;++j) {
+    A_coeffs.push_back(Tripletd(j, j, LdotY(j)));
+  }
+
+  for(int j=0;j<state.LoG_coeffs.size();++j) {
+    auto& item_j = state.LoG_coeffs[j];
+    if(is_valid_pixel[item_j.row()] && is_valid_pixel[item_j.col()]) {
+      int new_i = pixel_index_map[item_j.row()] + num_constraints;
+      int new_j = pixel_index_map[item_j.col()];
+      A_coeffs.push_back(Tripletd(new_i, new_j, item_j.value() * lambda2));
+    }
+  }
+
+  if(write_debug_output) {
+    std::lock_guard<std::mutex> lock(debug_output_mutex);
+    ofstream fout("A.txt");
+    for(auto ttt : A_coeffs) {
+      fout << ttt.row() << ' ' << ttt.col() << ' ' << ttt.value() << '\n';
+    }
+    fout.close();
+  }
+
+  Eigen::SparseMatrix<double> A(num_constraints * 2, num_constraints);
+  A.setFromTriplets(A_coeffs.begin(), A_coeffs.end());
+
+  SFS_LOG(Debug, Albedo) << "A assembled ...";
+
+  // fill each channel individually
+  MatrixXd B(num_constraints*2, 3);
+  for(int j=0;j<num_constraints;++j) {
+    int pidx = pixel_indices_i[j].x * num_cols + pixel_indices_i[j].y;
+    B.row(j) = pixels_i.row(j);
+    B.row(j + num_constraints) = (state.albedo_ref_LoG_i.row(pidx) * lambda2).eval();
+  }
+
+  SFS_LOG(Debug, Albedo) << "done.";
+
+  // ====================================================================
+  // solve linear least squares
+  // ====================================================================
+  SFS_LOG(Debug, Albedo) << "Computing AtA ...";
+  Eigen::SparseMatrix<double> AtA = A.transpose() * A;
+  assemble_span.End();
+
+  SFS_LOG(Debug, Albedo) << AtA.rows() << 'x' << AtA.cols();
+  SFS_LOG(Debug, Albedo) << AtA.nonZeros();
+  TraceCounter("albedo.AtA_nonzeros", AtA.nonZeros());
+
+  // AtA is symmetric, so it is okay to use it as column major?
+  CholmodSupernodalLLT<Eigen::SparseMatrix<double>> solver;
+  {
+    TraceSpan factorize_span("cholmod_factorize");
+    ScopedLatency factorize_latency("sfs_cholmod_factorize_seconds");
+    solver.compute(AtA);
+  }
+  if(solver.info()!=Success) {
+    throw runtime_error("Failed to decompose matrix A.");
+  }
+
+  TraceSpan solve_span("cholmod_solve");
+  MatrixXd rho(num_rows*num_cols, 3);
+  state.energy.albedo_data = state.energy.albedo_LoG = 0;
+  for(int cidx=0;cidx<3;++cidx) {
+    VectorXd Atb = A.transpose() * B.col(cidx);
+    VectorXd x = solver.solve(Atb);
+
+    if(solver.info()!=Success) {
+      throw runtime_error("Failed to solve A\\b.");
+    }
+
+    // the rows of A are the data term, then the LoG term
+    const VectorXd residuals = A * x - B.col(cidx);
+    state.energy.albedo_data += residuals.head(num_constraints).squaredNorm();
+    state.energy.albedo_LoG += residuals.tail(num_constraints).squaredNorm();
+
+    for(int j=0;j<num_constraints;++j) {
+      int pidx = pixel_indices_i[j].x * num_cols + pixel_indices_i[j].y;
+      rho(pidx, cidx) = x(j);
+    }
+  }
+
+  solve_span.End();
+
+  // update albedo
+  for(int j=0;j<num_constraints;++j) {
+    int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+    int pidx = r * num_cols + c;
+    state.albedo.Set(r, c, cv::Vec3d(rho(pidx, 0), rho(pidx, 1), rho(pidx, 2)));
+  }
+
+  // ====================================================================
+  // [Optional] output result of estimated albedo
+  // ====================================================================
+  if(!context.ShouldWrite(SFSOutputLevel::PerIteration)) return;
+
+  TraceSpan write_span("write_albedo_images");
+  QImage image_with_albedo(num_cols, num_rows, QImage::Format_ARGB32);
+  QImage image_with_albedo_lighting(num_cols, num_rows, QImage::Format_ARGB32);
+  image_with_albedo.fill(0);
+  image_with_albedo_lighting.fill(0);
+  for (int y = 0; y < num_rows; ++y) {
+    for (int x = 0; x < num_cols; ++x) {
+      cv::Vec3d pix_albedo = state.albedo(y, x);
+      if (pix_albedo[0] == 0 && pix_albedo[1] == 0 && pix_albedo[2] == 0) {
+        continue;
+      }
+      else {
+        cv::Vec3d pix = state.normal_map(y, x);
+
+        double nx = pix[0], ny = pix[1], nz = pix[2];
+        VectorXd Y_ij = sphericalharmonics(nx, ny, nz);
+
+        double LdotY = state.lighting_coeffs.transpose() * Y_ij;
+        cv::Vec3d pix_val = cv::Vec3d(rho(y*num_cols+x, 0), rho(y*num_cols+x, 1), rho(y*num_cols+x, 2));
+        pix_val *= 255.0;
+
+        image_with_albedo.setPixel(x, y, qRgb(clamp<double>(pix_val[0], 0, 255),
+                                              clamp<double>(pix_val[1], 0, 255),
+                                              clamp<double>(pix_val[2], 0, 255)));
+
+        pix_val *= LdotY;
+        image_with_albedo_lighting.setPixel(x, y, qRgb(clamp<double>(pix_val[0], 0, 255),
+                                                       clamp<double>(pix_val[1], 0, 255),
+                                                       clamp<double>(pix_val[2], 0, 255)));
+      }
+    }
+  }
+  context.WriteImage("albedo_opt_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", image_with_albedo);
+  context.WriteImage("albedo_opt_lighting_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", image_with_albedo_lighting);
+}
+
+// @NOTE Construct the problem for whole image, then solve for valid pixels only
+void SFSDepthStage::Run(const ImageBundle& bundle, SFSImageState& state, int iters) {
+  const SFSSettings& global_settings = context.settings;
+  const int i = state.index;
+  const int num_rows = bundle.image.height(), num_cols = bundle.image.width();
+  vector<bool>& is_boundary = state.is_boundary;
+
+  const int iters_depth = global_settings.depth.num_iters;
+  const double min_cost_reduction = global_settings.convergence.depth_cost_reduction;
+  for(int iii=0;iii<iters_depth;++iii){
+    // anytime mode: the current depth is a valid result, stop refining it
+    if(iii > 0 && context.deadline && context.deadline->Expired()) break;
+    if(iii > 0 && state.depth_cost_reduction < min_cost_reduction) {
+      SFS_LOG(Info, Depth) << "Depth converged after " << iii << " iterations";
+      break;
+    }
+
+    TraceSpan depth_iteration_span("depth_iteration");
+    depth_iteration_span.SetArg("depth_iteration", iii);
+
+    // ====================================================================
+    // collect valid pixels
+    // ====================================================================
+    vector<glm::ivec2> pixel_indices_i;
+    if (state.valid_depth_pixels.empty()) {
+      TraceSpan valid_span("select_depth_pixels");
+      cv::Mat boundary_pixel_image(num_rows, num_cols, CV_8U);
+      cv::Mat valid_pixel_image(num_rows, num_cols, CV_8U);
+      for (int y = 0; y < state.normal_map.rows; ++y) {
+        for (int x = 0; x < state.normal_map.cols; ++x) {
+          boundary_pixel_image.at<unsigned char>(y, x) = 0;
+          valid_pixel_image.at<unsigned char>(y, x) = 0;
+
+          float zval = state.zmap.at<float>(y, x);
+          if (zval < -1e5) continue;
+          else {
+
+            bool flag = false;
+            flag |= state.zmap.at<float>(y-1, x) < -1e5;
+            flag |= state.zmap.at<float>(y+1, x) < -1e5;
+            flag |= state.zmap.at<float>(y, x-1) < -1e5;
+            flag |= state.zmap.at<float>(y, x+1) < -1e5;
+
+            if(flag) {
+              boundary_pixel_image.at<unsigned char>(y, x) = 255;
+              is_boundary[y*num_cols+x] = true;
+            } else {
+              pixel_indices_i.push_back(glm::ivec2(y, x));
+              valid_pixel_image.at<unsigned char>(y, x) = 255;
+            }
+          }
+        }
+      }
+
+      // Filter out edges
+      const double integrability_threshold = global_settings.depth.integrability_threshold;
+      for(int r=0;r<num_rows;++r) {
+        for(int c=0;c<num_cols;++c) {
+          cv::Vec3d pix = state.normal_map(r, c);
+          double nx = pix[0], ny = pix[1], nz = pix[2];
+
+          cv::Vec3d pix_u = state.normal_map(r-1, c);
+          double nx_u, ny_u, nz_u;
+          nx_u = pix_u[0]; ny_u = pix_u[1]; nz_u = pix_u[2];
+
+          cv::Vec3d pix_l = state.normal_map(r, c-1);
+          double nx_l, ny_l, nz_l;
+          nx_l = pix_l[0]; ny_l = pix_l[1]; nz_l = pix_l[2];
+
+          auto round_off = [](double val, double eps) {
+            if(fabs(val) < eps) {
+              return val>0?eps:-eps;
+            } else return val;
+          };
+          double nxnz = nx / round_off(nz, 1e-16);
+          double nynz = ny / round_off(nz, 1e-16);
+          double nxnz_u = nx_u / round_off(nz_u, 1e-16);
+          double nynz_l = ny_l / round_off(nz_l, 1e-16);
+          double integrability_val = clamp<double>(fabs((nxnz_u - nxnz) - (nynz - nynz_l)) * 255.0, 0, 255);
+
+          if(integrability_val > integrability_threshold) {
+            boundary_pixel_image.at<unsigned char>(r, c) = 255;
+            is_boundary[r*num_cols+c] = true;
+          }
+        }
+      }
+
+      if(context.ShouldWrite(SFSOutputLevel::PerIteration)) {
+        context.WriteImage("boundary_pixels_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", boundary_pixel_image);
+        context.WriteImage("valid_pixels_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", valid_pixel_image);
+      }
+
+      state.valid_depth_pixels = pixel_indices_i;
+    } else {
+      pixel_indices_i = state.valid_depth_pixels;
+    }
+
+    // ====================================================================
+    // collect constraints from valid pixels
+    // ====================================================================
+    const int num_constraints = pixel_indices_i.size();
+    SFS_LOG(Debug, Depth) << num_constraints;
+
+    MatrixXd albedos_i(num_constraints, 3);
+    MatrixXd pixels_i(num_constraints, 3);
+
+    for (int j = 0; j < num_constraints; ++j) {
+      int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+
+      cv::Vec3d pix_albedo = state.albedo(r, c);
+      albedos_i(j, 0) = pix_albedo[0];
+      albedos_i(j, 1) = pix_albedo[1];
+      albedos_i(j, 2) = pix_albedo[2];
+
+      auto pix_i = bundle.image.pixel(c, r);
+      pixels_i(j, 0) = qRed(pix_i) / 255.0;
+      pixels_i(j, 1) = qGreen(pix_i) / 255.0;
+      pixels_i(j, 2) = qBlue(pix_i) / 255.0;
+    }
+
+    // ====================================================================
+    // assemble cost functions
+    // ====================================================================
+
+    // create a valid pixel map first
+    vector<bool> is_valid_pixel(num_rows*num_cols, false);
+    vector<int> pixel_index_map(num_rows*num_cols, -1);
+    for(int j=0;j<num_constraints;++j) {
+      int pidx = pixel_indices_i[j].x * num_cols + pixel_indices_i[j].y;
+      is_valid_pixel[pidx] = true;
+      pixel_index_map[pidx] = j;
+    }
+
+    {
+      // Optimize for depth directly
+      ceres::Problem problem;
+      VectorXd z_value(num_constraints);
+      // residual blocks of each term, to report their energy
+      vector<ceres::ResidualBlockId> data_blocks, integrability_blocks, reg_blocks;
+
+      // initialize nx and ny
+      double mean_z_val = 0;
+      for (int j = 0; j < num_constraints; ++j) {
+        int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+
+        z_value(j) = state.zmap.at<float>(r, c);
+        mean_z_val += z_value(j);
+      }
+      mean_z_val /= num_constraints;
+      SFS_LOG(Debug, Depth) << "mean z = " << mean_z_val;
+
+      const double w_reg = global_settings.depth.w_reg;
+      const double w_integrability = global_settings.depth.w_int;
+
+      SFS_LOG(Debug, Depth) << "Assembling cost functions ...";
+      {
+        TraceSpan assemble_span("ceres_assemble");
+        TraceCounter("depth.num_constraints", num_constraints);
+
+        // data term
+        double mean_dz_val = 0; int mean_dz_count = 0;
+        for(int j = 0; j < num_constraints; ++j) {
+          int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+          int pidx = r * num_cols + c;
+          if(c < 1 || r < 1 || c >= num_cols || r >= num_rows) continue;
+
+          int left_idx = pidx - 1;
+          int up_idx = pidx - num_cols;
+
+          if(is_valid_pixel[left_idx] && is_valid_pixel[up_idx]) {
+            mean_dz_val += fabs(z_value(j) - z_value(pixel_index_map[left_idx]));
+            mean_dz_val += fabs(z_value(j) - z_value(pixel_index_map[up_idx]));
+            ++mean_dz_count;
+
+            cv::Vec2d depth_ij = state.xy_map(r, c);
+            cv::Vec2d depth_ij_l = state.xy_map(r, c-1);
+            cv::Vec2d depth_ij_u = state.xy_map(r-1, c);
+            double dx = -fabs(depth_ij[0] - depth_ij_l[0]);
+            double dy = -fabs(depth_ij_u[1] - depth_ij[1]);
+
+            ceres::DynamicNumericDiffCostFunction<DepthMapDataTerm> *cost_function =
+              new ceres::DynamicNumericDiffCostFunction<DepthMapDataTerm>(
+                new DepthMapDataTerm(
+                  pixels_i(j, 0), pixels_i(j, 1), pixels_i(j, 2),
+                  albedos_i(j, 0), albedos_i(j, 1), albedos_i(j, 2),
+                  state.lighting_coeffs, dx, dy)
+              );
+            cost_function->AddParameterBlock(1);
+            cost_function->AddParameterBlock(1);
+            cost_function->AddParameterBlock(1);
+            cost_function->SetNumResiduals(3);
+            data_blocks.push_back(problem.AddResidualBlock(
+              cost_function, NULL,
+              z_value.data()+j,
+              z_value.data()+pixel_index_map[left_idx],
+              z_value.data()+pixel_index_map[up_idx]));
+          }
+        }
+
+        mean_dz_val /= mean_dz_count;
+        SFS_LOG(Debug, Depth) << "mean dz = " << mean_dz_val;
+
+        // integrability term
+        for(int j = 0; j < num_constraints; ++j) {
+          int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+          int pidx = r * num_cols + c;
+          if(c < 1 || r < 1 || c >= num_cols || r >= num_rows) continue;
+
+          int left_idx = pidx - 1;
+          int up_idx = pidx - num_cols;
+          int up_left_idx = pidx - num_cols - 1;
+          int up_up_idx = pidx - num_cols - num_cols;
+          int left_left_idx = pidx - 2;
+
+          if(is_valid_pixel[left_idx] && is_valid_pixel[up_idx]
+             && is_valid_pixel[up_left_idx]
+             && is_valid_pixel[up_up_idx] && is_valid_pixel[left_left_idx]) {
+
+            cv::Vec2d depth_ij = state.xy_map(r, c);
+            cv::Vec2d depth_ij_l = state.xy_map(r, c-1);
+            cv::Vec2d depth_ij_u = state.xy_map(r-1, c);
+            double dx = -fabs(depth_ij[0] - depth_ij_l[0]);
+            double dy = -fabs(depth_ij_u[1] - depth_ij[1]);
+
+            bool boundary_pixel = is_boundary[pidx];
+
+            ceres::DynamicNumericDiffCostFunction<DepthMapIntegrabilityTerm>
+              *cost_function =
+                new ceres::DynamicNumericDiffCostFunction<DepthMapIntegrabilityTerm>(
+                  new DepthMapIntegrabilityTerm(dx, dy, boundary_pixel?0:w_integrability));
+            cost_function->AddParameterBlock(1);
+            cost_function->AddParameterBlock(1);
+            cost_function->AddParameterBlock(1);
+            cost_function->AddParameterBlock(1);
+            cost_function->AddParameterBlock(1);
+            cost_function->AddParameterBlock(1);
+            cost_function->SetNumResiduals(1);
+
+            integrability_blocks.push_back(problem.AddResidualBlock(
+              cost_function, NULL,
+              z_value.data()+j,
+              z_value.data()+pixel_index_map[left_idx],
+              z_value.data()+pixel_index_map[up_idx],
+              z_value.data()+pixel_index_map[up_left_idx],
+              z_value.data()+pixel_index_map[up_up_idx],
+              z_value.data()+pixel_index_map[left_left_idx]));
+          }
+        }
+
+        // regularization term
+        for(int j = 0; j < num_constraints; ++j) {
+          int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+          int pidx = r * num_cols + c;
+
+          vector<pair<int, double>> reginfo;
+          for(auto p : state.LoG_coeffs_perpixel[pidx]) {
+            if(is_valid_pixel[p.first]) reginfo.push_back(p);
+          }
+          if(reginfo.empty()) continue;
+          else {
+            double z_LoG_j = state.depth_map_ref_LoG_i(pidx);
+
+            ceres::DynamicNumericDiffCostFunction<DepthMapRegularizationTerm> *cost_function =
+              new ceres::DynamicNumericDiffCostFunction<DepthMapRegularizationTerm>(
+                new DepthMapRegularizationTerm(reginfo, z_LoG_j, w_reg)
+              );
+
+            cost_function->SetNumResiduals(1);
+            for(auto ri : reginfo) {
+              cost_function->AddParameterBlock(1);
+            }
+
+            vector<double*> params_ptrs;
+            for(auto ri : reginfo) {
+              params_ptrs.push_back(z_value.data()+pixel_index_map[ri.first]);
+            }
+            reg_blocks.push_back(problem.AddResidualBlock(cost_function, NULL, params_ptrs));
+          }
+        }
+      }
+      SFS_LOG(Debug, Depth) << "done.";
+
+      SFS_LOG(Debug, Depth) << "Solving non-linear least squares ...";
+      {
+        TraceSpan solve_span("ceres_solve");
+        ceres::Solver::Options options;
+        options.max_num_iterations = global_settings.depth.optimization_max_iters;
+        options.num_threads = context.solver_threads;
+        options.num_linear_solver_threads = context.solver_threads;
+
+        options.initial_trust_region_radius = global_settings.depth.optimization_init_tr_radius;
+
+        // ceres returns the best depth found when it runs out of time
+        if(context.deadline) options.max_solver_time_in_seconds = max(context.deadline->Remaining(), 0.0);
+
+        options.min_lm_diagonal = 1.0;
+        options.max_lm_diagonal = 1.0;
+
+        // ceres prints its progress itself, only let it when it would be logged
+        options.minimizer_progress_to_stdout = SFSLog::Enabled(SFSLogLevel::Trace, SFSLogModule::Depth);
+        ceres::Solver::Summary summary;
+        ceres::Solve(options, &problem, &summary);
+        SFS_LOG(Debug, Depth) << summary.BriefReport();
+        state.depth_cost_reduction = summary.initial_cost > 0?
+          (summary.initial_cost - summary.final_cost) / summary.initial_cost : 0;
+        solve_span.SetArg("iterations", summary.iterations.size())
+                  .SetArg("initial_cost", summary.initial_cost)
+                  .SetArg("final_cost", summary.final_cost);
+        TraceCounter("depth.ceres_iterations", summary.iterations.size());
+
+        SFSMetrics& metrics = SFSMetrics::Instance();
+        metrics.Observe("sfs_ceres_solve_seconds", summary.total_time_in_seconds);
+        metrics.Increment("sfs_ceres_iterations_total", summary.iterations.size());
+        // every iteration evaluates all the residuals once
+        metrics.Increment("sfs_ceres_residual_evaluations_total",
+                          static_cast<double>(summary.num_residuals) * summary.iterations.size());
+        metrics.Increment("sfs_ceres_residual_evaluation_seconds_total",
+                          summary.residual_evaluation_time_in_seconds
+                          + summary.jacobian_evaluation_time_in_seconds);
+
+        // energy of each term at the solution, one more residual evaluation
+        auto term_energy = [&](const vector<ceres::ResidualBlockId>& blocks) {
+          // no blocks would evaluate the whole problem
+          if(blocks.empty()) return 0.0;
+          ceres::Problem::EvaluateOptions evaluate_options;
+          evaluate_options.residual_blocks = blocks;
+          evaluate_options.num_threads = context.solver_threads;
+          double cost = 0;
+          problem.Evaluate(evaluate_options, &cost, nullptr, nullptr, nullptr);
+          return 2 * cost;
+        };
+        state.energy.depth_data = term_energy(data_blocks);
+        state.energy.depth_integrability = term_energy(integrability_blocks);
+        state.energy.depth_reg = term_energy(reg_blocks);
+      }
+
+      // update depth map
+      for(int j=0;j<num_constraints;++j) {
+        int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+        state.zmap.at<float>(r, c) = z_value(j);
+      }
+
+      // update normal map
+      for(int j=0;j<num_constraints;++j) {
+        int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+        int pidx = r * num_cols + c;
+        if (is_valid_pixel[pidx-1] && is_valid_pixel[pidx-num_cols]) {
+
+          cv::Vec2d depth_ij = state.xy_map(r, c);
+          cv::Vec2d depth_ij_l = state.xy_map(r, c-1);
+          cv::Vec2d depth_ij_u = state.xy_map(r-1, c);
+          double dx = -fabs(depth_ij[0] - depth_ij_l[0]);
+          double dy = -fabs(depth_ij_u[1] - depth_ij[1]);
+
+          double p = (state.zmap.at<float>(r, c) - state.zmap.at<float>(r, c-1)) / dx;
+          double q = (state.zmap.at<float>(r-1, c) - state.zmap.at<float>(r, c)) / dy;
+
+          double N = p * p + q * q + 1;
+          state.normal_map.Set(r, c, cv::Vec3d(p/N, q/N, 1/N));
+        }
+      }
+    }
+
+    SFS_LOG(Debug, Depth) << "done.";
+
+    // ====================================================================
+    // [Optional] output result of estimated lighting
+    // ====================================================================
+    if(!context.ShouldWrite(SFSOutputLevel::PerIteration)) continue;
+
+    TraceSpan write_span("write_depth_images");
+    QImage normal_image(num_cols, num_rows, QImage::Format_ARGB32);
+    QImage image_with_albedo_normal_lighting(num_cols, num_rows, QImage::Format_ARGB32);
+    QImage image_error(num_cols, num_rows, QImage::Format_ARGB32);
+    QImage integrability_image(num_cols, num_rows, QImage::Format_ARGB32);
+    QImage smoothness_image(num_cols, num_rows, QImage::Format_ARGB32);
+    QImage theta_image(num_cols, num_rows, QImage::Format_ARGB32);
+    QImage phi_image(num_cols, num_rows, QImage::Format_ARGB32);
+
+    normal_image.fill(0);
+    image_with_albedo_normal_lighting.fill(0);
+    image_error.fill(0);
+    integrability_image.fill(0);
+    smoothness_image.fill(0);
+    theta_image.fill(0);
+    phi_image.fill(0);
+
+    for (int y = 0; y < num_rows; ++y) {
+      for (int x = 0; x < num_cols; ++x) {
+        cv::Vec3d pix_albedo = state.albedo(y, x);
+        float zval = state.zmap.at<float>(y, x);
+        if (zval < -1e5) {
+          continue;
+        }
+        else {
+          cv::Vec3d pix = state.normal_map(y, x);
+          double nx = pix[0], ny = pix[1], nz = pix[2];
+          double theta, phi;
+          tie(theta, phi) = normal2sphericalcoords(nx, ny, nz);
+
+          VectorXd Y_ij = sphericalharmonics(nx, ny, nz);
+
+          normal_image.setPixel(x, y, qRgb((nx+1)*0.5*255.0,
+                                           (ny+1)*0.5*255.0,
+                                           (nz+1)*0.5*255.0));
+
+          cv::Vec3d rho = pix_albedo;
+          double LdotY = state.lighting_coeffs.transpose() * Y_ij;
+          cv::Vec3d pix_val = cv::Vec3d(rho(0), rho(1), rho(2));
+          pix_val *= 255.0 * LdotY;
+
+          image_with_albedo_normal_lighting.setPixel(x, y, qRgb(clamp<double>(pix_val[0], 0, 255),
+                                                                clamp<double>(pix_val[1], 0, 255),
+                                                                clamp<double>(pix_val[2], 0, 255)));
+
+          auto pix_ij = bundle.image.pixel(x, y);
+          cv::Vec3d pix_diff(fabs(pix_val(0) - qRed(pix_ij)),
+                             fabs(pix_val(1) - qGreen(pix_ij)),
+                             fabs(pix_val(2) - qBlue(pix_ij)));
+          image_error.setPixel(x, y, qRgb(pix_diff(0), pix_diff(1), pix_diff(2)));
+
+          cv::Vec3d pix_u = state.normal_map(y-1, x);
+          double nx_u, ny_u, nz_u;
+          nx_u = pix_u[0]; ny_u = pix_u[1]; nz_u = pix_u[2];
+          double theta_u, phi_u;
+          tie(theta_u, phi_u) = normal2sphericalcoords(nx_u, ny_u, nz_u);
+
+          cv::Vec3d pix_l = state.normal_map(y, x-1);
+          double nx_l, ny_l, nz_l;
+          nx_l = pix_l[0]; ny_l = pix_l[1]; nz_l = pix_l[2];
+          double theta_l, phi_l;
+          tie(theta_l, phi_l) = normal2sphericalcoords(nx_l, ny_l, nz_l);
+
+          auto round_off = [](double val, double eps) {
+            if(fabs(val) < eps) {
+              return val>0?eps:-eps;
+            } else return val;
+          };
+          double nxnz = nx / round_off(nz, 1e-16);
+          double nynz = ny / round_off(nz, 1e-16);
+          double nxnz_u = nx_u / round_off(nz_u, 1e-16);
+          double nynz_l = ny_l / round_off(nz_l, 1e-16);
+          double integrability_val = fabs((nxnz_u - nxnz) - (nynz - nynz_l));
+          integrability_image.setPixel(x, y, jet_color_QRgb(integrability_val * 10.0));
+
+          double smoothness_val = (theta - theta_u) * (theta - theta_u) + (theta - theta_l) * (theta - theta_l)
+                                + (phi - phi_u) * (phi - phi_u) + (phi - phi_l) * (phi - phi_l);
+          smoothness_image.setPixel(x, y, jet_color_QRgb(smoothness_val * 2.0));
+
+          // [0, pi], [-pi, pi]
+          double theta_ratio = clamp<double>(theta * 2.0 / 3.1415926535897, 0, 1);
+          theta_image.setPixel(x, y, jet_color_QRgb(theta_ratio));
+
+          double phi_ratio = clamp<double>((phi + 3.1415926535897)*0.5/3.1415926535897, 0, 1);
+          phi_image.setPixel(x, y, jet_color_QRgb(phi_ratio));
+        }
+      }
+    }
+    context.WriteImage("normal_opt_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", normal_image);
+    context.WriteImage("normal_opt_lighting_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", image_with_albedo_normal_lighting);
+    context.WriteImage("error_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", image_error);
+    context.WriteImage("integrability_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", integrability_image);
+    context.WriteImage("smoothness_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", smoothness_image);
+    context.WriteImage("theta_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", theta_image);
+    context.WriteImage("phi_" + std::to_string(i) + "_" + std::to_string(iters) + ".png", phi_image);
+  }
+}
+
+void SFSExportStage::Run(const ImageBundle& bundle, SFSImageState& state) {
+  // the export only writes files
+  if(!context.ShouldWrite(SFSOutputLevel::Final)) return;
+
+  const fs::path& results_path = context.results_path;
+  const int i = state.index;
+
+  TraceSpan span("export");
+  span.SetArg("image", i);
+  ScopedLatency latency("sfs_stage_seconds", MetricLabel("stage", "export"));
+
+  SFS_LOG(Info, Export) << "[Shape from shading] Depth recovery.";
+  const int num_cols = bundle.image.width(), num_rows = bundle.image.height();
+
+  // ====================================================================
+  // collect valid pixels
+  // ====================================================================
+  vector<glm::ivec2> pixel_indices_i;
+  for (int y = 0; y < num_rows; ++y) {
+    for (int x = 0; x < num_cols; ++x) {
+      if (state.depth_map_ref.at<MapScalar>(y, x) > -1e5) {
+        pixel_indices_i.push_back(glm::ivec2(y, x));
+      }
+    }
+  }
+
+  const int num_constraints = pixel_indices_i.size();
+
+  glm::dmat4 Rmat_inv = glm::eulerAngleZ(-bundle.params.params_model.R[2])
+                      * glm::eulerAngleX(-bundle.params.params_model.R[1])
+                      * glm::eulerAngleY(-bundle.params.params_model.R[0]);
+
+  vector<glm::dvec3> depth_final;
+  vector<glm::dvec3> depth_final_raw;
+  for(int j=0;j<num_constraints;++j) {
+    int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+    cv::Vec2d xy = state.xy_map(r, c);
+
+    float d_j = state.zmap.at<float>(r, c);
+
+    glm::dvec3 pt = glm::vec3(xy[0], xy[1], d_j);
+    depth_final.push_back(pt);
+
+    glm::dvec4 pt0 =  Rmat_inv * glm::dvec4(pt.x, pt.y, pt.z, 1.0);
+    depth_final_raw.push_back(glm::dvec3(pt0.x, pt0.y, pt0.z));
+  }
+
+  // write out the new depth map
+  {
+    ofstream fout( (results_path / fs::path("point_cloud_opt" + std::to_string(i) + ".txt")).string() );
+    for(auto p : depth_final) {
+      fout << p.x << ' ' << p.y << ' ' << p.z << endl;
+    }
+    fout.close();
+  }
+
+  {
+    ofstream fout( (results_path / fs::path("point_cloud_opt_raw" + std::to_string(i) + ".txt")).string() );
+    for(auto p : depth_final_raw) {
+      fout << p.x << ' ' << p.y << ' ' << p.z << endl;
+    }
+    fout.close();
+  }
+
+  // write out the depth mesh
+  vector<int> depth_node_map(num_rows * num_cols, -1);
+  for(int j=0;j<num_constraints;++j) {
+    int r = pixel_indices_i[j].x, c = pixel_indices_i[j].y;
+    depth_node_map[r*num_cols+c] = j + 1;
+  }
+
+  WriteDepthMesh((results_path / fs::path("point_cloud_opt" + std::to_string(i) + ".obj")).string(),
+                 depth_final, pixel_indices_i, depth_node_map, num_rows, num_cols);
+  WriteDepthMesh((results_path / fs::path("point_cloud_opt_raw" + std::to_string(i) + ".obj")).string(),
+                 depth_final_raw, pixel_indices_i, depth_node_map, num_rows, num_cols);
+}
+
+void SFSPipeline::GenerateMeanTexture(const SFSImageSource& images, SFSContext& context,
+                                      const FaceIndicesCallback& store_face_indices) {
+  // opened first so that the texture buffers are part of its memory
+  TraceSpan span("mean_texture");
+  ScopedLatency latency("sfs_stage_seconds", MetricLabel("stage", "mean_texture"));
+  const int tex_size = resources.options.tex_size;
+
+  vector<vector<glm::dvec3>> mean_texture(tex_size, vector<glm::dvec3>(tex_size, glm::dvec3(0, 0, 0)));
+  cv::Mat mean_texture_mat(tex_size, tex_size, CV_64FC3);
+  vector<vector<double>> mean_texture_weight(tex_size, vector<double>(tex_size, 0));
+
+  // Collect texture information from each input (image, mesh) pair to obtain mean texture
+  json mean_texture_options = settings.mean_texture_options;
+  mean_texture_options["use_blendshapes"] = resources.options.use_blendshapes;
+  mean_texture_options["core_face_region_filename"] = resources.paths.core_face_region_filename;
+  mean_texture_options["symmetric_texture"] = true;
+  mean_texture_options["write_textures"] = context.ShouldWrite(SFSOutputLevel::Final);
+  mean_texture_options["write_debug_images"] = context.ShouldWrite(SFSOutputLevel::Debug);
+
+  // the albedo maps are only needed to build a new mean texture
+  static const vector<vector<PixelInfo>> no_pixel_map;
+  const bool generate_mean_texture = mean_texture_options.value("generate_mean_texture", false);
+  context.mean_texture_image = ::GenerateMeanTexture(
+    images.size(),
+    [&images](int i) { return images.Load(i); },
+    store_face_indices,
+    [this](const ReconstructionResult& params) { resources.ApplyParams(params); },
+    resources.mesh(),
+    tex_size,
+    generate_mean_texture? resources.albedo_pixel_map() : no_pixel_map,
+    mean_texture,
+    mean_texture_weight,
+    mean_texture_mat,
+    resources.paths.mean_albedo_filename,
+    context.results_path,
+    mean_texture_options.dump()
+  );
+}
+
+void SFSPipeline::Solve(const ImageBundle& bundle, SFSImageState& state, SFSContext& job_context) {
+  TraceSpan span("solve");
+  span.SetArg("image", state.index);
+  ScopedLatency latency("sfs_solve_seconds");
+
+  // Anytime mode: the budget of the image starts now, the stages see it
+  // through their context
+  SFSDeadline deadline(job_context.settings.deadline.seconds_per_image);
+  SFSContext context = job_context;
+  if(context.settings.deadline.seconds_per_image > 0) context.deadline = &deadline;
+
+  // ====================================================================
+  // coarse-to-fine: solve subsampled copies of the image first, each one
+  // starting from the solution of the previous level
+  // ====================================================================
+  const SFSPyramidSettings& pyramid_settings = context.settings.pyramid;
+  const int num_levels = pyramid_settings.num_levels;
+  const int min_level_size = pyramid_settings.min_level_size;
+
+  // The coarse levels are not checkpointed or cached, they are only needed if
+  // the full resolution iterations have to be recomputed from the start
+  const bool restorable =
+    (context.resume && context.checkpoints
+     && context.checkpoints->HasStage(state.index, bundle.filename, 1, SFSCheckpointStore::Lighting))
+    || (context.cache
+        && context.cache->HasStage(StageCacheKey(state, context, 1, SFSCheckpointStore::Lighting)));
+
+  SFSImageState coarse_state;
+  int coarse_scale = 0;
+  if(num_levels > 1 && !restorable) {
+    SFSContext level_context = context;
+    level_context.settings.max_iters = pyramid_settings.coarse_iters;
+    level_context.checkpoints = nullptr;
+    level_context.resume = false;
+    level_context.cache = nullptr;
+    level_context.output_level = min(context.output_level, SFSOutputLevel::Final);
+
+    for(int level=num_levels-1;level>0;--level) {
+      const int scale = 1 << level;
+      if(min(bundle.image.width(), bundle.image.height()) / scale < min_level_size) continue;
+      if(context.deadline && context.deadline->Expired()) break;
+
+      TraceSpan level_span("pyramid_level");
+      level_span.SetArg("image", state.index).SetArg("level", level);
+      SFS_LOG(Info, Pipeline) << "Pyramid level " << level << " (1/" << scale << " resolution)";
+
+      ImageBundle level_bundle = DownsampleImageBundle(bundle, scale);
+      SFSImageState level_state = DownsampleImageState(state, scale);
+      SFSPrepareStage(level_context).PrepareSolver(level_bundle, level_state);
+      if(coarse_scale > 0) UpsampleSolution(coarse_state, coarse_scale, level_state, scale);
+      Iterate(level_bundle, level_state, level_context);
+
+      coarse_state = std::move(level_state);
+      coarse_scale = scale;
+    }
+  }
+
+  // The reference maps of the full resolution state must be untouched until
+  // its solver is prepared, the working maps share their planes.
+  SFSPrepareStage(context).PrepareSolver(bundle, state);
+  if(coarse_scale > 0) {
+    UpsampleSolution(coarse_state, coarse_scale, state, 1);
+    coarse_state = SFSImageState();
+  }
+
+  Iterate(bundle, state, context);
+  if(context.deadline) span.SetArg("seconds", context.deadline->Elapsed());
+}
+
+void SFSPipeline::Iterate(const ImageBundle& bundle, SFSImageState& state, SFSContext& context) {
+  SFSLightingStage lighting_stage(context);
+  SFSAlbedoStage albedo_stage(context);
+  SFSDepthStage depth_stage(context);
+
+  SFS_LOG(Info, Pipeline) << "Shape from shading ...";
+  const SFSSettings& global_settings = context.settings;
+  const int max_iters = global_settings.max_iters;
+  int iters = 0;
+
+  // Replay the checkpoints in execution order until the first missing one,
+  // then the cached results the same way. Everything after that is
+  // recomputed. Cached stages are checkpointed too, so that an interrupted
+  // job resumes from them.
+  //
+  // With a deadline, a stage is only started if it is expected to finish in
+  // time, judging from how long it took in the previous iteration. A stage
+  // cut short by the deadline is neither checkpointed nor cached, its result
+  // differs from a complete run.
+  const char* stage_names[] = {"lighting", "albedo", "depth"};
+  double stage_seconds[] = {0, 0, 0};
+  bool out_of_time = false;
+  bool resuming = context.resume && context.checkpoints;
+  bool cached = context.cache != nullptr;
+  auto run_stage = [&](SFSCheckpointStore::Stage stage, SFSIterationStage& step) {
+    if(out_of_time) return;
+    if(context.deadline && !context.deadline->Allows(stage_seconds[stage])) {
+      SFS_LOG(Info, Pipeline) << "Image " << state.index << " out of time before the "
+                              << stage_names[stage] << " stage of iteration " << iters;
+      out_of_time = true;
+      return;
+    }
+
+    TraceSpan stage_span(stage_names[stage]);
+    stage_span.SetArg("image", state.index).SetArg("iteration", iters);
+    if(resuming && context.checkpoints->LoadStage(state.index, bundle.filename, iters, stage, state)) {
+      stage_span.SetArg("restored", true);
+      return;
+    }
+    resuming = false;
+
+    const uint64_t cache_key = context.cache? StageCacheKey(state, context, iters, stage) : 0;
+    if(cached && context.cache->LoadStage(cache_key, stage, state)) {
+      stage_span.SetArg("cached", true);
+    } else {
+      cached = false;
+      const SFSDeadline::Clock::time_point stage_start = SFSDeadline::Clock::now();
+      step.Run(bundle, state, iters);
+      stage_seconds[stage] = std::chrono::duration<double>(SFSDeadline::Clock::now() - stage_start).count();
+      SFSMetrics::Instance().Observe("sfs_stage_seconds", stage_seconds[stage],
+                                     MetricLabel("stage", stage_names[stage]));
+      if(context.deadline && context.deadline->Expired()) {
+        stage_span.SetArg("deadline", true);
+        out_of_time = true;
+        return;
+      }
+      if(context.cache) context.cache->SaveStage(cache_key, stage, state);
+    }
+    if(context.checkpoints) context.checkpoints->SaveStage(state.index, bundle.filename, iters, stage, state);
+  };
+
+  // An iteration that changes lighting, albedo and depth less than the
+  // enabled thresholds ends the loop. The changes are measured around the
+  // stages, so they are the same whether a stage was computed or restored.
+  const SFSConvergenceSettings& convergence = global_settings.convergence;
+  const bool test_convergence = convergence.lighting_change > 0 || convergence.albedo_change > 0
+                                || convergence.depth_cost_reduction > 0;
+
+  // Energy of the terms after each iteration, printed once the loop ends so
+  // that the tables of images solved concurrently do not interleave
+  vector<pair<int, SFSEnergy>> energy_log;
+
+  // [Shape from shading] main loop
+  while(iters++ < max_iters && !out_of_time){
+    SFS_LOG(Info, Pipeline) << "iteration " << iters;
+    TraceSpan iteration_span("iteration");
+    iteration_span.SetArg("iteration", iters);
+    state.energy = SFSEnergy();
+
+    const VectorXd previous_lighting = state.lighting_coeffs;
+    vector<cv::Vec3d> previous_albedo;
+    if(convergence.albedo_change > 0) previous_albedo = SampleFaceAlbedo(state);
+
+    // [Shape from shading] step 1: fix albedo and normal map, estimate lighting coefficients
+    run_stage(SFSCheckpointStore::Lighting, lighting_stage);
+
+    // [Shape from shading] step 2: fix depth and lighting, estimate albedo
+    run_stage(SFSCheckpointStore::Albedo, albedo_stage);
+
+    // [Shape from shading] step 3: fix albedo and lighting, estimate normal map
+    run_stage(SFSCheckpointStore::Depth, depth_stage);
+
+    energy_log.push_back(make_pair(iters, state.energy));
+    iteration_span.SetArg("energy", state.energy.ToJson());
+
+    if(!test_convergence || out_of_time) continue;
+    const double lighting_change = RelativeChange(previous_lighting, state.lighting_coeffs);
+    const double albedo_change = convergence.albedo_change > 0?
+      RelativeChange(previous_albedo, SampleFaceAlbedo(state)) : 0;
+    iteration_span.SetArg("lighting_change", lighting_change)
+                  .SetArg("albedo_change", albedo_change)
+                  .SetArg("depth_cost_reduction", state.depth_cost_reduction);
+
+    const bool converged = (convergence.lighting_change <= 0 || lighting_change < convergence.lighting_change)
+      && (convergence.albedo_change <= 0 || albedo_change < convergence.albedo_change)
+      && (convergence.depth_cost_reduction <= 0 || state.depth_cost_reduction < convergence.depth_cost_reduction);
+    if(converged) {
+      SFS_LOG(Info, Pipeline) << "Image " << state.index << " converged after "
+                              << iters << " iterations";
+      break;
+    }
+  }
+
+  if(!energy_log.empty()) SFS_LOG(Info, Pipeline) << EnergyTable(state.index, energy_log);
+}
+
+uint64_t SFSPipeline::PrepareFingerprint() const {
+  json inputs;
+  inputs["mean_texture_options"] = settings.mean_texture_options;
+  inputs["use_blendshapes"] = resources.options.use_blendshapes;
+  inputs["blendshapes_path"] = resources.options.blendshapes_path;
+  inputs["subdivision_depth"] = resources.options.subdivision_depth;
+  inputs["tex_size"] = resources.options.tex_size;
+  inputs["use_template_geometry"] = resources.options.use_template_geometry;
+  // the prepared maps are stored in MapScalar
+  inputs["map_scalar_size"] = sizeof(MapScalar);
+  return HashString(inputs.dump());
+}
+
+uint64_t SFSPipeline::SolveFingerprint() const {
+  // settings that do not change the results
+  json solve_settings = settings.ToJson();
+  solve_settings.erase("parallel");
+  solve_settings.erase("preparation_only");
+  solve_settings.erase("trace");
+  solve_settings.erase("output");
+  solve_settings.erase("cache");
+  solve_settings.erase("deadline");
+  solve_settings.erase("metrics");
+  solve_settings.erase("log");
+  solve_settings.erase("handoff");
+  return HashString(solve_settings.dump(), PrepareFingerprint());
+}
+
+uint64_t SFSPipeline::MeanTextureKey(const vector<uint64_t>& bundle_hashes) const {
+  uint64_t key = HashString(SFSCodeVersion(), PrepareFingerprint());
+  // the mean texture is read from a file, or refined with the core face region
+  key = HashCombine(key, HashFile(resources.paths.mean_albedo_filename));
+  key = HashCombine(key, HashFile(resources.paths.core_face_region_filename));
+  for(auto h : bundle_hashes) key = HashCombine(key, h);
+  return key;
+}
+
+void SFSPipeline::LoadOrGenerateMeanTexture(const SFSImageSource& images, SFSContext& context,
+                                            uint64_t cache_key, const vector<uint64_t>& prepare_keys,
+                                            const FaceIndicesCallback& store_face_indices) {
+  bool cached = context.cache && context.cache->LoadMeanTexture(cache_key, context.mean_texture_image);
+  for(int i=0;i<images.size() && cached;++i) {
+    vector<int> face_indices_map;
+    cached = context.cache->LoadFaceIndices(prepare_keys[i], face_indices_map);
+    if(cached) store_face_indices(i, std::move(face_indices_map));
+  }
+
+  if(cached) {
+    SFS_LOG(Info, MeanTexture) << "Loaded the mean texture from the cache";
+    // only the texture used by the solver is cached, a generated texture is
+    // the refined one
+    if(context.ShouldWrite(SFSOutputLevel::Final) && !context.mean_texture_image.isNull()) {
+      const bool generated = settings.mean_texture_options.value("generate_mean_texture", false);
+      context.WriteImage(generated? "mean_texture_refined.png" : "mean_texture.png", context.mean_texture_image);
+    }
+    return;
+  }
+
+  // The maps stored above are replaced as the images are rendered again
+  GenerateMeanTexture(images, context, [&](int i, vector<int> face_indices_map) {
+    if(context.cache) context.cache->SaveFaceIndices(prepare_keys[i], face_indices_map);
+    store_face_indices(i, std::move(face_indices_map));
+  });
+  if(context.cache) context.cache->SaveMeanTexture(cache_key, context.mean_texture_image);
+}
+
+void SFSPipeline::Run(const SFSImageSource& images, const fs::path& results_path) {
+  // Create SFS results directory
+  fs::create_directories(results_path);
+
+  SFSContext context(resources, settings, results_path);
+
+  ApplyLogSettings(settings.log);
+
+  // The preparation runs on this thread and can use the whole budget
+  const ThreadBudget thread_budget(settings.parallel.num_threads);
+  DisableNestedParallelism();
+  ScopedThreadLimit job_thread_limit(thread_budget.total());
+
+  const bool trace_enabled = settings.trace.enabled;
+  Tracer::Instance().Enable(trace_enabled);
+  Tracer::Instance().EnableMemory(settings.trace.memory);
+  Tracer::Instance().Clear();
+  ScopedTraceWriter trace_writer(
+    trace_enabled? (results_path / fs::path(settings.trace.filename)).string() : string());
+  TraceSpan span("job");
+  span.SetArg("num_images", images.size());
+
+  SFSCheckpointStore checkpoints(results_path / fs::path("checkpoints"),
+                                 PrepareFingerprint(),
+                                 SolveFingerprint());
+  context.checkpoints = &checkpoints;
+  context.resume = resume;
+
+  // The preparation only mode is run for the maps it writes out, the
+  // prepared maps are not taken from the cache there
+  unique_ptr<SFSResultCache> cache;
+  if(!settings.cache.path.empty()) cache.reset(new SFSResultCache(settings.cache.path));
+  context.cache = cache.get();
+  context.solve_key = HashString(SFSCodeVersion(), SolveFingerprint());
+  const bool use_cached_preparation = cache && !settings.preparation_only;
+
+  context.output_level = settings.output.level;
+  AsyncImageWriter image_writer(settings.output.writer_threads, settings.output.png_compression);
+  context.image_writer = &image_writer;
+
+  // The metrics outlive the job, the file covers every job of the process
+  unique_ptr<MetricsFileWriter> metrics_writer;
+  if(!settings.metrics.path.empty()) {
+    metrics_writer.reset(new MetricsFileWriter(settings.metrics.path, settings.metrics.format,
+                                               settings.metrics.interval_seconds));
+  }
+
+  // [Shape from shading] initialization
+  const int num_images = images.size();
+  vector<SFSImageState> states(num_images);
+  // Loaded when the image is prepared, released once it is exported
+  vector<ImageBundle> bundles(num_images);
+
+  // Content keys of the mean texture and of the prepared maps of each image
+  uint64_t mean_texture_key = 0;
+  vector<uint64_t> prepare_keys(num_images, 0);
+  if(cache) {
+    TraceSpan hash_span("hash_inputs");
+    vector<uint64_t> bundle_hashes(num_images);
+    // a streamed image is read here only for its hash
+    #pragma omp parallel for if(!images.streamed())
+    for(int i=0;i<num_images;++i) bundle_hashes[i] = HashImageBundle(images.Load(i));
+    mean_texture_key = MeanTextureKey(bundle_hashes);
+    for(int i=0;i<num_images;++i) prepare_keys[i] = HashCombine(mean_texture_key, bundle_hashes[i]);
+  }
+
+  // Prepared maps handed over in shared memory: published by the preparation
+  // only mode, attached by a solving run
+  const string& shm_prefix = settings.handoff.shm_prefix;
+  const bool attach_shared_maps = !shm_prefix.empty() && !settings.preparation_only;
+  vector<SharedMapsReader> shared_maps(num_images);
+  auto shared_maps_fingerprint = [&](int i) { return HashString(images.filename(i), PrepareFingerprint()); };
+
+  // The mean texture is only needed to prepare the images, skip it if all of
+  // them can be restored
+  bool all_prepared = resume || use_cached_preparation || attach_shared_maps;
+  for(int i=0;i<num_images && all_prepared;++i) {
+    all_prepared &= (resume && checkpoints.HasPrepared(first_index + i, images.filename(i)))
+                    || (use_cached_preparation && cache->HasPrepared(prepare_keys[i]))
+                    || (attach_shared_maps && HasSharedMaps(SharedMapsName(shm_prefix, first_index + i),
+                                                            shared_maps_fingerprint(i)));
+  }
+
+  FaceIndexMaps face_indices_maps(
+    num_images, settings.parallel.streaming? results_path / fs::path("face_indices") : fs::path());
+  if(!all_prepared) {
+    LoadOrGenerateMeanTexture(images, context, mean_texture_key, prepare_keys,
+                              [&face_indices_maps](int i, vector<int> face_indices_map) {
+                                face_indices_maps.Put(i, std::move(face_indices_map));
+                              });
+  }
+
+  // Renders on this thread, which owns the GL context
+  SFSPrepareStage prepare_stage(context);
+  // bundles[i] is loaded by the caller
+  auto prepare = [&](int i) {
+    const string& filename = images.filename(i);
+    states[i].index = first_index + i;
+    states[i].image_index = get_image_index(filename);
+    states[i].cache_key = prepare_keys[i];
+    if(resume && checkpoints.LoadPrepared(states[i].index, filename, states[i])) {
+      SFS_LOG(Info, Prepare) << "Restored prepared image " << filename;
+      return;
+    }
+    const string shm_name = SharedMapsName(shm_prefix, states[i].index);
+    if(attach_shared_maps && shared_maps[i].Attach(shm_name, shared_maps_fingerprint(i))
+       && ReadPreparedFields(shared_maps[i], states[i])) {
+      SFS_LOG(Info, Prepare) << "Attached prepared image " << filename << " from " << shm_name;
+      // handed over, the mapping stays valid until it is detached
+      RemoveSharedMaps(shm_name);
+    } else if(use_cached_preparation && cache->LoadPrepared(prepare_keys[i], states[i])) {
+      SFS_LOG(Info, Prepare) << "Loaded prepared image " << filename << " from the cache";
+    } else {
+      shared_maps[i].Detach();
+      states[i].face_indices_map = face_indices_maps.Take(i);
+      prepare_stage.Run(bundles[i], states[i]);
+      if(cache) cache->SavePrepared(prepare_keys[i], states[i]);
+    }
+    checkpoints.SavePrepared(states[i].index, filename, states[i]);
+  };
+
+  if (settings.preparation_only) {
+    // HACK In preparation only mode, we only generate initial normal map,
+    // albedo, depth map and point clouds. The actual SFS is done in a separate
+    // program.
+    json shared_maps_list = json::array();
+    for(int i=0;i<num_images;++i) {
+      bundles[i] = images.Load(i);
+      prepare(i);
+      if(!shm_prefix.empty()) {
+        const string shm_name = SharedMapsName(shm_prefix, states[i].index);
+        SharedMapsWriter writer(shared_maps_fingerprint(i));
+        WritePreparedFields(writer, states[i]);
+        if(writer.Publish(shm_name)) {
+          SFS_LOG(Info, Prepare) << "Published prepared image " << images.filename(i) << " as " << shm_name;
+          shared_maps_list.push_back({{"image", images.filename(i)}, {"index", states[i].index},
+                                      {"name", shm_name}, {"fingerprint", shared_maps_fingerprint(i)}});
+        } else {
+          SFS_LOG(Error, Prepare) << "Failed to publish " << shm_name;
+        }
+      }
+      bundles[i] = ImageBundle();
+      states[i] = SFSImageState();
+    }
+    // Lets other programs find the published maps
+    if(!shm_prefix.empty()) {
+      ofstream fout((results_path / fs::path("shared_maps.json")).string());
+      fout << shared_maps_list.dump(2) << endl;
+    }
+    SFSMetrics::Instance().Increment("sfs_jobs_total");
+    return;
+  }
+
+  // [Shape from shading] solve the images concurrently. Each image gets
+  // threads_per_image threads for its inner solvers, the rest of the thread
+  // budget is used to run more images at once.
+  const ThreadPlan thread_plan = thread_budget.Split(num_images, settings.parallel.threads_per_image);
+  const int num_workers = thread_plan.num_workers;
+  context.solver_threads = thread_plan.threads_per_worker;
+  span.SetArg("num_workers", num_workers);
+  span.SetArg("solver_threads", context.solver_threads);
+
+  // An image holds its share of the memory budget from its preparation until
+  // it is exported, so the budget bounds the prepared images held in memory
+  // as well as the solvers running at once.
+  const size_t memory_budget_mb = settings.parallel.memory_budget_mb;
+  MemoryBudget memory_budget(memory_budget_mb * 1024 * 1024);
+  vector<unique_ptr<MemoryBudget::Reservation>> reservations(num_images);
+
+  SFS_LOG(Info, Pipeline) << "Solving " << num_images << " images with " << num_workers << " workers, "
+                          << context.solver_threads << " solver threads each.";
+
+  // Render and solve as a pipeline: this thread prepares the images in
+  // order while the workers solve the ones already prepared. It runs at most
+  // render_ahead images ahead of the workers, which also bounds the number of
+  // prepared images held in memory. Its own work is mostly GL, one thread is
+  // left to it.
+  InFlightLimit in_flight(num_workers + settings.parallel.render_ahead);
+  ScopedThreadLimit render_thread_limit(1);
+
+  WorkStealingScheduler scheduler(num_workers);
+  for(int i=0;i<num_images;++i) {
+    {
+      TraceSpan wait_span("wait_for_solvers");
+      in_flight.Acquire();
+    }
+    bundles[i] = images.Load(i);
+    {
+      TraceSpan wait_span("wait_for_memory");
+      reservations[i].reset(new MemoryBudget::Reservation(memory_budget, EstimateSolveMemory(bundles[i])));
+    }
+    prepare(i);
+
+    // Solve on the face region only, the full size prepared maps are dropped
+    const ImageBundle& full_bundle = bundles[i];
+    cv::Rect region(0, 0, full_bundle.image.width(), full_bundle.image.height());
+    if(settings.roi.enabled) region = FaceRegion(states[i], settings.roi.padding);
+    const bool cropped = region.area() < full_bundle.image.width() * full_bundle.image.height();
+    if(cropped) {
+      TraceSpan crop_span("crop_face_region");
+      crop_span.SetArg("image", states[i].index).SetArg("width", region.width).SetArg("height", region.height);
+      states[i] = CropImageState(states[i], region);
+    }
+
+    scheduler.Submit([this, i, region, cropped, &bundles, &states, &shared_maps, &context, &reservations,
+                      &in_flight]() {
+      InFlightLimit::Releaser release(in_flight);
+      const unique_ptr<MemoryBudget::Reservation> reservation = std::move(reservations[i]);
+      const ImageBundle bundle = cropped? CropImageBundle(bundles[i], region) : bundles[i];
+      ScopedThreadLimit thread_limit(context.solver_threads);
+
+      Solve(bundle, states[i], context);
+      SFSMetrics::Instance().Increment("sfs_images_total");
+      SFSMetrics::Instance().Increment("sfs_pixels_total", states[i].valid_pixels_map.size());
+
+      // The export and the callback see the full image
+      if(cropped) {
+        states[i] = UncropImageState(states[i], region,
+                                     bundles[i].image.height(), bundles[i].image.width());
+      }
+
+      // Depth recovery
+      SFSExportStage(context).Run(bundles[i], states[i]);
+
+      if(result_callback) result_callback(bundles[i], states[i]);
+
+      // The results are on disk, drop the working set of this image
+      states[i] = SFSImageState();
+      bundles[i] = ImageBundle();
+      shared_maps[i].Detach();
+    });
+  }
+  scheduler.Wait();
+
+  if(cache) {
+    SFS_LOG(Info, Pipeline) << "Result cache: " << cache->hits() << " hits, "
+                            << cache->misses() << " misses";
+    span.SetArg("cache_hits", cache->hits()).SetArg("cache_misses", cache->misses());
+  }
+
+  {
+    TraceSpan flush_span("flush_images");
+    image_writer.Flush();
+  }
+  SFSMetrics::Instance().Increment("sfs_jobs_total");
+
+  if(Tracer::Instance().IsMemoryEnabled()) {
+    string report = "Peak RSS: " + to_string(static_cast<int>(ToMegabytes(PeakRSS()))) + " MB";
+    if(HeapProfilingEnabled()) {
+      report += ", peak heap: " + to_string(static_cast<int>(ToMegabytes(PeakProcessHeapBytes()))) + " MB";
+    }
+    SFS_LOG(Info, Pipeline) << report;
+  }
+
+  // the caller's output comes after the job's
+  SFSLog::Flush();
+}
+
+size_t SFSPipeline::EstimateSolveMemory(const ImageBundle& bundle) {
+  const size_t num_pixels = static_cast<size_t>(bundle.image.width()) * bundle.image.height();
+
+  // 5x5 LoG stencil, stored as triplets and per pixel pairs
+  const size_t LoG_bytes = 25 * (sizeof(SFSImageState::Tripletd) + sizeof(pair<int, double>));
+  // albedo system (A, AtA, factorization) and the ceres problem for depth
+  const size_t solver_bytes = 25 * 3 * sizeof(double) + 1024;
+  // reference and working maps, the LoG filtered references in double and
+  // the interleaved copies used while filtering
+  const size_t maps_bytes = 9 * sizeof(MapScalar) + sizeof(float) + 10 * sizeof(double);
+
+  return num_pixels * (LoG_bytes + solver_bytes + maps_bytes);
+}
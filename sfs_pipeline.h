@@ -0,0 +1,372 @@
+#ifndef FACESHAPEFROMSHADING_SFS_PIPELINE_H
+#define FACESHAPEFROMSHADING_SFS_PIPELINE_H
+
+#include "common.h"
+
+#include <limits>
+
+#include <opencv2/opencv.hpp>
+
+#include "sfs_cache.h"
+#include "sfs_checkpoint.h"
+#include "sfs_deadline.h"
+#include "sfs_maps.h"
+#include "sfs_output.h"
+#include "sfs_resources.h"
+#include "sfs_settings.h"
+#include "utils.h"
+
+struct SFSResourceOptions {
+  SFSResourceOptions()
+    : use_blendshapes(false), subdivision_depth(0), tex_size(2048),
+      generate_index_map(true), generate_pixel_map(true), use_map_cache(true),
+      use_template_geometry(false) {}
+
+  // Deform the template with FACS blendshapes instead of the multilinear model
+  bool use_blendshapes;
+  string blendshapes_path;
+
+  // Number of subdivisions applied to the template, must match the blendshapes
+  int subdivision_depth;
+
+  int tex_size;
+  bool generate_index_map;
+  bool generate_pixel_map;
+
+  // Load the index and pixel maps from the binary cache in map_cache_dir when
+  // one exists for this mesh, and create it otherwise. The directory of the
+  // albedo pixel map is used if map_cache_dir is empty.
+  bool use_map_cache;
+  string map_cache_dir;
+
+  // Keep the template geometry as loaded and only use the camera and pose of
+  // the reconstructions. Used for synthetic images rendered from the template.
+  bool use_template_geometry;
+};
+
+// Assets that only depend on the template mesh. Each one is loaded on first
+// use through the asset registry, so a job only pays for what it touches, and
+// they can be shared by any number of jobs run through the same SFSPipeline.
+class SFSResources {
+public:
+  SFSResources(const SFSResourcePaths& paths, const SFSResourceOptions& options);
+
+  // Deform the template mesh with the parameters of a reconstruction. Loads
+  // the multilinear model or the blendshapes, whichever is used.
+  void ApplyParams(const ReconstructionResult& params);
+
+  // Template mesh subdivided options.subdivision_depth times, deformed by the
+  // last ApplyParams
+  BasicMesh& mesh();
+  // Valid faces of mesh()
+  const vector<int>& valid_faces_indices();
+  const unordered_set<int>& face_boundary_indices() { return assets.FaceBoundaryIndices(); }
+  const unordered_set<int>& hair_region_indices() { return assets.HairRegionIndices(); }
+
+  const vector<BasicMesh>& blendshapes();
+
+  // Only needed to build a new mean texture
+  const QImage& albedo_index_map() { return albedo_maps().index_map; }
+  const vector<vector<PixelInfo>>& albedo_pixel_map() { return albedo_maps().pixel_map; }
+
+  SFSResourcePaths paths;
+  SFSResourceOptions options;
+  SFSAssetRegistry assets;
+
+private:
+  struct AlbedoMaps {
+    QImage index_map;
+    vector<vector<PixelInfo>> pixel_map;
+  };
+
+  const BasicMesh& subdivided_template();
+  const AlbedoMaps& albedo_maps();
+
+  LazyResource<BasicMesh> subdivided_template_mesh;
+  LazyResource<BasicMesh> working_mesh;
+  LazyResource<vector<int>> subdivided_valid_faces_indices;
+  LazyResource<vector<BasicMesh>> blendshape_meshes;
+  LazyResource<AlbedoMaps> loaded_albedo_maps;
+};
+
+// Load the images, points and reconstruction results listed in a settings
+// file. The .res files are looked up in recon_path, or next to the images if
+// recon_path is empty. If images is not empty, only the listed images are
+// loaded, in the order of the settings file.
+vector<ImageBundle> LoadImageBundles(const string& settings_filename,
+                                     const string& recon_path = "",
+                                     const vector<string>& images = vector<string>());
+
+// The images of a job, held in memory or read from disk each time they are
+// needed. A streamed source only keeps the filenames, so a job run on it
+// holds the images it is working on rather than all of them.
+class SFSImageSource {
+public:
+  explicit SFSImageSource(vector<ImageBundle> image_bundles);
+
+  // The images listed in a settings file, as in LoadImageBundles, read on
+  // demand
+  static SFSImageSource Stream(const string& settings_filename,
+                               const string& recon_path = "",
+                               const vector<string>& images = vector<string>());
+
+  int size() const { return filenames.size(); }
+  bool streamed() const { return !files.empty(); }
+
+  // Name of image i in the settings file
+  const string& filename(int i) const { return filenames[i]; }
+
+  // Image i with its points and reconstruction result
+  ImageBundle Load(int i) const;
+
+private:
+  struct ImageFiles {
+    fs::path image, points, reconstruction;
+  };
+
+  SFSImageSource() {}
+
+  vector<string> filenames;
+  vector<ImageBundle> image_bundles;
+  vector<ImageFiles> files;
+};
+
+// Energy of the terms of each solver stage at the solution of its last run,
+// as sums of squared weighted residuals (twice the ceres cost for depth).
+// NaN for a stage that did not run since the reset, e.g. a restored one.
+struct SFSEnergy {
+  static constexpr double kNotRun = std::numeric_limits<double>::quiet_NaN();
+
+  double lighting_data = kNotRun;
+  double lighting_reg = kNotRun;
+  double albedo_data = kNotRun;
+  double albedo_LoG = kNotRun;
+  double depth_data = kNotRun;
+  double depth_integrability = kNotRun;
+  double depth_reg = kNotRun;
+
+  json ToJson() const;
+};
+
+// Per-image working set of the shape from shading solver. The maps are
+// stored as planes of MapScalar (see sfs_maps.h). The z value of a pixel is
+// kept in depth_map_ref and zmap only, the camera space x and y of the
+// pixel grid in xy_map. The LoG filtered references are only stored in the
+// double precision form the solvers use.
+struct SFSImageState {
+  using Tripletd = Eigen::Triplet<double>;
+
+  int index;               // position of the image in the job, plus its first index
+  int image_index;         // index parsed from the image filename
+  uint64_t cache_key = 0;  // content key of the prepared maps, 0 without a cache
+
+  VectorXd lighting_coeffs;
+
+  // The working normal map and albedo start out sharing the planes of the
+  // references.
+  Map3 normal_map_ref, normal_map;
+  Map3 albedo_ref, albedo;
+
+  // Rendered z (kMapDepth, -1e6 outside the face) and the z being solved
+  // for (CV_32F)
+  cv::Mat depth_map_ref;
+  cv::Mat zmap;
+  Map2 xy_map;
+
+  vector<int> valid_pixels_map;
+  vector<glm::ivec2> valid_depth_pixels;
+  vector<int> face_indices_map;
+
+  // LoG operator over the image grid, both as matrix triplets and per pixel
+  vector<Tripletd> LoG_coeffs;
+  vector<vector<pair<int, double>>> LoG_coeffs_perpixel;
+
+  // LoG filtered reference albedo (num_pixels x 3) and depth (num_pixels)
+  MatrixXd albedo_ref_LoG_i;
+  VectorXd depth_map_ref_LoG_i;
+
+  vector<bool> is_boundary;
+
+  // Relative cost reduction of the last depth solve, for the convergence test
+  double depth_cost_reduction = std::numeric_limits<double>::infinity();
+
+  // Reset at the start of every iteration of the main loop
+  SFSEnergy energy;
+};
+
+// Job level data shared by all stages.
+struct SFSContext {
+  SFSContext(SFSResources& resources, const SFSSettings& settings, const fs::path& results_path)
+    : resources(resources), settings(settings), results_path(results_path),
+      solver_threads(8), checkpoints(nullptr), resume(false),
+      cache(nullptr), solve_key(0), deadline(nullptr), output_level(SFSOutputLevel::Debug), image_writer(nullptr) {}
+
+  SFSResources& resources;
+  SFSSettings settings;
+  fs::path results_path;
+  QImage mean_texture_image;
+
+  // Threads given to the solvers of one image
+  int solver_threads;
+
+  // Stage checkpoints of this job. With resume set, stages that have a valid
+  // checkpoint are loaded instead of recomputed.
+  const SFSCheckpointStore* checkpoints;
+  bool resume;
+
+  // Stage results shared across jobs, looked up when no checkpoint is
+  // restored. solve_key covers the solver settings and the code version.
+  const SFSResultCache* cache;
+  uint64_t solve_key;
+
+  // Time budget of the image being solved, null unless in the anytime mode
+  const SFSDeadline* deadline;
+
+  // Diagnostics above output_level are skipped, images go through
+  // image_writer, or are written directly if there is none.
+  SFSOutputLevel output_level;
+  AsyncImageWriter* image_writer;
+
+  bool ShouldWrite(SFSOutputLevel level) const { return output_level >= level; }
+
+  // Write an image (QImage or cv::Mat) under results_path
+  template <typename Image>
+  void WriteImage(const string& name, const Image& image) const {
+    const string filename = (results_path / fs::path(name)).string();
+    if(image_writer) {
+      image_writer->Write(filename, image);
+    } else if(!AsyncImageWriter::Save(filename, image, 1)) {
+      SFS_LOG(Error, Output) << "Failed to write " << filename;
+    }
+  }
+};
+
+class SFSStage {
+public:
+  explicit SFSStage(SFSContext& context) : context(context) {}
+  virtual ~SFSStage() {}
+
+protected:
+  SFSContext& context;
+};
+
+// A stage that runs once per iteration of the main loop.
+class SFSIterationStage : public SFSStage {
+public:
+  using SFSStage::SFSStage;
+  virtual void Run(const ImageBundle& bundle, SFSImageState& state, int iters) = 0;
+};
+
+// Renders the reference normal and depth maps and the initial albedo of an
+// image, then builds the LoG operators used by the solver.
+class SFSPrepareStage : public SFSStage {
+public:
+  using SFSStage::SFSStage;
+  void Run(const ImageBundle& bundle, SFSImageState& state);
+  void PrepareSolver(const ImageBundle& bundle, SFSImageState& state);
+};
+
+// Fix albedo and normal map, estimate lighting coefficients.
+class SFSLightingStage : public SFSIterationStage {
+public:
+  using SFSIterationStage::SFSIterationStage;
+  void Run(const ImageBundle& bundle, SFSImageState& state, int iters) override;
+
+  // Fraction of the second order terms used in iteration iters (1 based),
+  // ramped up over the iterations. A single iteration gets them in full.
+  static double SecondOrderWeight(int iters, int max_iters);
+};
+
+// Fix depth and lighting, estimate albedo.
+class SFSAlbedoStage : public SFSIterationStage {
+public:
+  using SFSIterationStage::SFSIterationStage;
+  void Run(const ImageBundle& bundle, SFSImageState& state, int iters) override;
+};
+
+// Fix albedo and lighting, estimate depth and update the normal map.
+class SFSDepthStage : public SFSIterationStage {
+public:
+  using SFSIterationStage::SFSIterationStage;
+  void Run(const ImageBundle& bundle, SFSImageState& state, int iters) override;
+};
+
+// Write out the recovered point clouds and depth meshes.
+class SFSExportStage : public SFSStage {
+public:
+  using SFSStage::SFSStage;
+  void Run(const ImageBundle& bundle, SFSImageState& state);
+};
+
+// The complete shape from shading flow. Resources are borrowed, so the same
+// pipeline can be run repeatedly on different subjects without reloading.
+class SFSPipeline {
+public:
+  SFSPipeline(SFSResources& resources, const SFSSettings& settings)
+    : resources(resources), settings(settings), resume(false), first_index(0) {}
+
+  // Reuse the checkpoints of a previous run with the same inputs and settings
+  void SetResume(bool value) { resume = value; }
+
+  // Index of the first image in the output and checkpoint filenames, for jobs
+  // that process a part of a larger image set
+  void SetFirstIndex(int value) { first_index = value; }
+
+  // Called with the final state of each image once it is solved and exported,
+  // before its working set is released. Runs on the solver threads.
+  using ResultCallback = function<void(const ImageBundle&, const SFSImageState&)>;
+  void SetResultCallback(ResultCallback callback) { result_callback = callback; }
+
+  // Each image is loaded from the source when it is prepared and released
+  // once it is exported. With parallel.streaming set, the face index maps
+  // also wait for their images on disk, so only the images in flight, the
+  // mean texture and the models are held in memory.
+  void Run(const SFSImageSource& images, const fs::path& results_path);
+  void Run(const vector<ImageBundle>& image_bundles, const fs::path& results_path) {
+    Run(SFSImageSource(image_bundles), results_path);
+  }
+
+  // Collect texture from all images to build the mean texture of the subject.
+  // The visible face index map of each image is passed to store_face_indices.
+  using FaceIndicesCallback = function<void(int, vector<int>)>;
+  void GenerateMeanTexture(const SFSImageSource& images, SFSContext& context,
+                           const FaceIndicesCallback& store_face_indices);
+
+  // Run lighting, albedo and depth estimation on a prepared image. With
+  // pyramid.num_levels > 1, the image is first solved at
+  // 1/2^(num_levels-1), ..., 1/2 resolution for pyramid.coarse_iters
+  // iterations each, and every level starts from the previous solution.
+  // With deadline.seconds_per_image set, the solve stops early to stay
+  // within that time.
+  void Solve(const ImageBundle& bundle, SFSImageState& state, SFSContext& context);
+
+  // Rough upper bound of the memory held by one image from its preparation
+  // to its export, covering the prepared maps, the LoG operators, the albedo
+  // system and the depth problem.
+  static size_t EstimateSolveMemory(const ImageBundle& bundle);
+
+private:
+  // The main loop: max_iters rounds of lighting, albedo and depth estimation
+  void Iterate(const ImageBundle& bundle, SFSImageState& state, SFSContext& context);
+
+  // Fingerprints of the inputs each group of checkpoints depends on
+  uint64_t PrepareFingerprint() const;
+  uint64_t SolveFingerprint() const;
+
+  // Content key of the mean texture of a set of images, given their hashes
+  uint64_t MeanTextureKey(const vector<uint64_t>& bundle_hashes) const;
+
+  // GenerateMeanTexture through the result cache, the face index maps are
+  // looked up with the prepare keys of the images
+  void LoadOrGenerateMeanTexture(const SFSImageSource& images, SFSContext& context,
+                                 uint64_t cache_key, const vector<uint64_t>& prepare_keys,
+                                 const FaceIndicesCallback& store_face_indices);
+
+  SFSResources& resources;
+  SFSSettings settings;
+  bool resume;
+  int first_index;
+  ResultCallback result_callback;
+};
+
+#endif  // FACESHAPEFROMSHADING_SFS_PIPELINE_H
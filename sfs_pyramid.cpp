@@ -0,0 +1,160 @@
+#include "sfs_pyramid.h"
+
+namespace {
+
+// Bilinear weights of the coarse samples around a fine pixel. Samples
+// outside the face get no weight, the others are renormalized. Returns false
+// if none of them is on the face.
+struct CoarseSamples {
+  int r[4], c[4];
+  double w[4];
+};
+
+bool FindCoarseSamples(const SFSImageState& coarse, int coarse_scale,
+                       int fine_r, int fine_c, int fine_scale,
+                       CoarseSamples& samples) {
+  // full resolution position of the fine pixel, then coarse coordinates
+  const double full_r = fine_r * fine_scale + fine_scale / 2;
+  const double full_c = fine_c * fine_scale + fine_scale / 2;
+  const double u = (full_r - coarse_scale / 2) / coarse_scale;
+  const double v = (full_c - coarse_scale / 2) / coarse_scale;
+
+  const int r0 = static_cast<int>(floor(u)), c0 = static_cast<int>(floor(v));
+  const double fr = u - r0, fc = v - c0;
+
+  double total = 0;
+  for(int k=0;k<4;++k) {
+    int r = r0 + k / 2, c = c0 + k % 2;
+    double w = (k / 2? fr : 1 - fr) * (k % 2? fc : 1 - fc);
+    r = clamp(r, 0, coarse.zmap.rows - 1);
+    c = clamp(c, 0, coarse.zmap.cols - 1);
+    if(coarse.zmap.at<float>(r, c) < -1e5) w = 0;
+    samples.r[k] = r; samples.c[k] = c; samples.w[k] = w;
+    total += w;
+  }
+  if(total <= 0) return false;
+  for(int k=0;k<4;++k) samples.w[k] /= total;
+  return true;
+}
+
+}  // namespace
+
+int PyramidLevelSize(int full_size, int scale) {
+  return (full_size - 1 - scale / 2) / scale + 1;
+}
+
+ImageBundle DownsampleImageBundle(const ImageBundle& bundle, int scale) {
+  const int full_rows = bundle.image.height(), full_cols = bundle.image.width();
+  const int num_rows = PyramidLevelSize(full_rows, scale);
+  const int num_cols = PyramidLevelSize(full_cols, scale);
+
+  ImageBundle level_bundle = bundle;
+  level_bundle.image = QImage(num_cols, num_rows, QImage::Format_ARGB32);
+  for(int r=0;r<num_rows;++r) {
+    for(int c=0;c<num_cols;++c) {
+      int sum_r = 0, sum_g = 0, sum_b = 0, count = 0;
+      for(int y=r*scale;y<min((r+1)*scale, full_rows);++y) {
+        for(int x=c*scale;x<min((c+1)*scale, full_cols);++x) {
+          auto pix = bundle.image.pixel(x, y);
+          sum_r += qRed(pix); sum_g += qGreen(pix); sum_b += qBlue(pix);
+          ++count;
+        }
+      }
+      level_bundle.image.setPixel(c, r, qRgb(sum_r / count, sum_g / count, sum_b / count));
+    }
+  }
+  return level_bundle;
+}
+
+SFSImageState DownsampleImageState(const SFSImageState& state, int scale) {
+  const int full_rows = state.zmap.rows, full_cols = state.zmap.cols;
+  const int num_rows = PyramidLevelSize(full_rows, scale);
+  const int num_cols = PyramidLevelSize(full_cols, scale);
+  const int offset = scale / 2;
+
+  SFSImageState level;
+  level.index = state.index;
+  level.image_index = state.image_index;
+  level.lighting_coeffs = state.lighting_coeffs;
+
+  level.normal_map_ref = Map3(num_rows, num_cols);
+  level.albedo_ref = Map3(num_rows, num_cols);
+  level.depth_map_ref = cv::Mat(num_rows, num_cols, kMapDepth);
+  level.zmap = cv::Mat(num_rows, num_cols, CV_32F);
+  level.xy_map = Map2(num_rows, num_cols);
+  level.face_indices_map.resize(num_rows * num_cols);
+
+  for(int r=0;r<num_rows;++r) {
+    for(int c=0;c<num_cols;++c) {
+      const int y = r * scale + offset, x = c * scale + offset;
+      level.normal_map_ref.Set(r, c, state.normal_map_ref(y, x));
+      level.depth_map_ref.at<MapScalar>(r, c) = state.depth_map_ref.at<MapScalar>(y, x);
+      level.zmap.at<float>(r, c) = state.zmap.at<float>(y, x);
+      level.xy_map.Set(r, c, state.xy_map(y, x));
+      level.face_indices_map[r * num_cols + c] = state.face_indices_map[y * full_cols + x];
+      if(level.zmap.at<float>(r, c) > -1e5) level.valid_pixels_map.push_back(r * num_cols + c);
+
+      cv::Vec3d albedo_sum(0, 0, 0);
+      int count = 0;
+      for(int yy=r*scale;yy<min((r+1)*scale, full_rows);++yy) {
+        for(int xx=c*scale;xx<min((c+1)*scale, full_cols);++xx) {
+          albedo_sum += state.albedo_ref(yy, xx);
+          ++count;
+        }
+      }
+      level.albedo_ref.Set(r, c, albedo_sum * (1.0 / count));
+    }
+  }
+
+  // same as after the prepare stage, the working maps start as the references
+  level.normal_map = level.normal_map_ref;
+  level.albedo = level.albedo_ref;
+  return level;
+}
+
+void UpsampleSolution(const SFSImageState& coarse, int coarse_scale,
+                      SFSImageState& fine, int fine_scale) {
+  const int num_rows = fine.zmap.rows, num_cols = fine.zmap.cols;
+
+  fine.lighting_coeffs = coarse.lighting_coeffs;
+
+  for(int r=0;r<num_rows;++r) {
+    for(int c=0;c<num_cols;++c) {
+      if(fine.zmap.at<float>(r, c) < -1e5) continue;
+
+      CoarseSamples samples;
+      if(!FindCoarseSamples(coarse, coarse_scale, r, c, fine_scale, samples)) continue;
+
+      cv::Vec3d albedo(0, 0, 0);
+      double dz = 0;
+      for(int k=0;k<4;++k) {
+        const int cr = samples.r[k], cc = samples.c[k];
+        albedo += coarse.albedo(cr, cc) * samples.w[k];
+        dz += samples.w[k] * (coarse.zmap.at<float>(cr, cc) - coarse.depth_map_ref.at<MapScalar>(cr, cc));
+      }
+      fine.albedo.Set(r, c, albedo);
+      fine.zmap.at<float>(r, c) = fine.depth_map_ref.at<MapScalar>(r, c) + dz;
+    }
+  }
+
+  // recompute the normals from the new depth, as in the depth stage
+  for(int r=1;r<num_rows;++r) {
+    for(int c=1;c<num_cols;++c) {
+      if(fine.zmap.at<float>(r, c) < -1e5
+         || fine.zmap.at<float>(r, c-1) < -1e5
+         || fine.zmap.at<float>(r-1, c) < -1e5) continue;
+
+      cv::Vec2d depth_ij = fine.xy_map(r, c);
+      cv::Vec2d depth_ij_l = fine.xy_map(r, c-1);
+      cv::Vec2d depth_ij_u = fine.xy_map(r-1, c);
+      double dx = -fabs(depth_ij[0] - depth_ij_l[0]);
+      double dy = -fabs(depth_ij_u[1] - depth_ij[1]);
+
+      double p = (fine.zmap.at<float>(r, c) - fine.zmap.at<float>(r, c-1)) / dx;
+      double q = (fine.zmap.at<float>(r-1, c) - fine.zmap.at<float>(r, c)) / dy;
+
+      double N = p * p + q * q + 1;
+      fine.normal_map.Set(r, c, cv::Vec3d(p/N, q/N, 1/N));
+    }
+  }
+}
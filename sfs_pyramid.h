@@ -0,0 +1,36 @@
+#ifndef FACESHAPEFROMSHADING_SFS_PYRAMID_H
+#define FACESHAPEFROMSHADING_SFS_PYRAMID_H
+
+#include "sfs_pipeline.h"
+
+// Coarse-to-fine solving. A level with scale s holds every s-th pixel of the
+// prepared full resolution maps, taken at the center of each s x s block:
+// level pixel (r, c) is full resolution pixel (r*s + s/2, c*s + s/2). The
+// input image and the albedo are averaged over the block instead.
+//
+// Levels are solved from the coarsest up, and the solution of each level is
+// the starting point of the next one.
+
+// Number of rows or columns of a level with the given scale
+int PyramidLevelSize(int full_size, int scale);
+
+// Input of a level. Only the image is resampled, the landmarks and the
+// reconstruction are not used by the solver stages.
+ImageBundle DownsampleImageBundle(const ImageBundle& bundle, int scale);
+
+// Prepared state of a level, taken from the full resolution state before it
+// is modified by any solver stage. PrepareSolver still has to be run on it.
+SFSImageState DownsampleImageState(const SFSImageState& state, int scale);
+
+// Use the solution of a coarser level as initial value of a finer one:
+//  - the lighting coefficients are copied,
+//  - the albedo is bilinearly upsampled,
+//  - the change of the depth against the reference depth is bilinearly
+//    upsampled and added to the reference depth of the finer level, so the
+//    detail of the finer reference is kept, and the normal map is recomputed.
+// Only pixels on the face are changed, samples of the coarser level outside
+// the face are ignored.
+void UpsampleSolution(const SFSImageState& coarse, int coarse_scale,
+                      SFSImageState& fine, int fine_scale);
+
+#endif  // FACESHAPEFROMSHADING_SFS_PYRAMID_H
@@ -0,0 +1,110 @@
+#include "sfs_resources.h"
+
+#include "Utils/utility.hpp"
+
+#include <MultilinearReconstruction/ioutilities.h>
+
+#include "sfs_log.h"
+
+namespace {
+
+// @HACK each quad face is triangulated, so the indices change from i to [2*i, 2*i+1]
+vector<int> TriangulateQuadIndices(const vector<int>& quad_indices) {
+  vector<int> indices;
+  for(auto fidx : quad_indices) {
+    indices.push_back(fidx*2);
+    indices.push_back(fidx*2+1);
+  }
+  return indices;
+}
+
+unordered_set<int> LoadTriangulatedIndexSet(const string& filename) {
+  unordered_set<int> indices;
+  for(auto fidx : TriangulateQuadIndices(LoadIndices(filename))) {
+    indices.insert(fidx);
+  }
+  return indices;
+}
+
+}  // namespace
+
+SFSResourcePaths SFSResourcePaths::FromHomeDirectory(const string& home_directory) {
+  SFSResourcePaths paths;
+  paths.model_filename = home_directory + "/Data/Multilinear/blendshape_core.tensor";
+  paths.id_prior_filename = home_directory + "/Data/Multilinear/blendshape_u_0_aug.tensor";
+  paths.exp_prior_filename = home_directory + "/Data/Multilinear/blendshape_u_1_aug.tensor";
+  paths.template_mesh_filename = home_directory + "/Data/Multilinear/template.obj";
+  paths.contour_points_filename = home_directory + "/Data/Multilinear/contourpoints.txt";
+  paths.landmarks_filename = home_directory + "/Data/Multilinear/landmarks_73.txt";
+  paths.albedo_index_map_filename = home_directory + "/Data/Multilinear/albedo_index.png";
+  paths.albedo_pixel_map_filename = home_directory + "/Data/Multilinear/albedo_pixel.png";
+  paths.mean_albedo_filename = home_directory + "/Data/Texture/mean_texture.png";
+  paths.core_face_region_filename = home_directory + "/Data/Multilinear/albedos/core_face.png";
+
+  paths.valid_faces_indices_filename = home_directory + "/Data/Multilinear/face_region_indices.txt";
+  paths.face_boundary_indices_filename = home_directory + "/Data/Multilinear/face_boundary_indices.txt";
+  paths.hair_region_filename = home_directory + "/Data/Multilinear/hair_region_indices.txt";
+  return paths;
+}
+
+const BasicMesh& SFSAssetRegistry::TemplateMesh() {
+  return Get(template_mesh, "template_mesh", [this]() {
+    return BasicMesh(paths.template_mesh_filename);
+  });
+}
+
+MultilinearModel& SFSAssetRegistry::Model() {
+  return Get(model, "multilinear_model", [this]() {
+    return MultilinearModel(paths.model_filename);
+  });
+}
+
+const vector<int>& SFSAssetRegistry::Landmarks() {
+  return Get(landmarks, "landmarks", [this]() {
+    return LoadIndices(paths.landmarks_filename);
+  });
+}
+
+const vector<vector<int>>& SFSAssetRegistry::ContourIndices() {
+  return Get(contour_indices, "contour_indices", [this]() {
+    return LoadContourIndices(paths.contour_points_filename);
+  });
+}
+
+const vector<int>& SFSAssetRegistry::ValidFacesIndices() {
+  return Get(valid_faces_indices, "valid_faces_indices", [this]() {
+    return TriangulateQuadIndices(LoadIndices(paths.valid_faces_indices_filename));
+  });
+}
+
+const unordered_set<int>& SFSAssetRegistry::FaceBoundaryIndices() {
+  return Get(face_boundary_indices, "face_boundary_indices", [this]() {
+    return LoadTriangulatedIndexSet(paths.face_boundary_indices_filename);
+  });
+}
+
+const unordered_set<int>& SFSAssetRegistry::HairRegionIndices() {
+  return Get(hair_region_indices, "hair_region_indices", [this]() {
+    return LoadTriangulatedIndexSet(paths.hair_region_filename);
+  });
+}
+
+vector<pair<string, double>> SFSAssetRegistry::LoadTimes() const {
+  std::lock_guard<std::mutex> lock(load_times_mutex);
+  return load_times;
+}
+
+void SFSAssetRegistry::ReportLoadTimes() const {
+  ostringstream oss;
+  oss << "Resources loaded:";
+  for(auto& t : LoadTimes()) {
+    oss << "\n  " << setw(24) << left << t.first << right << fixed << setprecision(3) << t.second << " s";
+  }
+  SFS_LOG(Info, Resources) << oss.str();
+}
+
+void SFSAssetRegistry::RecordLoadTime(const string& name, double seconds) {
+  SFS_LOG(Info, Resources) << "Loaded " << name << " in " << seconds << " seconds.";
+  std::lock_guard<std::mutex> lock(load_times_mutex);
+  load_times.push_back(make_pair(name, seconds));
+}
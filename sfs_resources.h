@@ -0,0 +1,105 @@
+#ifndef FACESHAPEFROMSHADING_SFS_RESOURCES_H
+#define FACESHAPEFROMSHADING_SFS_RESOURCES_H
+
+#include "common.h"
+
+#include <memory>
+#include <mutex>
+
+#include <boost/timer/timer.hpp>
+
+#include <MultilinearReconstruction/basicmesh.h>
+#include <MultilinearReconstruction/multilinearmodel.h>
+
+#include "sfs_trace.h"
+
+// Locations of the model, template and index assets used by the pipeline.
+struct SFSResourcePaths {
+  static SFSResourcePaths FromHomeDirectory(const string& home_directory);
+
+  string model_filename;
+  string id_prior_filename;
+  string exp_prior_filename;
+  string template_mesh_filename;
+  string contour_points_filename;
+  string landmarks_filename;
+  string albedo_index_map_filename;
+  string albedo_pixel_map_filename;
+  string mean_albedo_filename;
+  string core_face_region_filename;
+
+  string valid_faces_indices_filename;
+  string face_boundary_indices_filename;
+  string hair_region_filename;
+};
+
+// Storage of one lazily loaded asset, see SFSAssetRegistry::Get.
+template <typename T>
+class LazyResource {
+private:
+  friend class SFSAssetRegistry;
+  std::once_flag once;
+  unique_ptr<T> value;
+};
+
+// Loads the assets named in SFSResourcePaths on first use and keeps them for
+// the life of the registry, so a program only pays for the assets it
+// touches. The load time of each asset is recorded and traced.
+//
+// The accessors can be called from several threads: the first caller loads
+// the asset and the others wait for it. A load that throws is retried by the
+// next caller.
+class SFSAssetRegistry {
+public:
+  explicit SFSAssetRegistry(const SFSResourcePaths& paths) : paths(paths) {}
+
+  // Template mesh as loaded, before any subdivision
+  const BasicMesh& TemplateMesh();
+
+  // The model keeps the weights last applied to it, so only one caller at a
+  // time can use it.
+  MultilinearModel& Model();
+
+  const vector<int>& Landmarks();
+  const vector<vector<int>>& ContourIndices();
+
+  // Face indices of the triangulated template
+  const vector<int>& ValidFacesIndices();
+  const unordered_set<int>& FaceBoundaryIndices();
+  const unordered_set<int>& HairRegionIndices();
+
+  // Load an asset derived from the ones above with the same memoization and
+  // accounting. Its load time includes the assets the loader touches first.
+  template <typename T, typename Loader>
+  T& Get(LazyResource<T>& resource, const string& name, Loader loader) {
+    std::call_once(resource.once, [&]() {
+      TraceSpan span("load_" + name, "resources");
+      boost::timer::cpu_timer timer;
+      resource.value.reset(new T(loader()));
+      RecordLoadTime(name, timer.elapsed().wall * 1e-9);
+    });
+    return *resource.value;
+  }
+
+  // Assets loaded so far and their load time in seconds, in load order
+  vector<pair<string, double>> LoadTimes() const;
+  void ReportLoadTimes() const;
+
+  const SFSResourcePaths paths;
+
+private:
+  void RecordLoadTime(const string& name, double seconds);
+
+  LazyResource<BasicMesh> template_mesh;
+  LazyResource<MultilinearModel> model;
+  LazyResource<vector<int>> landmarks;
+  LazyResource<vector<vector<int>>> contour_indices;
+  LazyResource<vector<int>> valid_faces_indices;
+  LazyResource<unordered_set<int>> face_boundary_indices;
+  LazyResource<unordered_set<int>> hair_region_indices;
+
+  mutable std::mutex load_times_mutex;
+  vector<pair<string, double>> load_times;
+};
+
+#endif  // FACESHAPEFROMSHADING_SFS_RESOURCES_H
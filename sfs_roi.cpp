@@ -0,0 +1,135 @@
+#include "sfs_roi.h"
+
+namespace {
+
+template <int Channels>
+PlanarMap<Channels> CropMap(const PlanarMap<Channels>& m, const cv::Rect& region) {
+  PlanarMap<Channels> cropped(region.height, region.width);
+  for(int k=0;k<Channels;++k) cropped.plane(k) = m.plane(k)(region).clone();
+  return cropped;
+}
+
+template <int Channels>
+PlanarMap<Channels> PasteMap(const PlanarMap<Channels>& m, const cv::Rect& region,
+                             int num_rows, int num_cols) {
+  PlanarMap<Channels> full(num_rows, num_cols);
+  for(int k=0;k<Channels;++k) {
+    full.plane(k).setTo(cv::Scalar(0));
+    cv::Mat target = full.plane(k)(region);
+    m.plane(k).copyTo(target);
+  }
+  return full;
+}
+
+cv::Mat PasteMat(const cv::Mat& m, const cv::Rect& region, int num_rows, int num_cols, double fill) {
+  cv::Mat full(num_rows, num_cols, m.type(), cv::Scalar(fill));
+  cv::Mat target = full(region);
+  m.copyTo(target);
+  return full;
+}
+
+}  // namespace
+
+cv::Rect FaceRegion(const SFSImageState& state, int padding) {
+  const int num_rows = state.zmap.rows, num_cols = state.zmap.cols;
+  if(state.valid_pixels_map.empty()) return cv::Rect(0, 0, num_cols, num_rows);
+
+  int min_r = num_rows, max_r = -1, min_c = num_cols, max_c = -1;
+  for(int pidx : state.valid_pixels_map) {
+    const int r = pidx / num_cols, c = pidx % num_cols;
+    min_r = min(min_r, r); max_r = max(max_r, r);
+    min_c = min(min_c, c); max_c = max(max_c, c);
+  }
+  min_r = max(min_r - padding, 0);
+  min_c = max(min_c - padding, 0);
+  max_r = min(max_r + padding, num_rows - 1);
+  max_c = min(max_c + padding, num_cols - 1);
+  return cv::Rect(min_c, min_r, max_c - min_c + 1, max_r - min_r + 1);
+}
+
+ImageBundle CropImageBundle(const ImageBundle& bundle, const cv::Rect& region) {
+  ImageBundle cropped = bundle;
+  cropped.image = bundle.image.copy(region.x, region.y, region.width, region.height);
+  return cropped;
+}
+
+SFSImageState CropImageState(const SFSImageState& state, const cv::Rect& region) {
+  const int full_cols = state.zmap.cols;
+  const int num_cols = region.width;
+
+  SFSImageState cropped;
+  cropped.index = state.index;
+  cropped.image_index = state.image_index;
+  cropped.cache_key = state.cache_key;
+  cropped.lighting_coeffs = state.lighting_coeffs;
+
+  cropped.normal_map_ref = CropMap(state.normal_map_ref, region);
+  cropped.albedo_ref = CropMap(state.albedo_ref, region);
+  cropped.xy_map = CropMap(state.xy_map, region);
+  cropped.depth_map_ref = state.depth_map_ref(region).clone();
+  cropped.zmap = state.zmap(region).clone();
+
+  cropped.face_indices_map.resize(region.height * num_cols);
+  for(int r=0;r<region.height;++r) {
+    for(int c=0;c<num_cols;++c) {
+      cropped.face_indices_map[r * num_cols + c] =
+        state.face_indices_map[(r + region.y) * full_cols + c + region.x];
+    }
+  }
+
+  // the face lies inside the region by construction
+  cropped.valid_pixels_map.reserve(state.valid_pixels_map.size());
+  for(int pidx : state.valid_pixels_map) {
+    const int r = pidx / full_cols - region.y, c = pidx % full_cols - region.x;
+    cropped.valid_pixels_map.push_back(r * num_cols + c);
+  }
+
+  // same as after the prepare stage, the working maps start as the references
+  cropped.normal_map = cropped.normal_map_ref;
+  cropped.albedo = cropped.albedo_ref;
+  return cropped;
+}
+
+SFSImageState UncropImageState(const SFSImageState& cropped, const cv::Rect& region,
+                               int num_rows, int num_cols) {
+  const int cropped_cols = region.width;
+
+  SFSImageState full;
+  full.index = cropped.index;
+  full.image_index = cropped.image_index;
+  full.cache_key = cropped.cache_key;
+  full.lighting_coeffs = cropped.lighting_coeffs;
+  full.depth_cost_reduction = cropped.depth_cost_reduction;
+
+  full.normal_map_ref = PasteMap(cropped.normal_map_ref, region, num_rows, num_cols);
+  full.normal_map = PasteMap(cropped.normal_map, region, num_rows, num_cols);
+  full.albedo_ref = PasteMap(cropped.albedo_ref, region, num_rows, num_cols);
+  full.albedo = PasteMap(cropped.albedo, region, num_rows, num_cols);
+  full.xy_map = PasteMap(cropped.xy_map, region, num_rows, num_cols);
+  full.depth_map_ref = PasteMat(cropped.depth_map_ref, region, num_rows, num_cols, -1e6);
+  full.zmap = PasteMat(cropped.zmap, region, num_rows, num_cols, -1e6);
+
+  auto full_index = [&](int pidx) {
+    return (pidx / cropped_cols + region.y) * num_cols + pidx % cropped_cols + region.x;
+  };
+
+  full.face_indices_map.assign(num_rows * num_cols, -1);
+  for(int pidx=0;pidx<static_cast<int>(cropped.face_indices_map.size());++pidx) {
+    full.face_indices_map[full_index(pidx)] = cropped.face_indices_map[pidx];
+  }
+
+  full.is_boundary.assign(num_rows * num_cols, false);
+  for(int pidx=0;pidx<static_cast<int>(cropped.is_boundary.size());++pidx) {
+    if(cropped.is_boundary[pidx]) full.is_boundary[full_index(pidx)] = true;
+  }
+
+  full.valid_pixels_map.reserve(cropped.valid_pixels_map.size());
+  for(int pidx : cropped.valid_pixels_map) full.valid_pixels_map.push_back(full_index(pidx));
+
+  // (row, column) pairs
+  full.valid_depth_pixels.reserve(cropped.valid_depth_pixels.size());
+  for(auto& p : cropped.valid_depth_pixels) {
+    full.valid_depth_pixels.push_back(glm::ivec2(p.x + region.y, p.y + region.x));
+  }
+  return full;
+}
@@ -0,0 +1,35 @@
+#ifndef FACESHAPEFROMSHADING_SFS_ROI_H
+#define FACESHAPEFROMSHADING_SFS_ROI_H
+
+#include "sfs_pipeline.h"
+
+// Face region of interest. Once an image is prepared, the solver stages only
+// need the pixels of the rendered face and their neighbors, so the image and
+// the prepared maps are cropped to the bounding box of the face grown by a
+// margin. The LoG operators, index tables and per-pixel loops of the solver
+// then scale with the face rather than the image. The solution is pasted
+// back into full size maps for the export.
+//
+// The margin has to cover the 5x5 LoG stencils around the face pixels, the
+// pixels beyond it only take part in the albedo regularization off the face.
+
+// Bounding box of the face pixels of a prepared state, grown by padding on
+// every side and clipped to the image. The whole image if there is no face
+// pixel.
+cv::Rect FaceRegion(const SFSImageState& state, int padding);
+
+// The image cropped to a region. The landmarks and the reconstruction are
+// not used by the solver stages and are kept as they are.
+ImageBundle CropImageBundle(const ImageBundle& bundle, const cv::Rect& region);
+
+// Prepared state restricted to a region, taken before any solver stage ran
+// on it. PrepareSolver still has to be run on it.
+SFSImageState CropImageState(const SFSImageState& state, const cv::Rect& region);
+
+// Full size state holding the solution of a cropped one. The pixels outside
+// the region are off the face: depth -1e6, zero normal, albedo and xy. The
+// LoG operators are not carried over.
+SFSImageState UncropImageState(const SFSImageState& cropped, const cv::Rect& region,
+                               int num_rows, int num_cols);
+
+#endif  // FACESHAPEFROMSHADING_SFS_ROI_H
@@ -0,0 +1,374 @@
+#include "sfs_settings.h"
+
+#include <cstdlib>
+#include <stdexcept>
+
+namespace {
+
+// Reads the keys of one JSON object into typed fields, keeping track of the
+// keys used so anything left over can be reported.
+class SettingsSection {
+public:
+  SettingsSection(const json& j, const string& path) : j(j), path(path) {
+    if(!j.is_object()) throw invalid_argument("Settings: " + Name() + " must be an object.");
+  }
+
+  template <typename T>
+  SettingsSection& Get(const string& key, T& value) {
+    used.insert(key);
+    if(!j.count(key)) return *this;
+    try {
+      value = j[key].get<T>();
+    } catch(std::exception&) {
+      throw invalid_argument("Settings: " + path + key + " has the wrong type, got " + j[key].dump() + ".");
+    }
+    return *this;
+  }
+
+  SettingsSection Section(const string& key) {
+    used.insert(key);
+    static const json empty = json::object();
+    return SettingsSection(j.count(key)? j[key] : empty, path + key + ".");
+  }
+
+  // json kept as is
+  SettingsSection& GetJson(const string& key, json& value) {
+    used.insert(key);
+    if(j.count(key)) value = j[key];
+    return *this;
+  }
+
+  void CheckUnknownKeys() const {
+    for(auto it = j.begin(); it != j.end(); ++it) {
+      if(!used.count(it.key())) throw invalid_argument("Settings: unknown key " + path + it.key() + ".");
+    }
+  }
+
+private:
+  string Name() const { return path.empty()? string("the settings") : path.substr(0, path.size() - 1); }
+
+  const json& j;
+  string path;
+  set<string> used;
+};
+
+void Require(bool condition, const string& message) {
+  if(!condition) throw invalid_argument("Settings: " + message);
+}
+
+}  // namespace
+
+SFSSettings SFSSettings::FromJson(const json& j) {
+  SFSSettings s;
+  SettingsSection root(j, "");
+  root.Get("max_iters", s.max_iters)
+      .Get("preparation_only", s.preparation_only);
+
+  SettingsSection lighting = root.Section("lighting");
+  lighting.Get("saturated_pixels_threshold", s.lighting.saturated_pixels_threshold)
+          .Get("dark_pixels_threshold", s.lighting.dark_pixels_threshold)
+          .Get("albedo_distance_bins", s.lighting.albedo_distance_bins)
+          .Get("lighting_pixels_ratio_lower", s.lighting.lighting_pixels_ratio_lower)
+          .Get("lighting_pixels_ratio_upper", s.lighting.lighting_pixels_ratio_upper)
+          .Get("num_dof", s.lighting.num_dof)
+          .Get("w_reg", s.lighting.w_reg)
+          .Get("relaxation", s.lighting.relaxation);
+  lighting.CheckUnknownKeys();
+
+  SettingsSection albedo = root.Section("albedo");
+  albedo.Get("lambda", s.albedo.lambda);
+  albedo.CheckUnknownKeys();
+
+  SettingsSection depth = root.Section("depth");
+  depth.Get("num_iters", s.depth.num_iters)
+       .Get("w_data", s.depth.w_data)
+       .Get("w_int", s.depth.w_int)
+       .Get("w_reg", s.depth.w_reg)
+       .Get("w_smooth", s.depth.w_smooth)
+       .Get("integrability_threshold", s.depth.integrability_threshold);
+  SettingsSection optimization = depth.Section("optimization");
+  optimization.Get("max_iters", s.depth.optimization_max_iters)
+              .Get("init_tr_radius", s.depth.optimization_init_tr_radius);
+  optimization.CheckUnknownKeys();
+  depth.CheckUnknownKeys();
+
+  SettingsSection pyramid = root.Section("pyramid");
+  pyramid.Get("num_levels", s.pyramid.num_levels)
+         .Get("coarse_iters", s.pyramid.coarse_iters)
+         .Get("min_level_size", s.pyramid.min_level_size);
+  pyramid.CheckUnknownKeys();
+
+  SettingsSection convergence = root.Section("convergence");
+  convergence.Get("lighting_change", s.convergence.lighting_change)
+             .Get("albedo_change", s.convergence.albedo_change)
+             .Get("depth_cost_reduction", s.convergence.depth_cost_reduction);
+  convergence.CheckUnknownKeys();
+
+  SettingsSection roi = root.Section("roi");
+  roi.Get("enabled", s.roi.enabled)
+     .Get("padding", s.roi.padding);
+  roi.CheckUnknownKeys();
+
+  SettingsSection output = root.Section("output");
+  string level = OutputLevelName(s.output.level);
+  output.Get("level", level)
+        .Get("writer_threads", s.output.writer_threads)
+        .Get("png_compression", s.output.png_compression);
+  output.CheckUnknownKeys();
+  s.output.level = ParseOutputLevel(level);
+
+  SettingsSection trace = root.Section("trace");
+  trace.Get("enabled", s.trace.enabled)
+       .Get("filename", s.trace.filename)
+       .Get("memory", s.trace.memory);
+  trace.CheckUnknownKeys();
+
+  SettingsSection parallel = root.Section("parallel");
+  parallel.Get("num_threads", s.parallel.num_threads)
+          .Get("threads_per_image", s.parallel.threads_per_image)
+          .Get("render_ahead", s.parallel.render_ahead)
+          .Get("memory_budget_mb", s.parallel.memory_budget_mb)
+          .Get("streaming", s.parallel.streaming);
+  parallel.CheckUnknownKeys();
+
+  SettingsSection metrics = root.Section("metrics");
+  metrics.Get("path", s.metrics.path)
+         .Get("format", s.metrics.format)
+         .Get("interval_seconds", s.metrics.interval_seconds);
+  metrics.CheckUnknownKeys();
+
+  SettingsSection log = root.Section("log");
+  string log_level = LogLevelName(s.log.level);
+  map<string, string> log_modules;
+  log.Get("level", log_level)
+     .Get("modules", log_modules);
+  log.CheckUnknownKeys();
+  try {
+    s.log.level = ParseLogLevel(log_level);
+    for(auto& m : log_modules) s.log.modules[ParseLogModule(m.first)] = ParseLogLevel(m.second);
+  } catch(invalid_argument& e) {
+    throw invalid_argument(string("Settings: log: ") + e.what());
+  }
+
+  SettingsSection cache = root.Section("cache");
+  cache.Get("path", s.cache.path);
+  cache.CheckUnknownKeys();
+
+  SettingsSection deadline = root.Section("deadline");
+  deadline.Get("seconds_per_image", s.deadline.seconds_per_image);
+  deadline.CheckUnknownKeys();
+
+  SettingsSection handoff = root.Section("handoff");
+  handoff.Get("shm_prefix", s.handoff.shm_prefix);
+  handoff.CheckUnknownKeys();
+
+  root.GetJson("mean_texture_options", s.mean_texture_options);
+  root.CheckUnknownKeys();
+
+  Require(s.max_iters >= 1, "max_iters must be at least 1.");
+  Require(s.lighting.saturated_pixels_threshold >= 0 && s.lighting.saturated_pixels_threshold <= 255,
+          "lighting.saturated_pixels_threshold must be in [0, 255].");
+  Require(s.lighting.dark_pixels_threshold >= 0 && s.lighting.dark_pixels_threshold <= 255,
+          "lighting.dark_pixels_threshold must be in [0, 255].");
+  Require(s.lighting.albedo_distance_bins >= 1, "lighting.albedo_distance_bins must be at least 1.");
+  Require(s.lighting.lighting_pixels_ratio_lower > 0 && s.lighting.lighting_pixels_ratio_lower <= 1
+          && s.lighting.lighting_pixels_ratio_upper > 0 && s.lighting.lighting_pixels_ratio_upper <= 1,
+          "lighting.lighting_pixels_ratio_lower/upper must be in (0, 1].");
+  Require(s.lighting.num_dof == 9, "lighting.num_dof must be 9, the number of spherical harmonics used.");
+  Require(s.lighting.relaxation > 0 && s.lighting.relaxation <= 1, "lighting.relaxation must be in (0, 1].");
+  Require(s.depth.num_iters >= 1, "depth.num_iters must be at least 1.");
+  Require(s.depth.optimization_max_iters >= 1, "depth.optimization.max_iters must be at least 1.");
+  Require(s.depth.optimization_init_tr_radius > 0, "depth.optimization.init_tr_radius must be positive.");
+  Require(s.pyramid.num_levels >= 1, "pyramid.num_levels must be at least 1.");
+  Require(s.pyramid.coarse_iters >= 1, "pyramid.coarse_iters must be at least 1.");
+  Require(s.convergence.lighting_change >= 0 && s.convergence.albedo_change >= 0
+          && s.convergence.depth_cost_reduction >= 0, "convergence thresholds must not be negative.");
+  Require(s.roi.padding >= 2, "roi.padding must be at least 2, the radius of the LoG stencils.");
+  Require(s.output.png_compression >= 0 && s.output.png_compression <= 9, "output.png_compression must be in [0, 9].");
+  Require(s.output.writer_threads >= 0, "output.writer_threads must not be negative.");
+  Require(s.parallel.num_threads >= 0, "parallel.num_threads must not be negative.");
+  Require(s.parallel.threads_per_image >= 1, "parallel.threads_per_image must be at least 1.");
+  Require(s.parallel.render_ahead >= 0, "parallel.render_ahead must not be negative.");
+  Require(s.parallel.memory_budget_mb >= 0, "parallel.memory_budget_mb must not be negative.");
+  Require(s.deadline.seconds_per_image >= 0, "deadline.seconds_per_image must not be negative.");
+  Require(s.metrics.format == "prometheus" || s.metrics.format == "json",
+          "metrics.format must be prometheus or json.");
+  Require(s.metrics.interval_seconds >= 0, "metrics.interval_seconds must not be negative.");
+  Require(s.handoff.shm_prefix.find('/') == string::npos && s.handoff.shm_prefix.size() <= 200,
+          "handoff.shm_prefix must not contain a / and be at most 200 characters.");
+  Require(s.mean_texture_options.is_object(), "mean_texture_options must be an object.");
+  return s;
+}
+
+json SFSSettings::ToJson() const {
+  json j;
+  j["max_iters"] = max_iters;
+  j["preparation_only"] = preparation_only;
+
+  j["lighting"]["saturated_pixels_threshold"] = lighting.saturated_pixels_threshold;
+  j["lighting"]["dark_pixels_threshold"] = lighting.dark_pixels_threshold;
+  j["lighting"]["albedo_distance_bins"] = lighting.albedo_distance_bins;
+  j["lighting"]["lighting_pixels_ratio_lower"] = lighting.lighting_pixels_ratio_lower;
+  j["lighting"]["lighting_pixels_ratio_upper"] = lighting.lighting_pixels_ratio_upper;
+  j["lighting"]["num_dof"] = lighting.num_dof;
+  j["lighting"]["w_reg"] = lighting.w_reg;
+  j["lighting"]["relaxation"] = lighting.relaxation;
+
+  j["albedo"]["lambda"] = albedo.lambda;
+
+  j["depth"]["num_iters"] = depth.num_iters;
+  j["depth"]["w_data"] = depth.w_data;
+  j["depth"]["w_int"] = depth.w_int;
+  j["depth"]["w_reg"] = depth.w_reg;
+  j["depth"]["w_smooth"] = depth.w_smooth;
+  j["depth"]["integrability_threshold"] = depth.integrability_threshold;
+  j["depth"]["optimization"]["max_iters"] = depth.optimization_max_iters;
+  j["depth"]["optimization"]["init_tr_radius"] = depth.optimization_init_tr_radius;
+
+  j["pyramid"]["num_levels"] = pyramid.num_levels;
+  j["pyramid"]["coarse_iters"] = pyramid.coarse_iters;
+  j["pyramid"]["min_level_size"] = pyramid.min_level_size;
+
+  j["convergence"]["lighting_change"] = convergence.lighting_change;
+  j["convergence"]["albedo_change"] = convergence.albedo_change;
+  j["convergence"]["depth_cost_reduction"] = convergence.depth_cost_reduction;
+
+  j["roi"]["enabled"] = roi.enabled;
+  j["roi"]["padding"] = roi.padding;
+
+  j["output"]["level"] = OutputLevelName(output.level);
+  j["output"]["writer_threads"] = output.writer_threads;
+  j["output"]["png_compression"] = output.png_compression;
+
+  j["trace"]["enabled"] = trace.enabled;
+  j["trace"]["filename"] = trace.filename;
+  j["trace"]["memory"] = trace.memory;
+
+  j["parallel"]["num_threads"] = parallel.num_threads;
+  j["parallel"]["threads_per_image"] = parallel.threads_per_image;
+  j["parallel"]["render_ahead"] = parallel.render_ahead;
+  j["parallel"]["memory_budget_mb"] = parallel.memory_budget_mb;
+  j["parallel"]["streaming"] = parallel.streaming;
+
+  j["metrics"]["path"] = metrics.path;
+  j["metrics"]["format"] = metrics.format;
+  j["metrics"]["interval_seconds"] = metrics.interval_seconds;
+
+  j["log"]["level"] = LogLevelName(log.level);
+  j["log"]["modules"] = json::object();
+  for(auto& m : log.modules) j["log"]["modules"][LogModuleName(m.first)] = LogLevelName(m.second);
+
+  j["cache"]["path"] = cache.path;
+
+  j["deadline"]["seconds_per_image"] = deadline.seconds_per_image;
+
+  j["handoff"]["shm_prefix"] = handoff.shm_prefix;
+
+  j["mean_texture_options"] = mean_texture_options;
+  return j;
+}
+
+void ApplyLogSettings(const SFSLogSettings& settings) {
+  SFSLog::SetVerbosity(settings.level);
+  for(auto& m : settings.modules) SFSLog::SetVerbosity(m.first, m.second);
+}
+
+string DefaultSettingsFilename(const string& home_directory) {
+  const char* filename = std::getenv("SFS_SETTINGS_FILE");
+  if(filename && filename[0]) return string(filename);
+  return home_directory + "/Codes/FaceShapeFromShading/settings.txt";
+}
+
+void MergeSettings(json& base, const json& override) {
+  if(!base.is_object() || !override.is_object()) {
+    base = override;
+    return;
+  }
+  for(auto it = override.begin(); it != override.end(); ++it) {
+    MergeSettings(base[it.key()], it.value());
+  }
+}
+
+void ApplySettingsOverride(json& settings, const string& assignment) {
+  const size_t pos = assignment.find('=');
+  if(pos == string::npos || pos == 0) {
+    throw invalid_argument("Settings override " + assignment + " is not of the form key=value.");
+  }
+
+  json value;
+  try {
+    value = json::parse(assignment.substr(pos + 1));
+  } catch(std::exception&) {
+    value = assignment.substr(pos + 1);
+  }
+
+  // walk down key.subkey..., creating the objects on the way
+  json* node = &settings;
+  const string key = assignment.substr(0, pos);
+  size_t start = 0;
+  while(true) {
+    const size_t dot = key.find('.', start);
+    const string name = key.substr(start, dot == string::npos? string::npos : dot - start);
+    if(!node->is_object()) *node = json::object();
+    node = &(*node)[name];
+    if(dot == string::npos) break;
+    start = dot + 1;
+  }
+  *node = value;
+}
+
+namespace {
+
+json ParseSettingsJson(const string& filename) {
+  ifstream fin(filename);
+  if(!fin) throw runtime_error("Failed to open settings file " + filename);
+  return json::parse(fin);
+}
+
+}  // namespace
+
+json LoadSettingsJson(const string& filename,
+                      const vector<string>& override_files,
+                      const vector<string>& overrides) {
+  json settings = ParseSettingsJson(filename);
+  for(auto& override_file : override_files) {
+    MergeSettings(settings, ParseSettingsJson(override_file));
+  }
+  for(auto& assignment : overrides) {
+    ApplySettingsOverride(settings, assignment);
+  }
+  return settings;
+}
+
+json MergeJobSettings(const json& global_settings, const json& job,
+                      const vector<string>& overrides) {
+  json settings = global_settings;
+  if(job.count("settings_overrides")) {
+    for(auto& override_file : job["settings_overrides"]) {
+      MergeSettings(settings, ParseSettingsJson(override_file.get<string>()));
+    }
+  }
+  if(job.count("settings")) MergeSettings(settings, job["settings"]);
+  for(auto& assignment : overrides) {
+    ApplySettingsOverride(settings, assignment);
+  }
+  return settings;
+}
+
+void AddSettingsOptions(boost::program_options::options_description& desc) {
+  namespace po = boost::program_options;
+  desc.add_options()
+    ("global_settings", po::value<string>(), "Global settings file. Defaults to $SFS_SETTINGS_FILE or the one in the source tree.")
+    ("settings_override", po::value<vector<string>>()->composing(), "Settings file merged over the global settings. Can be repeated.")
+    ("set", po::value<vector<string>>()->composing(), "Override one setting, e.g. --set depth.w_reg=0.1. Can be repeated.");
+}
+
+json LoadSettingsJson(const boost::program_options::variables_map& vm,
+                      const string& home_directory) {
+  auto get_list = [&vm](const string& name) {
+    return vm.count(name)? vm[name].as<vector<string>>() : vector<string>();
+  };
+  const string filename = vm.count("global_settings")?
+    vm["global_settings"].as<string>() : DefaultSettingsFilename(home_directory);
+  return LoadSettingsJson(filename, get_list("settings_override"), get_list("set"));
+}
@@ -0,0 +1,202 @@
+#ifndef FACESHAPEFROMSHADING_SFS_SETTINGS_H
+#define FACESHAPEFROMSHADING_SFS_SETTINGS_H
+
+#include "common.h"
+
+#include <boost/program_options.hpp>
+
+#include "sfs_log.h"
+#include "sfs_output.h"
+#include "utils.h"
+
+// Typed form of the global settings file (settings.txt). The JSON is parsed
+// and validated once, the solver stages only read these structs. Keys missing
+// from the file keep the defaults below, unknown keys are rejected.
+
+struct SFSLightingSettings {
+  // Pixels brighter or darker than these (average of R, G, B) are not used
+  int saturated_pixels_threshold = 225;
+  int dark_pixels_threshold = 25;
+
+  int albedo_distance_bins = 1000;
+  // Fraction of the pixels used, interpolated from lower to upper over the
+  // iterations
+  double lighting_pixels_ratio_lower = 1.0;
+  double lighting_pixels_ratio_upper = 1.0;
+  int num_dof = 9;
+  double w_reg = 0.0001;
+  double relaxation = 1.0;
+};
+
+struct SFSAlbedoSettings {
+  double lambda = 256.0;
+};
+
+struct SFSDepthSettings {
+  int num_iters = 3;
+  double w_data = 1.0;
+  double w_int = 0.0;
+  double w_reg = 0.0;
+  double w_smooth = 0.0;
+  double integrability_threshold = 64.0;
+
+  // ceres options
+  int optimization_max_iters = 10;
+  double optimization_init_tr_radius = 0.01;
+};
+
+struct SFSPyramidSettings {
+  int num_levels = 1;
+  int coarse_iters = 2;
+  int min_level_size = 32;
+};
+
+struct SFSRoiSettings {
+  // Solve on the bounding box of the face instead of the whole image
+  bool enabled = false;
+  // Margin around the face, at least the 2 pixels of the LoG stencils
+  int padding = 8;
+};
+
+// Early stopping. The main loop ends after an iteration in which every
+// enabled change is below its threshold, the depth iterations end when a
+// solve reduces the cost by less than depth_cost_reduction. 0 disables a
+// test.
+struct SFSConvergenceSettings {
+  // Relative change of the lighting coefficients
+  double lighting_change = 0;
+  // Mean change of the albedo over the face, relative to its mean value
+  double albedo_change = 0;
+  // (initial cost - final cost) / initial cost of a depth solve
+  double depth_cost_reduction = 0;
+};
+
+struct SFSOutputSettings {
+  SFSOutputLevel level = SFSOutputLevel::Debug;
+  int writer_threads = 2;
+  int png_compression = 1;
+};
+
+struct SFSTraceSettings {
+  bool enabled = false;
+  string filename = "trace.json";
+  // Record the RSS and heap usage of every span (see sfs_trace.h)
+  bool memory = false;
+};
+
+struct SFSLogSettings {
+  // Most verbose messages printed (see sfs_log.h)
+  SFSLogLevel level = SFSLogLevel::Info;
+  // Overrides of the level per module, e.g. {"depth": "debug"}
+  map<SFSLogModule, SFSLogLevel> modules;
+};
+
+// Sets the verbosity of every module
+void ApplyLogSettings(const SFSLogSettings& settings);
+
+struct SFSDeadlineSettings {
+  // Wall clock budget for solving one image, 0 for no limit
+  double seconds_per_image = 0;
+};
+
+struct SFSMetricsSettings {
+  // File the metrics are written to (see sfs_metrics.h), empty to disable it
+  string path;
+  // "prometheus" or "json"
+  string format = "prometheus";
+  // 0 writes the file only at the end of each job
+  double interval_seconds = 30;
+};
+
+struct SFSCacheSettings {
+  // Directory of the result cache (see sfs_cache.h), empty to disable it
+  string path;
+};
+
+struct SFSHandoffSettings {
+  // Prefix of the shared memory objects the prepared maps are handed over in
+  // (see sfs_shm.h), empty to disable it. The preparation only mode publishes
+  // them, a solving run attaches them instead of preparing the images.
+  string shm_prefix;
+};
+
+struct SFSParallelSettings {
+  // 0 means all hardware threads
+  int num_threads = 0;
+  int threads_per_image = 8;
+  // Images prepared ahead of the solvers
+  int render_ahead = 2;
+  // Memory of the images held at once, from their preparation to their
+  // export, as estimated from their size. 0 means no limit
+  int memory_budget_mb = 0;
+  // Read each image when it is prepared and keep the face index maps on disk
+  // until then, so the memory of a job does not grow with its size
+  bool streaming = false;
+};
+
+struct SFSSettings {
+  int max_iters = 3;
+  bool preparation_only = true;
+
+  SFSLightingSettings lighting;
+  SFSAlbedoSettings albedo;
+  SFSDepthSettings depth;
+  SFSPyramidSettings pyramid;
+  SFSConvergenceSettings convergence;
+  SFSRoiSettings roi;
+  SFSOutputSettings output;
+  SFSTraceSettings trace;
+  SFSMetricsSettings metrics;
+  SFSLogSettings log;
+  SFSParallelSettings parallel;
+  SFSCacheSettings cache;
+  SFSDeadlineSettings deadline;
+  SFSHandoffSettings handoff;
+
+  // Passed to GenerateMeanTexture as is
+  json mean_texture_options = json::object();
+
+  // Throws invalid_argument naming the offending key.
+  static SFSSettings FromJson(const json& j);
+
+  // Complete settings, including the defaults, in the layout of settings.txt
+  json ToJson() const;
+};
+
+// $SFS_SETTINGS_FILE if set, the settings.txt of the source tree otherwise
+string DefaultSettingsFilename(const string& home_directory);
+
+// Merge override into base: objects are merged key by key, anything else is
+// replaced.
+void MergeSettings(json& base, const json& override);
+
+// Apply a command line override "key.subkey=value". The value is parsed as
+// JSON, and taken as a string if that fails.
+void ApplySettingsOverride(json& settings, const string& assignment);
+
+// The settings file, then each override file, then each key=value override.
+json LoadSettingsJson(const string& filename,
+                      const vector<string>& override_files = vector<string>(),
+                      const vector<string>& overrides = vector<string>());
+
+// The settings of a sfs_worker job: the "settings_overrides" files and the
+// "settings" object of the job merged over the global settings, then the
+// command line overrides again so they win over the job.
+json MergeJobSettings(const json& global_settings, const json& job,
+                      const vector<string>& overrides = vector<string>());
+
+inline SFSSettings LoadSettings(const string& filename,
+                                const vector<string>& override_files = vector<string>(),
+                                const vector<string>& overrides = vector<string>()) {
+  return SFSSettings::FromJson(LoadSettingsJson(filename, override_files, overrides));
+}
+
+// Command line options shared by the programs that run the pipeline:
+//   --global_settings    settings file, DefaultSettingsFilename if not given
+//   --settings_override  settings file merged over it, can be repeated
+//   --set key=value      single setting override, can be repeated
+void AddSettingsOptions(boost::program_options::options_description& desc);
+json LoadSettingsJson(const boost::program_options::variables_map& vm,
+                      const string& home_directory);
+
+#endif  // FACESHAPEFROMSHADING_SFS_SETTINGS_H
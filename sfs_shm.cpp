@@ -0,0 +1,224 @@
+#include "sfs_shm.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kSharedMapsMagic[8] = {'S', 'F', 'S', 'S', 'H', 'M', '\0', '\0'};
+const uint32_t kSharedMapsVersion = 1;
+const size_t kPayloadAlignment = 64;
+
+// Same kinds as the checkpoint fields
+enum FieldKind : uint32_t {
+  kMat = 1,
+  kVectorXd = 2,
+  kIntVector = 3
+};
+
+struct SegmentHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_fields;
+  uint64_t size;
+  uint64_t fingerprint;
+};
+
+struct FieldEntry {
+  char name[48];
+  uint32_t kind;
+  int32_t type, rows, cols;
+  uint64_t offset;
+  uint64_t size;
+};
+
+size_t AlignUp(size_t offset) {
+  return (offset + kPayloadAlignment - 1) / kPayloadAlignment * kPayloadAlignment;
+}
+
+}  // namespace
+
+void SharedMapsWriter::AddField(const string& name, uint32_t kind, const void* data, size_t size,
+                                int32_t type, int32_t rows, int32_t cols) {
+  if(name.size() >= sizeof(FieldEntry::name)) {
+    throw invalid_argument("Shared maps field name too long: " + name);
+  }
+  fields.push_back(Field{name, kind, type, rows, cols, data, size});
+}
+
+void SharedMapsWriter::Write(const string& name, const cv::Mat& m) {
+  const cv::Mat* mc = &m;
+  if(!m.isContinuous()) {
+    copies.push_back(m.clone());
+    mc = &copies.back();
+  }
+  AddField(name, kMat, mc->data, mc->total() * mc->elemSize(), mc->type(), mc->rows, mc->cols);
+}
+
+void SharedMapsWriter::Write(const string& name, const VectorXd& v) {
+  AddField(name, kVectorXd, v.data(), sizeof(double) * v.size());
+}
+
+void SharedMapsWriter::Write(const string& name, const vector<int>& v) {
+  AddField(name, kIntVector, v.data(), sizeof(int) * v.size());
+}
+
+bool SharedMapsWriter::Publish(const string& name) const {
+  // lay out the payloads after the field table
+  vector<FieldEntry> entries(fields.size());
+  size_t offset = AlignUp(sizeof(SegmentHeader) + sizeof(FieldEntry) * fields.size());
+  for(size_t j=0;j<fields.size();++j) {
+    FieldEntry& e = entries[j];
+    memset(&e, 0, sizeof(e));
+    strncpy(e.name, fields[j].name.c_str(), sizeof(e.name) - 1);
+    e.kind = fields[j].kind;
+    e.type = fields[j].type; e.rows = fields[j].rows; e.cols = fields[j].cols;
+    e.offset = offset;
+    e.size = fields[j].size;
+    offset = AlignUp(offset + fields[j].size);
+  }
+  const size_t total_size = offset;
+
+  // a new object rather than the old one truncated, which may still be mapped
+  shm_unlink(name.c_str());
+  const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if(fd < 0) return false;
+  // reserve the memory now, a full /dev/shm would otherwise fault on write
+  if(posix_fallocate(fd, 0, total_size) != 0) {
+    close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+  void* mapped = mmap(nullptr, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(mapped == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  unsigned char* segment = static_cast<unsigned char*>(mapped);
+  SegmentHeader header;
+  memset(&header, 0, sizeof(header));
+  header.version = kSharedMapsVersion;
+  header.num_fields = static_cast<uint32_t>(fields.size());
+  header.size = total_size;
+  header.fingerprint = fingerprint;
+  memcpy(segment, &header, sizeof(header));
+  if(!entries.empty()) memcpy(segment + sizeof(header), entries.data(), sizeof(FieldEntry) * entries.size());
+  for(size_t j=0;j<fields.size();++j) {
+    if(fields[j].size) memcpy(segment + entries[j].offset, fields[j].data, fields[j].size);
+  }
+
+  // the segment is complete once it has its magic
+  __sync_synchronize();
+  memcpy(segment, kSharedMapsMagic, sizeof(kSharedMapsMagic));
+  munmap(mapped, total_size);
+  return true;
+}
+
+bool SharedMapsReader::Attach(const string& name, uint64_t fingerprint) {
+  Detach();
+
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if(fd < 0) return false;
+  struct stat st;
+  if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SegmentHeader)) {
+    close(fd);
+    return false;
+  }
+  const size_t mapped_size = st.st_size;
+  // private and writable, so the solvers can work on the maps in place
+  void* mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapped == MAP_FAILED) return false;
+  base = static_cast<unsigned char*>(mapped);
+  size = mapped_size;
+
+  SegmentHeader header;
+  memcpy(&header, base, sizeof(header));
+  const bool valid_header =
+    memcmp(header.magic, kSharedMapsMagic, sizeof(kSharedMapsMagic)) == 0
+    && header.version == kSharedMapsVersion
+    && header.size == size
+    && (fingerprint == 0 || header.fingerprint == fingerprint)
+    && sizeof(SegmentHeader) + sizeof(FieldEntry) * static_cast<size_t>(header.num_fields) <= size;
+  if(!valid_header) {
+    Detach();
+    return false;
+  }
+
+  for(uint32_t j=0;j<header.num_fields;++j) {
+    FieldEntry e;
+    memcpy(&e, base + sizeof(SegmentHeader) + sizeof(FieldEntry) * j, sizeof(e));
+    e.name[sizeof(e.name) - 1] = '\0';
+    if(e.offset > size || e.size > size - e.offset || e.offset % kPayloadAlignment != 0) {
+      Detach();
+      return false;
+    }
+    fields[e.name] = Field{e.kind, e.type, e.rows, e.cols, base + e.offset, static_cast<size_t>(e.size)};
+  }
+  return true;
+}
+
+void SharedMapsReader::Detach() {
+  if(base) munmap(base, size);
+  base = nullptr;
+  size = 0;
+  fields.clear();
+}
+
+uint64_t SharedMapsReader::fingerprint() const {
+  if(!base) return 0;
+  SegmentHeader header;
+  memcpy(&header, base, sizeof(header));
+  return header.fingerprint;
+}
+
+const SharedMapsReader::Field* SharedMapsReader::Find(const string& name, uint32_t kind) const {
+  auto it = fields.find(name);
+  if(it == fields.end() || it->second.kind != kind) return nullptr;
+  return &(it->second);
+}
+
+bool SharedMapsReader::Read(const string& name, cv::Mat& m) const {
+  const Field* field = Find(name, kMat);
+  if(!field || field->rows < 0 || field->cols < 0) return false;
+  cv::Mat view(field->rows, field->cols, field->type, field->data);
+  if(view.total() * view.elemSize() != field->size) return false;
+  m = view;
+  return true;
+}
+
+bool SharedMapsReader::Read(const string& name, VectorXd& v) const {
+  const Field* field = Find(name, kVectorXd);
+  if(!field || field->size % sizeof(double) != 0) return false;
+  v.resize(field->size / sizeof(double));
+  memcpy(v.data(), field->data, field->size);
+  return true;
+}
+
+bool SharedMapsReader::Read(const string& name, vector<int>& v) const {
+  const Field* field = Find(name, kIntVector);
+  if(!field || field->size % sizeof(int) != 0) return false;
+  v.resize(field->size / sizeof(int));
+  memcpy(v.data(), field->data, field->size);
+  return true;
+}
+
+string SharedMapsName(const string& prefix, int i) {
+  return "/" + prefix + "_" + to_string(i);
+}
+
+bool HasSharedMaps(const string& name, uint64_t fingerprint) {
+  SharedMapsReader reader;
+  return reader.Attach(name, fingerprint);
+}
+
+bool RemoveSharedMaps(const string& name) {
+  return shm_unlink(name.c_str()) == 0;
+}
@@ -0,0 +1,123 @@
+#ifndef FACESHAPEFROMSHADING_SFS_SHM_H
+#define FACESHAPEFROMSHADING_SFS_SHM_H
+
+#include "common.h"
+
+#include <cstdint>
+
+#include <opencv2/opencv.hpp>
+
+#include "sfs_maps.h"
+
+// Hands the prepared maps of an image to another process through a POSIX
+// shared memory object, instead of writing them out as images and text. A
+// segment holds named fields like a checkpoint (sfs_checkpoint.h), but every
+// payload starts on a 64 byte boundary and is stored as it is in memory, so
+// a reader maps the segment and uses the planes in place:
+//
+//   header  magic "SFSSHM\0\0" | uint32 version | uint32 num_fields
+//           | uint64 size | uint64 fingerprint
+//   fields  char name[48] | uint32 kind | int32 type, rows, cols
+//           | uint64 offset | uint64 size
+//   payloads
+//
+// The magic is written last, a reader never attaches a segment that is still
+// being written. A segment outlives its writer until it is removed, which the
+// reader does once it has attached it. Only this file and sfs_maps.h are
+// needed to read the maps, see the sfsshm library.
+
+class SharedMapsWriter {
+public:
+  explicit SharedMapsWriter(uint64_t fingerprint = 0) : fingerprint(fingerprint) {}
+
+  // The data is referenced, not copied: it has to stay alive until Publish.
+  // Names are at most 47 characters.
+  void Write(const string& name, const cv::Mat& m);
+  void Write(const string& name, const VectorXd& v);
+  void Write(const string& name, const vector<int>& v);
+
+  // One field per plane: name.0, name.1, ...
+  template <int Channels>
+  void Write(const string& name, const PlanarMap<Channels>& m) {
+    for(int k=0;k<Channels;++k) Write(name + "." + to_string(k), m.plane(k));
+  }
+
+  // Creates the shared memory object, replacing an older one of the same
+  // name. Readers attached to the old one keep their data.
+  bool Publish(const string& name) const;
+
+private:
+  struct Field {
+    string name;
+    uint32_t kind;
+    int32_t type, rows, cols;
+    const void* data;
+    size_t size;
+  };
+
+  void AddField(const string& name, uint32_t kind, const void* data, size_t size,
+                int32_t type = 0, int32_t rows = 0, int32_t cols = 0);
+
+  uint64_t fingerprint;
+  vector<Field> fields;
+  // continuous copies of the matrices that were not
+  vector<cv::Mat> copies;
+};
+
+class SharedMapsReader {
+public:
+  SharedMapsReader() : base(nullptr), size(0) {}
+  ~SharedMapsReader() { Detach(); }
+
+  SharedMapsReader(const SharedMapsReader&) = delete;
+  SharedMapsReader& operator=(const SharedMapsReader&) = delete;
+
+  // Maps the object. Returns false if it is missing, unfinished, malformed or
+  // has another fingerprint. A fingerprint of 0 accepts any.
+  bool Attach(const string& name, uint64_t fingerprint = 0);
+  void Detach();
+
+  bool attached() const { return base != nullptr; }
+  uint64_t fingerprint() const;
+
+  // Matrices and planes are views of the segment, valid while the reader is
+  // attached. The mapping is private: writing to them copies the touched
+  // pages and leaves the segment as it is.
+  bool Read(const string& name, cv::Mat& m) const;
+  bool Read(const string& name, VectorXd& v) const;
+  bool Read(const string& name, vector<int>& v) const;
+
+  template <int Channels>
+  bool Read(const string& name, PlanarMap<Channels>& m) const {
+    vector<cv::Mat> planes(Channels);
+    for(int k=0;k<Channels;++k) {
+      if(!Read(name + "." + to_string(k), planes[k])) return false;
+    }
+    return m.SetPlanes(planes);
+  }
+
+private:
+  struct Field {
+    uint32_t kind;
+    int32_t type, rows, cols;
+    unsigned char* data;
+    size_t size;
+  };
+
+  const Field* Find(const string& name, uint32_t kind) const;
+
+  unsigned char* base;
+  size_t size;
+  map<string, Field> fields;
+};
+
+// Name of the object the prepared maps of image i are published under
+string SharedMapsName(const string& prefix, int i);
+
+// Whether a finished segment of that fingerprint is there to attach
+bool HasSharedMaps(const string& name, uint64_t fingerprint = 0);
+
+// Removes the object, attached readers keep their data
+bool RemoveSharedMaps(const string& name);
+
+#endif  // FACESHAPEFROMSHADING_SFS_SHM_H
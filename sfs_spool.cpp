@@ -0,0 +1,265 @@
+#include "sfs_spool.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include <signal.h>
+#include <unistd.h>
+
+#include "sfs_log.h"
+
+namespace {
+
+string HostName() {
+  char name[256] = {0};
+  if(gethostname(name, sizeof(name) - 1) != 0) return "localhost";
+  return string(name);
+}
+
+vector<fs::path> ListJobs(const fs::path& dir) {
+  vector<fs::path> jobs;
+  if(!fs::is_directory(dir)) return jobs;
+  for(fs::directory_iterator it(dir), end; it != end; ++it) {
+    if(fs::is_regular_file(it->status()) && it->path().extension() == ".json") {
+      jobs.push_back(it->path());
+    }
+  }
+  std::sort(jobs.begin(), jobs.end());
+  return jobs;
+}
+
+bool ReadJson(const fs::path& filename, json& j) {
+  ifstream fin(filename.string());
+  if(!fin) return false;
+  try {
+    j = json::parse(fin);
+  } catch(std::exception&) {
+    return false;
+  }
+  return true;
+}
+
+// The owner of a lease is a process of this host that has exited
+bool LeaseOwnerExited(const json& lease) {
+  if(!lease.is_object() || lease.value("host", string()) != HostName()) return false;
+  const int pid = lease.value("pid", 0);
+  if(pid <= 0 || pid == getpid()) return false;
+  return kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+}  // namespace
+
+SFSSpool::SFSSpool(const fs::path& spool_dir)
+  : spool_dir(spool_dir),
+    running_dir(spool_dir / fs::path("running")),
+    done_dir(spool_dir / fs::path("done")),
+    failed_dir(spool_dir / fs::path("failed")) {
+  fs::create_directories(running_dir);
+  fs::create_directories(done_dir);
+  fs::create_directories(failed_dir);
+}
+
+string SFSSpool::DefaultOwner() {
+  return HostName() + ":" + to_string(getpid());
+}
+
+void SFSSpool::Submit(const string& name, const json& job) {
+  WriteAtomically(spool_dir / fs::path(name + ".json"), job);
+}
+
+vector<fs::path> SFSSpool::PendingJobs() const {
+  return ListJobs(spool_dir);
+}
+
+bool SFSSpool::Claim(const fs::path& pending_job, const string& owner, fs::path& running_job) {
+  const fs::path target = running_dir / pending_job.filename();
+  boost::system::error_code ec;
+  fs::rename(pending_job, target, ec);
+  if(ec) return false;
+
+  // the job keeps the time it was submitted, refresh it so the job does not
+  // look abandoned before the lease is written
+  fs::last_write_time(target, std::time(nullptr), ec);
+  if(ec) return false;
+
+  json lease;
+  lease["owner"] = owner;
+  lease["host"] = HostName();
+  lease["pid"] = static_cast<int>(getpid());
+  lease["claimed_at"] = static_cast<int64_t>(std::time(nullptr));
+  WriteAtomically(LeaseFile(target), lease);
+
+  running_job = target;
+  return true;
+}
+
+void SFSSpool::RenewLease(const fs::path& running_job) {
+  boost::system::error_code ec;
+  fs::last_write_time(LeaseFile(running_job), std::time(nullptr), ec);
+}
+
+bool SFSSpool::Complete(const fs::path& running_job, const string& owner) {
+  const fs::path taken = TakeOwnedJob(running_job, owner);
+  if(taken.empty()) return false;
+  boost::system::error_code ec;
+  fs::rename(taken, done_dir / running_job.filename(), ec);
+  if(ec) {
+    fs::rename(taken, running_job, ec);
+    return false;
+  }
+  fs::remove(LeaseFile(running_job), ec);
+  return true;
+}
+
+bool SFSSpool::Fail(const fs::path& running_job, const string& owner, const string& error) {
+  const fs::path taken = TakeOwnedJob(running_job, owner);
+  if(taken.empty()) return false;
+  boost::system::error_code ec;
+  json job;
+  if(!ReadJson(taken, job)) {
+    // keep the file as it is for inspection
+    fs::rename(taken, failed_dir / running_job.filename(), ec);
+  } else {
+    Reschedule(JobName(running_job), job, error);
+    fs::remove(taken, ec);
+  }
+  fs::remove(LeaseFile(running_job), ec);
+  return true;
+}
+
+vector<string> SFSSpool::RequeueAbandoned(std::chrono::seconds lease_duration) {
+  vector<string> requeued;
+  const std::time_t now = std::time(nullptr);
+  for(auto& running_job : ListJobs(running_dir)) {
+    const fs::path lease_file = LeaseFile(running_job);
+    boost::system::error_code ec;
+
+    // a job without a lease yet is timed from its claim
+    json lease;
+    const bool has_lease = ReadJson(lease_file, lease);
+    const std::time_t renewed = fs::last_write_time(has_lease? lease_file : running_job, ec);
+    if(ec) continue;
+
+    string reason;
+    if(now - renewed > lease_duration.count()) {
+      reason = "lease expired";
+    } else if(has_lease && LeaseOwnerExited(lease)) {
+      reason = "owner " + lease.value("owner", string()) + " exited";
+    } else {
+      continue;
+    }
+
+    const fs::path taken = TakeRunningJob(running_job);
+    if(taken.empty()) continue;
+    fs::remove(lease_file, ec);
+    json job;
+    if(!ReadJson(taken, job)) {
+      SFS_LOG(Warning, Spool) << "Dropping unreadable job " << running_job;
+    } else {
+      Reschedule(JobName(running_job), job, reason);
+      requeued.push_back(JobName(running_job));
+    }
+    fs::remove(taken, ec);
+  }
+  return requeued;
+}
+
+SFSSpool::Status SFSSpool::GetStatus() const {
+  Status status;
+  status.pending = ListJobs(spool_dir).size();
+  status.running = ListJobs(running_dir).size();
+  status.done = ListJobs(done_dir).size();
+  status.failed = ListJobs(failed_dir).size();
+  return status;
+}
+
+fs::path SFSSpool::LeaseFile(const fs::path& running_job) const {
+  return running_dir / fs::path(JobName(running_job) + ".lease");
+}
+
+bool SFSSpool::OwnsLease(const fs::path& running_job, const string& owner) const {
+  json lease;
+  return ReadJson(LeaseFile(running_job), lease) && lease.value("owner", string()) == owner;
+}
+
+fs::path SFSSpool::TakeRunningJob(const fs::path& running_job) const {
+  // only one process can rename the job, the name no longer ends in .json
+  const fs::path taken = running_dir / fs::path(running_job.filename().string() + ".taken." + to_string(getpid()));
+  boost::system::error_code ec;
+  fs::rename(running_job, taken, ec);
+  if(ec) return fs::path();
+  return taken;
+}
+
+fs::path SFSSpool::TakeOwnedJob(const fs::path& running_job, const string& owner) const {
+  // Checked once the job is out of running/, where it can no longer be
+  // requeued and claimed again by another process
+  const fs::path taken = TakeRunningJob(running_job);
+  if(taken.empty()) return taken;
+  if(!OwnsLease(running_job, owner)) {
+    boost::system::error_code ec;
+    fs::rename(taken, running_job, ec);
+    return fs::path();
+  }
+  return taken;
+}
+
+void SFSSpool::Reschedule(const string& name, json job, const string& error) {
+  const int attempts = job.value("attempts", 0) + 1;
+  const int max_attempts = job.value("max_attempts", 1);
+  job["attempts"] = attempts;
+  if(attempts < max_attempts) {
+    job["last_error"] = error;
+    job.erase("error");
+    WriteAtomically(spool_dir / fs::path(name + ".json"), job);
+    SFS_LOG(Warning, Spool) << "Job " << name << " requeued (" << error << "), attempt "
+                            << attempts + 1 << " of " << max_attempts;
+  } else {
+    job["error"] = error;
+    WriteAtomically(failed_dir / fs::path(name + ".json"), job);
+    SFS_LOG(Error, Spool) << "Job " << name << " failed after " << attempts << " attempts: " << error;
+  }
+}
+
+void SFSSpool::WriteAtomically(const fs::path& filename, const json& j) const {
+  // processes on several hosts may write the same file, e.g. requeue a job
+  const fs::path tmp = filename.parent_path() / fs::path(
+    "." + filename.filename().string() + ".tmp." + HostName() + "." + to_string(getpid()));
+  {
+    ofstream fout(tmp.string());
+    fout << setw(2) << j << endl;
+    if(!fout) throw runtime_error("Failed to write " + tmp.string());
+  }
+  fs::rename(tmp, filename);
+}
+
+struct SFSLeaseKeeper::State {
+  std::mutex mtx;
+  std::condition_variable stop_requested;
+  bool stopping = false;
+  std::thread thread;
+};
+
+SFSLeaseKeeper::SFSLeaseKeeper(SFSSpool& spool, const fs::path& running_job, std::chrono::seconds interval)
+  : state(new State) {
+  State* s = state.get();
+  s->thread = std::thread([s, &spool, running_job, interval]() {
+    std::unique_lock<std::mutex> lock(s->mtx);
+    while(!s->stop_requested.wait_for(lock, interval, [s]{ return s->stopping; })) {
+      spool.RenewLease(running_job);
+    }
+  });
+}
+
+SFSLeaseKeeper::~SFSLeaseKeeper() {
+  {
+    std::lock_guard<std::mutex> lock(state->mtx);
+    state->stopping = true;
+  }
+  state->stop_requested.notify_all();
+  state->thread.join();
+}
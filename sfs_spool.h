@@ -0,0 +1,109 @@
+#ifndef FACESHAPEFROMSHADING_SFS_SPOOL_H
+#define FACESHAPEFROMSHADING_SFS_SPOOL_H
+
+#include "common.h"
+
+#include <chrono>
+
+#include "boost/filesystem/operations.hpp"
+#include "boost/filesystem/path.hpp"
+
+namespace fs = boost::filesystem;
+
+#include "nlohmann/json.hpp"
+using json = nlohmann::json;
+
+// File based job queue shared by sfs_worker and sfs_coordinator. All of the
+// state is kept in the spool directory, so any number of processes, on any
+// machines that mount it, can work on the same queue:
+//
+//   <spool_dir>/*.json               pending jobs, taken in filename order
+//   <spool_dir>/running/<job>.json   claimed jobs
+//   <spool_dir>/running/<job>.lease  lease of a claimed job
+//   <spool_dir>/done/                finished jobs
+//   <spool_dir>/failed/              failed jobs, with the error in the file
+//
+// A job is claimed by renaming it into running/, which only one process can
+// do. The owner renews the lease by touching the lease file while it works on
+// the job. A job whose lease has not been renewed for the lease duration, or
+// whose owner is a process of this host that no longer exists, is put back
+// in the queue by whoever notices it first.
+//
+// A job that fails or is abandoned counts as one attempt. It is put back in
+// the queue until its "attempts" reach "max_attempts" (1 if not given), then
+// moved to failed/.
+class SFSSpool {
+public:
+  using Clock = std::chrono::system_clock;
+
+  // Creates the directories if needed
+  explicit SFSSpool(const fs::path& spool_dir);
+
+  const fs::path& dir() const { return spool_dir; }
+
+  // Add a job. It is written under a temporary name first, so readers never
+  // see a partial job.
+  void Submit(const string& name, const json& job);
+
+  vector<fs::path> PendingJobs() const;
+
+  // Take a pending job for owner. Returns false if another process took it
+  // first, running_job is set otherwise.
+  bool Claim(const fs::path& pending_job, const string& owner, fs::path& running_job);
+
+  void RenewLease(const fs::path& running_job);
+
+  // Finish a job claimed by owner. Both return false if the lease was lost,
+  // i.e. the job was taken back in the meantime.
+  bool Complete(const fs::path& running_job, const string& owner);
+  bool Fail(const fs::path& running_job, const string& owner, const string& error);
+
+  // Take back the running jobs whose owner is gone. Returns their names.
+  vector<string> RequeueAbandoned(std::chrono::seconds lease_duration);
+
+  struct Status {
+    int pending = 0, running = 0, done = 0, failed = 0;
+  };
+  Status GetStatus() const;
+
+  // Name of a job, i.e. its filename without the .json extension
+  static string JobName(const fs::path& job_file) { return job_file.stem().string(); }
+
+  // host:pid of this process
+  static string DefaultOwner();
+
+private:
+  fs::path LeaseFile(const fs::path& running_job) const;
+  bool OwnsLease(const fs::path& running_job, const string& owner) const;
+
+  // Move a running job out of the way so no other process can finish or
+  // requeue it. Returns the new name, empty if the job is gone. The lease
+  // file is left to the caller.
+  fs::path TakeRunningJob(const fs::path& running_job) const;
+
+  // Take a running job if its lease belongs to owner, put it back otherwise
+  fs::path TakeOwnedJob(const fs::path& running_job, const string& owner) const;
+
+  // Count one attempt of a job taken out of running/ and requeue or fail it
+  void Reschedule(const string& name, json job, const string& error);
+
+  void WriteAtomically(const fs::path& filename, const json& j) const;
+
+  fs::path spool_dir, running_dir, done_dir, failed_dir;
+};
+
+// Renews the lease of a claimed job from a background thread while alive.
+class SFSLeaseKeeper {
+public:
+  SFSLeaseKeeper(SFSSpool& spool, const fs::path& running_job, std::chrono::seconds interval);
+  ~SFSLeaseKeeper();
+
+  SFSLeaseKeeper(const SFSLeaseKeeper&) = delete;
+  SFSLeaseKeeper& operator=(const SFSLeaseKeeper&) = delete;
+
+private:
+  struct State;
+  unique_ptr<State> state;
+};
+
+#endif  // FACESHAPEFROMSHADING_SFS_SPOOL_H
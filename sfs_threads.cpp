@@ -0,0 +1,51 @@
+#include "sfs_threads.h"
+
+#include <thread>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef EIGEN_USE_MKL_ALL
+#include <mkl.h>
+#endif
+
+ThreadBudget::ThreadBudget(int num_threads) : num_threads(num_threads) {
+  if(this->num_threads <= 0) this->num_threads = max<int>(std::thread::hardware_concurrency(), 1);
+}
+
+ThreadPlan ThreadBudget::Split(int num_images, int threads_per_image) const {
+  threads_per_image = max(min(threads_per_image, num_threads), 1);
+  ThreadPlan plan;
+  plan.num_workers = max(min(num_threads / threads_per_image, num_images), 1);
+  plan.threads_per_worker = max(num_threads / plan.num_workers, 1);
+  return plan;
+}
+
+ScopedThreadLimit::ScopedThreadLimit(int num_threads)
+  : previous_omp_threads(0), previous_mkl_threads(0) {
+  num_threads = max(num_threads, 1);
+#ifdef _OPENMP
+  previous_omp_threads = omp_get_max_threads();
+  omp_set_num_threads(num_threads);
+#endif
+#ifdef EIGEN_USE_MKL_ALL
+  // returns the previous thread local limit, 0 if the global one was used
+  previous_mkl_threads = mkl_set_num_threads_local(num_threads);
+#endif
+}
+
+ScopedThreadLimit::~ScopedThreadLimit() {
+#ifdef _OPENMP
+  omp_set_num_threads(previous_omp_threads);
+#endif
+#ifdef EIGEN_USE_MKL_ALL
+  mkl_set_num_threads_local(previous_mkl_threads);
+#endif
+}
+
+void DisableNestedParallelism() {
+#ifdef _OPENMP
+  omp_set_max_active_levels(1);
+#endif
+}
@@ -0,0 +1,55 @@
+#ifndef FACESHAPEFROMSHADING_SFS_THREADS_H
+#define FACESHAPEFROMSHADING_SFS_THREADS_H
+
+#include "common.h"
+
+// Thread budget of a job. The solvers use threads from three sources: OpenMP
+// (Eigen and our own loops), MKL (BLAS and LAPACK under Eigen and CHOLMOD)
+// and ceres. Left alone, each of them starts one thread per core in every
+// image solved concurrently. The budget instead gives each image an explicit
+// share of the cores, and ScopedThreadLimit makes OpenMP and MKL stay within
+// it. Ceres gets the same number through its solver options.
+
+// How a budget is split over the images of a job
+struct ThreadPlan {
+  int num_workers;          // images solved at once
+  int threads_per_worker;   // threads of the inner solvers of each image
+};
+
+class ThreadBudget {
+public:
+  // num_threads <= 0 means all hardware threads
+  explicit ThreadBudget(int num_threads);
+
+  int total() const { return num_threads; }
+
+  // Run as many images at once as the budget allows with threads_per_image
+  // threads each. The threads left over are shared by the images that run,
+  // so a single image gets the whole budget.
+  ThreadPlan Split(int num_images, int threads_per_image) const;
+
+private:
+  int num_threads;
+};
+
+// Limits the OpenMP and MKL threads started from the calling thread while
+// alive, and restores the previous limits afterwards. Both limits are per
+// thread, so each worker can hold its own. Eigen follows the OpenMP limit.
+class ScopedThreadLimit {
+public:
+  explicit ScopedThreadLimit(int num_threads);
+  ~ScopedThreadLimit();
+
+  ScopedThreadLimit(const ScopedThreadLimit&) = delete;
+  ScopedThreadLimit& operator=(const ScopedThreadLimit&) = delete;
+
+private:
+  int previous_omp_threads;
+  int previous_mkl_threads;
+};
+
+// Process wide part of the budget: parallel regions opened inside another
+// parallel region run on one thread, instead of multiplying the thread count.
+void DisableNestedParallelism();
+
+#endif  // FACESHAPEFROMSHADING_SFS_THREADS_H
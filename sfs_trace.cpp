@@ -0,0 +1,90 @@
+#include "sfs_trace.h"
+
+#include <fstream>
+
+#include <unistd.h>
+
+Tracer::Tracer() : enabled(false), memory_enabled(false), start_time(std::chrono::steady_clock::now()) {}
+
+Tracer& Tracer::Instance() {
+  static Tracer tracer;
+  return tracer;
+}
+
+int64_t Tracer::Now() const {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start_time).count();
+}
+
+int Tracer::ThreadId() {
+  static std::atomic<int> next_id(0);
+  thread_local int id = next_id++;
+  return id;
+}
+
+void Tracer::AddCompleteEvent(const string& name, const string& category,
+                              int64_t ts, int64_t dur, json args) {
+  Event e{name, category, 'X', ts, dur, ThreadId(), std::move(args)};
+  std::lock_guard<std::mutex> lock(mtx);
+  events.push_back(std::move(e));
+}
+
+void Tracer::AddCounter(const string& name, double value) {
+  json args;
+  args[name] = value;
+  Event e{name, "counter", 'C', Now(), 0, ThreadId(), std::move(args)};
+  std::lock_guard<std::mutex> lock(mtx);
+  events.push_back(std::move(e));
+}
+
+void Tracer::Clear() {
+  std::lock_guard<std::mutex> lock(mtx);
+  events.clear();
+}
+
+map<string, Tracer::SpanTotal> Tracer::SpanTotals() const {
+  map<string, SpanTotal> totals;
+  std::lock_guard<std::mutex> lock(mtx);
+  for(auto& e : events) {
+    if(e.phase != 'X') continue;
+    SpanTotal& total = totals.insert(make_pair(e.name, SpanTotal{0, 0, 0, 0, 0})).first->second;
+    total.duration += e.dur;
+    ++total.count;
+    if(e.args.is_object()) {
+      total.allocated_mb += e.args.value("allocated_mb", 0.0);
+      total.peak_heap_mb = max(total.peak_heap_mb, e.args.value("peak_heap_mb", 0.0));
+      total.peak_rss_mb = max(total.peak_rss_mb, e.args.value("peak_rss_mb", 0.0));
+    }
+  }
+  return totals;
+}
+
+bool Tracer::WriteChromeTrace(const string& filename) const {
+  const int pid = getpid();
+
+  json trace_events = json::array();
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    for(auto& e : events) {
+      json item;
+      item["name"] = e.name;
+      item["cat"] = e.category;
+      item["ph"] = string(1, e.phase);
+      item["ts"] = e.ts;
+      if(e.phase == 'X') item["dur"] = e.dur;
+      item["pid"] = pid;
+      item["tid"] = e.tid;
+      if(!e.args.is_null()) item["args"] = e.args;
+      trace_events.push_back(item);
+    }
+  }
+
+  json trace;
+  trace["traceEvents"] = trace_events;
+  trace["displayTimeUnit"] = "ms";
+
+  ofstream fout(filename);
+  if(!fout) return false;
+  fout << trace;
+  return static_cast<bool>(fout);
+}
@@ -0,0 +1,140 @@
+#ifndef FACESHAPEFROMSHADING_SFS_TRACE_H
+#define FACESHAPEFROMSHADING_SFS_TRACE_H
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include "nlohmann/json.hpp"
+using json = nlohmann::json;
+
+#include "sfs_memory.h"
+
+// Process wide trace recorder. Spans and counters are collected in memory
+// and written out in the Chrome trace event format, which can be loaded in
+// chrome://tracing or https://ui.perfetto.dev. Recording is off by default
+// and costs a single flag check per span when disabled.
+class Tracer {
+public:
+  static Tracer& Instance();
+
+  void Enable(bool value) { enabled = value; }
+  bool IsEnabled() const { return enabled; }
+
+  // Record the memory use of every span along with its time, see TraceSpan
+  void EnableMemory(bool value) { memory_enabled = value; }
+  bool IsMemoryEnabled() const { return enabled && memory_enabled; }
+
+  // Microseconds since the tracer was created
+  int64_t Now() const;
+
+  // Small sequential id of the calling thread
+  static int ThreadId();
+
+  void AddCompleteEvent(const string& name, const string& category,
+                        int64_t ts, int64_t dur, json args);
+  void AddCounter(const string& name, double value);
+
+  // Drop all recorded events
+  void Clear();
+
+  // Total duration and number of the recorded spans, by span name. With
+  // memory recording, also the heap allocated by all of them, the largest
+  // heap peak of one of them and the largest process RSS seen at their end.
+  struct SpanTotal {
+    int64_t duration;
+    int count;
+    double allocated_mb;
+    double peak_heap_mb;
+    double peak_rss_mb;
+  };
+  map<string, SpanTotal> SpanTotals() const;
+
+  bool WriteChromeTrace(const string& filename) const;
+
+private:
+  Tracer();
+
+  struct Event {
+    string name, category;
+    char phase;
+    int64_t ts, dur;
+    int tid;
+    json args;
+  };
+
+  std::atomic<bool> enabled, memory_enabled;
+  std::chrono::steady_clock::time_point start_time;
+  mutable std::mutex mtx;
+  vector<Event> events;
+};
+
+// Records the lifetime of the enclosing scope as a span. Spans opened inside
+// other spans on the same thread show up nested in the trace viewer.
+//
+// With memory recording on, a span also gets the process RSS and its high
+// water mark at its end (rss_mb, peak_rss_mb) and, in builds with heap
+// profiling (sfs_memory.h), the heap allocated on its thread while it was open
+// and the most it held at once (allocated_mb, peak_heap_mb).
+class TraceSpan {
+public:
+  TraceSpan(const string& name, const string& category = "sfs")
+    : active(Tracer::Instance().IsEnabled()) {
+    if(active) {
+      this->name = name;
+      this->category = category;
+      if(Tracer::Instance().IsMemoryEnabled()) heap.reset(new HeapScope());
+      ts = Tracer::Instance().Now();
+    }
+  }
+
+  ~TraceSpan() { End(); }
+
+  // Close the span before the end of the scope
+  void End() {
+    if(active) {
+      Tracer& tracer = Tracer::Instance();
+      const int64_t dur = tracer.Now() - ts;
+      if(heap) RecordMemory();
+      tracer.AddCompleteEvent(name, category, ts, dur, std::move(args));
+      active = false;
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  template <typename T>
+  TraceSpan& SetArg(const string& key, const T& value) {
+    if(active) args[key] = value;
+    return *this;
+  }
+
+private:
+  void RecordMemory() {
+    args["rss_mb"] = ToMegabytes(CurrentRSS());
+    args["peak_rss_mb"] = ToMegabytes(PeakRSS());
+    if(HeapProfilingEnabled()) {
+      args["allocated_mb"] = ToMegabytes(heap->Allocated());
+      args["peak_heap_mb"] = ToMegabytes(heap->Peak());
+    }
+    heap.reset();
+    Tracer::Instance().AddCounter("memory.rss_mb", args["rss_mb"].get<double>());
+  }
+
+  bool active;
+  string name, category;
+  int64_t ts;
+  json args;
+  unique_ptr<HeapScope> heap;
+};
+
+// Records a counter sample, shown as a track in the trace viewer.
+inline void TraceCounter(const string& name, double value) {
+  Tracer& tracer = Tracer::Instance();
+  if(tracer.IsEnabled()) tracer.AddCounter(name, value);
+}
+
+#endif  // FACESHAPEFROMSHADING_SFS_TRACE_H
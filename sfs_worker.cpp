@@ -0,0 +1,203 @@
+#include <QApplication>
+#include <QDir>
+
+#include <GL/freeglut_std.h>
+
+#include <csignal>
+#include <chrono>
+#include <thread>
+
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include "sfs_pipeline.h"
+#include "sfs_spool.h"
+
+// Resident shape from shading worker.
+//
+// The model, template mesh, blendshapes and albedo index/pixel maps are
+// loaded by the first job that needs them and reused by the next ones. Jobs
+// are picked up from a spool directory (see sfs_spool.h), which any number of
+// workers can share:
+//
+//   <spool_dir>/*.json      pending jobs, processed in filename order
+//   <spool_dir>/running/    the jobs being processed, and their leases
+//   <spool_dir>/done/       finished jobs
+//   <spool_dir>/failed/     failed jobs, with the error stored in the job file
+//
+// A job file looks like
+//
+//   {
+//     "settings_file": "/path/to/subject/settings.txt",
+//     "recon_path": "/path/to/reconstructions",     (optional)
+//     "results_path": "/path/to/subject/SFS",       (optional)
+//     "resume": true,                                (optional)
+//     "settings_overrides": ["/path/to/override.json"],  (optional)
+//     "settings": {"max_iters": 5},                  (optional)
+//     "images": ["1.jpg", "2.jpg"],                  (optional)
+//     "first_index": 0,                              (optional)
+//     "max_attempts": 3                              (optional)
+//   }
+//
+// The settings of a job are the global settings of the worker, merged with
+// the override files and then the "settings" object of the job. The --set
+// values of the worker are applied last and win over the job. With
+// "images", only those images of the settings file are processed, and
+// "first_index" is the index of the first one in the output filenames.
+//
+// Submitting a job is a matter of writing the file under a temporary name and
+// renaming it to *.json, so the worker never sees a partially written job.
+// Creating <spool_dir>/stop, SIGINT or SIGTERM makes the worker exit after the
+// current job. The lease of the current job is renewed every lease_seconds/4,
+// jobs of workers that stopped renewing theirs are taken back.
+
+namespace {
+
+volatile sig_atomic_t stop_requested = 0;
+
+void HandleStopSignal(int) {
+  stop_requested = 1;
+}
+
+po::variables_map ParseCommandlineOptions(int argc, char** argv) {
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help", "Print help messages")
+    ("spool_dir", po::value<string>()->required(), "Spool directory to take jobs from.")
+    ("blendshapes_path", po::value<string>(), "Input blendshapes path. Deform the template with blendshapes if given.")
+    ("subdivision_depth", po::value<int>()->default_value(0), "The depth of subdivision of the template.")
+    ("poll_interval", po::value<int>()->default_value(500), "Spool directory polling interval in milliseconds.")
+    ("lease_seconds", po::value<int>()->default_value(60), "A job is taken back if its lease is not renewed for this long.")
+    ("once", "Process the pending jobs and exit.");
+  AddSettingsOptions(desc);
+  po::variables_map vm;
+
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if(vm.count("help")) {
+      cout << desc << endl;
+      exit(1);
+    }
+    return vm;
+  } catch(po::error& e) {
+    cerr << "Error: " << e.what() << endl;
+    cerr << desc << endl;
+    exit(1);
+  }
+}
+
+void RunJob(const json& job, SFSResources& resources, const json& global_settings,
+            const vector<string>& overrides) {
+  const string settings_filename = job["settings_file"];
+
+  const json job_settings = MergeJobSettings(global_settings, job, overrides);
+  const string recon_path = job.count("recon_path")? job["recon_path"].get<string>() : string();
+
+  fs::path results_path;
+  if(job.count("results_path")) {
+    results_path = fs::path(job["results_path"].get<string>());
+  } else {
+    results_path = fs::path(settings_filename).parent_path() / fs::path("SFS");
+  }
+
+  vector<string> images;
+  if(job.count("images")) images = job["images"].get<vector<string>>();
+  const SFSSettings settings = SFSSettings::FromJson(job_settings);
+  const SFSImageSource image_source = settings.parallel.streaming
+    ? SFSImageSource::Stream(settings_filename, recon_path, images)
+    : SFSImageSource(LoadImageBundles(settings_filename, recon_path, images));
+
+  SFSPipeline pipeline(resources, settings);
+  pipeline.SetResume(job.value("resume", false));
+  pipeline.SetFirstIndex(job.value("first_index", 0));
+  pipeline.Run(image_source, results_path);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  po::variables_map vm = ParseCommandlineOptions(argc, argv);
+
+  QApplication a(argc, argv);
+  glutInit(&argc, argv);
+
+  std::signal(SIGINT, HandleStopSignal);
+  std::signal(SIGTERM, HandleStopSignal);
+
+  const string home_directory = QDir::homePath().toStdString();
+  cout << "Home dir: " << home_directory << endl;
+
+  const fs::path spool_dir(vm["spool_dir"].as<string>());
+  SFSSpool spool(spool_dir);
+  const string owner = SFSSpool::DefaultOwner();
+  const std::chrono::seconds lease_duration(max(vm["lease_seconds"].as<int>(), 1));
+  const std::chrono::seconds lease_interval(max<int>(lease_duration.count() / 4, 1));
+
+  // Jobs left over by workers that were killed are put back in the queue
+  for(auto& name : spool.RequeueAbandoned(lease_duration)) {
+    SFS_LOG(Info, Spool) << "Requeued interrupted job " << name;
+  }
+
+  // load the settings file
+  PhGUtils::message("Loading global settings ...");
+  const json global_settings = LoadSettingsJson(vm, home_directory);
+  const vector<string> overrides = vm.count("set")? vm["set"].as<vector<string>>() : vector<string>();
+  // fail early on invalid global settings, jobs only add overrides
+  cout << setw(2) << SFSSettings::FromJson(global_settings).ToJson() << endl;
+  PhGUtils::message("done.");
+
+  SFSResourceOptions resource_options;
+  if(vm.count("blendshapes_path")) {
+    resource_options.use_blendshapes = true;
+    resource_options.blendshapes_path = vm["blendshapes_path"].as<string>();
+  }
+  resource_options.subdivision_depth = vm["subdivision_depth"].as<int>();
+
+  // loaded by the first job that needs them, then kept for the next ones
+  SFSResources resources(SFSResourcePaths::FromHomeDirectory(home_directory),
+                         resource_options);
+
+  const bool run_once = vm.count("once");
+  const auto poll_interval = std::chrono::milliseconds(vm["poll_interval"].as<int>());
+
+  SFS_LOG(Info, Spool) << "Waiting for jobs in " << spool_dir.string();
+  while(!stop_requested && !fs::exists(spool_dir / fs::path("stop"))) {
+    vector<fs::path> jobs = spool.PendingJobs();
+    if(jobs.empty()) {
+      if(run_once) break;
+      spool.RequeueAbandoned(lease_duration);
+      std::this_thread::sleep_for(poll_interval);
+      continue;
+    }
+
+    // Claim the job. Another worker may have taken it in the meantime.
+    fs::path running_job;
+    if(!spool.Claim(jobs.front(), owner, running_job)) continue;
+    const string job_name = SFSSpool::JobName(running_job);
+
+    SFS_LOG(Info, Spool) << "Running job " << job_name;
+    try {
+      SFSLeaseKeeper lease_keeper(spool, running_job, lease_interval);
+      const json job = json::parse(ifstream(running_job.string()));
+      boost::timer::cpu_timer timer;
+      RunJob(job, resources, global_settings, overrides);
+      SFS_LOG(Info, Spool) << "[Shape from shading] Job time = " << timer.elapsed().wall * 1e-9 << " seconds.";
+      if(spool.Complete(running_job, owner)) {
+        SFS_LOG(Info, Spool) << "Job " << job_name << " done.";
+      } else {
+        SFS_LOG(Warning, Spool) << "Job " << job_name << " finished after its lease was lost.";
+      }
+    } catch(std::exception& e) {
+      SFS_LOG(Error, Spool) << "Job " << job_name << " failed: " << e.what();
+      if(!spool.Fail(running_job, owner, e.what())) {
+        SFS_LOG(Warning, Spool) << "Job " << job_name << " failed after its lease was lost.";
+      }
+    }
+  }
+
+  resources.assets.ReportLoadTimes();
+  SFS_LOG(Info, Spool) << "Worker stopped.";
+  SFSLog::Flush();
+  return 0;
+}
@@ -0,0 +1,149 @@
+#include "../sfs_cache.h"
+
+#include <cstdio>
+#include <fstream>
+
+#include "test_common.h"
+#include "test_state.h"
+
+namespace {
+
+// Layout of the entries, see sfs_cache.h
+fs::path EntryPath(const fs::path& cache_path, const string& kind, uint64_t key) {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(key));
+  return cache_path / fs::path(kind) / fs::path(string(hex, 2)) / fs::path(string(hex) + ".ckpt");
+}
+
+void TestPrepared() {
+  TestDirectory dir;
+  SFSResultCache cache(dir.path / fs::path("cache"));
+  const SFSImageState state = PreparedState(5, 4);
+  const uint64_t key = HashString("prepared image");
+
+  SFSImageState loaded;
+  CHECK(!cache.HasPrepared(key));
+  CHECK(!cache.LoadPrepared(key, loaded));
+  cache.SavePrepared(key, state);
+  CHECK(fs::exists(EntryPath(cache.path(), "prepare", key)));
+  CHECK(cache.HasPrepared(key));
+  CHECK(!cache.HasPrepared(key + 1));
+  CHECK(cache.LoadPrepared(key, loaded));
+  CHECK(SamePrepared(loaded, state));
+  CHECK(loaded.normal_map.plane(0).data == loaded.normal_map_ref.plane(0).data);
+
+  // only loads are counted
+  CHECK(cache.hits() == 1);
+  CHECK(cache.misses() == 1);
+
+  // shared by every cache on the same directory
+  SFSResultCache other(cache.path());
+  SFSImageState other_loaded;
+  CHECK(other.LoadPrepared(key, other_loaded) && SamePrepared(other_loaded, state));
+}
+
+void TestStage() {
+  TestDirectory dir;
+  SFSResultCache cache(dir.path);
+  SFSImageState state = PreparedState(3, 3);
+  state.lighting_coeffs = VectorXd::Constant(9, 0.5);
+  const uint64_t key = HashString("lighting stage");
+  cache.SaveStage(key, SFSCheckpointStore::Lighting, state);
+  CHECK(cache.HasStage(key));
+
+  SFSImageState loaded = PreparedState(3, 3);
+  CHECK(cache.LoadStage(key, SFSCheckpointStore::Lighting, loaded));
+  CHECK(loaded.lighting_coeffs == state.lighting_coeffs);
+  // the entry only holds the fields of its stage
+  CHECK(!cache.LoadStage(key, SFSCheckpointStore::Depth, loaded));
+}
+
+void TestMeanTexture() {
+  TestDirectory dir;
+  SFSResultCache cache(dir.path);
+
+  QImage texture(4, 3, QImage::Format_ARGB32);
+  for(int y=0;y<texture.height();++y) {
+    for(int x=0;x<texture.width();++x) texture.setPixel(x, y, qRgb(x * 50, y * 80, 7));
+  }
+  cache.SaveMeanTexture(1, texture);
+  QImage loaded;
+  CHECK(cache.LoadMeanTexture(1, loaded));
+  CHECK(loaded.convertToFormat(QImage::Format_ARGB32) == texture);
+
+  // no texture is a valid entry too
+  cache.SaveMeanTexture(2, QImage());
+  loaded = texture;
+  CHECK(cache.LoadMeanTexture(2, loaded));
+  CHECK(loaded.isNull());
+  CHECK(!cache.LoadMeanTexture(3, loaded));
+
+  const vector<int> face_indices = {0, -1, 4, 4, 9};
+  vector<int> face_indices_loaded;
+  cache.SaveFaceIndices(1, face_indices);
+  CHECK(cache.LoadFaceIndices(1, face_indices_loaded));
+  CHECK(face_indices_loaded == face_indices);
+}
+
+void TestInvalidEntries() {
+  TestDirectory dir;
+  SFSResultCache cache(dir.path);
+  const SFSImageState state = PreparedState(4, 4);
+  const uint64_t key = HashString("a"), other_key = HashString("b");
+  cache.SavePrepared(key, state);
+
+  // an entry is checked against its key, not only found by it
+  const fs::path entry = EntryPath(cache.path(), "prepare", key);
+  const fs::path other_entry = EntryPath(cache.path(), "prepare", other_key);
+  fs::create_directories(other_entry.parent_path());
+  fs::copy_file(entry, other_entry);
+  SFSImageState loaded;
+  CHECK(!cache.HasPrepared(other_key));
+  CHECK(!cache.LoadPrepared(other_key, loaded));
+
+  // truncated, e.g. copied from a full disk
+  const uintmax_t size = fs::file_size(entry);
+  fs::resize_file(entry, size / 2);
+  CHECK(!cache.HasPrepared(key));
+  CHECK(!cache.LoadPrepared(key, loaded));
+  fs::resize_file(entry, 0);
+  CHECK(!cache.LoadPrepared(key, loaded));
+
+  // maps stored by a build with the other MapScalar: the planes written last
+  // replace the ones of WritePreparedFields
+  const int other_depth = kMapDepth == CV_32F? CV_64F : CV_32F;
+  CheckpointWriter writer(key);
+  WritePreparedFields(writer, state);
+  for(int k=0;k<3;++k) writer.Write("normal_map_ref." + to_string(k), Ramp(4, 4, other_depth, k));
+  CHECK(writer.Save(entry.string()));
+  CHECK(cache.HasPrepared(key));
+  CHECK(!cache.LoadPrepared(key, loaded));
+}
+
+void TestHashes() {
+  TestDirectory dir;
+  const fs::path a = dir.path / fs::path("a.txt"), b = dir.path / fs::path("b.txt");
+  {
+    ofstream(a.string()) << "same content";
+    ofstream(b.string()) << "same content";
+  }
+  CHECK(HashFile(a.string()) != 0);
+  CHECK(HashFile(a.string()) == HashFile(b.string()));
+  CHECK(HashFile((dir.path / fs::path("missing")).string()) == 0);
+  {
+    ofstream(b.string()) << "other content";
+  }
+  CHECK(HashFile(a.string()) != HashFile(b.string()));
+  CHECK(!SFSCodeVersion().empty());
+}
+
+}  // namespace
+
+int main() {
+  TestPrepared();
+  TestStage();
+  TestMeanTexture();
+  TestInvalidEntries();
+  TestHashes();
+  return TestResult("test_cache");
+}
@@ -0,0 +1,209 @@
+#include "../sfs_checkpoint.h"
+
+#include <fstream>
+
+#include "test_common.h"
+#include "test_state.h"
+
+namespace {
+
+void TestRoundTrip() {
+  TestDirectory dir;
+  const string filename = (dir.path / fs::path("fields.ckpt")).string();
+
+  const cv::Mat mat = Ramp(4, 5, CV_64F, 1.5);
+  const VectorXd vec = VectorXd::LinSpaced(7, 0.0, 3.0);
+  const vector<int> ints = {3, -1, 4, 1, -5};
+  const vector<bool> bools = {true, false, false, true};
+  const vector<glm::ivec2> pixels = {glm::ivec2(1, 2), glm::ivec2(-3, 4)};
+  const Map3 map = RampMap<3>(3, 2, 0.0);
+
+  CheckpointWriter writer(42);
+  writer.Write("mat", mat);
+  writer.Write("vec", vec);
+  writer.Write("ints", ints);
+  writer.Write("bools", bools);
+  writer.Write("pixels", pixels);
+  writer.Write("map", map);
+  writer.Write("empty_ints", vector<int>());
+  CHECK(writer.Save(filename));
+
+  CheckpointReader reader;
+  CHECK(reader.Load(filename, 42));
+
+  cv::Mat mat_read;
+  VectorXd vec_read;
+  vector<int> ints_read, empty_read = {1};
+  vector<bool> bools_read;
+  vector<glm::ivec2> pixels_read;
+  Map3 map_read;
+  CHECK(reader.Read("mat", mat_read) && SameMat(mat_read, mat));
+  CHECK(reader.Read("vec", vec_read) && vec_read == vec);
+  CHECK(reader.Read("ints", ints_read) && ints_read == ints);
+  CHECK(reader.Read("bools", bools_read) && bools_read == bools);
+  CHECK(reader.Read("pixels", pixels_read) && pixels_read == pixels);
+  CHECK(reader.Read("map", map_read) && SameMap(map_read, map));
+  CHECK(reader.Read("empty_ints", empty_read) && empty_read.empty());
+
+  // a field is only read back as its own kind
+  CHECK(!reader.Read("missing", ints_read));
+  CHECK(!reader.Read("vec", ints_read));
+  CHECK(!reader.Read("ints", mat_read));
+
+  // a matching matrix is restored in place, so shared data sees the update
+  cv::Mat target = Ramp(4, 5, CV_64F, 0);
+  const cv::Mat alias = target;
+  CHECK(reader.Read("mat", target));
+  CHECK(target.data == alias.data && SameMat(alias, mat));
+}
+
+void TestInvalidFiles() {
+  TestDirectory dir;
+  const string filename = (dir.path / fs::path("fields.ckpt")).string();
+  CheckpointWriter writer(42);
+  writer.Write("mat", Ramp(8, 8, CV_32F, 0));
+  writer.Write("ints", vector<int>(16, 1));
+  CHECK(writer.Save(filename));
+
+  CheckpointReader reader;
+  CHECK(!reader.Load(filename, 43));
+  CHECK(!reader.Load((dir.path / fs::path("missing.ckpt")).string(), 42));
+
+  // every truncation is detected
+  string bytes;
+  {
+    ifstream fin(filename, ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+  }
+  const fs::path truncated = dir.path / fs::path("truncated.ckpt");
+  for(size_t n=0;n<bytes.size();++n) {
+    {
+      ofstream fout(truncated.string(), ios::binary);
+      fout.write(bytes.data(), n);
+    }
+    if(reader.Load(truncated.string(), 42)) {
+      std::cerr << "truncated checkpoint of " << n << " bytes accepted" << std::endl;
+      CHECK(false);
+      break;
+    }
+  }
+
+  // not a checkpoint
+  {
+    ofstream fout(truncated.string(), ios::binary);
+    fout << "SFSCKPX and some more bytes to fill the header";
+  }
+  CHECK(!reader.Load(truncated.string(), 42));
+}
+
+void TestMapScalarMismatch() {
+  // planes stored with the other scalar type, e.g. by a build with the other
+  // SFS_DOUBLE_PRECISION_MAPS setting
+  const int other_depth = kMapDepth == CV_32F? CV_64F : CV_32F;
+  TestDirectory dir;
+  const string filename = (dir.path / fs::path("fields.ckpt")).string();
+  CheckpointWriter writer(42);
+  for(int k=0;k<3;++k) writer.Write("map." + to_string(k), Ramp(3, 3, other_depth, k));
+  // planes of different sizes
+  writer.Write("uneven.0", Ramp(3, 3, kMapDepth, 0));
+  writer.Write("uneven.1", Ramp(3, 4, kMapDepth, 0));
+  CHECK(writer.Save(filename));
+
+  CheckpointReader reader;
+  CHECK(reader.Load(filename, 42));
+  Map3 map;
+  CHECK(!reader.Read("map", map));
+  Map2 uneven;
+  CHECK(!reader.Read("uneven", uneven));
+}
+
+void TestStore() {
+  TestDirectory dir;
+  const fs::path path = dir.path / fs::path("checkpoints");
+  const SFSImageState state = PreparedState(4, 6);
+  {
+    SFSCheckpointStore store(path, 1, 2);
+    CHECK(!store.HasPrepared(3, "a.jpg"));
+    store.SavePrepared(3, "a.jpg", state);
+    CHECK(store.HasPrepared(3, "a.jpg"));
+    // keyed by the image too
+    CHECK(!store.HasPrepared(3, "b.jpg"));
+    CHECK(!store.HasPrepared(4, "a.jpg"));
+
+    SFSImageState loaded;
+    CHECK(store.LoadPrepared(3, "a.jpg", loaded));
+    CHECK(loaded.lighting_coeffs == state.lighting_coeffs);
+    CHECK(SameMap(loaded.normal_map_ref, state.normal_map_ref));
+    CHECK(SameMap(loaded.albedo_ref, state.albedo_ref));
+    CHECK(SameMap(loaded.xy_map, state.xy_map));
+    CHECK(SameMat(loaded.depth_map_ref, state.depth_map_ref));
+    CHECK(SameMat(loaded.zmap, state.zmap));
+    CHECK(loaded.valid_pixels_map == state.valid_pixels_map);
+    CHECK(loaded.face_indices_map == state.face_indices_map);
+    // the working maps start as the references
+    CHECK(loaded.normal_map.plane(0).data == loaded.normal_map_ref.plane(0).data);
+    CHECK(loaded.albedo.plane(0).data == loaded.albedo_ref.plane(0).data);
+
+    // stage fields
+    SFSImageState solved = PreparedState(4, 6);
+    solved.zmap = Ramp(4, 6, CV_32F, 50);
+    solved.normal_map = RampMap<3>(4, 6, 9);
+    solved.valid_depth_pixels = {glm::ivec2(0, 1), glm::ivec2(2, 3)};
+    solved.is_boundary = {false, true};
+    solved.depth_cost_reduction = 0.125;
+    store.SaveStage(3, "a.jpg", 1, SFSCheckpointStore::Depth, solved);
+    CHECK(store.HasStage(3, "a.jpg", 1, SFSCheckpointStore::Depth));
+    CHECK(!store.HasStage(3, "a.jpg", 2, SFSCheckpointStore::Depth));
+    CHECK(!store.HasStage(3, "a.jpg", 1, SFSCheckpointStore::Albedo));
+
+    SFSImageState resumed = PreparedState(4, 6);
+    CHECK(store.LoadStage(3, "a.jpg", 1, SFSCheckpointStore::Depth, resumed));
+    CHECK(SameMat(resumed.zmap, solved.zmap));
+    CHECK(SameMap(resumed.normal_map, solved.normal_map));
+    CHECK(resumed.valid_depth_pixels == solved.valid_depth_pixels);
+    CHECK(resumed.is_boundary == solved.is_boundary);
+    CHECK(resumed.depth_cost_reduction == 0.125);
+
+    // a stage checkpoint does not restore other stages
+    CHECK(!store.LoadStage(3, "a.jpg", 1, SFSCheckpointStore::Lighting, resumed));
+
+    // another image at the same index, e.g. from an edited image list: its
+    // preparation is recomputed, so the stages must not be replayed on it
+    SFSImageState other = PreparedState(4, 6);
+    CHECK(!store.HasStage(3, "b.jpg", 1, SFSCheckpointStore::Depth));
+    CHECK(!store.LoadStage(3, "b.jpg", 1, SFSCheckpointStore::Depth, other));
+    CHECK(SameMat(other.zmap, state.zmap));
+  }
+
+  // new solver settings keep the preparation but not the stages
+  {
+    SFSCheckpointStore store(path, 1, 3);
+    CHECK(store.HasPrepared(3, "a.jpg"));
+    CHECK(!store.HasStage(3, "a.jpg", 1, SFSCheckpointStore::Depth));
+  }
+  // new preparation inputs invalidate everything
+  {
+    SFSCheckpointStore store(path, 5, 2);
+    CHECK(!store.HasPrepared(3, "a.jpg"));
+  }
+}
+
+void TestHashes() {
+  CHECK(HashString("abc") == HashString("abc"));
+  CHECK(HashString("abc") != HashString("abd"));
+  CHECK(HashString("abc", 1) != HashString("abc", 2));
+  const uint64_t h = HashString("seed");
+  CHECK(HashCombine(h, 1) != HashCombine(h, 2));
+  CHECK(HashCombine(HashCombine(h, 1), 2) != HashCombine(HashCombine(h, 2), 1));
+}
+
+}  // namespace
+
+int main() {
+  TestRoundTrip();
+  TestInvalidFiles();
+  TestMapScalarMismatch();
+  TestStore();
+  TestHashes();
+  return TestResult("test_checkpoint");
+}
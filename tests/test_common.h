@@ -0,0 +1,58 @@
+#ifndef FACESHAPEFROMSHADING_TEST_COMMON_H
+#define FACESHAPEFROMSHADING_TEST_COMMON_H
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+// Minimal checks for the unit tests: a failed check is reported and makes
+// the test return 1, the remaining checks still run.
+static int num_failed_checks = 0;
+
+#define CHECK(cond) \
+  do { \
+    if(!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+      ++num_failed_checks; \
+    } \
+  } while(0)
+
+#define CHECK_THROWS(expr) \
+  do { \
+    bool thrown = false; \
+    try { expr; } catch(std::exception&) { thrown = true; } \
+    if(!thrown) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": expected an exception: " #expr << std::endl; \
+      ++num_failed_checks; \
+    } \
+  } while(0)
+
+inline int TestResult(const std::string& name) {
+  if(num_failed_checks > 0) {
+    std::cerr << name << ": " << num_failed_checks << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << name << ": ok" << std::endl;
+  return 0;
+}
+
+// A fresh directory under the system temporary directory, removed with its
+// contents when the test ends.
+class TestDirectory {
+public:
+  TestDirectory()
+    : path(boost::filesystem::temp_directory_path()
+           / boost::filesystem::unique_path("sfs_test_%%%%-%%%%-%%%%")) {
+    boost::filesystem::create_directories(path);
+  }
+  ~TestDirectory() {
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(path, ec);
+  }
+
+  const boost::filesystem::path path;
+};
+
+#endif  // FACESHAPEFROMSHADING_TEST_COMMON_H
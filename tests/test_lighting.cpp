@@ -0,0 +1,26 @@
+#include "../sfs_pipeline.h"
+
+#include <cmath>
+
+#include "test_common.h"
+
+namespace {
+
+void TestSecondOrderWeight() {
+  // ramped up from the first to the last iteration
+  CHECK(SFSLightingStage::SecondOrderWeight(1, 3) == 0.0);
+  CHECK(SFSLightingStage::SecondOrderWeight(2, 3) == 0.5);
+  CHECK(SFSLightingStage::SecondOrderWeight(3, 3) == 1.0);
+  CHECK(SFSLightingStage::SecondOrderWeight(5, 3) == 1.0);
+
+  // a single iteration, e.g. pyramid.coarse_iters = 1, gets a finite weight
+  CHECK(std::isfinite(SFSLightingStage::SecondOrderWeight(1, 1)));
+  CHECK(SFSLightingStage::SecondOrderWeight(1, 1) == 1.0);
+}
+
+}  // namespace
+
+int main() {
+  TestSecondOrderWeight();
+  return TestResult("test_lighting");
+}
@@ -0,0 +1,139 @@
+#include "../sfs_settings.h"
+
+#include <fstream>
+
+#include "test_common.h"
+
+namespace {
+
+bool Accepted(const json& j) {
+  try {
+    SFSSettings::FromJson(j);
+  } catch(std::exception&) {
+    return false;
+  }
+  return true;
+}
+
+void WriteJson(const fs::path& filename, const json& j) {
+  ofstream fout(filename.string());
+  fout << j << endl;
+}
+
+void TestDefaults() {
+  // missing keys keep their defaults, and the full settings read back as is
+  const SFSSettings defaults = SFSSettings::FromJson(json::object());
+  CHECK(!defaults.roi.enabled);
+  CHECK(SFSSettings::FromJson(defaults.ToJson()).ToJson() == defaults.ToJson());
+
+  // the settings file of the source tree is complete and valid
+  const SFSSettings settings = LoadSettings(SFS_SOURCE_DIR "/settings.txt");
+  const json j = settings.ToJson();
+  CHECK(SFSSettings::FromJson(j).ToJson() == j);
+}
+
+void TestUnknownKeys() {
+  CHECK(Accepted({{"max_iters", 3}}));
+  CHECK(!Accepted({{"max_iter", 3}}));
+  CHECK(!Accepted({{"depth", {{"w_regularization", 1.0}}}}));
+  CHECK(!Accepted({{"depth", {{"optimization", {{"max_iter", 10}}}}}}));
+  CHECK(!Accepted({{"lighting", 1}}));
+  // mean_texture_options is passed on as is
+  CHECK(Accepted({{"mean_texture_options", {{"anything", 1}}}}));
+}
+
+void TestValidation() {
+  CHECK(!Accepted({{"max_iters", "three"}}));
+  CHECK(!Accepted({{"roi", {{"enabled", "yes"}}}}));
+
+  // a single iteration is valid, at full resolution and on the coarse levels
+  CHECK(Accepted({{"max_iters", 1}, {"pyramid", {{"coarse_iters", 1}}}}));
+  CHECK(!Accepted({{"max_iters", 0}}));
+  CHECK(!Accepted({{"pyramid", {{"coarse_iters", 0}}}}));
+  CHECK(Accepted({{"roi", {{"padding", 2}}}}));
+  CHECK(!Accepted({{"roi", {{"padding", 1}}}}));
+  CHECK(Accepted({{"output", {{"png_compression", 9}}}}));
+  CHECK(!Accepted({{"output", {{"png_compression", 10}}}}));
+  CHECK(!Accepted({{"output", {{"level", "everything"}}}}));
+  CHECK(!Accepted({{"parallel", {{"threads_per_image", 0}}}}));
+  CHECK(!Accepted({{"parallel", {{"memory_budget_mb", -1}}}}));
+  CHECK(!Accepted({{"pyramid", {{"num_levels", 0}}}}));
+  CHECK(!Accepted({{"convergence", {{"albedo_change", -0.1}}}}));
+  CHECK(!Accepted({{"deadline", {{"seconds_per_image", -1}}}}));
+  CHECK(!Accepted({{"metrics", {{"format", "xml"}}}}));
+  CHECK(!Accepted({{"handoff", {{"shm_prefix", "a/b"}}}}));
+  CHECK(!Accepted({{"log", {{"level", "loud"}}}}));
+  CHECK(!Accepted({{"mean_texture_options", 1}}));
+}
+
+void TestOverrides() {
+  json settings = {{"depth", {{"w_reg", 1.0}, {"w_smooth", 1.0}}}, {"max_iters", 2}};
+  MergeSettings(settings, {{"depth", {{"w_reg", 0.5}}}});
+  CHECK(settings["depth"]["w_reg"] == 0.5);
+  CHECK(settings["depth"]["w_smooth"] == 1.0);
+  CHECK(settings["max_iters"] == 2);
+
+  // values are parsed as JSON, strings otherwise
+  ApplySettingsOverride(settings, "depth.w_smooth=0.25");
+  ApplySettingsOverride(settings, "output.level=final");
+  ApplySettingsOverride(settings, "roi.enabled=true");
+  CHECK(settings["depth"]["w_smooth"] == 0.25);
+  CHECK(settings["depth"]["w_reg"] == 0.5);
+  CHECK(settings["output"]["level"] == "final");
+  CHECK(settings["roi"]["enabled"] == true);
+
+  CHECK_THROWS(ApplySettingsOverride(settings, "max_iters"));
+  CHECK_THROWS(ApplySettingsOverride(settings, "=3"));
+}
+
+void TestPrecedence() {
+  // Each level sets one more weight: settings file < override files < job
+  // override files < job settings < --set
+  TestDirectory dir;
+  const fs::path settings_file = dir.path / fs::path("settings.json");
+  const fs::path override_file = dir.path / fs::path("override.json");
+  const fs::path job_override_file = dir.path / fs::path("job_override.json");
+  WriteJson(settings_file, {{"max_iters", 1},
+                            {"depth", {{"w_data", 1.0}, {"w_int", 1.0}, {"w_reg", 1.0}, {"w_smooth", 1.0}}},
+                            {"albedo", {{"lambda", 1.0}}}});
+  WriteJson(override_file, {{"depth", {{"w_int", 2.0}, {"w_reg", 2.0}, {"w_smooth", 2.0}}},
+                            {"albedo", {{"lambda", 2.0}}}});
+  WriteJson(job_override_file, {{"depth", {{"w_reg", 3.0}, {"w_smooth", 3.0}}},
+                                {"albedo", {{"lambda", 3.0}}}});
+
+  const vector<string> sets = {"depth.w_smooth=5", "max_iters=7"};
+  const json global_settings = LoadSettingsJson(settings_file.string(), {override_file.string()}, sets);
+
+  const SFSSettings global = SFSSettings::FromJson(global_settings);
+  CHECK(global.max_iters == 7);
+  CHECK(global.depth.w_data == 1.0);
+  CHECK(global.depth.w_int == 2.0);
+  CHECK(global.depth.w_smooth == 5.0);
+
+  json job;
+  job["settings_overrides"] = {job_override_file.string()};
+  job["settings"] = {{"depth", {{"w_smooth", 4.0}}}, {"albedo", {{"lambda", 4.0}}}, {"max_iters", 4}};
+  const SFSSettings s = SFSSettings::FromJson(MergeJobSettings(global_settings, job, sets));
+  CHECK(s.depth.w_data == 1.0);
+  CHECK(s.depth.w_int == 2.0);
+  CHECK(s.depth.w_reg == 3.0);
+  CHECK(s.albedo.lambda == 4.0);
+  CHECK(s.depth.w_smooth == 5.0);
+  CHECK(s.max_iters == 7);
+
+  // a job without overrides runs with the global settings
+  CHECK(MergeJobSettings(global_settings, json::object(), sets) == global_settings);
+
+  CHECK_THROWS(LoadSettingsJson((dir.path / fs::path("missing.json")).string()));
+}
+
+}  // namespace
+
+int main() {
+  TestDefaults();
+  TestUnknownKeys();
+  TestValidation();
+  TestOverrides();
+  TestPrecedence();
+  return TestResult("test_settings");
+}
@@ -0,0 +1,162 @@
+#include "../sfs_shm.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "test_common.h"
+
+namespace {
+
+bool Aligned(const void* p) {
+  return reinterpret_cast<uintptr_t>(p) % 64 == 0;
+}
+
+cv::Mat Ramp(int rows, int cols, int type, double offset) {
+  cv::Mat m(rows, cols, type);
+  for(int r=0;r<rows;++r) {
+    for(int c=0;c<cols;++c) {
+      if(type == CV_32F) m.at<float>(r, c) = offset + r * cols + c;
+      else m.at<double>(r, c) = offset + r * cols + c;
+    }
+  }
+  return m;
+}
+
+bool SameMat(const cv::Mat& a, const cv::Mat& b) {
+  return a.type() == b.type() && a.rows == b.rows && a.cols == b.cols
+         && memcmp(a.data, b.data, a.total() * a.elemSize()) == 0;
+}
+
+// Overwrite the magic of a published segment, as if its writer had not
+// finished it yet
+void SetMagic(const string& name, const char* magic) {
+  const int fd = shm_open(name.c_str(), O_RDWR, 0);
+  CHECK(fd >= 0);
+  if(fd < 0) return;
+  void* mapped = mmap(nullptr, 8, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  CHECK(mapped != MAP_FAILED);
+  if(mapped == MAP_FAILED) return;
+  memcpy(mapped, magic, 8);
+  munmap(mapped, 8);
+}
+
+void TestRoundTrip(const string& prefix) {
+  const string name = SharedMapsName(prefix, 0);
+  CHECK(name == "/" + prefix + "_0");
+
+  // odd sizes, so the payloads only line up if they are padded
+  const cv::Mat mat = Ramp(3, 5, CV_64F, 0.5);
+  const VectorXd vec = VectorXd::LinSpaced(9, -1.0, 1.0);
+  const vector<int> ints = {7, -1, 3}, empty;
+  PlanarMap<3> map;
+  map.SetPlanes({Ramp(5, 7, kMapDepth, 0), Ramp(5, 7, kMapDepth, 100), Ramp(5, 7, kMapDepth, 200)});
+
+  SharedMapsWriter writer(42);
+  writer.Write("mat", mat);
+  writer.Write("vec", vec);
+  writer.Write("ints", ints);
+  writer.Write("map", map);
+  writer.Write("empty", empty);
+  CHECK_THROWS(writer.Write(string(48, 'x'), ints));
+  CHECK(writer.Publish(name));
+  CHECK(HasSharedMaps(name, 42));
+
+  SharedMapsReader reader;
+  CHECK(reader.Attach(name, 42));
+  CHECK(reader.attached());
+  CHECK(reader.fingerprint() == 42);
+
+  cv::Mat mat_read;
+  VectorXd vec_read;
+  vector<int> ints_read, empty_read = {1};
+  PlanarMap<3> map_read;
+  CHECK(reader.Read("mat", mat_read) && SameMat(mat_read, mat));
+  CHECK(reader.Read("vec", vec_read) && vec_read == vec);
+  CHECK(reader.Read("ints", ints_read) && ints_read == ints);
+  CHECK(reader.Read("map", map_read));
+  for(int k=0;k<3;++k) {
+    CHECK(SameMat(map_read.plane(k), map.plane(k)));
+    CHECK(Aligned(map_read.plane(k).data));
+  }
+  CHECK(Aligned(mat_read.data));
+  CHECK(reader.Read("empty", empty_read) && empty_read.empty());
+  CHECK(!reader.Read("missing", ints_read));
+  CHECK(!reader.Read("vec", ints_read));
+
+  // the mapping is private, writes stay in this process
+  mat_read.at<double>(0, 0) = -100;
+  SharedMapsReader other;
+  cv::Mat other_mat;
+  CHECK(other.Attach(name) && other.Read("mat", other_mat) && SameMat(other_mat, mat));
+  other.Detach();
+  CHECK(!other.attached());
+
+  // removed once attached, the attached reader keeps its data
+  CHECK(RemoveSharedMaps(name));
+  CHECK(!HasSharedMaps(name));
+  CHECK(!RemoveSharedMaps(name));
+  CHECK(SameMat(map_read.plane(2), map.plane(2)));
+  reader.Detach();
+  CHECK(!reader.Read("mat", mat_read));
+}
+
+void TestRejected(const string& prefix) {
+  const string name = SharedMapsName(prefix, 1);
+  CHECK(!HasSharedMaps(name));
+
+  const vector<int> ints = {1, 2, 3};
+  SharedMapsWriter writer(7);
+  writer.Write("ints", ints);
+  CHECK(writer.Publish(name));
+
+  // another fingerprint, e.g. other preparation settings; 0 accepts any
+  SharedMapsReader reader;
+  CHECK(!reader.Attach(name, 8));
+  CHECK(!reader.attached());
+  CHECK(reader.Attach(name, 0));
+  CHECK(reader.fingerprint() == 7);
+  reader.Detach();
+
+  // not finished yet: the magic is written last
+  const char no_magic[8] = {0};
+  SetMagic(name, no_magic);
+  CHECK(!HasSharedMaps(name, 7));
+  CHECK(!reader.Attach(name, 7));
+  SetMagic(name, "SFSSHM\0");
+  CHECK(HasSharedMaps(name, 7));
+
+  // publishing again replaces the object
+  const vector<int> new_ints = {4};
+  SharedMapsWriter replacement(9);
+  replacement.Write("ints", new_ints);
+  CHECK(replacement.Publish(name));
+  CHECK(!HasSharedMaps(name, 7));
+  vector<int> ints_read;
+  CHECK(reader.Attach(name, 9) && reader.Read("ints", ints_read) && ints_read == new_ints);
+  reader.Detach();
+  CHECK(RemoveSharedMaps(name));
+
+  // too small to be a segment
+  const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  CHECK(fd >= 0);
+  if(fd >= 0) {
+    CHECK(ftruncate(fd, 8) == 0);
+    close(fd);
+  }
+  CHECK(!reader.Attach(name));
+  RemoveSharedMaps(name);
+}
+
+}  // namespace
+
+int main() {
+  // unique per process, tests may run in parallel
+  const string prefix = "sfs_test_shm_" + to_string(getpid());
+  TestRoundTrip(prefix);
+  TestRejected(prefix);
+  return TestResult("test_shm");
+}
@@ -0,0 +1,177 @@
+#include "../sfs_spool.h"
+
+#include <ctime>
+#include <fstream>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "test_common.h"
+
+namespace {
+
+json ReadJob(const fs::path& filename) {
+  ifstream fin(filename.string());
+  return json::parse(fin);
+}
+
+bool SameStatus(const SFSSpool::Status& status, int pending, int running, int done, int failed) {
+  return status.pending == pending && status.running == running
+         && status.done == done && status.failed == failed;
+}
+
+// Make the lease of a running job look like it was last renewed long ago
+void AgeLease(const SFSSpool& spool, const string& name) {
+  fs::last_write_time(spool.dir() / fs::path("running") / fs::path(name + ".lease"), std::time(nullptr) - 3600);
+}
+
+// Claim the only pending job
+bool ClaimNext(SFSSpool& spool, const string& owner, fs::path& running_job) {
+  const vector<fs::path> jobs = spool.PendingJobs();
+  return jobs.size() == 1 && spool.Claim(jobs.front(), owner, running_job);
+}
+
+void TestClaimAndComplete() {
+  TestDirectory dir;
+  SFSSpool spool(dir.path);
+  spool.Submit("job_b", {{"index", 2}});
+  spool.Submit("job_a", {{"index", 1}});
+  CHECK(SameStatus(spool.GetStatus(), 2, 0, 0, 0));
+
+  // taken in filename order, only once
+  const vector<fs::path> jobs = spool.PendingJobs();
+  CHECK(jobs.size() == 2 && SFSSpool::JobName(jobs[0]) == "job_a");
+  fs::path running_job;
+  CHECK(spool.Claim(jobs[0], "worker_1", running_job));
+  CHECK(SFSSpool::JobName(running_job) == "job_a");
+  fs::path again;
+  CHECK(!spool.Claim(jobs[0], "worker_2", again));
+  CHECK(SameStatus(spool.GetStatus(), 1, 1, 0, 0));
+
+  // only the owner finishes the job
+  CHECK(!spool.Complete(running_job, "worker_2"));
+  CHECK(!spool.Fail(running_job, "worker_2", "not mine"));
+  CHECK(SameStatus(spool.GetStatus(), 1, 1, 0, 0));
+  CHECK(spool.Complete(running_job, "worker_1"));
+  CHECK(SameStatus(spool.GetStatus(), 1, 0, 1, 0));
+  CHECK(ReadJob(dir.path / fs::path("done") / fs::path("job_a.json"))["index"] == 1);
+  CHECK(!fs::exists(dir.path / fs::path("running") / fs::path("job_a.lease")));
+  CHECK(!spool.Complete(running_job, "worker_1"));
+}
+
+void TestRenewAndExpiry() {
+  TestDirectory dir;
+  SFSSpool spool(dir.path);
+  spool.Submit("job", {{"max_attempts", 3}});
+  fs::path running_job;
+  CHECK(ClaimNext(spool, "worker_1", running_job));
+
+  // a fresh lease is kept
+  CHECK(spool.RequeueAbandoned(std::chrono::seconds(60)).empty());
+
+  // renewing an old lease keeps the job
+  AgeLease(spool, "job");
+  spool.RenewLease(running_job);
+  CHECK(spool.RequeueAbandoned(std::chrono::seconds(60)).empty());
+  CHECK(SameStatus(spool.GetStatus(), 0, 1, 0, 0));
+
+  // an expired one puts it back in the queue, as one attempt
+  AgeLease(spool, "job");
+  const vector<string> requeued = spool.RequeueAbandoned(std::chrono::seconds(60));
+  CHECK(requeued.size() == 1 && requeued[0] == "job");
+  CHECK(SameStatus(spool.GetStatus(), 1, 0, 0, 0));
+  const json job = ReadJob(dir.path / fs::path("job.json"));
+  CHECK(job["attempts"] == 1);
+  CHECK(job["last_error"] == "lease expired");
+  CHECK(!fs::exists(dir.path / fs::path("running") / fs::path("job.lease")));
+}
+
+void TestOwnerExited() {
+  TestDirectory dir;
+  SFSSpool spool(dir.path);
+  spool.Submit("job", {{"max_attempts", 2}});
+
+  // claimed by a process of this host that is gone
+  const pid_t pid = fork();
+  if(pid == 0) {
+    fs::path running_job;
+    _exit(ClaimNext(spool, SFSSpool::DefaultOwner(), running_job)? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK(SameStatus(spool.GetStatus(), 0, 1, 0, 0));
+
+  // taken back long before the lease expires
+  CHECK(spool.RequeueAbandoned(std::chrono::seconds(3600)).size() == 1);
+  CHECK(SameStatus(spool.GetStatus(), 1, 0, 0, 0));
+}
+
+void TestMaxAttempts() {
+  TestDirectory dir;
+  SFSSpool spool(dir.path);
+  spool.Submit("job", {{"max_attempts", 2}, {"payload", "data"}});
+
+  fs::path running_job;
+  CHECK(ClaimNext(spool, "worker_1", running_job));
+  CHECK(spool.Fail(running_job, "worker_1", "first error"));
+  CHECK(SameStatus(spool.GetStatus(), 1, 0, 0, 0));
+  json job = ReadJob(dir.path / fs::path("job.json"));
+  CHECK(job["attempts"] == 1);
+  CHECK(job["last_error"] == "first error");
+  CHECK(job["payload"] == "data");
+
+  CHECK(ClaimNext(spool, "worker_2", running_job));
+  CHECK(spool.Fail(running_job, "worker_2", "second error"));
+  CHECK(SameStatus(spool.GetStatus(), 0, 0, 0, 1));
+  job = ReadJob(dir.path / fs::path("failed") / fs::path("job.json"));
+  CHECK(job["attempts"] == 2);
+  CHECK(job["error"] == "second error");
+
+  // without max_attempts a job gets one attempt, abandoning it counts too
+  spool.Submit("once", json::object());
+  CHECK(ClaimNext(spool, "worker_1", running_job));
+  AgeLease(spool, "once");
+  CHECK(spool.RequeueAbandoned(std::chrono::seconds(60)).size() == 1);
+  CHECK(SameStatus(spool.GetStatus(), 0, 0, 0, 2));
+}
+
+void TestLostLease() {
+  TestDirectory dir;
+  SFSSpool spool(dir.path);
+  spool.Submit("job", {{"max_attempts", 3}});
+
+  // worker_1 stops renewing, the job is requeued
+  fs::path lost_job;
+  CHECK(ClaimNext(spool, "worker_1", lost_job));
+  AgeLease(spool, "job");
+  CHECK(spool.RequeueAbandoned(std::chrono::seconds(60)).size() == 1);
+  CHECK(!spool.Complete(lost_job, "worker_1"));
+  CHECK(!spool.Fail(lost_job, "worker_1", "late error"));
+  CHECK(SameStatus(spool.GetStatus(), 1, 0, 0, 0));
+
+  // and claimed by worker_2 under the same name: worker_1 can no longer
+  // finish it, and leaves it running for worker_2
+  fs::path running_job;
+  CHECK(ClaimNext(spool, "worker_2", running_job));
+  CHECK(running_job == lost_job);
+  CHECK(!spool.Complete(lost_job, "worker_1"));
+  CHECK(!spool.Fail(lost_job, "worker_1", "late error"));
+  CHECK(SameStatus(spool.GetStatus(), 0, 1, 0, 0));
+  CHECK(fs::exists(dir.path / fs::path("running") / fs::path("job.lease")));
+
+  CHECK(spool.Complete(running_job, "worker_2"));
+  CHECK(SameStatus(spool.GetStatus(), 0, 0, 1, 0));
+  CHECK(ReadJob(dir.path / fs::path("done") / fs::path("job.json"))["attempts"] == 1);
+}
+
+}  // namespace
+
+int main() {
+  TestClaimAndComplete();
+  TestRenewAndExpiry();
+  TestOwnerExited();
+  TestMaxAttempts();
+  TestLostLease();
+  return TestResult("test_spool");
+}
@@ -0,0 +1,74 @@
+#ifndef FACESHAPEFROMSHADING_TEST_STATE_H
+#define FACESHAPEFROMSHADING_TEST_STATE_H
+
+#include <cstring>
+
+#include "../sfs_pipeline.h"
+
+// Small maps and image states with distinct values, for the tests of the
+// checkpoints, the result cache and the shared memory handoff.
+
+inline bool SameMat(const cv::Mat& a, const cv::Mat& b) {
+  return a.type() == b.type() && a.rows == b.rows && a.cols == b.cols
+         && memcmp(a.data, b.data, a.total() * a.elemSize()) == 0;
+}
+
+template <int Channels>
+inline bool SameMap(const PlanarMap<Channels>& a, const PlanarMap<Channels>& b) {
+  for(int k=0;k<Channels;++k) {
+    if(!SameMat(a.plane(k), b.plane(k))) return false;
+  }
+  return true;
+}
+
+inline cv::Mat Ramp(int rows, int cols, int type, double offset) {
+  cv::Mat m(rows, cols, type);
+  for(int r=0;r<rows;++r) {
+    for(int c=0;c<cols;++c) {
+      if(type == CV_32F) m.at<float>(r, c) = offset + r * cols + c;
+      else m.at<double>(r, c) = offset + r * cols + c;
+    }
+  }
+  return m;
+}
+
+template <int Channels>
+inline PlanarMap<Channels> RampMap(int rows, int cols, double offset) {
+  PlanarMap<Channels> m;
+  vector<cv::Mat> planes;
+  for(int k=0;k<Channels;++k) planes.push_back(Ramp(rows, cols, kMapDepth, offset + 100 * k));
+  m.SetPlanes(planes);
+  return m;
+}
+
+inline SFSImageState PreparedState(int rows, int cols) {
+  SFSImageState state;
+  state.index = 3;
+  state.image_index = 17;
+  state.lighting_coeffs = VectorXd::LinSpaced(9, -1.0, 1.0);
+  state.normal_map_ref = RampMap<3>(rows, cols, 0.5);
+  state.normal_map = state.normal_map_ref;
+  state.albedo_ref = RampMap<3>(rows, cols, 0.25);
+  state.albedo = state.albedo_ref;
+  state.depth_map_ref = Ramp(rows, cols, kMapDepth, -10);
+  state.zmap = Ramp(rows, cols, CV_32F, 5);
+  state.xy_map = RampMap<2>(rows, cols, 2);
+  state.valid_pixels_map.assign(rows * cols, -1);
+  for(int j=0;j<rows*cols;j+=2) state.valid_pixels_map[j] = j / 2;
+  state.face_indices_map.assign(rows * cols, 7);
+  return state;
+}
+
+// Same prepared fields, as written by WritePreparedFields
+inline bool SamePrepared(const SFSImageState& a, const SFSImageState& b) {
+  return a.lighting_coeffs == b.lighting_coeffs
+         && SameMap(a.normal_map_ref, b.normal_map_ref)
+         && SameMap(a.albedo_ref, b.albedo_ref)
+         && SameMap(a.xy_map, b.xy_map)
+         && SameMat(a.depth_map_ref, b.depth_map_ref)
+         && SameMat(a.zmap, b.zmap)
+         && a.valid_pixels_map == b.valid_pixels_map
+         && a.face_indices_map == b.face_indices_map;
+}
+
+#endif  // FACESHAPEFROMSHADING_TEST_STATE_H
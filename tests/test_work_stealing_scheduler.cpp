@@ -0,0 +1,190 @@
+#include "../work_stealing_scheduler.h"
+
+#include <chrono>
+
+#include "test_common.h"
+
+namespace {
+
+// Wait up to a few seconds for cond, so a broken scheduler fails instead of
+// hanging the test
+template <typename Cond>
+bool WaitFor(Cond cond) {
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while(!cond()) {
+    if(std::chrono::steady_clock::now() > deadline) return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+void TestStealing() {
+  // The first task blocks its worker until all the others have run. Half of
+  // them are queued on that worker, so they only run if the other worker
+  // steals them.
+  const int num_tasks = 16;
+  std::atomic<int> num_done(0);
+  std::atomic<bool> blocker_started(false), others_done(false);
+  std::thread::id blocker_thread;
+  std::mutex ids_mtx;
+  vector<std::thread::id> task_threads;
+
+  WorkStealingScheduler scheduler(2);
+  scheduler.Submit([&]() {
+    blocker_thread = std::this_thread::get_id();
+    blocker_started = true;
+    others_done = WaitFor([&]{ return num_done == num_tasks; });
+  });
+  CHECK(WaitFor([&]{ return blocker_started.load(); }));
+  for(int i=0;i<num_tasks;++i) {
+    scheduler.Submit([&]() {
+      {
+        std::lock_guard<std::mutex> lock(ids_mtx);
+        task_threads.push_back(std::this_thread::get_id());
+      }
+      ++num_done;
+    });
+  }
+  scheduler.Wait();
+
+  CHECK(others_done);
+  CHECK(num_done == num_tasks);
+  for(auto& id : task_threads) CHECK(id != blocker_thread);
+}
+
+void TestExceptions() {
+  WorkStealingScheduler scheduler(3);
+  std::atomic<int> num_done(0);
+  for(int i=0;i<10;++i) {
+    scheduler.Submit([&, i]() {
+      if(i == 4) throw runtime_error("task 4");
+      ++num_done;
+    });
+  }
+
+  string message;
+  try {
+    scheduler.Wait();
+  } catch(runtime_error& e) {
+    message = e.what();
+  }
+  CHECK(message == "task 4");
+  // the other tasks still run
+  CHECK(num_done == 9);
+
+  // the error is reported once, the scheduler stays usable
+  scheduler.Submit([&]() { ++num_done; });
+  bool thrown = false;
+  try {
+    scheduler.Wait();
+  } catch(std::exception&) {
+    thrown = true;
+  }
+  CHECK(!thrown);
+  CHECK(num_done == 10);
+}
+
+void TestShutdown() {
+  // an idle scheduler stops right away
+  {
+    WorkStealingScheduler scheduler(4);
+    CHECK(scheduler.NumWorkers() == 4);
+  }
+
+  // the queued tasks are finished before the workers exit
+  std::atomic<int> num_done(0);
+  {
+    WorkStealingScheduler scheduler(2);
+    for(int i=0;i<100;++i) {
+      scheduler.Submit([&]() {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        ++num_done;
+      });
+    }
+  }
+  CHECK(num_done == 100);
+
+  // at least one worker
+  WorkStealingScheduler scheduler(0);
+  CHECK(scheduler.NumWorkers() == 1);
+}
+
+void TestMemoryBudget() {
+  MemoryBudget budget(100);
+
+  // larger than the budget, granted when nothing else is reserved
+  std::atomic<bool> granted(false);
+  std::thread oversized([&]() {
+    MemoryBudget::Reservation reservation(budget, 1000);
+    granted = true;
+  });
+  CHECK(WaitFor([&]{ return granted.load(); }));
+  oversized.join();
+
+  // but it waits for the reservations in flight
+  granted = false;
+  std::thread waiting;
+  {
+    MemoryBudget::Reservation reservation(budget, 60);
+    waiting = std::thread([&]() {
+      MemoryBudget::Reservation reservation(budget, 1000);
+      granted = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(!granted);
+  }
+  CHECK(WaitFor([&]{ return granted.load(); }));
+  waiting.join();
+
+  // reservations that fit are granted together
+  {
+    MemoryBudget::Reservation a(budget, 40);
+    MemoryBudget::Reservation b(budget, 60);
+  }
+
+  // an unlimited budget never waits
+  MemoryBudget unlimited(0);
+  MemoryBudget::Reservation a(unlimited, 1 << 30);
+  MemoryBudget::Reservation b(unlimited, 1 << 30);
+}
+
+void TestInFlightLimit() {
+  InFlightLimit limit(2);
+  limit.Acquire();
+  limit.Acquire();
+
+  std::atomic<bool> acquired(false);
+  std::thread producer([&]() {
+    limit.Acquire();
+    acquired = true;
+    limit.Release();
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  CHECK(!acquired);
+
+  // a task gives its slot back when it ends, also by an exception
+  try {
+    InFlightLimit::Releaser releaser(limit);
+    throw runtime_error("task failed");
+  } catch(runtime_error&) {
+  }
+  CHECK(WaitFor([&]{ return acquired.load(); }));
+  producer.join();
+  limit.Release();
+
+  // the capacity is at least one
+  InFlightLimit single(0);
+  single.Acquire();
+  single.Release();
+}
+
+}  // namespace
+
+int main() {
+  TestStealing();
+  TestExceptions();
+  TestShutdown();
+  TestMemoryBudget();
+  TestInFlightLimit();
+  return TestResult("test_work_stealing_scheduler");
+}
@@ -20,6 +20,7 @@
 #include <MultilinearReconstruction/utils.hpp>
 
 #include "defs.h"
+#include "sfs_log.h"
 
 #include "boost/filesystem/operations.hpp"
 #include "boost/filesystem/path.hpp"
@@ -307,7 +308,7 @@ static QImage TransferColor(const QImage& source, const QImage& target,
     const int num_cols = img.width(), num_rows  = img.height();
     MatrixXd pixels(3, num_pixels);
 
-    cout << num_cols << 'x' << num_rows << endl;
+    SFS_LOG(Debug, MeanTexture) << num_cols << 'x' << num_rows;
 
     for(size_t i=0;i<num_pixels;++i) {
       int y = valid_pixels[i] / num_cols;
@@ -338,8 +339,8 @@ static QImage TransferColor(const QImage& source, const QImage& target,
 
     for(int i=0;i<3;++i) stdev[i] = sqrt(stdev[i]);
 
-    cout << "mean: " << mean << endl;
-    cout << "std: " << stdev << endl;
+    SFS_LOG(Debug, MeanTexture) << "mean: " << mean.transpose();
+    SFS_LOG(Debug, MeanTexture) << "std: " << stdev.transpose();
 
     return make_tuple(pixels_lab, mean, stdev);
   };
@@ -385,7 +386,7 @@ inline QImage GetIndexMap(const string& albedo_index_map_filename,
                    int tex_size = 2048) {
   QImage albedo_index_map;
   if(QFile::exists(albedo_index_map_filename.c_str()) && (!generate_index_map)) {
-    PhGUtils::message("loading index map for albedo.");
+    SFS_LOG(Info, Resources) << "loading index map for albedo.";
     albedo_index_map = QImage(albedo_index_map_filename.c_str());
     albedo_index_map.save("albedo_index.png");
   } else {
@@ -414,8 +415,8 @@ inline pair<QImage, vector<vector<PixelInfo>>> GetPixelCoordinatesMap(
   if(QFile::exists(albedo_pixel_map_filename.c_str()) && (!gen_pixel_map)) {
     pixel_map_image = QImage(albedo_pixel_map_filename.c_str());
 
-    PhGUtils::message("generating pixel map for albedo ...");
-    boost::timer::auto_cpu_timer t("pixel map for albedo generation time = %w seconds.\n");
+    SFS_LOG(Info, Resources) << "generating pixel map for albedo ...";
+    boost::timer::cpu_timer t;
 
     for(int i=0;i<tex_size;++i) {
       for(int j=0;j<tex_size;++j) {
@@ -436,13 +437,13 @@ inline pair<QImage, vector<vector<PixelInfo>>> GetPixelCoordinatesMap(
       }
     }
     //pixel_map_image.save("albedo_pixel.png");
-    PhGUtils::message("done.");
+    SFS_LOG(Debug, Resources) << "pixel map for albedo generation time = " << t.elapsed().wall * 1e-9 << " seconds.";
   } else {
     /// @FIXME antialiasing issue because of round-off error
     pixel_map_image = QImage(tex_size, tex_size, QImage::Format_ARGB32);
     pixel_map_image.fill(0);
-    PhGUtils::message("generating pixel map for albedo ...");
-    boost::timer::auto_cpu_timer t("pixel map for albedo generation time = %w seconds.\n");
+    SFS_LOG(Info, Resources) << "generating pixel map for albedo ...";
+    boost::timer::cpu_timer t;
 
     for(int i=0;i<tex_size;++i) {
       for(int j=0;j<tex_size;++j) {
@@ -474,7 +475,7 @@ inline pair<QImage, vector<vector<PixelInfo>>> GetPixelCoordinatesMap(
       }
     }
     pixel_map_image.save("albedo_pixel.jpg");
-    PhGUtils::message("done.");
+    SFS_LOG(Debug, Resources) << "pixel map for albedo generation time = " << t.elapsed().wall * 1e-9 << " seconds.";
   }
 
   return make_pair(pixel_map_image, albedo_pixel_map);
@@ -495,13 +496,17 @@ inline void ApplyWeights(
   mesh.ComputeNormals();
 }
 
-inline tuple<QImage, vector<vector<int>>> GenerateMeanTexture(
-  const vector<ImageBundle> image_bundles,
-  MultilinearModel& model,
-  const vector<BasicMesh>& blendshapes,
+// The images are loaded one at a time by load_bundle, and the visible face
+// index map of each image is handed to store_face_indices once it is found,
+// so that no more than one image is held here.
+inline QImage GenerateMeanTexture(
+  int num_images,
+  const function<ImageBundle(int)>& load_bundle,
+  const function<void(int, vector<int>)>& store_face_indices,
+  const function<void(const ReconstructionResult&)>& apply_params,
   BasicMesh& mesh,
   int tex_size,
-  vector<vector<PixelInfo>>& albedo_pixel_map,
+  const vector<vector<PixelInfo>>& albedo_pixel_map,
   vector<vector<glm::dvec3>>& mean_texture,
   vector<vector<double>>& mean_texture_weight,
   cv::Mat& mean_texture_mat,
@@ -509,29 +514,26 @@ inline tuple<QImage, vector<vector<int>>> GenerateMeanTexture(
   const fs::path& results_path,
   const string& options) {
   QImage mean_texture_image;
-  vector<vector<int>> face_indices_maps;
   {
     json settings = json::parse(options);
 
-    cout << settings << endl;
+    SFS_LOG(Debug, MeanTexture) << settings;
 
     bool generate_mean_texture = settings["generate_mean_texture"];
     bool use_blendshapes = settings["use_blendshapes"];
+    bool write_textures = settings.value("write_textures", true);
+    bool write_debug_images = settings.value("write_debug_images", true);
 
     // use a larger scale when generating mean texture with blendshapes
     // since blendshapes are subdivided meshes and each triangle is much smaller
     double scale_factor = 6.0;
     if(use_blendshapes) scale_factor = 8.0;
 
-    for(auto& bundle : image_bundles) {
+    for(int bundle_index=0;bundle_index<num_images;++bundle_index) {
+      const ImageBundle bundle = load_bundle(bundle_index);
+
       // get the geometry of the mesh, update normal
-      if(use_blendshapes) {
-        ApplyWeights(mesh, blendshapes, bundle.params.params_model.Wexp_FACS);
-      } else {
-        model.ApplyWeights(bundle.params.params_model.Wid, bundle.params.params_model.Wexp);
-        mesh.UpdateVertices(model.GetTM());
-        mesh.ComputeNormals();
-      }
+      apply_params(bundle.params);
 
       // for each image bundle, render the mesh to FBO with culling to get the visible triangles
       OffscreenMeshVisualizer visualizer(bundle.image.width() * scale_factor, bundle.image.height() * scale_factor);
@@ -543,13 +545,18 @@ inline tuple<QImage, vector<vector<int>>> GenerateMeanTexture(
       visualizer.SetIndexEncoded(true);
       visualizer.SetEnableLighting(false);
       QImage img = visualizer.Render();
-      img.save("mesh.png");
+      if(write_debug_images) img.save("mesh.png");
 
       // find the visible triangles from the index map
       auto triangles_indices_pair = FindTrianglesIndices(img);
       set<int> triangles = triangles_indices_pair.first;
-      face_indices_maps.push_back(triangles_indices_pair.second);
-      cerr << triangles.size() << endl;
+      // @NOTE The index map is rendered at scale_factor times the image size,
+      // but the solver looks it up with the pixel indices of the image, so only
+      // its first width * height entries are ever read. Keep just those.
+      const vector<int>& full_indices_map = triangles_indices_pair.second;
+      store_face_indices(bundle_index, vector<int>(
+        full_indices_map.begin(), full_indices_map.begin() + bundle.image.width() * bundle.image.height()));
+      SFS_LOG(Debug, MeanTexture) << triangles.size() << " visible triangles";
 
       // get the projection parameters
       glm::dmat4 Rmat = glm::eulerAngleYXZ(bundle.params.params_model.R[0], bundle.params.params_model.R[1],
@@ -574,9 +581,11 @@ inline tuple<QImage, vector<vector<int>>> GenerateMeanTexture(
         glm::dvec3 v2_tri = ProjectPoint(glm::dvec3(v2_mesh[0], v2_mesh[1], v2_mesh[2]), Mview, bundle.params.params_cam) * scale_factor;
         triangles_projected[tidx] = vector<glm::dvec3>{v0_tri, v1_tri, v2_tri};
 
-        img_vertices.setPixel(v0_tri.x, img.height()-1-v0_tri.y, qRgb(255, 255, 255));
-        img_vertices.setPixel(v1_tri.x, img.height()-1-v1_tri.y, qRgb(255, 255, 255));
-        img_vertices.setPixel(v2_tri.x, img.height()-1-v2_tri.y, qRgb(255, 255, 255));
+        if(write_debug_images) {
+          img_vertices.setPixel(v0_tri.x, img.height()-1-v0_tri.y, qRgb(255, 255, 255));
+          img_vertices.setPixel(v1_tri.x, img.height()-1-v1_tri.y, qRgb(255, 255, 255));
+          img_vertices.setPixel(v2_tri.x, img.height()-1-v2_tri.y, qRgb(255, 255, 255));
+        }
 
         // TODO Warp this triangle into the destination
         // auto tex_coords_i = mesh.face_texture(tidx);
@@ -593,7 +602,7 @@ inline tuple<QImage, vector<vector<int>>> GenerateMeanTexture(
         // cv::Mat transform_i = cv::getAffineTransform(src_points, dst_points);
         // transforms[tidx] = transform_i;
       }
-      img_vertices.save("mesh_with_vertices.png");
+      if(write_debug_images) img_vertices.save("mesh_with_vertices.png");
 
       // QImage tex_img_warped(tex_size, tex_size, QImage::Format_ARGB32);
       // tex_img_warped.fill(0);
@@ -613,42 +622,44 @@ inline tuple<QImage, vector<vector<int>>> GenerateMeanTexture(
       // tex_img_warped.save("tex_warped.png");
 
       // for each pixel in img, compute bcoords and visualize it
-      QImage img_bcoords = img;
-      for(int i=0;i<img.height();++i) {
-        for(int j=0;j<img.width();++j) {
-          int pidx = i * img.width() + j;
-          int fidx = triangles_indices_pair.second[pidx];
-          if(fidx < 0 || fidx >= mesh.NumFaces()) continue;
-
-          // auto face_i = mesh.face(fidx);
-          // auto v0_mesh = mesh.vertex(face_i[0]);
-          // auto v1_mesh = mesh.vertex(face_i[1]);
-          // auto v2_mesh = mesh.vertex(face_i[2]);
-          // glm::dvec3 v0_tri = ProjectPoint(glm::dvec3(v0_mesh[0], v0_mesh[1], v0_mesh[2]), Mview, bundle.params.params_cam) * scale_factor;
-          // glm::dvec3 v1_tri = ProjectPoint(glm::dvec3(v1_mesh[0], v1_mesh[1], v1_mesh[2]), Mview, bundle.params.params_cam) * scale_factor;
-          // glm::dvec3 v2_tri = ProjectPoint(glm::dvec3(v2_mesh[0], v2_mesh[1], v2_mesh[2]), Mview, bundle.params.params_cam) * scale_factor;
-          // triangles_projected.push_back(vector<glm::dvec3>{v0_tri, v1_tri, v2_tri});
-
-          glm::dvec3 v0_tri, v1_tri, v2_tri;
-          auto tri_verts_2d = triangles_projected.at(fidx);
-          v0_tri = tri_verts_2d[0];
-          v1_tri = tri_verts_2d[1];
-          v2_tri = tri_verts_2d[2];
-
-          using PhGUtils::Point3f;
-          using PhGUtils::Point2d;
-          Point3f bcoords;
-          // Compute barycentric coordinates
-          PhGUtils::computeBarycentricCoordinates(Point2d(j+0.5, i+0.5),
-                                                  Point2d(v0_tri.x, img.height()-1-v0_tri.y),
-                                                  Point2d(v1_tri.x, img.height()-1-v1_tri.y),
-                                                  Point2d(v2_tri.x, img.height()-1-v2_tri.y),
-                                                  bcoords);
-          // Color the pixel
-          img_bcoords.setPixel(j, i, qRgb(bcoords.x*255, bcoords.y*255, bcoords.z*255));
+      if(write_debug_images) {
+        QImage img_bcoords = img;
+        for(int i=0;i<img.height();++i) {
+          for(int j=0;j<img.width();++j) {
+            int pidx = i * img.width() + j;
+            int fidx = triangles_indices_pair.second[pidx];
+            if(fidx < 0 || fidx >= mesh.NumFaces()) continue;
+
+            // auto face_i = mesh.face(fidx);
+            // auto v0_mesh = mesh.vertex(face_i[0]);
+            // auto v1_mesh = mesh.vertex(face_i[1]);
+            // auto v2_mesh = mesh.vertex(face_i[2]);
+            // glm::dvec3 v0_tri = ProjectPoint(glm::dvec3(v0_mesh[0], v0_mesh[1], v0_mesh[2]), Mview, bundle.params.params_cam) * scale_factor;
+            // glm::dvec3 v1_tri = ProjectPoint(glm::dvec3(v1_mesh[0], v1_mesh[1], v1_mesh[2]), Mview, bundle.params.params_cam) * scale_factor;
+            // glm::dvec3 v2_tri = ProjectPoint(glm::dvec3(v2_mesh[0], v2_mesh[1], v2_mesh[2]), Mview, bundle.params.params_cam) * scale_factor;
+            // triangles_projected.push_back(vector<glm::dvec3>{v0_tri, v1_tri, v2_tri});
+
+            glm::dvec3 v0_tri, v1_tri, v2_tri;
+            auto tri_verts_2d = triangles_projected.at(fidx);
+            v0_tri = tri_verts_2d[0];
+            v1_tri = tri_verts_2d[1];
+            v2_tri = tri_verts_2d[2];
+
+            using PhGUtils::Point3f;
+            using PhGUtils::Point2d;
+            Point3f bcoords;
+            // Compute barycentric coordinates
+            PhGUtils::computeBarycentricCoordinates(Point2d(j+0.5, i+0.5),
+                                                    Point2d(v0_tri.x, img.height()-1-v0_tri.y),
+                                                    Point2d(v1_tri.x, img.height()-1-v1_tri.y),
+                                                    Point2d(v2_tri.x, img.height()-1-v2_tri.y),
+                                                    bcoords);
+            // Color the pixel
+            img_bcoords.setPixel(j, i, qRgb(bcoords.x*255, bcoords.y*255, bcoords.z*255));
+          }
         }
+        img_bcoords.save("mesh_with_bcoords.png");
       }
-      img_bcoords.save("mesh_with_bcoords.png");
 
       if(generate_mean_texture) {
         // populate the current texture map
@@ -695,7 +706,7 @@ inline tuple<QImage, vector<vector<int>>> GenerateMeanTexture(
           }
         }
 
-        tex_img_i.save( (results_path / fs::path(fs::path(bundle.filename.c_str()).stem().string() + "_tex.png")).string().c_str() );
+        if(write_debug_images) tex_img_i.save( (results_path / fs::path(fs::path(bundle.filename.c_str()).stem().string() + "_tex.png")).string().c_str() );
       }
     }
 
@@ -757,7 +768,7 @@ inline tuple<QImage, vector<vector<int>>> GenerateMeanTexture(
         mean_texture_refined_mat = 0.25 * mean_texture_mat + 0.75 * mean_texture_refined_mat;
         cv::resize(mean_texture_refined_mat, mean_texture_refined_mat, cv::Size(), 4.0, 4.0);
       } else if (refine_method == "hsv") {
-        cout << "Refine using hsv method ..." << endl;
+        SFS_LOG(Info, MeanTexture) << "Refine using hsv method ...";
         // refine using core face region and clustering in hsv space
         const string core_face_region_filename = settings["core_face_region_filename"];
         auto core_face_region = cv::imread(core_face_region_filename.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
@@ -769,7 +780,7 @@ inline tuple<QImage, vector<vector<int>>> GenerateMeanTexture(
             if( c > 0 ) valid_pixels.push_back(glm::ivec2(i, j));
           }
         }
-        cout << "valid pixels = " << valid_pixels.size() << endl;
+        SFS_LOG(Debug, MeanTexture) << "valid pixels = " << valid_pixels.size();
 
         glm::dvec3 mean_color(0, 0, 0);
         for(auto p : valid_pixels) {
@@ -814,16 +825,18 @@ inline tuple<QImage, vector<vector<int>>> GenerateMeanTexture(
         }
       }
 
-      mean_texture_image.save( (results_path / fs::path("mean_texture.png")).string().c_str() );
-      mean_texture_image_refined.save( (results_path / fs::path("mean_texture_refined.png")).string().c_str() );
+      if(write_textures) {
+        mean_texture_image.save( (results_path / fs::path("mean_texture.png")).string().c_str() );
+        mean_texture_image_refined.save( (results_path / fs::path("mean_texture_refined.png")).string().c_str() );
+      }
       mean_texture_image = mean_texture_image_refined;
     } else {
       mean_texture_image = QImage(mean_albedo_filename.c_str());
-      mean_texture_image.save( (results_path / fs::path("mean_texture.png")).string().c_str() );
+      if(write_textures) mean_texture_image.save( (results_path / fs::path("mean_texture.png")).string().c_str() );
     }
   }
 
-  return make_tuple(mean_texture_image, face_indices_maps);
+  return mean_texture_image;
 }
 
 #endif //FACESHAPEFROMSHADING_UTILS_H
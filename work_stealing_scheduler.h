@@ -0,0 +1,215 @@
+#ifndef FACESHAPEFROMSHADING_WORK_STEALING_SCHEDULER_H
+#define FACESHAPEFROMSHADING_WORK_STEALING_SCHEDULER_H
+
+#include "common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// A fixed pool of workers, each owning a task deque. A worker takes tasks
+// from the back of its own deque and, when that runs dry, steals from the
+// front of the others, so uneven tasks (e.g. images of different sizes) keep
+// every worker busy.
+class WorkStealingScheduler {
+public:
+  using Task = std::function<void()>;
+
+  explicit WorkStealingScheduler(int num_workers)
+    : num_queued(0), num_pending(0), next_queue(0), stopping(false) {
+    num_workers = max(num_workers, 1);
+    for(int i=0;i<num_workers;++i) {
+      queues.emplace_back(new WorkerQueue);
+    }
+    for(int i=0;i<num_workers;++i) {
+      workers.emplace_back(&WorkStealingScheduler::WorkerLoop, this, i);
+    }
+  }
+
+  ~WorkStealingScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stopping = true;
+    }
+    task_available.notify_all();
+    for(auto& worker : workers) worker.join();
+  }
+
+  int NumWorkers() const { return workers.size(); }
+
+  void Submit(Task task) {
+    const int qidx = next_queue++ % queues.size();
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      {
+        std::lock_guard<std::mutex> queue_lock(queues[qidx]->mtx);
+        queues[qidx]->tasks.push_back(std::move(task));
+      }
+      ++num_queued;
+      ++num_pending;
+    }
+    task_available.notify_one();
+  }
+
+  // Block until all submitted tasks have finished. The first exception thrown
+  // by a task is rethrown here.
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mtx);
+    all_done.wait(lock, [this]{ return num_pending == 0; });
+    if(error) {
+      std::exception_ptr e = error;
+      error = nullptr;
+      std::rethrow_exception(e);
+    }
+  }
+
+private:
+  struct WorkerQueue {
+    std::mutex mtx;
+    std::deque<Task> tasks;
+  };
+
+  bool TryPop(int idx, Task& task) {
+    {
+      std::lock_guard<std::mutex> lock(queues[idx]->mtx);
+      if(!queues[idx]->tasks.empty()) {
+        task = std::move(queues[idx]->tasks.back());
+        queues[idx]->tasks.pop_back();
+        return true;
+      }
+    }
+    for(int k=1;k<queues.size();++k) {
+      auto& victim = queues[(idx + k) % queues.size()];
+      std::lock_guard<std::mutex> lock(victim->mtx);
+      if(!victim->tasks.empty()) {
+        task = std::move(victim->tasks.front());
+        victim->tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void WorkerLoop(int idx) {
+    while(true) {
+      Task task;
+      if(TryPop(idx, task)) {
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          --num_queued;
+        }
+
+        std::exception_ptr task_error;
+        try {
+          task();
+        } catch(...) {
+          task_error = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if(task_error && !error) error = task_error;
+        task_error = nullptr;
+        if(--num_pending == 0) all_done.notify_all();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(mtx);
+      task_available.wait(lock, [this]{ return stopping || num_queued > 0; });
+      if(stopping && num_queued == 0) return;
+    }
+  }
+
+  vector<std::unique_ptr<WorkerQueue>> queues;
+  vector<std::thread> workers;
+
+  std::mutex mtx;
+  std::condition_variable task_available, all_done;
+  int num_queued, num_pending;
+  std::atomic<int> next_queue;
+  bool stopping;
+  std::exception_ptr error;
+};
+
+// Caps the total estimated size of the work in flight. A reservation larger
+// than the whole budget is still granted when nothing else is running, so a
+// single oversized task can not deadlock.
+class MemoryBudget {
+public:
+  // capacity in bytes, 0 means unlimited
+  explicit MemoryBudget(size_t capacity) : capacity(capacity), in_use(0) {}
+
+  void Acquire(size_t bytes) {
+    if(capacity == 0) return;
+    std::unique_lock<std::mutex> lock(mtx);
+    released.wait(lock, [&]{ return in_use == 0 || in_use + bytes <= capacity; });
+    in_use += bytes;
+  }
+
+  void Release(size_t bytes) {
+    if(capacity == 0) return;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      in_use -= bytes;
+    }
+    released.notify_all();
+  }
+
+  class Reservation {
+  public:
+    Reservation(MemoryBudget& budget, size_t bytes) : budget(budget), bytes(bytes) {
+      budget.Acquire(bytes);
+    }
+    ~Reservation() { budget.Release(bytes); }
+  private:
+    MemoryBudget& budget;
+    size_t bytes;
+  };
+
+private:
+  size_t capacity, in_use;
+  std::mutex mtx;
+  std::condition_variable released;
+};
+
+// Caps the number of tasks between a producer and the workers. The producer
+// takes a slot before it produces the input of a task and the task gives it
+// back when it ends, so together with the scheduler this is a bounded queue:
+// the producer waits once it is capacity tasks ahead of the workers.
+class InFlightLimit {
+public:
+  explicit InFlightLimit(int capacity) : available(max(capacity, 1)) {}
+
+  void Acquire() {
+    std::unique_lock<std::mutex> lock(mtx);
+    released.wait(lock, [this]{ return available > 0; });
+    --available;
+  }
+
+  void Release() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      ++available;
+    }
+    released.notify_one();
+  }
+
+  // Gives a slot back when the task ends, whichever way it ends
+  class Releaser {
+  public:
+    explicit Releaser(InFlightLimit& limit) : limit(limit) {}
+    ~Releaser() { limit.Release(); }
+  private:
+    InFlightLimit& limit;
+  };
+
+private:
+  int available;
+  std::mutex mtx;
+  std::condition_variable released;
+};
+
+#endif  // FACESHAPEFROMSHADING_WORK_STEALING_SCHEDULER_H